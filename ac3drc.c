@@ -0,0 +1,618 @@
+/* ac3drc - strip dynamic range info from A/52 frames in place
+
+Unlike ac3strip, which drops the dynrng fields and repacks the stream, this
+zeroes them. A dynrng of 0 is a gain of 0dB, so the frame decodes without
+compression, keeps its size, and can be written back where it came from. */
+
+#include <string.h>
+#include "ac3drc.h"
+#include "ac3bits.h"
+#include "bitreader.h"
+
+#define SYNCWORD 0x0B77
+
+// CRC polynomial x^16 + x^15 + x^2 + 1
+#define CRC16_POLY 0x18005
+
+static const int nfchanstab[] = {2, 1, 2, 3, 3, 4, 4, 5};
+static const int expgrptab[] = {0, 3, 6, 12};
+static const int grpsizetab[] = {0, 1, 2, 4};
+
+// Frame sizes in 16-bit words, indexed by fscod and frmsizecod.
+static const int frmsizetab[3][38] = {{
+	64, 64, 80, 80, 96, 96, 112, 112, 128, 128, 160, 160, 192, 192, 224,
+	224, 256, 256, 320, 320, 384, 384, 448, 448, 512, 512, 640, 640, 768,
+	768, 896, 896, 1024, 1024, 1152, 1152, 1280, 1280,
+}, {
+	69, 70, 87, 88, 104, 105, 121, 122, 139, 140, 174, 175, 208, 209, 243,
+	244, 278, 279, 348, 349, 417, 418, 487, 488, 557, 558, 696, 697, 835,
+	836, 975, 976, 1114, 1115, 1253, 1254, 1393, 1394,
+}, {
+	96, 96, 120, 120, 144, 144, 168, 168, 192, 192, 240, 240, 288, 288,
+	336, 336, 384, 384, 480, 480, 576, 576, 672, 672, 768, 768, 960, 960,
+	1152, 1152, 1344, 1344, 1536, 1536, 1728, 1728, 1920, 1920,
+}};
+
+static const int sdecaytab[] = {0x0F, 0x11, 0x13, 0x15};
+static const int fdecaytab[] = {0x3F, 0x53, 0x67, 0x7B};
+static const int sgaintab[] = {0x540, 0x4D8, 0x478, 0x410};
+static const int dbkneetab[] = {0x000, 0x700, 0x900, 0xB00};
+static const int floortab[] = {
+	0x2F0, 0x2B0, 0x270, 0x230, 0x1F0, 0x170, 0x0F0, 0xF800,
+};
+static const int fgaintab[] = {
+	0x080, 0x100, 0x180, 0x200, 0x280, 0x300, 0x380, 0x400
+};
+
+// Mantissa sizes for bap 6-15 (7.3.3)
+static const uint quantization_tab[16] = {
+	0, 0, 0, 0, 0, 0,
+	5, 6, 7, 8, 9, 10, 11, 12, 14, 16,
+};
+
+// Return the size in bytes of the frame starting at hdr, which must point to
+// at least 5 bytes. Returns -1 if hdr isn't a valid A/52 header.
+int ac3_frame_size(const u8 *hdr)
+{
+	uint fscod, frmsizecod;
+	if ((hdr[0] << 8 | hdr[1]) != SYNCWORD) {
+		return -1;
+	}
+	fscod = hdr[4] >> 6;
+	frmsizecod = hdr[4] & 0x3f;
+	if (fscod > 2 || frmsizecod > 37) {
+		return -1;
+	}
+	return frmsizetab[fscod][frmsizecod] * 2;
+}
+
+// Size in bytes of the part of the frame covered by crc1.
+static int frame_size_58(int size)
+{
+	return ((size >> 2) + (size >> 4)) << 1;
+}
+
+static uint crc16(const u8 *p, int n)
+{
+	uint crc = 0;
+	int i, k;
+	for (i = 0; i < n; i++) {
+		crc ^= (uint)p[i] << 8;
+		for (k = 0; k < 8; k++) {
+			crc <<= 1;
+			if (crc & 0x10000) {
+				crc ^= CRC16_POLY;
+			}
+		}
+	}
+	return crc;
+}
+
+// Multiply two polynomials modulo CRC16_POLY.
+static uint mul_poly(uint a, uint b)
+{
+	uint c = 0;
+	while (a) {
+		if (a & 1) {
+			c ^= b;
+		}
+		a >>= 1;
+		b <<= 1;
+		if (b & 0x10000) {
+			b ^= CRC16_POLY;
+		}
+	}
+	return c;
+}
+
+static uint pow_poly(uint a, uint n)
+{
+	uint r = 1;
+	while (n) {
+		if (n & 1) {
+			r = mul_poly(r, a);
+		}
+		a = mul_poly(a, a);
+		n >>= 1;
+	}
+	return r;
+}
+
+// Report whether both CRCs of a frame are valid.
+int ac3_check_crc(const u8 *frame, int size)
+{
+	int n = frame_size_58(size);
+	return crc16(frame+2, n-2) == 0 && crc16(frame+n, size-n) == 0;
+}
+
+// Recompute crc1 and crc2 after a frame has been modified.
+void ac3_fix_crc(u8 *frame, int size)
+{
+	int n = frame_size_58(size);
+	uint crc;
+
+	// crc1 comes first in the data it protects, so it can't be computed
+	// directly. Compute the remainder with crc1 zeroed and then divide out
+	// the x^(8n) that the following bytes multiply it by. x^-1 is
+	// x^15 + x^14 + x.
+	frame[2] = 0;
+	frame[3] = 0;
+	crc = crc16(frame+2, n-2);
+	crc = mul_poly(crc, pow_poly(0xC002, 8*(uint)(n-2)));
+	frame[2] = (u8)(crc >> 8);
+	frame[3] = (u8)crc;
+
+	// crc2 comes last, so it is just the remainder of everything before it.
+	crc = crc16(frame+n, size-n-2);
+	frame[size-2] = (u8)(crc >> 8);
+	frame[size-1] = (u8)crc;
+}
+
+// Stripping DRC only requires knowing where the fields are, but finding the
+// dynrng of block 5 means walking blocks 0-4 all the way through their
+// mantissas. The parser below keeps just enough state to do that.
+
+// Maximum number of compr and dynrng fields in a frame.
+enum { MAX_FIELDS = 2 + 2*6 };
+
+struct drc {
+	struct bitreader br;
+
+	int acmod, lfeon, fscod, nfchans;
+
+	// Coupling
+	int cplinu, chincpl, phsflginu;
+	int cplbegf, cplendf, ncplbnd;
+	int cplstrtmant, cplendmant;
+
+	// Exponents and bit allocation. These persist from block to block.
+	int chbwcod[5];
+	int exp[5][256], cplexp[256], lfeexp[256];
+	int bap[5][256], cplbap[256], lfebap[256];
+	struct balloc ba[5], cplba, lfeba;
+	int csnroffst;
+	int sdecay, fdecay, sgain, dbknee, floor;
+
+	int b1, b2, b4; // mantissa groups
+
+	// Bit offsets of the compr and dynrng fields.
+	size_t fields[MAX_FIELDS];
+	int nfields;
+};
+
+static uint get(struct drc *d, uint n)
+{
+	return read_bits(&d->br, n);
+}
+
+// Read an 8-bit compr or dynrng field and remember where it was.
+static void field(struct drc *d)
+{
+	if (d->nfields < MAX_FIELDS) {
+		d->fields[d->nfields++] = d->br.pos*8 - d->br.count;
+	}
+	skip_bits(&d->br, 8);
+}
+
+static void skip_mant(struct drc *d, int bap)
+{
+	switch (bap) {
+	case 0:
+		break;
+	case 1:
+		if (d->b1) {
+			d->b1--;
+		} else {
+			skip_bits(&d->br, 5);
+			d->b1 = 2;
+		}
+		break;
+	case 2:
+		if (d->b2) {
+			d->b2--;
+		} else {
+			skip_bits(&d->br, 7);
+			d->b2 = 2;
+		}
+		break;
+	case 3:
+		skip_bits(&d->br, 3);
+		break;
+	case 4:
+		if (d->b4) {
+			d->b4 = 0;
+		} else {
+			skip_bits(&d->br, 7);
+			d->b4 = 1;
+		}
+		break;
+	case 5:
+		skip_bits(&d->br, 4);
+		break;
+	default:
+		skip_bits(&d->br, quantization_tab[bap & 15]);
+		break;
+	}
+}
+
+static int read_delta(struct drc *d, struct balloc *ba)
+{
+	int seg;
+	ba->deltnseg = (int)get(d, 3) + 1;
+	for (seg = 0; seg < ba->deltnseg; seg++) {
+		ba->deltoffst[seg] = (int)get(d, 5);
+		ba->deltlen[seg] = (int)get(d, 4);
+		ba->deltba[seg] = (int)get(d, 3);
+	}
+	return 0;
+}
+
+// Walk one audio block. For the last block, stop once the dynrng fields
+// have been read. Returns -1 if the block is malformed.
+static int audblk(struct drc *d, int blk)
+{
+	int ch, bnd, grp, bin;
+	int nfchans = d->nfchans;
+	int cplcoe[5] = {0};
+	int chexpstr[5], cplexpstr = 0, lfeexpstr = 0;
+	int endmant[5];
+	int dexp[256];
+	int absexp, ngrps, deltbae, got_cplchan;
+
+	skip_bits(&d->br, (uint)nfchans); // blksw
+	skip_bits(&d->br, (uint)nfchans); // dithflag
+	if (get(d, 1)) { // dynrnge
+		field(d);
+	}
+	if (d->acmod == 0) {
+		if (get(d, 1)) { // dynrng2e
+			field(d);
+		}
+	}
+	if (blk == 5) {
+		return 0;
+	}
+
+	// Coupling strategy
+	if (get(d, 1)) { // cplstre
+		d->cplinu = (int)get(d, 1);
+		d->chincpl = 0;
+		if (d->cplinu) {
+			for (ch = 0; ch < nfchans; ch++) {
+				d->chincpl |= (int)get(d, 1) << ch;
+			}
+			if (d->acmod == 2) {
+				d->phsflginu = (int)get(d, 1);
+			}
+			d->cplbegf = (int)get(d, 4);
+			d->cplendf = (int)get(d, 4) + 3;
+			if (d->cplendf <= d->cplbegf) {
+				return -1;
+			}
+			d->ncplbnd = d->cplendf - d->cplbegf;
+			for (bnd = 1; bnd < d->cplendf - d->cplbegf; bnd++) {
+				d->ncplbnd -= (int)get(d, 1); // cplbndstrc
+			}
+			d->cplstrtmant = d->cplbegf*12 + 37;
+			d->cplendmant = d->cplendf*12 + 37;
+		}
+	} else if (blk == 0) {
+		return -1;
+	}
+	if (d->cplinu) {
+		for (ch = 0; ch < nfchans; ch++) {
+			if (d->chincpl & (1<<ch)) {
+				cplcoe[ch] = (int)get(d, 1);
+				if (cplcoe[ch]) {
+					skip_bits(&d->br, 2); // mstrcplco
+					for (bnd = 0; bnd < d->ncplbnd; bnd++) {
+						skip_bits(&d->br, 4); // cplcoexp
+						skip_bits(&d->br, 4); // cplcomant
+					}
+				}
+			}
+		}
+		if (d->acmod == 2 && d->phsflginu && (cplcoe[0] || cplcoe[1])) {
+			skip_bits(&d->br, (uint)d->ncplbnd); // phsflg
+		}
+	}
+
+	// Rematrixing
+	if (d->acmod == 2) {
+		if (get(d, 1)) { // rematstr
+			if (d->cplbegf == 0 && d->cplinu) {
+				skip_bits(&d->br, 2);
+			} else if (d->cplbegf <= 2 && d->cplinu) {
+				skip_bits(&d->br, 3);
+			} else {
+				skip_bits(&d->br, 4);
+			}
+		}
+	}
+
+	// Exponents
+	if (d->cplinu) {
+		cplexpstr = (int)get(d, 2);
+	}
+	for (ch = 0; ch < nfchans; ch++) {
+		chexpstr[ch] = (int)get(d, 2);
+	}
+	if (d->lfeon) {
+		lfeexpstr = (int)get(d, 1);
+	}
+	for (ch = 0; ch < nfchans; ch++) {
+		if (chexpstr[ch] != 0 && !(d->chincpl & (1<<ch))) {
+			d->chbwcod[ch] = (int)get(d, 6);
+			if (d->chbwcod[ch] > 60) {
+				return -1;
+			}
+		}
+		if (d->cplinu && (d->chincpl & (1<<ch))) {
+			endmant[ch] = d->cplstrtmant;
+		} else {
+			endmant[ch] = 37 + 3*(d->chbwcod[ch] + 12);
+		}
+	}
+	if (d->cplinu && cplexpstr != 0) {
+		ngrps = (d->cplendmant - d->cplstrtmant) / expgrptab[cplexpstr];
+		absexp = (int)get(d, 4) << 1; // cplabsexp
+		for (grp = 0; grp < ngrps; grp++) {
+			dexp[grp] = (int)get(d, 7);
+		}
+		decode_exponents(&d->cplexp[d->cplstrtmant-1], dexp, ngrps, absexp, grpsizetab[cplexpstr]);
+	}
+	for (ch = 0; ch < nfchans; ch++) {
+		if (chexpstr[ch] != 0) {
+			absexp = (int)get(d, 4);
+			ngrps = (endmant[ch] - 1 + expgrptab[chexpstr[ch]] - 3) / expgrptab[chexpstr[ch]];
+			for (grp = 0; grp < ngrps; grp++) {
+				dexp[grp] = (int)get(d, 7);
+			}
+			decode_exponents(d->exp[ch], dexp, ngrps, absexp, grpsizetab[chexpstr[ch]]);
+			skip_bits(&d->br, 2); // gainrng
+		} else if (blk == 0) {
+			return -1;
+		}
+	}
+	if (d->lfeon && lfeexpstr != 0) {
+		absexp = (int)get(d, 4);
+		dexp[0] = (int)get(d, 7);
+		dexp[1] = (int)get(d, 7);
+		decode_exponents(d->lfeexp, dexp, 2, absexp, 1);
+	}
+
+	// Bit allocation parametric information
+	if (get(d, 1)) { // baie
+		d->sdecay = sdecaytab[get(d, 2)];
+		d->fdecay = fdecaytab[get(d, 2)];
+		d->sgain = sgaintab[get(d, 2)];
+		d->dbknee = dbkneetab[get(d, 2)];
+		d->floor = floortab[get(d, 3)];
+	} else if (blk == 0) {
+		return -1;
+	}
+	if (get(d, 1)) { // snroffste
+		d->csnroffst = (int)get(d, 6);
+		if (d->cplinu) {
+			d->cplba.fsnroffst = (int)get(d, 4);
+			d->cplba.fgain = fgaintab[get(d, 3)];
+		}
+		for (ch = 0; ch < nfchans; ch++) {
+			d->ba[ch].fsnroffst = (int)get(d, 4);
+			d->ba[ch].fgain = fgaintab[get(d, 3)];
+		}
+		if (d->lfeon) {
+			d->lfeba.fsnroffst = (int)get(d, 4);
+			d->lfeba.fgain = fgaintab[get(d, 3)];
+		}
+	} else if (blk == 0) {
+		return -1;
+	}
+	if (d->cplinu) {
+		if (get(d, 1)) { // cplleake
+			d->cplba.fleak = (int)get(d, 3);
+			d->cplba.sleak = (int)get(d, 3);
+		}
+	}
+	if (get(d, 1)) { // deltbaie
+		// deltbae 0 reuses the previous deltas, 1 sends new ones, and
+		// 2 turns them off.
+		int cpldeltbae = 0;
+		int chdeltbae[5];
+		if (d->cplinu) {
+			cpldeltbae = (int)get(d, 2);
+		}
+		for (ch = 0; ch < nfchans; ch++) {
+			chdeltbae[ch] = (int)get(d, 2);
+		}
+		if (d->cplinu) {
+			if (cpldeltbae == 1) {
+				read_delta(d, &d->cplba);
+			}
+			if (cpldeltbae != 0) {
+				d->cplba.deltbae = cpldeltbae;
+			}
+		}
+		for (ch = 0; ch < nfchans; ch++) {
+			deltbae = chdeltbae[ch];
+			if (deltbae == 1) {
+				read_delta(d, &d->ba[ch]);
+			}
+			if (deltbae != 0) {
+				d->ba[ch].deltbae = deltbae;
+			}
+		}
+	}
+
+	// Skip field
+	if (get(d, 1)) { // skiple
+		uint skipl = get(d, 9);
+		while (skipl-- > 0) {
+			skip_bits(&d->br, 8);
+		}
+	}
+
+	if (d->br.err != 0) {
+		return -1;
+	}
+
+	// Any of the parameters above may have changed, so redo the bit
+	// allocation for every channel.
+	for (ch = 0; ch < nfchans; ch++) {
+		bit_allocation(d->bap[ch], &d->ba[ch], d->fscod, d->exp[ch],
+			0, endmant[ch], d->csnroffst,
+			d->sdecay, d->fdecay, d->sgain, d->dbknee, d->floor);
+	}
+	if (d->cplinu) {
+		bit_allocation(d->cplbap, &d->cplba, d->fscod, d->cplexp,
+			d->cplstrtmant, d->cplendmant, d->csnroffst,
+			d->sdecay, d->fdecay, d->sgain, d->dbknee, d->floor);
+	}
+	if (d->lfeon) {
+		bit_allocation(d->lfebap, &d->lfeba, d->fscod, d->lfeexp,
+			0, 7, d->csnroffst,
+			d->sdecay, d->fdecay, d->sgain, d->dbknee, d->floor);
+	}
+
+	// Mantissas
+	d->b1 = 0;
+	d->b2 = 0;
+	d->b4 = 0;
+	got_cplchan = 0;
+	for (ch = 0; ch < nfchans; ch++) {
+		for (bin = 0; bin < endmant[ch]; bin++) {
+			skip_mant(d, d->bap[ch][bin]);
+		}
+		if (d->cplinu && (d->chincpl & (1<<ch)) && !got_cplchan) {
+			for (bin = d->cplstrtmant; bin < d->cplendmant; bin++) {
+				skip_mant(d, d->cplbap[bin]);
+			}
+			got_cplchan = 1;
+		}
+	}
+	if (d->lfeon) {
+		for (bin = 0; bin < 7; bin++) {
+			skip_mant(d, d->lfebap[bin]);
+		}
+	}
+
+	if (d->br.err != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+// Walk the bit stream information header.
+static int bsi(struct drc *d)
+{
+	uint i, n;
+
+	skip_bits(&d->br, 16); // syncword
+	skip_bits(&d->br, 16); // crc1
+	d->fscod = (int)get(d, 2);
+	skip_bits(&d->br, 6); // frmsizecod
+	if (get(d, 5) > 8) { // bsid
+		return -1; // not something we understand
+	}
+	skip_bits(&d->br, 3); // bsmod
+	d->acmod = (int)get(d, 3);
+	d->nfchans = nfchanstab[d->acmod];
+	if ((d->acmod & 1) && d->acmod != 1) {
+		skip_bits(&d->br, 2); // cmixlev
+	}
+	if (d->acmod & 4) {
+		skip_bits(&d->br, 2); // surmixlev
+	}
+	if (d->acmod == 2) {
+		skip_bits(&d->br, 2); // dsurmod
+	}
+	d->lfeon = (int)get(d, 1);
+	for (i = 0; i < (d->acmod == 0 ? 2U : 1U); i++) {
+		skip_bits(&d->br, 5); // dialnorm
+		if (get(d, 1)) { // compre
+			field(d);
+		}
+		if (get(d, 1)) { // langcode
+			skip_bits(&d->br, 8);
+		}
+		if (get(d, 1)) { // audprodie
+			skip_bits(&d->br, 5); // mixlevel
+			skip_bits(&d->br, 2); // roomtyp
+		}
+	}
+	skip_bits(&d->br, 1); // copyrightb
+	skip_bits(&d->br, 1); // origbs
+	if (get(d, 1)) { // timecod1e
+		skip_bits(&d->br, 14);
+	}
+	if (get(d, 1)) { // timecod2e
+		skip_bits(&d->br, 14);
+	}
+	if (get(d, 1)) { // addbsie
+		n = get(d, 6) + 1;
+		while (n-- > 0) {
+			skip_bits(&d->br, 8);
+		}
+	}
+	return d->br.err;
+}
+
+// Write n zero bits at bit offset pos.
+static void clear_bits(u8 *buf, size_t pos, int n)
+{
+	while (n-- > 0) {
+		buf[pos/8] &= (u8)~(0x80 >> (pos%8));
+		pos++;
+	}
+}
+
+// Set every compr and dynrng field in the frame to 0dB and fix up the CRCs.
+// The frame must be a complete syncframe with valid CRCs. Returns the
+// number of fields changed, or -1 if the frame could not be parsed, in which
+// case it is left untouched.
+int ac3_strip_drc(u8 *frame, int size)
+{
+	struct drc d;
+	int blk, i, changed;
+
+	if (size < 5 || ac3_frame_size(frame) != size) {
+		return -1;
+	}
+	if (!ac3_check_crc(frame, size)) {
+		return -1;
+	}
+
+	memset(&d, 0, sizeof d);
+	bitreader_init(&d.br, frame, (size_t)size);
+	for (i = 0; i < 5; i++) {
+		d.ba[i].deltbae = 2;
+	}
+	d.cplba.deltbae = 2;
+	d.lfeba.deltbae = 2;
+
+	if (bsi(&d) < 0) {
+		return -1;
+	}
+	for (blk = 0; blk < 6; blk++) {
+		if (audblk(&d, blk) < 0) {
+			return -1;
+		}
+	}
+
+	changed = 0;
+	for (i = 0; i < d.nfields; i++) {
+		size_t pos = d.fields[i];
+		uint v = (uint)frame[pos/8] << 8;
+		if (pos%8 != 0) {
+			v |= frame[pos/8+1];
+		}
+		if (((v >> (8 - pos%8)) & 0xff) != 0) {
+			clear_bits(frame, pos, 8);
+			changed++;
+		}
+	}
+	if (changed > 0) {
+		ac3_fix_crc(frame, size);
+	}
+	return changed;
+}
@@ -0,0 +1,14 @@
+#ifndef AC3DRC_H
+#define AC3DRC_H
+
+#include "uint.h"
+
+// Size in bytes of the largest A/52 syncframe (640kbps at 32kHz).
+#define AC3_MAX_FRAME_SIZE 3840
+
+int ac3_frame_size(const u8 *hdr);
+int ac3_check_crc(const u8 *frame, int size);
+void ac3_fix_crc(u8 *frame, int size);
+int ac3_strip_drc(u8 *frame, int size);
+
+#endif
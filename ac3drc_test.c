@@ -0,0 +1,121 @@
+#include "ac3drc.h"
+#include <assert.h>
+#include <string.h>
+
+struct bits {
+	u8 *buf;
+	int pos;
+};
+
+static void put(struct bits *b, uint v, int n)
+{
+	while (n-- > 0) {
+		if ((v >> n) & 1) {
+			b->buf[b->pos/8] |= (u8)(0x80 >> (b->pos%8));
+		}
+		b->pos++;
+	}
+}
+
+// Build a 32kbps mono frame whose exponents are all so small that every bap
+// is zero, so the frame has no mantissas. Compr and every dynrng are set to
+// drc.
+static void build_frame(u8 *frame, uint drc)
+{
+	struct bits b = {frame, 0};
+	int blk, grp;
+
+	memset(frame, 0, 128);
+	put(&b, 0x0B77, 16);
+	put(&b, 0, 16); // crc1
+	put(&b, 0, 2); // fscod
+	put(&b, 0, 6); // frmsizecod
+	put(&b, 8, 5); // bsid
+	put(&b, 0, 3); // bsmod
+	put(&b, 1, 3); // acmod
+	put(&b, 0, 1); // lfeon
+	put(&b, 27, 5); // dialnorm
+	put(&b, 1, 1); put(&b, drc, 8); // compre, compr
+	put(&b, 0, 1); // langcode
+	put(&b, 0, 1); // audprodie
+	put(&b, 0, 2); // copyrightb, origbs
+	put(&b, 0, 2); // timecod1e, timecod2e
+	put(&b, 0, 1); // addbsie
+
+	for (blk = 0; blk < 6; blk++) {
+		put(&b, 0, 2); // blksw, dithflag
+		put(&b, 1, 1); put(&b, drc, 8); // dynrnge, dynrng
+		if (blk == 0) {
+			put(&b, 1, 1); put(&b, 0, 1); // cplstre, cplinu
+			put(&b, 3, 2); // chexpstr
+			put(&b, 0, 6); // chbwcod
+			put(&b, 15, 4); // exps[0]
+			for (grp = 0; grp < 6; grp++) {
+				put(&b, 62, 7); // no change
+			}
+			put(&b, 0, 2); // gainrng
+			put(&b, 1, 1); put(&b, 0, 11); // baie
+			put(&b, 1, 1); put(&b, 0, 6+4+3); // snroffste
+		} else {
+			put(&b, 0, 1); // cplstre
+			put(&b, 0, 2); // chexpstr
+			put(&b, 0, 1); // baie
+			put(&b, 0, 1); // snroffste
+		}
+		put(&b, 0, 1); // deltbaie
+		put(&b, 0, 1); // skiple
+	}
+	assert(b.pos < 128*8);
+	ac3_fix_crc(frame, 128);
+}
+
+int main(int argc, char *argv[])
+{
+	(void)argc;
+	(void)argv;
+
+	u8 frame[AC3_MAX_FRAME_SIZE];
+	u8 want[128];
+	uint seed = 1;
+	int i;
+
+	// Fixed CRCs check out for every frame size, whatever the contents.
+	for (int size = 128; size <= AC3_MAX_FRAME_SIZE; size += 250) {
+		for (i = 0; i < size; i++) {
+			seed = seed*1103515245 + 12345;
+			frame[i] = (u8)(seed >> 16);
+		}
+		assert(!ac3_check_crc(frame, size));
+		ac3_fix_crc(frame, size);
+		assert(ac3_check_crc(frame, size));
+	}
+
+	frame[0] = 0x0B;
+	frame[1] = 0x77;
+	frame[4] = 0x00;
+	assert(ac3_frame_size(frame) == 128);
+	frame[4] = 0x1e; // 48kHz, 448kbps
+	assert(ac3_frame_size(frame) == 1792);
+	frame[4] = 0x5e; // 44.1kHz, 448kbps
+	assert(ac3_frame_size(frame) == 1950);
+	frame[4] = 0xc0;
+	assert(ac3_frame_size(frame) == -1);
+	frame[0] = 0;
+	assert(ac3_frame_size(frame) == -1);
+
+	build_frame(frame, 0xa5);
+	build_frame(want, 0);
+	assert(ac3_check_crc(frame, 128));
+	assert(ac3_strip_drc(frame, 128) == 7);
+	assert(memcmp(frame, want, 128) == 0);
+	assert(ac3_strip_drc(frame, 128) == 0);
+
+	// Frames with bad CRCs are left alone.
+	build_frame(frame, 0xa5);
+	frame[100] ^= 1;
+	memcpy(want, frame, 128);
+	assert(ac3_strip_drc(frame, 128) == -1);
+	assert(memcmp(frame, want, 128) == 0);
+
+	return 0;
+}
@@ -0,0 +1,103 @@
+/* ats - the track tables of DVD-Audio title sets */
+
+#include <stdlib.h>
+#include <string.h>
+#include "ats.h"
+
+enum { title_table = 0x800, title_size = 16, track_size = 20, sector_size = 12 };
+
+static uint be16(const u8* p)
+{
+	return (uint)(p[0]<<8 | p[1]);
+}
+
+static uint32_t be32(const u8* p)
+{
+	return (uint32_t)p[0]<<24 | (uint32_t)p[1]<<16 | (uint32_t)p[2]<<8 | p[3];
+}
+
+// Parse the title at offset t of the IFO.
+static int parse_title(struct ats_title* x, const u8* ifo, size_t size, size_t t)
+{
+	size_t tracks, sectors;
+	const u8* p;
+	int i;
+
+	if (t + title_size > size) {
+		return -1;
+	}
+	p = ifo + t;
+	x->ntracks = p[2];
+	x->length = be32(p+4);
+	tracks = t + be16(p+10);
+	sectors = t + be16(p+12);
+	if (x->ntracks == 0 ||
+	    tracks + (size_t)x->ntracks * track_size > size ||
+	    sectors + (size_t)x->ntracks * sector_size > size) {
+		return -1;
+	}
+	x->tracks = malloc((size_t)x->ntracks * sizeof *x->tracks);
+	if (x->tracks == NULL) {
+		return -1;
+	}
+	for (i = 0; i < x->ntracks; i++) {
+		struct ats_track* k = &x->tracks[i];
+		const u8* r = ifo + tracks + (size_t)i * track_size;
+		const u8* s = ifo + sectors + (size_t)i * sector_size;
+		uint32_t first = be32(s+4), last = be32(s+8);
+
+		if (s[0] != 0x01 || first > last || last >= INT32_MAX) {
+			return -1;
+		}
+		// Tracks play in order on the disc.
+		if (i > 0 && (int)first <= x->tracks[i-1].last) {
+			return -1;
+		}
+		k->first = (int)first;
+		k->last = (int)last;
+		k->pts = be32(r+6);
+		k->length = be32(r+10);
+	}
+	return 0;
+}
+
+struct ats* ats_parse(const u8* ifo, size_t size)
+{
+	struct ats* a;
+	int i;
+
+	if (size < title_table + 8 || memcmp(ifo, "DVDAUDIO-ATS", 12) != 0) {
+		return NULL;
+	}
+	a = malloc(sizeof *a);
+	if (a == NULL) {
+		return NULL;
+	}
+	a->ntitles = (int)be16(ifo + title_table);
+	if (a->ntitles == 0 || title_table + 8 + (size_t)a->ntitles * 8 > size) {
+		free(a);
+		return NULL;
+	}
+	a->titles = calloc((size_t)a->ntitles, sizeof *a->titles);
+	if (a->titles == NULL) {
+		free(a);
+		return NULL;
+	}
+	for (i = 0; i < a->ntitles; i++) {
+		const u8* p = ifo + title_table + 8 + (size_t)i * 8;
+		if (parse_title(&a->titles[i], ifo, size, title_table + be32(p+4)) < 0) {
+			ats_free(a);
+			return NULL;
+		}
+	}
+	return a;
+}
+
+void ats_free(struct ats* a)
+{
+	for (int i = 0; i < a->ntitles; i++) {
+		free(a->titles[i].tracks);
+	}
+	free(a->titles);
+	free(a);
+}
@@ -0,0 +1,43 @@
+#ifndef ATS_H
+#define ATS_H
+
+#include <stddef.h>
+#include "uint.h"
+
+// The track tables of a DVD-Audio title set, from its ATS_xx_0.IFO.
+//
+// IFO layout, as far as it's needed here (all numbers big-endian):
+// 000: "DVDAUDIO-ATS"
+// 800: title table: number of titles (2 bytes), 2 reserved, end address
+//      (4), then 8 bytes per title: title number | 0x80, 3 reserved, and
+//      the offset of the title from the start of the table (4).
+// Each title: 2 reserved, number of tracks, number of indexes, length in
+//      90kHz ticks (4), 2 reserved, offset of the track table (2) and of
+//      the sector table (2), both from the start of the title.
+// Track table: 20 bytes per track: flags, 3 reserved, track number, 1
+//      reserved, first PTS (4), length in 90kHz ticks (4), 6 reserved.
+// Sector table: 12 bytes per track: 0x01, 3 reserved, first and last
+//      sector (4 each), counted from the start of ATS_xx_1.AOB.
+
+struct ats_track {
+	int first, last; // sectors
+	uint32_t pts, length;
+};
+
+struct ats_title {
+	int ntracks;
+	uint32_t length;
+	struct ats_track* tracks;
+};
+
+struct ats {
+	int ntitles;
+	struct ats_title* titles;
+};
+
+// Parse an ATS IFO of size bytes. Returns NULL if it isn't one, or is
+// broken, or if out of memory.
+struct ats* ats_parse(const u8* ifo, size_t size);
+void ats_free(struct ats* a);
+
+#endif
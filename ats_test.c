@@ -0,0 +1,83 @@
+#include "ats.h"
+#include <assert.h>
+#include <string.h>
+
+static u8 ifo[3*2048];
+
+static void put16(u8* p, uint v)
+{
+	p[0] = (u8)(v >> 8);
+	p[1] = (u8)v;
+}
+
+static void put32(u8* p, uint32_t v)
+{
+	put16(p, v >> 16);
+	put16(p+2, v & 0xffff);
+}
+
+// Lay out a title of n tracks at offset t from the title table, each track
+// len sectors long and starting where the last one left off.
+static int make_title(int t, int n, int first, int len)
+{
+	u8* p = ifo + 0x800 + t;
+	int i;
+
+	p[2] = (u8)n;
+	p[3] = (u8)n;
+	put32(p+4, (uint32_t)(n * 90000));
+	put16(p+10, 16);
+	put16(p+12, (uint)(16 + 20*n));
+	for (i = 0; i < n; i++) {
+		u8* r = p + 16 + 20*i;
+		u8* s = p + 16 + 20*n + 12*i;
+		r[0] = i == 0 ? 0xc0 : 0x00;
+		r[4] = (u8)(i+1);
+		put32(r+6, (uint32_t)(i * 90000));
+		put32(r+10, 90000);
+		s[0] = 0x01;
+		put32(s+4, (uint32_t)(first + i*len));
+		put32(s+8, (uint32_t)(first + (i+1)*len - 1));
+	}
+	return t + 16 + 32*n;
+}
+
+int main(int argc, char *argv[])
+{
+	(void)argc;
+	(void)argv;
+
+	struct ats* a;
+	int t;
+
+	memcpy(ifo, "DVDAUDIO-ATS", 12);
+	put16(ifo + 0x800, 2);
+	ifo[0x808] = 0x81;
+	put32(ifo + 0x80c, 24);
+	t = make_title(24, 3, 0, 100);
+	ifo[0x810] = 0x82;
+	put32(ifo + 0x814, (uint32_t)t);
+	make_title(t, 2, 300, 50);
+
+	a = ats_parse(ifo, sizeof ifo);
+	assert(a != NULL);
+	assert(a->ntitles == 2);
+	assert(a->titles[0].ntracks == 3);
+	assert(a->titles[0].length == 3*90000);
+	assert(a->titles[0].tracks[1].first == 100);
+	assert(a->titles[0].tracks[1].last == 199);
+	assert(a->titles[0].tracks[2].pts == 2*90000);
+	assert(a->titles[0].tracks[2].length == 90000);
+	assert(a->titles[1].ntracks == 2);
+	assert(a->titles[1].tracks[0].first == 300);
+	assert(a->titles[1].tracks[1].last == 399);
+	ats_free(a);
+
+	// Cut short, tracks out of order, and not an ATS at all
+	assert(ats_parse(ifo, (size_t)(0x800 + t + 16)) == NULL);
+	put32(ifo + 0x800 + t + 16 + 40 + 12 + 4, 0);
+	assert(ats_parse(ifo, sizeof ifo) == NULL);
+	memcpy(ifo, "DVDVIDEO-VTS", 12);
+	assert(ats_parse(ifo, sizeof ifo) == NULL);
+	return 0;
+}
@@ -0,0 +1,156 @@
+/* cells - planning a rip of several titles of a titleset */
+
+#include <stdlib.h>
+#include <string.h>
+#include "cells.h"
+
+static int compare_cells(const void* a, const void* b)
+{
+	const struct cell_range* x = a;
+	const struct cell_range* y = b;
+	if (x->first != y->first) {
+		return x->first < y->first ? -1 : 1;
+	}
+	return x->last < y->last ? -1 : x->last > y->last;
+}
+
+// How much of a piece belongs to the chapter before it.
+static int64_t piece_lead(const struct piece* p)
+{
+	return p->lead >= 0 ? p->lead : p->length;
+}
+
+int cells_add(struct title_cells* x, int first, int last)
+{
+	struct cell_range* r = realloc(x->ranges, (size_t)(x->ncells+1) * sizeof *r);
+	if (r == NULL) {
+		return -1;
+	}
+	x->ranges = r;
+	x->ranges[x->ncells].first = first;
+	x->ranges[x->ncells].last = last;
+	x->ncells++;
+	return 0;
+}
+
+void cells_free(struct title_cells* x)
+{
+	free(x->ranges);
+	free(x->cells);
+	free(x->start);
+	free(x->seconds);
+}
+
+int cells_union(struct title_cells* tc, int ntc, struct cell_range** cellsp)
+{
+	struct cell_range* cells = NULL;
+	int ncells = 0, i, j;
+
+	for (i = 0; i < ntc; i++) {
+		struct cell_range* r = realloc(cells, (size_t)(ncells + tc[i].ncells) * sizeof *r);
+		if (r == NULL && ncells + tc[i].ncells > 0) {
+			free(cells);
+			return -1;
+		}
+		cells = r;
+		memcpy(cells + ncells, tc[i].ranges, (size_t)tc[i].ncells * sizeof *r);
+		ncells += tc[i].ncells;
+	}
+	if (ncells > 0) {
+		qsort(cells, (size_t)ncells, sizeof *cells, compare_cells);
+	}
+	for (i = 0, j = 0; i < ncells; i++) {
+		if (j == 0 || compare_cells(&cells[j-1], &cells[i]) != 0) {
+			cells[j++] = cells[i];
+		}
+	}
+	ncells = j;
+	for (i = 0; i < ntc; i++) {
+		free(tc[i].cells);
+		tc[i].cells = malloc((size_t)tc[i].ncells * sizeof *tc[i].cells + 1);
+		if (tc[i].cells == NULL) {
+			free(cells);
+			return -1;
+		}
+		for (j = 0; j < tc[i].ncells; j++) {
+			struct cell_range* r = bsearch(&tc[i].ranges[j], cells, (size_t)ncells, sizeof *cells, compare_cells);
+			tc[i].cells[j] = (int)(r - cells);
+		}
+	}
+	*cellsp = cells;
+	return ncells;
+}
+
+int cells_passes(const struct cell_range* cells, int ncells, int* pass)
+{
+	// The last sector of each pass so far
+	int* passend = malloc((size_t)ncells * sizeof *passend + 1);
+	int npasses = 0, i, j;
+
+	if (passend == NULL) {
+		return -1;
+	}
+	for (i = 0; i < ncells; i++) {
+		for (j = 0; j < npasses && passend[j] >= cells[i].first; j++) {
+		}
+		if (j == npasses) {
+			npasses++;
+		}
+		pass[i] = j;
+		passend[j] = cells[i].last;
+	}
+	free(passend);
+	return npasses;
+}
+
+int cells_span(const struct cell_range* cells, int ncells, const int* pass, int i, int* span)
+{
+	int n = 0;
+
+	for (int j = i; j < ncells; j++) {
+		if (pass[j] != pass[i]) {
+			continue;
+		}
+		if (n > 0 && cells[j].first != cells[span[n-1]].last + 1) {
+			break;
+		}
+		span[n++] = j;
+	}
+	return n;
+}
+
+// Add a run of a piece, unless there's nothing to copy.
+static void add_run(struct piece_run* runs, int* n, const struct piece* p, int cell, int64_t from, int64_t to)
+{
+	if (p->offset >= 0 && from < to) {
+		runs[*n] = (struct piece_run){cell, from, to};
+		(*n)++;
+	}
+}
+
+int cells_track(const struct title_cells* x, int c, const struct piece* pieces, bool spu,
+	struct piece_run* runs, bool* complete)
+{
+	int first = x->start[c - x->first], end = x->start[c - x->first + 1];
+	int stop = c+1 < x->end || x->next ? x->start[c - x->first + 2] : end;
+	const struct piece* p;
+	bool started = spu;
+	int n = 0, j;
+
+	*complete = true;
+	for (j = first; j < end; j++) {
+		p = &pieces[x->cells[j]];
+		add_run(runs, &n, p, x->cells[j], started ? 0 : piece_lead(p), p->length);
+		started = started || p->lead >= 0;
+		*complete = *complete && p->complete;
+	}
+	for (j = end; j < stop && !spu; j++) {
+		p = &pieces[x->cells[j]];
+		add_run(runs, &n, p, x->cells[j], 0, piece_lead(p));
+		*complete = *complete && p->complete;
+		if (p->lead >= 0) {
+			break;
+		}
+	}
+	return n;
+}
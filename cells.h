@@ -0,0 +1,77 @@
+#ifndef CELLS_H
+#define CELLS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Planning a rip of several titles of a titleset. Each cell the titles play
+// is read once, in order on the disc, with every stream's data from each
+// cell kept as a piece of that stream's spool file. Then each title's
+// tracks are put together from the pieces of its cells.
+
+// A cell's sectors.
+struct cell_range {
+	int first, last;
+};
+
+// What a stream had in one cell: where it is in the stream's spool file,
+// and how much of it is the end of the frame before the cell, ahead of the
+// first frame starting in the cell.
+struct piece {
+	int64_t offset; // -1 until written
+	int64_t length;
+	int64_t lead; // -1 until a frame starts
+	bool complete;
+};
+
+// The cells a title plays, in order: start[i] is the first of the cells
+// of chapter first+i. The cells of the chapter after the last one ripped
+// are there too, if there is one, for the end of the last track.
+struct title_cells {
+	int title;
+	int first, end; // chapters to rip, 0-based, end excluded
+	bool next; // whether there's a chapter after end
+	struct cell_range* ranges;
+	int* cells; // the ranges as indexes into the titleset's cells
+	int ncells;
+	int* start;
+	double* seconds; // playback time of each chapter
+};
+
+// A run of a piece to copy to a track.
+struct piece_run {
+	int cell; // index into the titleset's cells
+	int64_t from, to;
+};
+
+// Add a cell to a title. Returns -1 if out of memory.
+int cells_add(struct title_cells* x, int first, int last);
+
+// Free what a title's cells hold, but not x.
+void cells_free(struct title_cells* x);
+
+// Make a list of the cells the titles play, each once, in order on the
+// disc, and set each title's cells to their indexes into it. Returns the
+// number of cells, or -1 if out of memory.
+int cells_union(struct title_cells* tc, int ntc, struct cell_range** cellsp);
+
+// Put the cells in passes, each of which has cells which don't overlap,
+// setting pass[i] for each cell. Returns the number of passes, or -1 if
+// out of memory.
+int cells_passes(const struct cell_range* cells, int ncells, int* pass);
+
+// Find the cells of cell i's pass that follow on from it on the disc, to
+// be read in one go, setting span to their indexes. Cell i has to be the
+// first of its pass not yet read. Returns how many there are.
+int cells_span(const struct cell_range* cells, int ncells, const int* pass, int i, int* span);
+
+// Plan the track of chapter c of a title from the pieces of a stream,
+// setting runs and returning how many there are; runs needs room for the
+// title's ncells. An audio track starts at the chapter's first frame, and
+// runs on into the next chapter until its first frame; a subpicture track
+// is the chapter's pieces as they are. Sets *complete to whether every
+// piece used was complete.
+int cells_track(const struct title_cells* x, int c, const struct piece* pieces, bool spu,
+	struct piece_run* runs, bool* complete);
+
+#endif
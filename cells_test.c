@@ -0,0 +1,155 @@
+#include "cells.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Make a title from its cells, with chapters starting at the given cells.
+static void make_title(struct title_cells* x, const struct cell_range* ranges, int n,
+	const int* start, int nchapters, bool next)
+{
+	memset(x, 0, sizeof *x);
+	for (int i = 0; i < n; i++) {
+		assert(cells_add(x, ranges[i].first, ranges[i].last) == 0);
+	}
+	x->first = 0;
+	x->end = nchapters;
+	x->next = next;
+	x->start = malloc((size_t)(nchapters + next + 1) * sizeof *x->start);
+	assert(x->start != NULL);
+	memcpy(x->start, start, (size_t)(nchapters + next + 1) * sizeof *x->start);
+}
+
+static bool runs_are(const struct piece_run* runs, int n, const struct piece_run* want, int nwant)
+{
+	if (n != nwant) {
+		return false;
+	}
+	for (int i = 0; i < n; i++) {
+		if (runs[i].cell != want[i].cell || runs[i].from != want[i].from || runs[i].to != want[i].to) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	(void)argc;
+	(void)argv;
+
+	struct title_cells tc[3];
+	struct cell_range* cells;
+	struct piece_run runs[8];
+	int pass[8], span[8];
+	bool complete, read[8] = {false};
+	int ncells, npasses, n, i;
+
+	// Titles which share some cells and overlap others. The third plays a
+	// cell twice.
+	make_title(&tc[0], (const struct cell_range[]){{10, 19}, {20, 29}, {30, 39}, {50, 59}}, 4,
+		(const int[]){0, 2, 3, 4}, 2, true);
+	make_title(&tc[1], (const struct cell_range[]){{20, 29}, {25, 34}, {50, 59}}, 3,
+		(const int[]){0, 2, 3}, 2, false);
+	make_title(&tc[2], (const struct cell_range[]){{50, 59}, {20, 29}, {30, 39}, {50, 59}}, 4,
+		(const int[]){0, 1, 4}, 1, true);
+
+	// Every cell once, in order on the disc
+	ncells = cells_union(tc, 3, &cells);
+	assert(ncells == 5);
+	const struct cell_range want[] = {{10, 19}, {20, 29}, {25, 34}, {30, 39}, {50, 59}};
+	for (i = 0; i < ncells; i++) {
+		assert(cells[i].first == want[i].first && cells[i].last == want[i].last);
+	}
+	assert(memcmp(tc[0].cells, (const int[]){0, 1, 3, 4}, 4 * sizeof(int)) == 0);
+	assert(memcmp(tc[1].cells, (const int[]){1, 2, 4}, 3 * sizeof(int)) == 0);
+	assert(memcmp(tc[2].cells, (const int[]){4, 1, 3, 4}, 4 * sizeof(int)) == 0);
+
+	// The overlapping cell goes in a pass of its own
+	npasses = cells_passes(cells, ncells, pass);
+	assert(npasses == 2);
+	assert(memcmp(pass, (const int[]){0, 0, 1, 0, 0}, 5 * sizeof(int)) == 0);
+
+	// Cells which follow each other are read together, and every cell is
+	// read once
+	n = cells_span(cells, ncells, pass, 0, span);
+	assert(n == 3 && span[0] == 0 && span[1] == 1 && span[2] == 3);
+	n = cells_span(cells, ncells, pass, 2, span);
+	assert(n == 1 && span[0] == 2);
+	for (int p = 0; p < npasses; p++) {
+		for (i = 0; i < ncells; i++) {
+			if (pass[i] != p) {
+				continue;
+			}
+			n = cells_span(cells, ncells, pass, i, span);
+			assert(n > 0 && span[0] == i);
+			for (int j = 0; j < n; j++) {
+				assert(!read[span[j]] && pass[span[j]] == p);
+				read[span[j]] = true;
+			}
+			i = span[n-1];
+		}
+	}
+	for (i = 0; i < ncells; i++) {
+		assert(read[i]);
+	}
+
+	// What each stream had in each cell. Nothing starts a frame in the
+	// second, and the last was cut short.
+	const struct piece pieces[] = {
+		{0, 100, 10, true},
+		{100, 50, -1, true},
+		{150, 40, 0, true},
+		{190, 80, 30, true},
+		{270, 60, 5, false},
+	};
+
+	// An audio track starts at its first frame, and runs on into the
+	// next chapter up to its first frame
+	n = cells_track(&tc[0], 0, pieces, false, runs, &complete);
+	assert(runs_are(runs, n, (const struct piece_run[]){{0, 10, 100}, {1, 0, 50}, {3, 0, 30}}, 3));
+	assert(complete);
+	n = cells_track(&tc[0], 1, pieces, false, runs, &complete);
+	assert(runs_are(runs, n, (const struct piece_run[]){{3, 30, 80}, {4, 0, 5}}, 2));
+	assert(!complete);
+
+	// A chapter that starts without a frame starts at the first one
+	n = cells_track(&tc[1], 0, pieces, false, runs, &complete);
+	assert(runs_are(runs, n, (const struct piece_run[]){{2, 0, 40}, {4, 0, 5}}, 2));
+	assert(!complete);
+	// The last chapter with none after it stops at its end
+	n = cells_track(&tc[1], 1, pieces, false, runs, &complete);
+	assert(runs_are(runs, n, (const struct piece_run[]){{4, 5, 60}}, 1));
+	assert(!complete);
+
+	// The next chapter's cells are run through until a frame starts
+	n = cells_track(&tc[2], 0, pieces, false, runs, &complete);
+	assert(runs_are(runs, n, (const struct piece_run[]){{4, 5, 60}, {1, 0, 50}, {3, 0, 30}}, 3));
+	assert(!complete);
+
+	// Subpictures take their chapter's pieces as they are
+	n = cells_track(&tc[0], 0, pieces, true, runs, &complete);
+	assert(runs_are(runs, n, (const struct piece_run[]){{0, 0, 100}, {1, 0, 50}}, 2));
+	assert(complete);
+	n = cells_track(&tc[2], 0, pieces, true, runs, &complete);
+	assert(runs_are(runs, n, (const struct piece_run[]){{4, 0, 60}}, 1));
+	assert(!complete);
+
+	// Pieces with nothing written are skipped, but still have to be
+	// complete
+	const struct piece empty[] = {
+		{-1, 0, -1, true},
+		{-1, 0, -1, false},
+		{0, 40, 10, true},
+		{40, 20, -1, true},
+		{60, 20, 0, true},
+	};
+	n = cells_track(&tc[0], 0, empty, false, runs, &complete);
+	assert(runs_are(runs, n, (const struct piece_run[]){{3, 0, 20}}, 1));
+	assert(!complete);
+
+	for (i = 0; i < 3; i++) {
+		cells_free(&tc[i]);
+	}
+	free(cells);
+	return 0;
+}
@@ -0,0 +1,322 @@
+/* checkpoint - how far a rip got
+
+The file is text: a magic line, the key, then a line for each track,
+either "done NAME" or "part NAME SECTOR OFFSET". A track that's done has
+no part line. */
+
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "checkpoint.h"
+
+struct part {
+	char* name;
+	int sector;
+	int64_t offset;
+};
+
+struct checkpoint {
+	char* filename;
+	char* key; // what was being ripped
+	pthread_mutex_t lock; // encoder workers finish tracks too
+	char** done;
+	int ndone, maxdone;
+	int failed; // tracks closed without all of their data
+	bool dirty; // tracks have finished since the last save
+	double saved;
+	struct part* parts;
+	int nparts, maxparts;
+};
+
+enum { checkpoint_interval = 10 }; // seconds
+
+// Longest track name read back; extractaudio's are well under it. Longer
+// ones are skipped rather than cut short.
+enum { max_name = 63 };
+
+static const char checkpoint_magic[] = "extractaudio checkpoint 1\n";
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static bool is_done(struct checkpoint* c, const char* name)
+{
+	for (int i = 0; i < c->ndone; i++) {
+		if (strcmp(c->done[i], name) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static struct part* find_part(struct checkpoint* c, const char* name)
+{
+	for (int i = 0; i < c->nparts; i++) {
+		if (strcmp(c->parts[i].name, name) == 0) {
+			return &c->parts[i];
+		}
+	}
+	return NULL;
+}
+
+// Add a finished track. Called with the lock held. Out of memory only
+// means the track is ripped again.
+static void add_done(struct checkpoint* c, const char* name)
+{
+	char* s;
+	if (is_done(c, name)) {
+		return;
+	}
+	if (c->ndone == c->maxdone) {
+		int max = c->maxdone > 0 ? c->maxdone*2 : 16;
+		void* p = realloc(c->done, (size_t)max * sizeof *c->done);
+		if (p == NULL) {
+			return;
+		}
+		c->done = p;
+		c->maxdone = max;
+	}
+	s = strdup(name);
+	if (s != NULL) {
+		c->done[c->ndone++] = s;
+	}
+}
+
+// Set where a track got to. Called with the lock held.
+static void set_part(struct checkpoint* c, const char* name, int sector, int64_t offset)
+{
+	struct part* p = find_part(c, name);
+	if (p == NULL) {
+		char* s;
+		if (c->nparts == c->maxparts) {
+			int max = c->maxparts > 0 ? c->maxparts*2 : 8;
+			void* q = realloc(c->parts, (size_t)max * sizeof *c->parts);
+			if (q == NULL) {
+				return;
+			}
+			c->parts = q;
+			c->maxparts = max;
+		}
+		s = strdup(name);
+		if (s == NULL) {
+			return;
+		}
+		p = &c->parts[c->nparts++];
+		p->name = s;
+	}
+	p->sector = sector;
+	p->offset = offset;
+}
+
+// Read a line into line, and return whether it all fit. At the end of the
+// file, returns false with line empty.
+static bool read_line(FILE* fp, char* line, int size)
+{
+	int ch;
+	size_t n;
+
+	if (fgets(line, size, fp) == NULL) {
+		line[0] = '\0';
+		return false;
+	}
+	n = strlen(line);
+	if (n > 0 && line[n-1] == '\n') {
+		line[n-1] = '\0';
+		return true;
+	}
+	if (feof(fp)) {
+		return true;
+	}
+	// Skip the rest.
+	while ((ch = getc(fp)) != EOF && ch != '\n') {
+	}
+	return false;
+}
+
+// Parse a done or part line into c.
+static void parse_line(struct checkpoint* c, const char* line)
+{
+	char name[max_name+1];
+	long long offset;
+	int sector, n = 0;
+
+	if (sscanf(line, "done %63s%n", name, &n) == 1 && line[n] == '\0') {
+		add_done(c, name);
+	} else if (sscanf(line, "part %63s %d %lld%n", name, &sector, &offset, &n) == 3 && line[n] == '\0' &&
+	           sector > 0 && offset >= 0) {
+		set_part(c, name, sector, offset);
+	}
+}
+
+struct checkpoint* checkpoint_open(const char* filename, const char* key)
+{
+	struct checkpoint* c = calloc(1, sizeof *c);
+	char line[256];
+	FILE* fp;
+
+	if (c == NULL) {
+		return NULL;
+	}
+	c->filename = strdup(filename);
+	c->key = strdup(key);
+	if (c->filename == NULL || c->key == NULL) {
+		free(c->filename);
+		free(c->key);
+		free(c);
+		return NULL;
+	}
+	pthread_mutex_init(&c->lock, NULL);
+	c->saved = now();
+
+	fp = fopen(filename, "r");
+	if (fp == NULL) {
+		return c;
+	}
+	if (fgets(line, sizeof line, fp) == NULL || strcmp(line, checkpoint_magic) != 0 ||
+	    !read_line(fp, line, sizeof line) || strcmp(line, key) != 0) {
+		fprintf(stderr, "%s: not from this rip; starting over\n", filename);
+		fclose(fp);
+		return c;
+	}
+	for (;;) {
+		bool whole = read_line(fp, line, sizeof line);
+		if (whole) {
+			parse_line(c, line);
+		} else if (line[0] == '\0') {
+			break;
+		}
+	}
+	fclose(fp);
+	return c;
+}
+
+void checkpoint_close(struct checkpoint* c, bool finished)
+{
+	int i;
+
+	if (finished && remove(c->filename) < 0 && errno != ENOENT) {
+		perror(c->filename);
+	}
+	pthread_mutex_destroy(&c->lock);
+	for (i = 0; i < c->ndone; i++) {
+		free(c->done[i]);
+	}
+	for (i = 0; i < c->nparts; i++) {
+		free(c->parts[i].name);
+	}
+	free(c->done);
+	free(c->parts);
+	free(c->filename);
+	free(c->key);
+	free(c);
+}
+
+bool checkpoint_done(struct checkpoint* c, const char* name)
+{
+	pthread_mutex_lock(&c->lock);
+	bool done = is_done(c, name);
+	pthread_mutex_unlock(&c->lock);
+	return done;
+}
+
+void checkpoint_finish(struct checkpoint* c, const char* name, bool done)
+{
+	pthread_mutex_lock(&c->lock);
+	if (!done) {
+		c->failed++;
+	} else {
+		add_done(c, name);
+	}
+	c->dirty = true;
+	pthread_mutex_unlock(&c->lock);
+}
+
+int checkpoint_failed(struct checkpoint* c)
+{
+	pthread_mutex_lock(&c->lock);
+	int failed = c->failed;
+	pthread_mutex_unlock(&c->lock);
+	return failed;
+}
+
+bool checkpoint_find(struct checkpoint* c, const char* name, int* sector, int64_t* offset)
+{
+	struct part* p;
+	bool found = false;
+
+	pthread_mutex_lock(&c->lock);
+	p = find_part(c, name);
+	if (p != NULL && !is_done(c, name)) {
+		*sector = p->sector;
+		*offset = p->offset;
+		found = true;
+	}
+	pthread_mutex_unlock(&c->lock);
+	return found;
+}
+
+void checkpoint_set(struct checkpoint* c, const char* name, int sector, int64_t offset)
+{
+	pthread_mutex_lock(&c->lock);
+	set_part(c, name, sector, offset);
+	pthread_mutex_unlock(&c->lock);
+}
+
+bool checkpoint_due(struct checkpoint* c)
+{
+	pthread_mutex_lock(&c->lock);
+	bool due = c->dirty || now() - c->saved >= checkpoint_interval;
+	pthread_mutex_unlock(&c->lock);
+	return due;
+}
+
+int checkpoint_save(struct checkpoint* c)
+{
+	struct part* p;
+	char* tmp;
+	FILE* fp;
+	int i;
+
+	tmp = malloc(strlen(c->filename) + 5);
+	if (tmp == NULL) {
+		return -1;
+	}
+	sprintf(tmp, "%s.tmp", c->filename);
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		perror(tmp);
+		free(tmp);
+		return -1;
+	}
+	fprintf(fp, "%s%s\n", checkpoint_magic, c->key);
+	pthread_mutex_lock(&c->lock);
+	for (i = 0; i < c->ndone; i++) {
+		fprintf(fp, "done %s\n", c->done[i]);
+	}
+	for (i = 0; i < c->nparts; i++) {
+		p = &c->parts[i];
+		if (!is_done(c, p->name)) {
+			fprintf(fp, "part %s %d %lld\n", p->name, p->sector, (long long)p->offset);
+		}
+	}
+	c->dirty = false;
+	pthread_mutex_unlock(&c->lock);
+	if (fclose(fp) != 0 || rename(tmp, c->filename) < 0) {
+		perror(c->filename);
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+	pthread_mutex_lock(&c->lock);
+	c->saved = now();
+	pthread_mutex_unlock(&c->lock);
+	return 0;
+}
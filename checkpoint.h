@@ -0,0 +1,47 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// A record of how far a rip got, so that running it again carries on: the
+// tracks that were finished, and for others, the sector a track can be
+// carried on from and how long its file was then. The record is kept in a
+// file, headed by a key naming what was being ripped, and replaced all at
+// once when it's saved. It's safe to finish tracks from several threads.
+
+struct checkpoint;
+
+// Load the checkpoint in filename if it was saved with the same key, or
+// start a new one. Lines that can't be read are skipped. Returns NULL if
+// out of memory.
+struct checkpoint* checkpoint_open(const char* filename, const char* key);
+
+// Free the checkpoint, and remove its file if the rip is finished.
+void checkpoint_close(struct checkpoint* c, bool finished);
+
+// Whether the named track was finished.
+bool checkpoint_done(struct checkpoint* c, const char* name);
+
+// Record that the named track was closed, and whether it was finished.
+void checkpoint_finish(struct checkpoint* c, const char* name, bool done);
+
+// The number of tracks closed without being finished.
+int checkpoint_failed(struct checkpoint* c);
+
+// Find where the named track can be carried on from. Returns false if
+// nothing's recorded, or the track was finished.
+bool checkpoint_find(struct checkpoint* c, const char* name, int* sector, int64_t* offset);
+
+// Record where the named track can be carried on from, replacing what was
+// there.
+void checkpoint_set(struct checkpoint* c, const char* name, int sector, int64_t offset);
+
+// Whether it's time to save again: a track has been closed, or a while has
+// gone by.
+bool checkpoint_due(struct checkpoint* c);
+
+// Save the checkpoint. Returns -1 on error.
+int checkpoint_save(struct checkpoint* c);
+
+#endif
@@ -0,0 +1,120 @@
+#include "checkpoint.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char filename[] = "checkpoint_test.ckpt";
+
+static void write_file(const char* s)
+{
+	FILE* fp = fopen(filename, "w");
+	assert(fp != NULL);
+	fputs(s, fp);
+	fclose(fp);
+}
+
+int main(int argc, char *argv[])
+{
+	(void)argc;
+	(void)argv;
+
+	struct checkpoint* c;
+	int sector;
+	int64_t offset;
+	char line[400];
+
+	// Nothing there to start with
+	remove(filename);
+	c = checkpoint_open(filename, "title 1 audio 0x1");
+	assert(c != NULL);
+	assert(!checkpoint_done(c, "track01.ac3"));
+	assert(!checkpoint_find(c, "track01.ac3", &sector, &offset));
+
+	// Round trip: finished tracks, tracks partway, and a failed one
+	checkpoint_finish(c, "track01.ac3", true);
+	checkpoint_finish(c, "track02.ac3", false);
+	assert(checkpoint_failed(c) == 1);
+	assert(checkpoint_due(c));
+	checkpoint_set(c, "track02.ac3", 100, 5000);
+	checkpoint_set(c, "track02.ac3", 200, 9000);
+	checkpoint_set(c, "track03.ac3", 300, 0);
+	assert(checkpoint_save(c) == 0);
+	assert(!checkpoint_due(c));
+	checkpoint_close(c, false);
+
+	c = checkpoint_open(filename, "title 1 audio 0x1");
+	assert(checkpoint_done(c, "track01.ac3"));
+	assert(!checkpoint_done(c, "track02.ac3"));
+	assert(checkpoint_failed(c) == 0);
+	assert(checkpoint_find(c, "track02.ac3", &sector, &offset));
+	assert(sector == 200 && offset == 9000);
+	assert(checkpoint_find(c, "track03.ac3", &sector, &offset));
+	assert(sector == 300 && offset == 0);
+
+	// A track that's done isn't carried on, and its part isn't saved
+	checkpoint_finish(c, "track02.ac3", true);
+	assert(!checkpoint_find(c, "track02.ac3", &sector, &offset));
+	assert(checkpoint_save(c) == 0);
+	checkpoint_close(c, false);
+	c = checkpoint_open(filename, "title 1 audio 0x1");
+	assert(checkpoint_done(c, "track02.ac3"));
+	assert(!checkpoint_find(c, "track02.ac3", &sector, &offset));
+	checkpoint_close(c, false);
+
+	// Nor when the file has both
+	write_file("extractaudio checkpoint 1\ntitle 1\npart a.ac3 5 10\ndone a.ac3\n");
+	c = checkpoint_open(filename, "title 1");
+	assert(checkpoint_done(c, "a.ac3"));
+	assert(!checkpoint_find(c, "a.ac3", &sector, &offset));
+	checkpoint_close(c, false);
+
+	// A different key, or just the start of the key, starts over
+	c = checkpoint_open(filename, "title 1 audio 0x2");
+	assert(!checkpoint_done(c, "a.ac3"));
+	checkpoint_close(c, false);
+	c = checkpoint_open(filename, "title");
+	assert(!checkpoint_done(c, "a.ac3"));
+	checkpoint_close(c, false);
+	write_file("extractaudio checkpoint 2\ntitle 1\ndone a.ac3\n");
+	c = checkpoint_open(filename, "title 1");
+	assert(!checkpoint_done(c, "a.ac3"));
+	checkpoint_close(c, false);
+
+	// Lines that can't be read are skipped, and the rest kept
+	memset(line, 'x', sizeof line);
+	memcpy(line, "done ", 5);
+	line[sizeof line - 2] = '\n';
+	line[sizeof line - 1] = '\0';
+	write_file("extractaudio checkpoint 1\ntitle 1\n"
+		"done\n"
+		"done b.ac3 extra\n"
+		"part c.ac3 5\n"
+		"part d.ac3 0 10\n"
+		"part e.ac3 5 -1\n"
+		"part f.ac3 5 10 11\n"
+		"part g.ac3 x 10\n"
+		"\n"
+		"finished h.ac3\n"
+		"done 0123456789012345678901234567890123456789012345678901234567890123456789\n");
+	FILE* fp = fopen(filename, "a");
+	fputs(line, fp);
+	fputs("done k.ac3\npart m.ac3 7 70", fp);
+	fclose(fp);
+	c = checkpoint_open(filename, "title 1");
+	assert(!checkpoint_done(c, "b.ac3"));
+	assert(!checkpoint_find(c, "c.ac3", &sector, &offset));
+	assert(!checkpoint_find(c, "d.ac3", &sector, &offset));
+	assert(!checkpoint_find(c, "e.ac3", &sector, &offset));
+	assert(!checkpoint_find(c, "f.ac3", &sector, &offset));
+	assert(!checkpoint_find(c, "g.ac3", &sector, &offset));
+	assert(!checkpoint_done(c, "h.ac3"));
+	assert(!checkpoint_done(c, "012345678901234567890123456789012345678901234567890123456789012"));
+	assert(checkpoint_done(c, "k.ac3"));
+	assert(checkpoint_find(c, "m.ac3", &sector, &offset));
+	assert(sector == 7 && offset == 70);
+
+	// A finished rip removes the file
+	checkpoint_close(c, true);
+	assert(fopen(filename, "r") == NULL);
+	return 0;
+}
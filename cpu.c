@@ -0,0 +1,84 @@
+/* cpu - which SIMD kernels this machine can run
+
+The level is found with cpuid, through __builtin_cpu_supports, which also
+checks that the OS saves the AVX and AVX-512 registers. It's kept once
+it's worked out; threads racing to work it out all get the same answer. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86 1
+#endif
+
+static const char* const names[CPU_LEVELS] = {
+	"scalar", "sse2", "ssse3", "sse4.2", "avx", "avx2", "avx512",
+};
+
+static int level = -1;
+
+const char* cpu_name(int l)
+{
+	return l >= 0 && l < CPU_LEVELS ? names[l] : "?";
+}
+
+int cpu_parse(const char* name)
+{
+	for (int l = 0; l < CPU_LEVELS; l++) {
+		if (strcmp(name, names[l]) == 0) {
+			return l;
+		}
+	}
+	return -1;
+}
+
+static int detect(void)
+{
+	int l = CPU_SCALAR;
+#ifdef HAVE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) {
+		l = CPU_SSE2;
+	}
+	if (l == CPU_SSE2 && __builtin_cpu_supports("ssse3")) {
+		l = CPU_SSSE3;
+	}
+	if (l == CPU_SSSE3 && __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul")) {
+		l = CPU_SSE42;
+	}
+	if (l == CPU_SSE42 && __builtin_cpu_supports("avx")) {
+		l = CPU_AVX;
+	}
+	if (l == CPU_AVX && __builtin_cpu_supports("avx2")) {
+		l = CPU_AVX2;
+	}
+	if (l == CPU_AVX2 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+		l = CPU_AVX512;
+	}
+#endif
+	return l;
+}
+
+int cpu_level(void)
+{
+	int l = __atomic_load_n(&level, __ATOMIC_RELAXED);
+	if (l >= 0) {
+		return l;
+	}
+	l = detect();
+	const char* env = getenv("DVDTOOLS_CPU");
+	if (env != NULL && *env != '\0') {
+		int want = cpu_parse(env);
+		if (want < 0) {
+			fprintf(stderr, "DVDTOOLS_CPU: unknown level %s\n", env);
+		} else if (want > l) {
+			fprintf(stderr, "DVDTOOLS_CPU: this CPU only runs %s\n", cpu_name(l));
+		} else {
+			l = want;
+		}
+	}
+	__atomic_store_n(&level, l, __ATOMIC_RELAXED);
+	return l;
+}
@@ -0,0 +1,29 @@
+#ifndef CPU_H
+#define CPU_H
+
+// Levels of instruction set support, from worst to best, each taking in
+// the ones before. The kernels of repack, loudness, mpegps and hash each
+// pick their best version for the level. On anything but x86 the level is
+// always CPU_SCALAR.
+enum {
+	CPU_SCALAR,
+	CPU_SSE2,
+	CPU_SSSE3,
+	CPU_SSE42, // with PCLMULQDQ
+	CPU_AVX,
+	CPU_AVX2,
+	CPU_AVX512, // F and BW
+	CPU_LEVELS,
+};
+
+// Return the best level this CPU runs, or the level named by the
+// DVDTOOLS_CPU environment variable if that's lower, to try the other
+// kernels. It's worked out once.
+int cpu_level(void);
+
+// The name of a level, as DVDTOOLS_CPU takes it, and back. cpu_parse
+// returns -1 for a name it doesn't know.
+const char* cpu_name(int level);
+int cpu_parse(const char* name);
+
+#endif
@@ -0,0 +1,24 @@
+#define _POSIX_C_SOURCE 200112L
+#include "cpu.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+int main(int argc, char *argv[])
+{
+	(void)argc;
+	(void)argv;
+
+	for (int l = 0; l < CPU_LEVELS; l++) {
+		assert(cpu_parse(cpu_name(l)) == l);
+	}
+	assert(cpu_parse("avx3") == -1);
+	assert(strcmp(cpu_name(CPU_SSE42), "sse4.2") == 0);
+
+	// The override holds from the first call on
+	assert(setenv("DVDTOOLS_CPU", "scalar", 1) == 0);
+	assert(cpu_level() == CPU_SCALAR);
+	assert(setenv("DVDTOOLS_CPU", "avx512", 1) == 0);
+	assert(cpu_level() == CPU_SCALAR);
+	return 0;
+}
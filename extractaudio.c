@@ -1,24 +1,55 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <string.h>
 #include <getopt.h>
 #include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/wait.h>
 #include <dvdread/dvd_reader.h>
+#include <dvdread/dvd_udf.h>
 #include <dvdread/ifo_read.h>
+#include <dvdread/nav_read.h>
 #include "uint.h"
 #include "bitreader.h"
-
-FILE *fdopen(int, const char*);
-
-typedef u8 sectorbuf[DVD_VIDEO_LB_LEN];
+#include "mpegps.h"
+#include "flacenc.h"
+#include "repack.h"
+#include "loudness.h"
+#include "ats.h"
+#include "hash.h"
+#include "secmap.h"
+#include "shring.h"
+#include "sched.h"
+#include "iothread.h"
+#include "checkpoint.h"
+#include "manifest.h"
+#include "parse.h"
+#include "cells.h"
 
 struct writer {
 	int (*write)(struct writer* w, const u8* buf, int size);
 	int (*close)(struct writer* w);
+	// Push everything written so far into the file and return the file's
+	// length, or -1 if the track can't be carried on later. NULL if the
+	// writer can't do that at all.
+	int64_t (*sync)(struct writer* w);
+	// Set before closing a track which got all of its data. Writers which
+	// pass data on to another pass this on too.
+	bool complete;
 
 	// Private fields used by various writers
 	struct writer* writer;
@@ -27,8 +58,80 @@ struct writer {
 	u8* buf;
 	int depth;
 	int channels;
+	struct flacenc* flacenc;
+	int32_t* samples;
+	struct sched_track* track;
+	struct repacker* repacker;
+	u8 partial[48]; // a block of samples split between writes
+	int npartial;
+	int fd;
+	struct iofile* iofile;
+	int64_t length;
+	int64_t head;
+	bool w64;
+	int sample_rate;
+	struct checkpoint* ckpt;
+	char* name;
+	struct piece* piece;
+	struct loudness* loudness;
+	struct gain* gain;
+	struct hash* hash;
+	struct sums* sums;
+	struct shring* shring;
+};
+
+struct source {
+	// Read up to count sectors starting at sector. Stores a pointer to the
+	// data in *bufp and returns the number of sectors read, or -1 on error.
+	// The data is valid until the next call to read.
+	int (*read)(struct source* s, int sector, int count, u8** bufp);
+	int (*close)(struct source* s);
+	// Whether the packs come from DVD-Audio AOBs, whose substream
+	// headers differ from a VOB's.
+	bool aob;
+
+	// Private fields used by various sources
+	struct source* source;
+	struct ring* ring;
+	dvd_file_t *vob;
+	u8* buf;
+	int batch; // maximum sectors per read
+	u8* map;
+	size_t maplen;
+	struct extent* extents;
+	int nextents;
+	int fd;
+	size_t len, keep; // bytes in buf, and where the ones not used yet start
+	int next; // sector to read next
+	bool eof;
+	int64_t dropped; // bytes not in any whole pack
+	const struct secmap* secmap; // if set, only its wanted sectors are read in
+	const bool* want;
+	int ahead; // sector the kernel has been asked to read in up to
+	int scanners; // threads to look through the sectors ahead of the demuxer
 };
 
+// Default number of sectors to read at once, and number of batches to read
+// ahead of the demuxer.
+enum { default_batch = 512, default_readahead = 4 };
+
+// Default number of tracks to encode at once, and megabytes of track data
+// allowed to wait for them.
+enum { default_workers = 2, default_budget = 256 };
+
+// Default size in kilobytes and number of the buffers raw tracks are
+// written from.
+enum { default_iobuf = 1024, default_iodepth = 8 };
+
+// Size of the ring -X passes flac's input through.
+enum { flac_ring_size = 1 << 20 };
+
+// Default number of jobs of a batch to run at once from a solid-state disk.
+enum { default_perdevice = 2 };
+
+// Where a rip records how far it got, in the directory the tracks go to.
+static const char checkpoint_file[] = "extractaudio.ckpt";
+
 static int debug = 0;
 
 void die(char *fmt, ...) {
@@ -88,66 +191,487 @@ int print_audio(audio_attr_t *a, int n)
 	}
 }
 
-// Skip the MPEG header. Returns a pointer to the PES header.
-u8 *skip_mpeg_header(u8 *b)
-{
-	return b + 0xe + (b[0xd] & 7);
-}
-
-// Skip the MPEG and PES headers. Returns a pointer to the substream header.
-u8* skip_pes_header(u8 *b)
-{
-	u8 *p = b + 0xe + (b[0xd] & 7); // points to PES
-	p = p + 9 + p[8]; // points to PES payload
-	return p;
-}
-
-
-// Return the stream id associated with a pack. If private is true and the
-// packet is private stream 1, return the stream id of the private stream.
-int pack_stream_id(sectorbuf b, bool private)
-{
-	// Theoretically, each pack only contains a single stream, so we
-	// shouldn't have to look beyond the first packet.
-	if (b[0] != 0 || b[1] != 0 || b[2] != 1 || b[3] != 0xba) {
-		return -1; // not a PACK
-	}
-	u8 *p = skip_mpeg_header(b);
-	if (p[0] != 0 || p[1] != 0 || p[2] != 1) {
-		return -1; // not a packet
-	}
-	if (private && p[3] == 0xbd) {
-		// private stream
-		return p[9+p[8]];
-	}
-	return p[3];
-}
-
 // Return the sector of the first audio packet for the given audio index.
 // The sector argument should be the sector of a NAV packet.
 // Returns -1 on error.
 int get_audio_sector(dvd_file_t *vob, int sector, int index)
 {
 	sectorbuf b;
+	dsi_t dsi;
 	if (DVDReadBlocks(vob, sector, 1, b) < 1) { return -1; }
 	if (pack_stream_id(b, true) != 0xbb) {
 		// Not a NAV
 		printf("not a nav: %#x\n", pack_stream_id(b, true));
 		return -1;
 	}
-	// Read the a_async value for the requested stream.
-	// Should probably just use nav_read.c.
-	u8 *p = b + 0x599 + index*2;
-	int n = (p[0] & 0x7f) << 8 | p[1];
+	// Read the a_synca value for the requested stream.
+	navRead_DSI(&dsi, b + DSI_START_BYTE);
+	uint a = dsi.synci.a_synca[index];
+	int n = (int)(a & 0x7fff);
 	if (n == 0 || n == 0x3fff) {
 		return -1;
 	}
-	if (p[0] & 0x80) {
+	if (a & 0x8000) {
 		return sector - n;
 	}
 	return sector + n;
 }
 
+// Return the cell to play in place of the given one (1-based). The first
+// cell of an angle block stands for the whole block, so it is replaced by
+// the cell for angle (0-based), or the last cell if there aren't that many.
+static uint angle_cell(pgc_t *pgc, uint cell, int angle)
+{
+	if (pgc->cell_playback[cell-1U].block_type != BLOCK_TYPE_ANGLE_BLOCK) {
+		return cell;
+	}
+	for (int i = 0; i < angle && cell < pgc->nr_of_cells; i++) {
+		if (pgc->cell_playback[cell-1U].block_mode == BLOCK_MODE_LAST_CELL) {
+			break;
+		}
+		cell++;
+	}
+	return cell;
+}
+
+// Report whether a cell belongs to an angle block but not to the given angle.
+static bool other_angle(pgc_t *pgc, uint cell, int angle)
+{
+	uint first = cell;
+	if (pgc->cell_playback[cell-1U].block_type != BLOCK_TYPE_ANGLE_BLOCK) {
+		return false;
+	}
+	while (first > 1 && pgc->cell_playback[first-1U].block_mode != BLOCK_MODE_FIRST_CELL) {
+		first--;
+	}
+	return angle_cell(pgc, first, angle) != cell;
+}
+
+// Fill in the sector starting each chapter of a title: the first audio
+// packet of the given audio stream, or the chapter's first cell for
+// subpictures (audio < 0). Chapters starting with an angle block start at
+// the given angle's cell. Sectors[chapters] ends the last chapter. Returns
+// the number of chapters, which may be short if the stream ends early.
+int chapter_sectors(ifo_handle_t *ifo, dvd_file_t *vob, ttu_t *vtt, int audio, int angle, int chapterstart, int *sectors)
+{
+	int chapters = vtt->nr_of_ptts;
+
+	for (int i = 0; i < chapters; i++) {
+		uint pgcn = vtt->ptt[i].pgcn - 1U;
+		uint pgn = vtt->ptt[i].pgn - 1U;
+		pgc_t *pgc = ifo->vts_pgcit->pgci_srp[pgcn].pgc;
+		uint cell = angle_cell(pgc, pgc->program_map[pgn], angle);
+		cell_playback_t *pb = &pgc->cell_playback[cell-1U];
+
+		if (audio < 0) {
+			sectors[i] = (int)pb->first_sector;
+			if (i == chapters - 1) {
+				sectors[chapters] = (int)pb->last_sector + 1;
+			}
+			continue;
+		}
+		sectors[i] = get_audio_sector(vob, (int)pb->first_sector, audio);
+		if (sectors[i] < 0) {
+			if (i != chapters - 1) {
+				if (i < chapterstart) {
+					fprintf(stderr, "warning: chapter %d: Couldn't get audio sector\n", i);
+				} else {
+					die("chapter %d: Couldn't get audio sector", i);
+				}
+			}
+			sectors[i] = (int)pb->first_sector;
+			chapters = i;
+			break;
+		}
+		if (i == chapters - 1) {
+			sectors[chapters] = (int)pb->last_sector;
+		}
+	}
+	return chapters;
+}
+
+static int bcd(uint v)
+{
+	return (int)(v >> 4) * 10 + (int)(v & 0xf);
+}
+
+// Convert a playback time to seconds.
+static double playback_seconds(dvd_time_t t)
+{
+	double fps = (t.frame_u >> 6) == 1 ? 25.0 : 30000.0/1001;
+	return bcd(t.hour)*3600 + bcd(t.minute)*60 + bcd(t.second) + bcd(t.frame_u & 0x3f) / fps;
+}
+
+// Return the PGC playing a chapter, and store the range of its cells: from
+// *firstp up to but not including *endp, 1-based.
+static pgc_t* chapter_cells(ifo_handle_t *ifo, ttu_t *vtt, int chapter, uint* firstp, uint* endp)
+{
+	uint pgcn = vtt->ptt[chapter].pgcn - 1U;
+	uint pgn = vtt->ptt[chapter].pgn - 1U;
+	pgc_t *pgc = ifo->vts_pgcit->pgci_srp[pgcn].pgc;
+
+	*firstp = pgc->program_map[pgn];
+	*endp = pgc->nr_of_cells + 1U;
+	if (pgn + 1U < pgc->nr_of_programs) {
+		*endp = pgc->program_map[pgn + 1U];
+	}
+	return pgc;
+}
+
+// Return the playback time of a chapter at the given angle: its cells up to
+// the start of the next chapter, or the end of its PGC.
+double chapter_seconds(ifo_handle_t *ifo, ttu_t *vtt, int chapter, int angle)
+{
+	uint cell, end;
+	pgc_t *pgc = chapter_cells(ifo, vtt, chapter, &cell, &end);
+	double seconds = 0;
+
+	for (; cell < end; cell++) {
+		if (other_angle(pgc, cell, angle)) {
+			continue;
+		}
+		seconds += playback_seconds(pgc->cell_playback[cell-1U].playback_time);
+	}
+	return seconds;
+}
+
+// A place in a title found by its playback time: the NAV pack to look for
+// its audio from, the time as a PTS, and the last sector of its cell.
+struct title_point {
+	int nav;
+	int64_t pts;
+	int last;
+};
+
+// Audio reaches the disc up to about this long before the video playing
+// with it, in 90kHz ticks.
+enum { audio_lead = 90000 };
+
+// Return the first NAV pack from sector up to end, and store the time its
+// VOBU starts at in *ptsp. Returns -1 if there isn't one.
+static int next_nav(dvd_file_t *vob, int sector, int end, int64_t* ptsp)
+{
+	sectorbuf b[16];
+	pci_t pci;
+	int i, n;
+
+	while (sector < end) {
+		n = end - sector < 16 ? end - sector : 16;
+		n = (int)DVDReadBlocks(vob, sector, (size_t)n, b[0]);
+		if (n < 1) {
+			return -1;
+		}
+		for (i = 0; i < n; i++) {
+			if (pack_stream_id(b[i], false) == 0xbb) {
+				navRead_PCI(&pci, b[i] + PCI_START_BYTE);
+				*ptsp = pci.pci_gi.vobu_s_ptm;
+				return sector + i;
+			}
+		}
+		sector += n;
+	}
+	return -1;
+}
+
+// Find the place seconds into a title at the given angle. The cell comes
+// from the cells' playback times. Within the cell, the VOBUs' NAV packs
+// are in order of time, so the one to start from is found by a binary
+// search over the cell's sectors, which reads a NAV pack or so a step.
+// It starts a little early, for the audio muxed ahead of the video.
+// Returns -1 if the title isn't that long.
+int find_time(ifo_handle_t *ifo, dvd_file_t *vob, ttu_t *vtt, int angle, double seconds, struct title_point* tp)
+{
+	double t = 0, d;
+
+	for (int i = 0; i < vtt->nr_of_ptts; i++) {
+		uint cell, end;
+		pgc_t *pgc = chapter_cells(ifo, vtt, i, &cell, &end);
+
+		for (; cell < end; cell++) {
+			if (other_angle(pgc, cell, angle)) {
+				continue;
+			}
+			cell_playback_t *pb = &pgc->cell_playback[cell-1U];
+			d = playback_seconds(pb->playback_time);
+			if (seconds >= t + d) {
+				t += d;
+				continue;
+			}
+
+			int lo = (int)pb->first_sector, hi = (int)pb->last_sector + 1;
+			int64_t pts, target;
+			int s;
+			if (next_nav(vob, lo, hi, &pts) != lo) {
+				return -1;
+			}
+			tp->nav = lo;
+			tp->pts = pts + (int64_t)((seconds - t) * 90000);
+			tp->last = hi - 1;
+			target = tp->pts - audio_lead;
+			lo++;
+			while (lo < hi) {
+				int mid = lo + (hi - lo) / 2;
+				s = next_nav(vob, mid, hi, &pts);
+				if (s < 0 || pts > target) {
+					hi = mid;
+				} else {
+					tp->nav = s;
+					lo = s + 1;
+				}
+			}
+			return 0;
+		}
+	}
+	return -1;
+}
+
+// Which audio frame find_frame picks.
+enum { FRAME_NEAREST, FRAME_BEFORE, FRAME_AFTER };
+
+// Find the pack of an audio stream whose first frame starts nearest to pts,
+// or the last one starting no later or the first no earlier. Looks at the
+// packs from sector through last, and stores the frame's PTS in *ptsp.
+// Returns -1 if there's none.
+int find_frame(dvd_file_t *vob, int sector, int last, int stream, int64_t pts, int which, int64_t* ptsp)
+{
+	sectorbuf b[16];
+	struct stream_info info;
+	int found = -1, i, n;
+	int64_t p;
+
+	for (; sector <= last; sector += n) {
+		n = last - sector + 1 < 16 ? last - sector + 1 : 16;
+		n = (int)DVDReadBlocks(vob, sector, (size_t)n, b[0]);
+		if (n < 1) {
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			if (pack_stream_id(b[i], true) != stream || get_stream_info(b[i], &info) < 0 ||
+			    info.first_frame_offset < 0 || (p = pack_pts(b[i])) < 0) {
+				continue;
+			}
+			if (p < pts || (p == pts && which != FRAME_AFTER)) {
+				found = sector + i;
+				*ptsp = p;
+				continue;
+			}
+			// The first frame after, unless the one before is
+			// the one we want.
+			if (found < 0 || which == FRAME_AFTER ||
+			    (which == FRAME_NEAREST && p - pts < pts - *ptsp)) {
+				found = sector + i;
+				*ptsp = p;
+			}
+			return found;
+		}
+	}
+	return which == FRAME_AFTER ? -1 : found;
+}
+
+// An angle block, and the part of it belonging to the angle being
+// extracted. The cells of an interleaved block overlap: each is a chain of
+// ILVUs (interleaved units) alternating with the other angles' ones.
+struct angle_block {
+	int start, end; // all of the block's cells
+	int first, last; // the angle's cell
+};
+
+struct angles {
+	struct angle_block* blocks;
+	int n;
+};
+
+// Flags in the DSI's sml_pbi.category
+enum { ilvu_block = 0x4000, ilvu_first = 0x2000 };
+
+// Find the angle blocks in the PGCs of a title. Returns NULL if there
+// aren't any.
+struct angles* find_angles(ifo_handle_t *ifo, ttu_t *vtt, int angle)
+{
+	struct angles* a = calloc(1, sizeof *a);
+	if (a == NULL) {
+		die("Out of memory");
+	}
+	for (int i = 0; i < vtt->nr_of_ptts; i++) {
+		uint pgcn = vtt->ptt[i].pgcn;
+		bool seen = false;
+		for (int j = 0; j < i; j++) {
+			seen = seen || vtt->ptt[j].pgcn == pgcn;
+		}
+		if (seen) {
+			continue;
+		}
+		pgc_t *pgc = ifo->vts_pgcit->pgci_srp[pgcn-1U].pgc;
+		for (uint c = 1; c <= pgc->nr_of_cells; c++) {
+			cell_playback_t *pb = &pgc->cell_playback[c-1U];
+			if (pb->block_type != BLOCK_TYPE_ANGLE_BLOCK || pb->block_mode != BLOCK_MODE_FIRST_CELL) {
+				continue;
+			}
+			cell_playback_t *chosen = &pgc->cell_playback[angle_cell(pgc, c, angle)-1U];
+			struct angle_block k = {
+				(int)pb->first_sector, (int)pb->last_sector,
+				(int)chosen->first_sector, (int)chosen->last_sector,
+			};
+			for (uint d = c+1; d <= pgc->nr_of_cells && pb->block_mode != BLOCK_MODE_LAST_CELL; d++) {
+				pb = &pgc->cell_playback[d-1U];
+				if ((int)pb->first_sector < k.start) {
+					k.start = (int)pb->first_sector;
+				}
+				if ((int)pb->last_sector > k.end) {
+					k.end = (int)pb->last_sector;
+				}
+			}
+			struct angle_block* blocks = realloc(a->blocks, (size_t)(a->n+1) * sizeof *blocks);
+			if (blocks == NULL) {
+				die("Out of memory");
+			}
+			a->blocks = blocks;
+			a->blocks[a->n++] = k;
+		}
+	}
+	if (a->n == 0) {
+		free(a);
+		return NULL;
+	}
+	return a;
+}
+
+void free_angles(struct angles* a)
+{
+	if (a != NULL) {
+		free(a->blocks);
+		free(a);
+	}
+}
+
+// A reader's place in the chosen angle's chain of ILVUs. The chain is only
+// known from the NAV pack at the start of each ILVU, so everything reading
+// the title in order keeps its own.
+struct ilvu {
+	const struct angles* angles;
+	int end; // last sector of the current ILVU, or -1
+	int next; // first sector of the angle's next ILVU, or -1
+	int nav; // sector of the next ILVU's NAV pack, or -1
+};
+
+static void ilvu_reset(struct ilvu* c, const struct angles* a)
+{
+	c->angles = a;
+	c->end = -1;
+	c->next = -1;
+	c->nav = -1;
+}
+
+// Return where to start reading the title at sector. Inside an angle block
+// that's the start of the angle's cell, whose NAV pack starts the chain.
+static int ilvu_start(struct ilvu* c, int sector)
+{
+	const struct angles* a = c->angles;
+	ilvu_reset(c, a);
+	for (int i = 0; a != NULL && i < a->n; i++) {
+		if (a->blocks[i].start <= sector && sector <= a->blocks[i].end) {
+			c->nav = a->blocks[i].first;
+			return c->nav;
+		}
+	}
+	return sector;
+}
+
+// Whether the title can be picked up again at sector: anywhere outside the
+// angle blocks, but inside them only at the NAV pack of the angle's next ILVU.
+static bool ilvu_resumable(const struct ilvu* c, int sector)
+{
+	const struct angles* a = c->angles;
+	if (sector == c->nav) {
+		return true;
+	}
+	for (int i = 0; a != NULL && i < a->n; i++) {
+		if (a->blocks[i].start <= sector && sector <= a->blocks[i].end) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Like ilvu_start, but for a sector ilvu_resumable said yes to.
+static int ilvu_resume(struct ilvu* c, int sector)
+{
+	if (ilvu_start(c, sector) != sector) {
+		c->nav = sector;
+	}
+	return sector;
+}
+
+// Return the last sector up to last which can be read in one go from
+// sector without running into another angle. An ILVU's NAV pack is read by
+// itself, since it says where the ILVU ends.
+static int ilvu_last(const struct ilvu* c, int sector, int last)
+{
+	const struct angles* a = c->angles;
+	if (a == NULL) {
+		return last;
+	}
+	if (sector == c->nav) {
+		return sector;
+	}
+	if (sector <= c->end && c->end < last) {
+		last = c->end;
+	}
+	for (int i = 0; i < a->n; i++) {
+		const struct angle_block* k = &a->blocks[i];
+		if (sector < k->start && k->start <= last) {
+			last = k->start - 1;
+		} else if (k->first <= sector && sector <= k->last && k->last < last) {
+			last = k->last;
+		}
+	}
+	return last < sector ? sector : last;
+}
+
+// Follow the angle past sector, whose data is b. Returns the next sector to
+// read: usually sector+1, but at the end of an ILVU the start of the
+// angle's next one, and around angle blocks the angle's cell and the end of
+// the block.
+static int ilvu_step(struct ilvu* c, int sector, u8* b)
+{
+	const struct angles* a = c->angles;
+	int next = sector + 1;
+	dsi_t dsi;
+
+	if (a == NULL) {
+		return next;
+	}
+	if (sector == c->nav) {
+		c->nav = -1;
+	}
+	if (pack_stream_id(b, true) == 0xbb) {
+		navRead_DSI(&dsi, b + DSI_START_BYTE);
+		uint32_t ea = dsi.sml_pbi.ilvu_ea, sa = dsi.sml_pbi.ilvu_sa;
+		if ((dsi.sml_pbi.category & (ilvu_block|ilvu_first)) == (ilvu_block|ilvu_first) && ea > 0 && ea < 0x3fffffff) {
+			c->end = sector + (int)ea;
+			c->next = sa > ea && sa < 0x3fffffff ? sector + (int)sa : -1;
+		}
+	}
+	if (sector == c->end) {
+		if (c->next > next) {
+			next = c->next;
+			c->nav = next;
+		}
+		c->end = -1;
+		c->next = -1;
+	}
+	for (int i = 0; i < a->n; i++) {
+		const struct angle_block* k = &a->blocks[i];
+		if (sector < k->start && k->start <= next && next <= k->end) {
+			next = k->first;
+			c->nav = next;
+		} else if (k->first <= sector && sector <= k->last && k->last < next && next <= k->end) {
+			next = k->end + 1;
+		}
+	}
+	return next;
+}
+
 struct lpcm_info {
 	int bitdepth;
 	int sample_rate;
@@ -175,6 +699,36 @@ error:
 	return info;
 }
 
+// The same for a DVD-Audio LPCM pack, whose header gives the depth and
+// rate of two groups of channels. Only streams whose groups match are read;
+// for others the depth is 0.
+struct lpcm_info read_aob_lpcm_header(sectorbuf b)
+{
+	struct lpcm_info info = {0};
+	static const int depths[16] = {16, 20, 24};
+	static const int rates[16] = {48000, 96000, 192000, [8] = 44100, 88200, 176400};
+	static const int channels[21] = {1, 2, 3, 4, 3, 4, 5, 3, 4, 5, 4, 5, 6, 4, 5, 4, 5, 6, 5, 5, 6};
+
+	if (pack_stream_id(b, true) != 0xa0) {
+		return info;
+	}
+	// get pointer to audio substream header
+	u8 *p = skip_pes_header(b);
+	int bits = p[5], rate = p[6];
+	if (p[4] < 4 || p[8] > 20 ||
+	    ((bits & 15) != 15 && (bits & 15) != bits >> 4) ||
+	    ((rate & 15) != 15 && (rate & 15) != rate >> 4)) {
+		return info;
+	}
+	if (depths[bits >> 4] == 0 || rates[rate >> 4] == 0) {
+		return info;
+	}
+	info.bitdepth = depths[bits >> 4];
+	info.sample_rate = rates[rate >> 4];
+	info.channels = channels[p[8]];
+	return info;
+}
+
 struct ac3_info {
 	uint sample_rate;
 	uint frame_size;
@@ -268,487 +822,4447 @@ error:
 	return info;
 }
 
-// MPEG Header
-// 00-03: 00 00 01 BA (4 bytes)
-// 04-09: system clock reference (6 bytes)
-// 0A-0C: mux rate
-// 0D: stuffing length
-// <stuffing>
-//
-// PES HEADER
-// 00 00 01 <stream id>
-// packet length
-// XX XX <header length>
-//
-// AUDIO HEADER
-// 1 byte: stream id
-// 2 bytes: offset to first packet
-// format-specific extra stuff
-
-struct stream_info {
-	// stream is the audio substream id.
-	int stream;
-	// data_offset is the offset to the start of the audio stream data.
-	// all offsets are relative to the start of the sector.
-	int data_offset;
-	// first_frame_offset is the offset to the frame corresponding to the
-	// packet's PTS (FirstAccUnit).
-	// if there is no first frame, it is -1.
-	int first_frame_offset;
-	// end_offset is the offset to the byte after the packet data. in other
-	// words, it is the size of the packet.
-	int end_offset;
+static int64_t nanos(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static double now(void)
+{
+	return (double)nanos() / 1e9;
+}
+
+// Reads are counted by how long they took: under 64us, under 128us, and so
+// on, with everything over half a second in the last bucket.
+enum { latency_buckets = 15 };
+
+// Counters for the whole run. They are updated from every thread, so only
+// touch them with stat_add, stat_set and stat_get.
+struct stats {
+	int64_t sectors; // read from the disc
+	int64_t reads;
+	int64_t latency[latency_buckets];
+	int64_t demuxed; // bytes written to tracks
+
+	// Time spent in each stage, in nanoseconds. Stages running on
+	// several threads add up their time.
+	int64_t read_ns, demux_ns, repack_ns, loudness_ns, hash_ns, write_ns;
+
+	// Where the demuxer is
+	int64_t sector, first, end;
 };
 
-int get_stream_info(sectorbuf b, struct stream_info *info)
+static struct stats own_stats;
+// A job of a batch points this at its slot in memory shared with the
+// parent, which adds them up for its progress line.
+static struct stats* stats = &own_stats;
+static double start_time;
+
+static void stat_add(int64_t* c, int64_t n)
 {
-	int data_offset, first_frame_offset, size, stream;
-	u8 *p = b;
+	__atomic_fetch_add(c, n, __ATOMIC_RELAXED);
+}
 
-	if (p[0] != 0 || p[1] != 0 || p[2] != 1 || p[3] != 0xba) {
-		return -1;
-	}
+static void stat_set(int64_t* c, int64_t n)
+{
+	__atomic_store_n(c, n, __ATOMIC_RELAXED);
+}
 
-	p = skip_mpeg_header(b);
-	if (p[0] != 0 || p[1] != 0 || p[2] != 1) {
-		return -1;
-	}
-	if (p[3] != 0xbd) {
-		return -1;
-	}
-	size = p[4]<<8 | p[5]; // + p+6 = end, so, length of the remaining data
-	size += p+6 - b;
+static int64_t stat_get(int64_t* c)
+{
+	return __atomic_load_n(c, __ATOMIC_RELAXED);
+}
 
-	p = skip_pes_header(b);
-	stream = p[0];
-	first_frame_offset = p[2]<<8 | p[3]; // relative to &p[3]
-	if (first_frame_offset == 0) {
-		// no first frame
-		first_frame_offset = -1;
-	} else {
-		first_frame_offset += p+3 - b;
+static void count_read(int64_t ns, int sectors)
+{
+	int i = 0;
+	while (i < latency_buckets-1 && ns >= (int64_t)64000 << i) {
+		i++;
 	}
-
-	data_offset = p+4 - b;
-	if ((stream & ~7) == 0xA0) {
-		// LPCM streams have a 3-byte header
-		data_offset += 3;
+	stat_add(&stats->latency[i], 1);
+	stat_add(&stats->reads, 1);
+	stat_add(&stats->read_ns, ns);
+	if (sectors > 0) {
+		stat_add(&stats->sectors, sectors);
 	}
+}
 
-	info->stream = stream;
-	info->end_offset = size;
-	info->data_offset = data_offset;
-	info->first_frame_offset = first_frame_offset;
-	return 0;
+// How far the demuxer has got, in percent.
+static int64_t percent_done(struct stats* st)
+{
+	int64_t sector = stat_get(&st->sector), first = stat_get(&st->first), end = stat_get(&st->end);
+	return end > first && sector > first ? (sector - first) * 100 / (end - first) : 0;
 }
 
-// Write audio packets to a file.
-// Last_sector should be the first audio packet of the next chapter.
-int dump_audio(struct writer* w, dvd_file_t *vob, int stream, int first_sector, int last_sector)
+static void print_progress(FILE* fp)
 {
-	sectorbuf b;
-	int sector;
-	int start, end;
-	struct stream_info info;
+	double t = now() - start_time;
+	int64_t sectors = stat_get(&stats->sectors);
+	int64_t sector = stat_get(&stats->sector), end = stat_get(&stats->end);
+	double mb = (double)sectors * SECTOR_SIZE / 1e6;
+	int64_t done = percent_done(stats);
 
-	// First packet: dump packet starting at FirstAccUnit
-	// Intermediate packets: dump complete packet contents
-	// Last packet: dump packet until FirstAccUnit
+	fprintf(fp, "progress: sector %"PRId64" of %"PRId64" (%"PRId64"%%), %.1f MB in %.1fs, %.1f MB/s, %.0f sectors/s, %.1f MB demuxed;"
+		" read %.2fs demux %.2fs repack %.2fs loudness %.2fs hash %.2fs write %.2fs\n",
+		sector, end, done, mb, t, t > 0 ? mb / t : 0, t > 0 ? (double)sectors / t : 0,
+		(double)stat_get(&stats->demuxed) / 1e6,
+		(double)stat_get(&stats->read_ns) / 1e9, (double)stat_get(&stats->demux_ns) / 1e9,
+		(double)stat_get(&stats->repack_ns) / 1e9, (double)stat_get(&stats->loudness_ns) / 1e9,
+		(double)stat_get(&stats->hash_ns) / 1e9, (double)stat_get(&stats->write_ns) / 1e9);
+}
 
-	for (sector = first_sector; sector <= last_sector; sector++) {
-		if (DVDReadBlocks(vob, sector, 1, b) < 1) {
-			printf("sector %d: DVDReadBlocks failed\n", sector);
-			return -1;
-		}
-		if (pack_stream_id(b, false) != 0xbd) {
-			continue;
+// Prints the progress line every interval seconds, if interval isn't 0, and
+// whenever the process gets SIGUSR1. Every other thread must block SIGUSR1.
+struct reporter {
+	pthread_t thread;
+	int interval;
+	int quit;
+};
+
+static void* report_thread(void* arg)
+{
+	struct reporter* p = arg;
+	struct timespec ts = {p->interval, 0};
+	sigset_t set;
+	int sig;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	for (;;) {
+		if (p->interval > 0) {
+			sig = sigtimedwait(&set, NULL, &ts);
+		} else {
+			sig = sigwaitinfo(&set, NULL);
 		}
-		if (get_stream_info(b, &info) < 0) {
-			printf("get_stream_info failed\n");
-			return -1;
+		if (__atomic_load_n(&p->quit, __ATOMIC_ACQUIRE)) {
+			break;
 		}
-		if (info.stream != stream) {
-			if (sector == first_sector) {
-				printf("sector %d: expected stream %#x, found %#x\n", sector, stream, info.stream);
-				return -1;
-			} else {
-				continue;
-			}
-		}
-		if (sector == first_sector || sector == last_sector) {
-			if (info.first_frame_offset < 0) {
-				printf("sector %d: no first frame\n", sector);
-				return -1;
-			}
-			if (info.first_frame_offset >= info.end_offset) {
-				printf("sector %d: invalid frame offset %#x\n",
-					sector, info.first_frame_offset);
-				return -1;
-			}
-		}
-		if (sector == first_sector) {
-			printf("sector %d: frame offset %#x\n", sector, info.first_frame_offset);
-			start = info.first_frame_offset;
-			end = info.end_offset;
-		} else if (sector == last_sector) {
-			start = info.data_offset;
-			end = info.first_frame_offset;
-		} else {
-			start = info.data_offset;
-			end = info.end_offset;
-		}
-		if (start == end) {
-			continue;
-		}
-		if (w->write(w, b+start, end-start) < 0) {
-			return -1;
+		if (sig < 0 && errno == EINTR) {
+			continue;
 		}
+		print_progress(stderr);
 	}
-	return 0;
+	return NULL;
 }
 
-char *itoa(int n) {
-	char *a = malloc(11);
-	int err = snprintf(a, 11, "%d", n);
-	if (err < 0) {
-		perror("snprintf");
-		free(a);
+struct reporter* open_reporter(int interval)
+{
+	struct reporter* p = calloc(1, sizeof *p);
+	if (p == NULL) {
 		return NULL;
-	} else if (err >= 11) {
-		free(a);
+	}
+	p->interval = interval;
+	if (pthread_create(&p->thread, NULL, report_thread, p) != 0) {
+		perror("pthread_create");
+		free(p);
 		return NULL;
 	}
-	return a;
+	return p;
 }
 
-static int file_write(struct writer* w, const u8* buf, int size);
-static int file_close(struct writer* w);
-static int flac_close(struct writer* w);
-static int repack_write(struct writer* w, const u8* buf, int size);
-static int repack_close(struct writer* w);
+void close_reporter(struct reporter* p)
+{
+	__atomic_store_n(&p->quit, 1, __ATOMIC_RELEASE);
+	pthread_kill(p->thread, SIGUSR1);
+	pthread_join(p->thread, NULL);
+	free(p);
+}
 
-static struct writer* open_file(const char* filename)
+static int dvd_read(struct source* s, int sector, int count, u8** bufp);
+static int dvd_close(struct source* s);
+
+// Open a source which reads from a VOB in batches of up to batch sectors.
+struct source* open_dvd_source(dvd_file_t *vob, int batch)
 {
-	struct writer* w = malloc(sizeof *w);
-	if (w == NULL) {
+	struct source* s = malloc(sizeof *s);
+	void *buf;
+	if (s == NULL) {
 		return NULL;
 	}
-	w->fp = fopen(filename, "wb");
-	if (w->fp == NULL) {
-		perror("fopen");
-		free(w);
+	// Aligned so that libdvdread can hand it straight to the drive.
+	if (posix_memalign(&buf, 4096, (size_t)batch * SECTOR_SIZE) != 0) {
+		perror("posix_memalign");
+		free(s);
 		return NULL;
 	}
-	w->write = file_write;
-	w->close = file_close;
-	return w;
+	s->read = dvd_read;
+	s->close = dvd_close;
+	s->aob = false;
+	s->source = NULL;
+	s->ring = NULL;
+	s->vob = vob;
+	s->buf = buf;
+	s->batch = batch;
+	return s;
 }
 
-static int file_write(struct writer* w, const u8* buf, int size)
+static int dvd_read(struct source* s, int sector, int count, u8** bufp)
 {
-	if (size < 0) {
-		return -1;
+	ssize_t n;
+	int64_t t;
+	if (count > s->batch) {
+		count = s->batch;
 	}
-	if (fwrite(buf, 1, (size_t)size, w->fp) != (size_t)size) {
-		perror("fwrite");
+	t = nanos();
+	n = DVDReadBlocks(s->vob, sector, (size_t)count, s->buf);
+	count_read(nanos() - t, (int)n);
+	if (n < 1) {
 		return -1;
 	}
+	*bufp = s->buf;
+	return (int)n;
+}
+
+static int dvd_close(struct source* s)
+{
+	free(s->buf);
+	free(s);
 	return 0;
 }
 
-static int file_close(struct writer* w)
+// Where one of a title set's VOB files is in a disc image. Sectors are
+// counted from the start of the first file, as DVDReadBlocks counts them.
+struct extent {
+	int sector;
+	int count;
+	size_t offset; // in the mapping
+};
+
+// Whether a pack is CSS-scrambled, as it is in an image that wasn't
+// decrypted.
+static bool scrambled(u8* b)
 {
-	int err = fclose(w->fp);
-	free(w);
-	return err;
+	int id = pack_stream_id(b, false);
+	if (id != 0xbd && !(0xc0 <= id && id <= 0xef)) {
+		return false;
+	}
+	return (skip_mpeg_header(b)[6] & 0x30) != 0;
 }
 
-struct writer* open_flac(char *filename, struct lpcm_info info)
+static int mmap_read(struct source* s, int sector, int count, u8** bufp);
+static int mmap_close(struct source* s);
+
+// Open a source which maps a decrypted disc image and hands out pointers
+// straight into it, reading up to batch sectors at a time. The title set's
+// VOB files, or AOB files if audio is true, are found with the UDF layer.
+// Returns NULL if filename isn't an image this can read, to read it through
+// libdvdread instead.
+struct source* open_mmap_source(const char* filename, dvd_reader_t* dvd, int titleset, bool audio, int batch)
 {
-	char *bps = NULL, *samplerate = NULL, *chans = NULL;
-	int pid, err;
-	int fd[2];
-	FILE *fp = NULL;
-	struct writer* w = NULL;
+	char fn[] = "/VIDEO_TS/VTS_??_?.VOB";
+	struct extent ext[9];
+	uint32_t lba[9], size, lo = UINT32_MAX, hi = 0;
+	struct source* s;
+	struct stat st;
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	off_t start;
+	size_t len;
+	void* map;
+	int fd, i, n, total = 0;
 
-	if (filename == NULL) {
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return NULL;
+	}
+	for (n = 0; n < 9; n++) {
+		if (audio) {
+			snprintf(fn, sizeof fn, "/AUDIO_TS/ATS_%02d_%d.AOB", titleset, n+1);
+		} else {
+			snprintf(fn, sizeof fn, "/VIDEO_TS/VTS_%02d_%d.VOB", titleset, n+1);
+		}
+		lba[n] = UDFFindFile(dvd, fn, &size);
+		if (lba[n] == 0) {
+			break;
+		}
+		ext[n].sector = total;
+		ext[n].count = (int)(size / SECTOR_SIZE);
+		total += ext[n].count;
+		if (lba[n] < lo) {
+			lo = lba[n];
+		}
+		if (lba[n] + (uint32_t)ext[n].count > hi) {
+			hi = lba[n] + (uint32_t)ext[n].count;
+		}
+	}
+	if (n == 0 || (off_t)hi * SECTOR_SIZE > st.st_size) {
+		close(fd);
 		return NULL;
 	}
+	// Map just the VOB files, from the page the first one starts in.
+	start = (off_t)((uint64_t)lo * SECTOR_SIZE / page * page);
+	len = (size_t)((off_t)hi * SECTOR_SIZE - start);
+	map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, start);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+	posix_madvise(map, len, POSIX_MADV_SEQUENTIAL);
+	for (i = 0; i < n; i++) {
+		ext[i].offset = (size_t)((off_t)lba[i] * SECTOR_SIZE - start);
+	}
+	// libdvdread would descramble an encrypted image as it reads it.
+	// Look at the start of the title set to see whether it needs to.
+	for (i = 0; i < ext[0].count && i < 1024; i++) {
+		if (scrambled((u8*)map + ext[0].offset + (size_t)i * SECTOR_SIZE)) {
+			if (audio) {
+				fprintf(stderr, "%s: scrambled\n", filename);
+			} else {
+				fprintf(stderr, "%s: scrambled; reading it through libdvdread\n", filename);
+			}
+			munmap(map, len);
+			return NULL;
+		}
+	}
 
-	w = malloc(sizeof *w);
-	if (w == NULL) {
+	s = malloc(sizeof *s);
+	if (s == NULL) {
+		munmap(map, len);
+		return NULL;
+	}
+	s->extents = malloc((size_t)n * sizeof *s->extents);
+	if (s->extents == NULL) {
+		munmap(map, len);
+		free(s);
 		return NULL;
 	}
+	memcpy(s->extents, ext, (size_t)n * sizeof *ext);
+	s->nextents = n;
+	s->read = mmap_read;
+	s->close = mmap_close;
+	s->aob = audio;
+	s->source = NULL;
+	s->ring = NULL;
+	s->buf = NULL;
+	s->map = map;
+	s->maplen = len;
+	s->batch = batch;
+	s->secmap = NULL;
+	s->scanners = 0;
+	return s;
+}
 
-	err = pipe(fd);
-	if (err < 0) {
-		perror("pipe");
-		goto cleanup;
+static int mmap_read(struct source* s, int sector, int count, u8** bufp)
+{
+	const struct extent* e = s->extents;
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t from, to;
+	int64_t t = nanos();
+	int i, n;
+
+	for (i = 0; i < s->nextents && sector >= e[i].sector + e[i].count; i++) {
+	}
+	if (i == s->nextents || sector < e[i].sector) {
+		return -1;
 	}
+	if (count > s->batch) {
+		count = s->batch;
+	}
+	n = e[i].sector + e[i].count - sector;
+	if (n > count) {
+		n = count;
+	}
+	from = e[i].offset + (size_t)(sector - e[i].sector) * SECTOR_SIZE;
+	*bufp = s->map + from;
 
-	fp = fdopen(fd[1], "w");
-	if (fp == NULL) {
-		goto cleanup;
+	if (s->secmap != NULL) {
+		// Ask for just the wanted sectors of the next batch, which
+		// the demuxer will skip to.
+		int a = s->ahead > sector ? s->ahead : sector;
+		int z = sector + n + s->batch, b;
+		if (z > e[i].sector + e[i].count) {
+			z = e[i].sector + e[i].count;
+		}
+		for (; (a = secmap_next(s->secmap, a, s->want)) < z; a = b) {
+			b = secmap_skip(s->secmap, a, s->want);
+			if (b > z) {
+				b = z;
+			}
+			from = e[i].offset + (size_t)(a - e[i].sector) * SECTOR_SIZE;
+			to = e[i].offset + (size_t)(b - e[i].sector) * SECTOR_SIZE;
+			from = from / page * page;
+			posix_madvise(s->map + from, to - from, POSIX_MADV_WILLNEED);
+		}
+		s->ahead = z;
+		count_read(nanos() - t, n);
+		return n;
 	}
 
-	// It might seem like it would be better to allocate these in the
-	// child, but we'd be in big trouble if they failed.
-	bps = itoa(info.bitdepth);
-	samplerate = itoa(info.sample_rate);
-	chans = itoa(info.channels);
-	if (bps == NULL || samplerate == NULL || chans == NULL) {
-		goto cleanup;
+	// Have the kernel read these sectors and the next batch in while
+	// they're demuxed.
+	to = from + (size_t)(n + s->batch) * SECTOR_SIZE;
+	if (to > e[i].offset + (size_t)e[i].count * SECTOR_SIZE) {
+		to = e[i].offset + (size_t)e[i].count * SECTOR_SIZE;
 	}
+	from = from / page * page;
+	posix_madvise(s->map + from, to - from, POSIX_MADV_WILLNEED);
+	count_read(nanos() - t, n);
+	return n;
+}
 
-	pid = fork();
-	if (pid < 0) {
-		perror("fork");
-		goto cleanup;
-	} else if (pid == 0) {
-		close(fd[1]);
-		dup2(fd[0], 0);
-		execlp("flac",
-			"flac",
-			"--silent",
-			"-o", filename,
-			"--force-raw-format",
-			"--sign=signed",
-			"--endian=little",
-			"--bps", bps,
-			"--sample-rate", samplerate,
-			"--channels", chans,
-			"-",
-			NULL);
-		// If we get here, execlp failed
-		perror("execlp");
-		_exit(1);
+// Have the demuxer look through a mapped image's sectors on the given
+// number of threads. Returns whether the source is one it can do that for.
+static bool scan_source(struct source* s, int threads)
+{
+	if (s->read != mmap_read) {
+		return false;
 	}
+	s->scanners = threads;
+	return true;
+}
 
-	close(fd[0]);
-	free(bps);
-	free(samplerate);
-	free(chans);
+// Have a source read only the sectors that m doesn't say hold none of the
+// wanted streams, if it's one that can skip about. Returns whether it is.
+static bool sparse_source(struct source* s, const struct secmap* m, const bool* want)
+{
+	if (s->read != mmap_read) {
+		return false;
+	}
+	// The kernel's readahead would read in the sectors being skipped.
+	posix_madvise(s->map, s->maplen, POSIX_MADV_RANDOM);
+	s->secmap = m;
+	s->want = want;
+	s->ahead = 0;
+	return true;
+}
 
-	w->fp = fp;
-	w->pid = pid;
-	w->write = file_write;
-	w->close = flac_close;
+static int mmap_close(struct source* s)
+{
+	munmap(s->map, s->maplen);
+	free(s->extents);
+	free(s);
+	return 0;
+}
 
-	return w;
+static int loose_read(struct source* s, int sector, int count, u8** bufp);
+static int loose_close(struct source* s);
 
-cleanup:
-	free(w);
-	free(bps);
-	free(samplerate);
-	free(chans);
+// Open a source which reads a loose VOB or MPEG program stream file in
+// batches of up to batch packs. The packs needn't be aligned: the file may
+// start part way into one, and a pack cut short, as where two files were
+// joined, is skipped. Sectors are numbered by the packs found, so the file
+// can only be read straight through.
+struct source* open_loose_source(const char* filename, int batch)
+{
+	struct source* s = malloc(sizeof *s);
+	void* buf;
+	if (s == NULL) {
+		return NULL;
+	}
+	s->fd = open(filename, O_RDONLY);
+	if (s->fd < 0) {
+		perror(filename);
+		free(s);
+		return NULL;
+	}
+	// Room for a batch and the start of the pack after it.
+	if (posix_memalign(&buf, 4096, (size_t)(batch+1) * SECTOR_SIZE) != 0) {
+		perror("posix_memalign");
+		close(s->fd);
+		free(s);
+		return NULL;
+	}
+	posix_fadvise(s->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	s->read = loose_read;
+	s->close = loose_close;
+	s->aob = false;
+	s->source = NULL;
+	s->ring = NULL;
+	s->buf = buf;
+	s->batch = batch;
+	s->len = 0;
+	s->keep = 0;
+	s->next = 0;
+	s->eof = false;
+	s->dropped = 0;
+	return s;
+}
+
+// Whether a pack ends where another starts, or at the end of the file.
+static bool pack_ends(const u8* p, const u8* end, bool eof)
+{
+	if (end - p < 4) {
+		return eof;
+	}
+	return p[0] == 0 && p[1] == 0 && p[2] == 1 && p[3] == 0xba;
+}
+
+// Fill a sector with a padding pack.
+static void padding_pack(u8* b)
+{
+	static const u8 head[] = {
+		0x00, 0x00, 0x01, 0xba, 0x44, 0x00, 0x04, 0x00, 0x04, 0x01, 0x01, 0x89, 0xc3, 0xf8,
+		0x00, 0x00, 0x01, 0xbe, (SECTOR_SIZE-20) >> 8, (SECTOR_SIZE-20) & 0xff,
+	};
+	memcpy(b, head, sizeof head);
+	memset(b + sizeof head, 0xff, SECTOR_SIZE - sizeof head);
+}
+
+static int loose_read(struct source* s, int sector, int count, u8** bufp)
+{
+	size_t size = (size_t)(s->batch+1) * SECTOR_SIZE;
+	const u8 *p, *q, *end;
+	int64_t ns;
+	ssize_t r;
+	int n = 0;
+
+	if (sector < s->next) {
+		printf("sector %d: can't seek back in a loose file\n", sector);
+		return -1;
+	}
+	while (s->next < sector) {
+		// Read through to it
+		if (loose_read(s, s->next, sector - s->next, bufp) < 1) {
+			return -1;
+		}
+	}
+	if (count > s->batch) {
+		count = s->batch;
+	}
+	while (n == 0) {
+		// Keep what was left over last time, and fill up the rest.
+		memmove(s->buf, s->buf + s->keep, s->len - s->keep);
+		s->len -= s->keep;
+		s->keep = 0;
+		ns = nanos();
+		while (!s->eof && s->len < size) {
+			r = read(s->fd, s->buf + s->len, size - s->len);
+			if (r < 0 && errno == EINTR) {
+				continue;
+			}
+			if (r < 0) {
+				perror("read");
+				return -1;
+			}
+			s->eof = r == 0;
+			s->len += (size_t)r;
+		}
+		ns = nanos() - ns;
+
+		// Move the whole packs down over anything between them. If
+		// the file is aligned, nothing moves.
+		p = s->buf;
+		end = s->buf + s->len;
+		while (n < count) {
+			q = find_pack(p, end);
+			if (q == NULL) {
+				// A start code could run on into the next read.
+				q = s->eof || end - p < 3 ? end : end - 3;
+			}
+			s->dropped += q - p;
+			p = q;
+			if (end - p < SECTOR_SIZE + 4 && !s->eof) {
+				break;
+			}
+			if (end - p < SECTOR_SIZE) {
+				s->dropped += end - p;
+				p = end;
+				break;
+			}
+			if (!pack_ends(p + SECTOR_SIZE, end, s->eof)) {
+				// Cut short; carry on from the next start code
+				s->dropped++;
+				p++;
+				continue;
+			}
+			if (p != s->buf + n*SECTOR_SIZE) {
+				memmove(s->buf + n*SECTOR_SIZE, p, SECTOR_SIZE);
+			}
+			n++;
+			p += SECTOR_SIZE;
+		}
+		s->keep = (size_t)(p - s->buf);
+		count_read(ns, n);
+
+		if (n == 0 && s->eof) {
+			// How many packs there are isn't known until the end,
+			// so the demuxer is told there could be one for every
+			// sector's worth of file. Past the end are padding
+			// packs, which it skips.
+			for (; n < count; n++) {
+				padding_pack(s->buf + n*SECTOR_SIZE);
+			}
+		}
+	}
+	s->next += n;
+	*bufp = s->buf;
+	return n;
+}
+
+static int loose_close(struct source* s)
+{
+	if (s->dropped > 0) {
+		fprintf(stderr, "loose file: skipped %" PRId64 " bytes outside whole packs\n", s->dropped);
+	}
+	close(s->fd);
+	free(s->buf);
+	free(s);
+	return 0;
+}
+
+// A batch of sectors in the read-ahead ring.
+struct batch {
+	int sector;
+	int count; // number of sectors read, or -1 on error
+	u8* buf;
+};
+
+// Read-ahead state shared between the consumer and the producer thread.
+// The producer reads batches sequentially into the ring until it is full
+// or it reaches last. The consumer owns the batch at head until it asks for
+// a sector past the end of it.
+struct ring {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct source* source;
+	const struct angles* angles; // followed by the producer, or NULL
+	struct batch* batches;
+	int depth;
+	int head, count;
+	int next; // first sector of the next batch to read
+	int last;
+	int gen; // bumped whenever the consumer seeks
+	bool quit;
+
+	// Stall statistics
+	long reads, empty, full;
+	double empty_time, full_time;
+};
+
+static void* readahead_thread(void* arg)
+{
+	struct ring* r = arg;
+	struct source* src = r->source;
+	struct batch* b;
+	struct ilvu cur;
+	u8* p;
+	int sector, count, n, gen, next, j;
+	int curgen = -1;
+	double t;
+
+	pthread_mutex_lock(&r->lock);
+	for (;;) {
+		if (r->quit) {
+			break;
+		}
+		if (r->next > r->last) {
+			pthread_cond_wait(&r->cond, &r->lock);
+			continue;
+		}
+		if (r->count == r->depth) {
+			t = now();
+			r->full++;
+			pthread_cond_wait(&r->cond, &r->lock);
+			r->full_time += now() - t;
+			continue;
+		}
+		b = &r->batches[(r->head + r->count) % r->depth];
+		sector = r->next;
+		gen = r->gen;
+		if (gen != curgen) {
+			// Start following the angle afresh after a seek.
+			ilvu_reset(&cur, r->angles);
+			curgen = gen;
+		}
+		count = ilvu_last(&cur, sector, r->last) - sector + 1;
+		pthread_mutex_unlock(&r->lock);
+
+		// The slot isn't visible to the consumer until count is bumped,
+		// so it is safe to fill without the lock.
+		n = src->read(src, sector, count, &p);
+		next = sector + n;
+		if (n > 0) {
+			memcpy(b->buf, p, (size_t)n * SECTOR_SIZE);
+			// Cut the batch where the angle jumps ahead.
+			for (j = 0; j < n; j++) {
+				next = ilvu_step(&cur, sector + j, b->buf + (size_t)j * SECTOR_SIZE);
+				if (next != sector + j + 1) {
+					n = j + 1;
+					break;
+				}
+			}
+		}
+
+		pthread_mutex_lock(&r->lock);
+		if (gen != r->gen) {
+			continue; // the consumer went somewhere else
+		}
+		b->sector = sector;
+		b->count = n;
+		r->count++;
+		r->reads++;
+		if (n > 0) {
+			r->next = next;
+		} else {
+			// Stop here. The consumer will see the error.
+			r->next = r->last + 1;
+		}
+		pthread_cond_broadcast(&r->cond);
+	}
+	pthread_mutex_unlock(&r->lock);
+	return NULL;
+}
+
+static int readahead_read(struct source* s, int sector, int count, u8** bufp);
+static int readahead_close(struct source* s);
+
+// Open a source which reads batches from src on a separate thread, keeping
+// up to depth batches ready ahead of the reader. Sectors after last are
+// never read ahead. If angles isn't NULL, the other angles' sectors are
+// skipped as the demuxer would.
+struct source* open_readahead(struct source* src, int depth, int last, const struct angles* angles)
+{
+	struct source* s = NULL;
+	struct ring* r = NULL;
+	int i;
+
+	s = malloc(sizeof *s);
+	r = calloc(1, sizeof *r);
+	if (s == NULL || r == NULL) {
+		goto error;
+	}
+	r->batches = calloc((size_t)depth, sizeof *r->batches);
+	if (r->batches == NULL) {
+		goto error;
+	}
+	for (i = 0; i < depth; i++) {
+		void *buf;
+		if (posix_memalign(&buf, 4096, (size_t)src->batch * SECTOR_SIZE) != 0) {
+			perror("posix_memalign");
+			goto error;
+		}
+		r->batches[i].buf = buf;
+	}
+	r->source = src;
+	r->angles = angles;
+	r->depth = depth;
+	r->last = last;
+	r->next = last + 1; // idle until the first read
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	if (pthread_create(&r->thread, NULL, readahead_thread, r) != 0) {
+		perror("pthread_create");
+		goto error;
+	}
+
+	s->read = readahead_read;
+	s->close = readahead_close;
+	s->aob = src->aob;
+	s->source = src;
+	s->ring = r;
+	s->batch = src->batch;
+	s->vob = NULL;
+	s->buf = NULL;
+	return s;
+
+error:
+	if (r != NULL && r->batches != NULL) {
+		for (i = 0; i < depth; i++) {
+			free(r->batches[i].buf);
+		}
+		free(r->batches);
+	}
+	free(r);
+	free(s);
 	return NULL;
 }
 
-static int flac_close(struct writer* w)
+static int readahead_read(struct source* s, int sector, int count, u8** bufp)
+{
+	struct ring* r = s->ring;
+	struct batch* b;
+	int n;
+	double t;
+
+	pthread_mutex_lock(&r->lock);
+	for (;;) {
+		// Release batches we're done with. A failed batch only
+		// answers for its first sector.
+		while (r->count > 0) {
+			b = &r->batches[r->head];
+			if (sector >= b->sector + (b->count > 0 ? b->count : 1)) {
+				r->head = (r->head + 1) % r->depth;
+				r->count--;
+				pthread_cond_broadcast(&r->cond);
+			} else {
+				break;
+			}
+		}
+		if (r->count > 0) {
+			b = &r->batches[r->head];
+			if (b->sector <= sector) {
+				break;
+			}
+		} else if (r->next == sector && sector <= r->last) {
+			// It's on its way.
+			t = now();
+			r->empty++;
+			pthread_cond_wait(&r->cond, &r->lock);
+			r->empty_time += now() - t;
+			continue;
+		}
+		// Seek: throw away everything and start over at sector.
+		r->head = 0;
+		r->count = 0;
+		r->next = sector;
+		if (r->last < sector) {
+			r->last = sector + count - 1;
+		}
+		r->gen++;
+		pthread_cond_broadcast(&r->cond);
+	}
+	if (b->count < 0) {
+		n = -1;
+	} else {
+		*bufp = b->buf + (size_t)(sector - b->sector) * SECTOR_SIZE;
+		n = b->sector + b->count - sector;
+		if (n > count) {
+			n = count;
+		}
+	}
+	pthread_mutex_unlock(&r->lock);
+	return n;
+}
+
+static int readahead_close(struct source* s)
+{
+	struct ring* r = s->ring;
+	int i, err;
+
+	pthread_mutex_lock(&r->lock);
+	r->quit = true;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+	pthread_join(r->thread, NULL);
+
+	fprintf(stderr, "readahead: %ld batches; waited on the disc %ld times (%.2fs), on the writer %ld times (%.2fs)\n",
+		r->reads, r->empty, r->empty_time, r->full, r->full_time);
+
+	err = r->source->close(r->source);
+	for (i = 0; i < r->depth; i++) {
+		free(r->batches[i].buf);
+	}
+	free(r->batches);
+	pthread_mutex_destroy(&r->lock);
+	pthread_cond_destroy(&r->cond);
+	free(r);
+	free(s);
+	return err;
+}
+
+// What a scan found in a sector: the stream id of its pack, or -1 if it
+// isn't one, and for a private stream 1 pack, where its data is.
+struct scanned {
+	int pack;
+	bool ok; // whether info was made out
+	struct stream_info info;
+};
+
+// A scan looks through a mapped image's sectors on several threads ahead
+// of the demuxer, a chunk at a time, so that the demuxer only touches the
+// packs of the streams it wants, and those already in memory.
+struct scan {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct source* source;
+	pthread_t* threads;
+	int nthreads;
+	int first, last; // sectors to look through
+	int chunk; // sectors a thread takes at a time
+	int nslots;
+	struct scanned* results; // nslots chunks of them
+	int* filled; // the chunk in each slot, or -1
+	bool* busy; // whether a thread is filling each slot
+	int next; // the next chunk to hand out
+	int done; // the demuxer is done with the chunks before this
+	int cur; // the chunk the demuxer is in, or -1
+	bool quit;
+
+	// Stall statistics
+	long chunks, waits;
+	double wait_time;
+};
+
+// Return a sector of a mapped source, or NULL if it isn't in the title set.
+static u8* mmap_sector(struct source* s, int sector)
+{
+	const struct extent* e = s->extents;
+	int i;
+
+	for (i = 0; i < s->nextents && sector >= e[i].sector + e[i].count; i++) {
+	}
+	if (i == s->nextents || sector < e[i].sector) {
+		return NULL;
+	}
+	return s->map + e[i].offset + (size_t)(sector - e[i].sector) * SECTOR_SIZE;
+}
+
+static void* scan_thread(void* arg)
+{
+	struct scan* sc = arg;
+	struct scanned* r;
+	int c, j, slot, sector;
+	u8* b;
+
+	pthread_mutex_lock(&sc->lock);
+	for (;;) {
+		if (sc->quit) {
+			break;
+		}
+		// Chunks the demuxer skipped past needn't be looked at.
+		if (sc->next < sc->done) {
+			sc->next = sc->done;
+		}
+		c = sc->next;
+		slot = c % sc->nslots;
+		if (sc->first + c*sc->chunk > sc->last || c >= sc->done + sc->nslots || sc->busy[slot]) {
+			pthread_cond_wait(&sc->cond, &sc->lock);
+			continue;
+		}
+		sc->next++;
+		sc->busy[slot] = true;
+		pthread_mutex_unlock(&sc->lock);
+
+		r = &sc->results[(size_t)slot * (size_t)sc->chunk];
+		for (j = 0; j < sc->chunk && (sector = sc->first + c*sc->chunk + j) <= sc->last; j++) {
+			b = mmap_sector(sc->source, sector);
+			r[j].pack = b != NULL ? pack_stream_id(b, false) : -1;
+			r[j].ok = false;
+			if (r[j].pack == 0xbd) {
+				r[j].ok = (sc->source->aob ? get_aob_stream_info(b, &r[j].info) : get_stream_info(b, &r[j].info)) >= 0;
+			}
+		}
+
+		pthread_mutex_lock(&sc->lock);
+		sc->busy[slot] = false;
+		sc->filled[slot] = c;
+		sc->chunks++;
+		pthread_cond_broadcast(&sc->cond);
+	}
+	pthread_mutex_unlock(&sc->lock);
+	return NULL;
+}
+
+static void close_scan(struct scan* sc);
+
+// Start scanning sectors first through last of a source, if it's a mapped
+// image the scan was asked for with scan_source. Returns NULL otherwise.
+static struct scan* open_scan(struct source* src, int first, int last)
+{
+	struct scan* sc;
+	int i;
+
+	if (src->read != mmap_read || src->scanners < 1 || first > last) {
+		return NULL;
+	}
+	sc = calloc(1, sizeof *sc);
+	if (sc == NULL) {
+		die("Out of memory");
+	}
+	sc->source = src;
+	sc->first = first;
+	sc->last = last;
+	sc->chunk = src->batch;
+	sc->nslots = 2 * src->scanners;
+	sc->cur = -1;
+	sc->results = malloc((size_t)sc->nslots * (size_t)sc->chunk * sizeof *sc->results);
+	sc->filled = malloc((size_t)sc->nslots * sizeof *sc->filled);
+	sc->busy = calloc((size_t)sc->nslots, sizeof *sc->busy);
+	sc->threads = malloc((size_t)src->scanners * sizeof *sc->threads);
+	if (sc->results == NULL || sc->filled == NULL || sc->busy == NULL || sc->threads == NULL) {
+		die("Out of memory");
+	}
+	for (i = 0; i < sc->nslots; i++) {
+		sc->filled[i] = -1;
+	}
+	pthread_mutex_init(&sc->lock, NULL);
+	pthread_cond_init(&sc->cond, NULL);
+	for (i = 0; i < src->scanners; i++) {
+		if (pthread_create(&sc->threads[i], NULL, scan_thread, sc) != 0) {
+			perror("pthread_create");
+			break;
+		}
+		sc->nthreads++;
+	}
+	if (sc->nthreads == 0) {
+		close_scan(sc);
+		return NULL;
+	}
+	return sc;
+}
+
+// Return what the scan found in a sector, waiting for it if need be.
+// Sectors are asked for in order, and the chunks before one asked for are
+// handed back to be filled again.
+static const struct scanned* scan_get(struct scan* sc, int sector)
+{
+	int c = (sector - sc->first) / sc->chunk;
+	int slot = c % sc->nslots;
+	double t;
+
+	if (c != sc->cur) {
+		pthread_mutex_lock(&sc->lock);
+		if (c > sc->done) {
+			sc->done = c;
+			pthread_cond_broadcast(&sc->cond);
+		}
+		while (sc->filled[slot] != c) {
+			t = now();
+			sc->waits++;
+			pthread_cond_wait(&sc->cond, &sc->lock);
+			sc->wait_time += now() - t;
+		}
+		pthread_mutex_unlock(&sc->lock);
+		sc->cur = c;
+	}
+	return &sc->results[(size_t)slot * (size_t)sc->chunk + (size_t)((sector - sc->first) % sc->chunk)];
+}
+
+static void close_scan(struct scan* sc)
+{
+	pthread_mutex_lock(&sc->lock);
+	sc->quit = true;
+	pthread_cond_broadcast(&sc->cond);
+	pthread_mutex_unlock(&sc->lock);
+	for (int i = 0; i < sc->nthreads; i++) {
+		pthread_join(sc->threads[i], NULL);
+	}
+	if (sc->nthreads > 0) {
+		fprintf(stderr, "scan: %d threads looked through %ld chunks; waited on them %ld times (%.2fs)\n",
+			sc->nthreads, sc->chunks, sc->waits, sc->wait_time);
+	}
+	pthread_mutex_destroy(&sc->lock);
+	pthread_cond_destroy(&sc->cond);
+	free(sc->results);
+	free(sc->filled);
+	free(sc->busy);
+	free(sc->threads);
+	free(sc);
+}
+
+// Output settings for the tracks of one stream.
+enum format {
+	FORMAT_RAW,
+	FORMAT_FLAC,
+	FORMAT_WAV,
+	FORMAT_W64,
+};
+
+static const char* format_names[] = {"raw", "flac", "wav", "w64"};
+
+struct output {
+	enum format format;
+	struct lpcm_info lpcm_info;
+	int threads; // FLAC encoder threads, or -1 to run flac
+	bool ring; // pass flac its input through a shared ring
+	const char* tag; // added to the file names when ripping several streams
+	const char* ext;
+	struct sched* sched; // encodes FLAC tracks in the background, or NULL
+	struct iothread* io; // writes raw tracks in the background, or NULL
+	const double* seconds; // playback time of each chapter
+	struct checkpoint* ckpt; // records the finished tracks, or NULL
+	bool trim; // cut the track down to length bytes after the first head
+	int64_t head, length;
+	int title; // if not 0, starts the file names, for ripping several titles
+	// When ripping several titles, the stream is first read into pieces,
+	// one for each cell, which pieces[chapter] says where to put in spool.
+	struct piece** pieces;
+	FILE* spool;
+	struct gain* gain; // measures the loudness of LPCM tracks, or NULL
+	struct sums* sums; // records the hashes of the tracks, or NULL
+};
+
+// Room for a track's file name.
+enum { track_name_size = 5+10+1+5+10+15+5+1 };
+
+static void track_name(char* name, const struct output* out, int chapter)
+{
+	if (out->title > 0) {
+		snprintf(name, track_name_size, "title%02d-track%02d%s%s", out->title, chapter+1, out->tag, out->ext);
+	} else {
+		snprintf(name, track_name_size, "track%02d%s%s", chapter+1, out->tag, out->ext);
+	}
+}
+
+static struct writer* open_track(struct output* out, int chapter, int64_t offset);
+
+// A stream being extracted. Every stream has its own chapter boundaries,
+// since each audio stream's first frame lands in a different pack.
+struct sink {
+	int stream; // substream id
+	bool spu;
+	struct output out;
+	int* sectors; // sectors[i] starts chapter i; sectors[last] ends the last one
+	int last;
+	int ch; // current chapter
+	int next; // sector of the next chapter boundary
+	int done; // sector already written at a boundary
+	bool skip; // the current chapter failed; ignore it until the next one
+	int from; // if not 0, carry on the current track from this sector...
+	int64_t offset; // ...where its file was this long
+	double* seconds; // playback time of each chapter, for preallocation
+	struct writer* w;
+	int64_t bytes; // written to the tracks
+	int64_t ns; // time spent writing them
+
+	// Subpictures are split between units rather than at FirstAccUnit,
+	// so the previous track stays open until its last unit is complete.
+	struct writer* prev;
+	int left; // bytes left in the current unit
+	int unit; // sector the current unit started in
+	int sync; // sector to start reading at to redo the current chapter
+
+	char tag[16];
+};
+
+// Position of a packet within a chapter.
+enum { PACKET_FIRST, PACKET_MIDDLE, PACKET_LAST };
+
+// Write part of a packet to one of a sink's tracks, keeping count.
+static int sink_write(struct sink* k, struct writer* w, const u8* p, int n)
+{
+	int64_t t = nanos();
+	int err = w->write(w, p, n);
+	k->ns += nanos() - t;
+	k->bytes += n;
+	stat_add(&stats->demuxed, n);
+	return err;
+}
+
+// Write the part of one pack belonging to the sink's current chapter. Info
+// is NULL if the pack isn't private stream 1.
+// First packet: dump packet starting at FirstAccUnit
+// Intermediate packets: dump complete packet contents
+// Last packet: dump packet until FirstAccUnit
+static int dump_packet(struct sink* k, u8* b, struct stream_info* info, int sector, int where)
+{
+	int stream = k->stream;
+	int start, end;
+
+	if (info == NULL) {
+		return 0;
+	}
+	if (info->stream != stream) {
+		if (where == PACKET_FIRST) {
+			printf("sector %d: expected stream %#x, found %#x\n", sector, stream, info->stream);
+			return -1;
+		}
+		return 0;
+	}
+	if (where != PACKET_MIDDLE) {
+		if (info->first_frame_offset < 0) {
+			printf("sector %d: no first frame\n", sector);
+			return -1;
+		}
+		if (info->first_frame_offset >= info->end_offset) {
+			printf("sector %d: invalid frame offset %#x\n",
+				sector, info->first_frame_offset);
+			return -1;
+		}
+	}
+	if (where == PACKET_FIRST) {
+		printf("sector %d: frame offset %#x\n", sector, info->first_frame_offset);
+		start = info->first_frame_offset;
+		end = info->end_offset;
+	} else if (where == PACKET_LAST) {
+		start = info->data_offset;
+		end = info->first_frame_offset;
+	} else {
+		start = info->data_offset;
+		end = info->end_offset;
+	}
+	if (start == end) {
+		return 0;
+	}
+	return sink_write(k, k->w, b+start, end-start);
+}
+
+// Close one of a sink's tracks. Complete ones are marked done in the
+// checkpoint once they're written.
+static void close_track(struct writer* w, bool complete)
+{
+	w->complete = complete;
+	w->close(w);
+}
+
+static void update_next(struct sink* k)
+{
+	if (k->ch == k->last) {
+		k->next = INT_MAX;
+	} else if (k->w == NULL) {
+		k->next = k->sectors[k->ch];
+	} else {
+		k->next = k->sectors[k->ch+1];
+	}
+}
+
+// Write a whole packet to a piece, noting where the first frame starting
+// in the piece is if the packet has it.
+static int piece_packet(struct sink* k, u8* b, struct stream_info* info, int sector)
+{
+	struct piece* p = k->out.pieces[k->ch];
+
+	if (info != NULL && info->stream == k->stream && p->lead < 0 && info->first_frame_offset >= 0) {
+		p->lead = p->length + info->first_frame_offset - info->data_offset;
+	}
+	return dump_packet(k, b, info, sector, PACKET_MIDDLE);
+}
+
+// Switch an audio stream's tracks at the chapter boundaries up to the given
+// sector. The pack on a boundary is split between the two tracks. B is NULL
+// if the sector couldn't be read.
+static int audio_boundary(struct sink* k, int sector, u8* b, struct stream_info* info)
+{
+	bool complete;
+
+	while (k->ch < k->last && sector >= k->sectors[k->ch+1]) {
+		complete = false;
+		if (k->w == NULL) {
+			// An empty chapter, or one we skipped over
+			k->w = open_track(&k->out, k->ch, 0);
+			if (k->w == NULL) {
+				return -1;
+			}
+		} else if (k->out.pieces != NULL) {
+			// Pieces end just before the boundary.
+			complete = !k->skip;
+		} else if (sector == k->sectors[k->ch+1] && !k->skip && b != NULL) {
+			complete = dump_packet(k, b, info, sector, PACKET_LAST) == 0;
+		}
+		close_track(k->w, complete);
+		k->w = NULL;
+		k->skip = false;
+		k->ch++;
+		k->done = sector;
+	}
+	if (k->ch < k->last && k->w == NULL && sector >= k->sectors[k->ch]) {
+		k->w = open_track(&k->out, k->ch, 0);
+		if (k->w == NULL) {
+			return -1;
+		}
+		if (k->out.pieces != NULL) {
+			// A piece can start anywhere in its cell.
+			k->skip = b == NULL || piece_packet(k, b, info, sector) < 0;
+		} else {
+			k->skip = sector != k->sectors[k->ch] || b == NULL ||
+				dump_packet(k, b, info, sector, PACKET_FIRST) < 0;
+		}
+		k->done = sector;
+	}
+	update_next(k);
+	return 0;
+}
+
+// Switch a subpicture stream's tracks at the chapter boundaries up to the
+// given sector. A unit which is still being written stays with the old track.
+static int spu_boundary(struct sink* k, int sector)
+{
+	while (k->ch < k->last && sector >= k->sectors[k->ch+1]) {
+		if (k->w == NULL) {
+			k->w = open_track(&k->out, k->ch, 0);
+			if (k->w == NULL) {
+				return -1;
+			}
+		}
+		if (k->left > 0 && k->prev == NULL && !k->skip) {
+			k->prev = k->w;
+		} else {
+			close_track(k->w, !k->skip);
+		}
+		k->w = NULL;
+		k->skip = false;
+		k->ch++;
+	}
+	if (k->ch < k->last && k->w == NULL && sector >= k->sectors[k->ch]) {
+		k->w = open_track(&k->out, k->ch, 0);
+		if (k->w == NULL) {
+			return -1;
+		}
+		k->sync = k->left > 0 ? k->unit : sector;
+	}
+	update_next(k);
+	return 0;
+}
+
+// Write a subpicture packet. Each unit starts with its size, and goes
+// whole to the track it started in.
+static void spu_packet(struct sink* k, u8* b, struct stream_info* info, int sector)
+{
+	u8* p = b + info->data_offset;
+	int n = info->end_offset - info->data_offset;
+	struct writer* w;
+	int m;
+
+	while (n > 0) {
+		if (k->left == 0) {
+			if (k->prev != NULL) {
+				close_track(k->prev, true);
+				k->prev = NULL;
+			}
+			k->left = n >= 2 ? p[0]<<8 | p[1] : n;
+			if (k->left < 2) {
+				k->left = n;
+			}
+			k->unit = sector;
+		}
+		m = n < k->left ? n : k->left;
+		w = k->prev != NULL ? k->prev : k->w;
+		if (w != NULL) {
+			sink_write(k, w, p, m);
+		}
+		p += m;
+		n -= m;
+		k->left -= m;
+	}
+}
+
+// Close whatever tracks are still open. They're complete if the title was
+// read to the end.
+static void close_sink(struct sink* k, bool complete)
+{
+	if (k->prev != NULL) {
+		close_track(k->prev, complete);
+		k->prev = NULL;
+	}
+	if (k->w != NULL) {
+		close_track(k->w, complete && !k->skip);
+		k->w = NULL;
+	}
+}
+
+// A checkpoint records how far a rip got, so that if it dies a rerun can
+// carry on rather than start over. It lists the finished tracks, and for
+// each track being written, the sector to carry on from and how long its
+// file was then. It's saved every few seconds while ripping.
+// Save the checkpoint, replacing the old one all at once. Unless cur is
+// NULL, the tracks being written are synced and recorded as carrying on
+// from sector, where cur is reading the title. Anything recorded before
+// stands until it's replaced or the track is done.
+static int save_checkpoint(struct checkpoint* c, struct sink* sinks, int nsinks, const struct ilvu* cur, int sector)
+{
+	char name[track_name_size];
+	struct ilvu probe;
+	struct sink* k;
+	int64_t offset;
+	int i;
+
+	for (i = 0; cur != NULL && i < nsinks; i++) {
+		k = &sinks[i];
+		// Done tracks are written to a writer which can't sync.
+		if (k->w == NULL || k->skip || k->w->sync == NULL) {
+			continue;
+		}
+		track_name(name, &k->out, k->ch);
+		if (k->spu) {
+			// Subpicture units run across chapters, so those
+			// tracks are redone from where their first unit
+			// started.
+			ilvu_reset(&probe, cur->angles);
+			if (k->sync >= 0 && ilvu_resumable(&probe, k->sync)) {
+				checkpoint_set(c, name, k->sync, 0);
+			}
+			continue;
+		}
+		// Partway through an ILVU, what was recorded before stands.
+		if (!ilvu_resumable(cur, sector)) {
+			continue;
+		}
+		offset = k->w->sync(k->w);
+		if (offset > 0) {
+			// A track that hasn't reached where it carried on
+			// from has only what it started with.
+			checkpoint_set(c, name, sector > k->from ? sector : k->from, offset);
+		}
+	}
+
+	return checkpoint_save(c);
+}
+
+// Set a sink up to carry on from the checkpoint: drop the finished tracks
+// at either end, and carry on the first unfinished one from where it got
+// to if its file is still there. Returns the number of tracks dropped.
+int resume_sink(struct sink* k, struct checkpoint* c)
+{
+	char name[track_name_size];
+	struct stat st;
+	int first = k->ch, n = 0, sector;
+	int64_t offset;
+	bool found;
+
+	for (; k->ch < k->last; k->ch++, n++) {
+		track_name(name, &k->out, k->ch);
+		if (!checkpoint_done(c, name)) {
+			break;
+		}
+	}
+	for (; k->last > k->ch; k->last--, n++) {
+		track_name(name, &k->out, k->last-1);
+		if (!checkpoint_done(c, name)) {
+			break;
+		}
+	}
+	if (k->ch == k->last) {
+		return n;
+	}
+	track_name(name, &k->out, k->ch);
+	found = checkpoint_find(c, name, &sector, &offset);
+	if (k->spu && k->ch > first) {
+		// A unit can run on into this chapter from the previous one,
+		// so read again from where that unit started to find where
+		// this chapter's units do. Without a record of that, read
+		// from the start.
+		if (found && k->sectors[k->ch-1] <= sector && sector <= k->sectors[k->ch]) {
+			k->ch--;
+			k->from = sector;
+		} else {
+			n -= k->ch - first;
+			k->ch = first;
+		}
+		return n;
+	}
+	if (k->spu || k->out.format == FORMAT_FLAC) {
+		return n;
+	}
+	if (found && k->sectors[k->ch] <= sector && sector <= k->sectors[k->ch+1] &&
+	    stat(name, &st) == 0 && st.st_size >= offset) {
+		k->from = sector;
+		k->offset = offset;
+	}
+	return n;
+}
+
+// Route each pack of the title to the sink for its stream, reading every
+// sector once however many streams are being extracted. Sinks start at
+// chapter ch and stop at last, carrying on their first track from sector
+// from if that's set. If angles isn't NULL, only the chosen angle's sectors
+// are read. If a chapter of a stream fails, we carry on with the next one.
+// If ckpt isn't NULL it's saved as we go. If map isn't NULL, what each
+// sector read holds is noted in it, and if the source can skip about, the
+// sectors it says hold none of the streams aren't read. Otherwise, a
+// source set up with scan_source has its sectors looked through on other
+// threads, unless an angle is chosen. Returns -1 if a track couldn't be
+// opened.
+int demux(struct source* src, struct sink* sinks, int nsinks, const struct angles* angles, struct checkpoint* ckpt, struct secmap* map)
+{
+	struct sink* route[256] = {0};
+	bool want[256] = {0};
+	struct sink* k;
+	struct stream_info info, *ip;
+	struct ilvu cur;
+	u8 *buf, *b;
+	int n, i, j, id, sector, step;
+	int first = INT_MAX, end = -1, next = INT_MAX;
+	int skipped = 0, unwanted = 0;
+	bool resume = false, sparse = false;
+	struct scan* scan = NULL;
+	int err = 0;
+	int64_t start = nanos(), waiting = 0, writing, t;
+
+	for (j = 0; j < nsinks; j++) {
+		k = &sinks[j];
+		route[k->stream] = k;
+		want[k->stream] = true;
+		k->w = NULL;
+		k->prev = NULL;
+		k->left = 0;
+		k->sync = -1;
+		k->skip = false;
+		k->done = -1;
+	}
+	sector = -1;
+	for (j = 0; j < nsinks; j++) {
+		k = &sinks[j];
+		if (k->from > 0) {
+			k->w = open_track(&k->out, k->ch, k->offset);
+			if (k->w == NULL) {
+				err = -1;
+				goto out;
+			}
+		}
+		update_next(k);
+		if (k->from > 0 && k->from <= first) {
+			first = k->from;
+			resume = true;
+		} else if (k->next < first) {
+			first = k->next;
+			resume = false;
+		}
+		// Subpicture chapters and pieces end just before the
+		// boundary sector.
+		int e = k->spu || k->out.pieces != NULL ? k->sectors[k->last] - 1 : k->sectors[k->last];
+		if (k->ch < k->last && e > end) {
+			end = e;
+		}
+	}
+	ilvu_reset(&cur, angles);
+	first = resume ? ilvu_resume(&cur, first) : ilvu_start(&cur, first);
+	next = first;
+	stat_set(&stats->first, first);
+	stat_set(&stats->end, end);
+	// Another angle's sectors are found from the NAV packs, which
+	// mustn't be skipped.
+	sparse = map != NULL && angles == NULL && sparse_source(src, map, want);
+	// A scan would read in the sectors the map lets us skip.
+	scan = !sparse && angles == NULL ? open_scan(src, first, end) : NULL;
+
+	for (n = 0, i = 0, sector = first; sector <= end; sector = step, i++) {
+		step = sector + 1;
+		if (sparse) {
+			// Boundary sectors are read whatever they hold.
+			int to = secmap_next(map, sector, want);
+			if (to > next) {
+				to = next;
+			}
+			if (to > end + 1) {
+				to = end + 1;
+			}
+			if (to > sector) {
+				unwanted += to - sector;
+				step = to;
+				n = 0;
+				i = -1;
+				continue;
+			}
+		}
+		if (i == n) {
+			// Demuxing is whatever isn't spent waiting for the
+			// source or writing tracks.
+			t = nanos();
+			writing = 0;
+			for (j = 0; j < nsinks; j++) {
+				writing += sinks[j].ns;
+			}
+			stat_set(&stats->demux_ns, t - start - waiting - writing);
+			stat_set(&stats->sector, sector);
+			if (ckpt != NULL && checkpoint_due(ckpt)) {
+				save_checkpoint(ckpt, sinks, nsinks, &cur, sector);
+			}
+			// Read on up to the next sector to skip. This one
+			// may be a boundary that's read anyway.
+			int last = ilvu_last(&cur, sector, end);
+			if (sparse && secmap_skip(map, sector+1, want) <= last) {
+				last = secmap_skip(map, sector+1, want) - 1;
+			}
+			n = src->read(src, sector, last - sector + 1, &buf);
+			waiting += nanos() - t;
+			if (n < 1) {
+				printf("sector %d: DVDReadBlocks failed\n", sector);
+				// Give up on the current chapters and carry on
+				// at the next boundary of any stream.
+				next = INT_MAX;
+				for (j = 0; j < nsinks; j++) {
+					k = &sinks[j];
+					if (k->spu) {
+						err = spu_boundary(k, sector);
+						if (k->prev != NULL) {
+							close_track(k->prev, false);
+							k->prev = NULL;
+						}
+						k->left = 0;
+					} else {
+						err = audio_boundary(k, sector, NULL, NULL);
+					}
+					k->skip = k->w != NULL;
+					if (err < 0) {
+						goto out;
+					}
+					if (k->next < next) {
+						next = k->next;
+					}
+				}
+				if (next == INT_MAX) {
+					break;
+				}
+				step = ilvu_start(&cur, next);
+				if (step <= sector) {
+					step = next;
+				}
+				n = 0;
+				i = -1;
+				continue;
+			}
+			i = 0;
+		}
+		b = buf + i*SECTOR_SIZE;
+
+		step = ilvu_step(&cur, sector, b);
+		if (step != sector + 1) {
+			// The rest of the batch belongs to another angle.
+			if (step > sector) {
+				skipped += step - sector - 1;
+			}
+			n = 0;
+			i = -1;
+		}
+
+		ip = NULL;
+		if (scan != NULL) {
+			// The sector itself is only touched if it's wanted
+			// or it's a boundary.
+			const struct scanned* x = scan_get(scan, sector);
+			id = x->pack;
+			if (x->ok) {
+				info = x->info;
+				ip = &info;
+			}
+		} else {
+			id = pack_stream_id(b, false);
+			if (id == 0xbd && (src->aob ? get_aob_stream_info(b, &info) : get_stream_info(b, &info)) >= 0) {
+				ip = &info;
+			}
+		}
+		if (id == 0xbd && ip == NULL) {
+			printf("sector %d: get_stream_info failed\n", sector);
+		}
+		// A private stream pack that couldn't be made out is left
+		// unknown, to be looked at again.
+		if (map != NULL && (id != 0xbd || ip != NULL) && secmap_note(map, sector, ip != NULL ? info.stream : id < 0 ? 0 : id) < 0) {
+			die("Out of memory");
+		}
+
+		if (sector >= next) {
+			next = INT_MAX;
+			for (j = 0; j < nsinks; j++) {
+				k = &sinks[j];
+				if (sector >= k->next) {
+					err = k->spu ? spu_boundary(k, sector) : audio_boundary(k, sector, b, ip);
+					if (err < 0) {
+						goto out;
+					}
+				}
+				if (k->next < next) {
+					next = k->next;
+				}
+			}
+		}
+
+		if (ip == NULL || (k = route[info.stream]) == NULL) {
+			continue;
+		}
+		if (k->spu) {
+			if (sector >= k->from) {
+				spu_packet(k, b, ip, sector);
+			}
+		} else if (k->w != NULL && !k->skip && k->done != sector && sector >= k->from) {
+			if (k->out.pieces != NULL) {
+				k->skip = piece_packet(k, b, ip, sector) < 0;
+			} else if (dump_packet(k, b, ip, sector, PACKET_MIDDLE) < 0) {
+				k->skip = true;
+			}
+		}
+	}
+
+out:
+	if (scan != NULL) {
+		close_scan(scan);
+	}
+	for (j = 0; j < nsinks; j++) {
+		close_sink(&sinks[j], err == 0);
+	}
+	writing = 0;
+	for (j = 0; j < nsinks; j++) {
+		writing += sinks[j].ns;
+	}
+	stat_set(&stats->demux_ns, nanos() - start - waiting - writing);
+	stat_set(&stats->sector, sector);
+	if (angles != NULL) {
+		fprintf(stderr, "angles: skipped %d sectors of other angles\n", skipped);
+	}
+	if (sparse) {
+		src->secmap = NULL;
+		fprintf(stderr, "map: skipped %d sectors of other streams\n", unwanted);
+	}
+	return err;
+}
+
+// A title set's sector map, kept in the directory given with -M.
+struct tsmap {
+	struct secmap* map;
+	char filename[PATH_MAX];
+	char key[64];
+};
+
+// Load the sector map of title set ts from dir, or start one. It's keyed by
+// the size of the title set's VOBs, so that one left by another disc isn't
+// used. The map is NULL if dir is.
+static void open_tsmap(struct tsmap* m, const char* dir, int ts, dvd_file_t* vob)
+{
+	m->map = NULL;
+	if (dir == NULL) {
+		return;
+	}
+	snprintf(m->filename, sizeof m->filename, "%s/VTS_%02d.map", dir, ts);
+	snprintf(m->key, sizeof m->key, "vts %d sectors %lld", ts, (long long)DVDFileSize(vob));
+	m->map = secmap_load(m->filename, m->key);
+	if (m->map == NULL) {
+		die("Out of memory");
+	}
+}
+
+// Save the map with what was read this time, and free it.
+static int close_tsmap(struct tsmap* m)
+{
+	int err = 0;
+	if (m->map != NULL) {
+		err = secmap_save(m->map, m->filename, m->key);
+		secmap_free(m->map);
+	}
+	return err;
+}
+
+// Write the counters as JSON to filename, or stdout if it's "-".
+int write_summary(const char* filename, struct sink* sinks, int nsinks)
+{
+	FILE* fp = strcmp(filename, "-") == 0 ? stdout : fopen(filename, "w");
+	double t = now() - start_time;
+	int64_t sectors = stat_get(&stats->sectors);
+	double mb = (double)sectors * SECTOR_SIZE / 1e6;
+	int i;
+
+	if (fp == NULL) {
+		perror("fopen");
+		return -1;
+	}
+	fprintf(fp, "{\n");
+	fprintf(fp, "\t\"seconds\": %.3f,\n", t);
+	fprintf(fp, "\t\"sectors\": %"PRId64",\n", sectors);
+	fprintf(fp, "\t\"reads\": %"PRId64",\n", stat_get(&stats->reads));
+	fprintf(fp, "\t\"sectors_per_second\": %.1f,\n", t > 0 ? (double)sectors / t : 0);
+	fprintf(fp, "\t\"mb_per_second\": %.3f,\n", t > 0 ? mb / t : 0);
+	fprintf(fp, "\t\"read_latency_us\": {\"under\": [");
+	for (i = 0; i < latency_buckets-1; i++) {
+		fprintf(fp, "%s%d", i > 0 ? ", " : "", 64 << i);
+	}
+	fprintf(fp, "], \"counts\": [");
+	for (i = 0; i < latency_buckets; i++) {
+		fprintf(fp, "%s%"PRId64, i > 0 ? ", " : "", stat_get(&stats->latency[i]));
+	}
+	fprintf(fp, "]},\n");
+	fprintf(fp, "\t\"time\": {\"read\": %.3f, \"demux\": %.3f, \"repack\": %.3f, \"loudness\": %.3f, \"hash\": %.3f, \"write\": %.3f},\n",
+		(double)stat_get(&stats->read_ns) / 1e9, (double)stat_get(&stats->demux_ns) / 1e9,
+		(double)stat_get(&stats->repack_ns) / 1e9, (double)stat_get(&stats->loudness_ns) / 1e9,
+		(double)stat_get(&stats->hash_ns) / 1e9, (double)stat_get(&stats->write_ns) / 1e9);
+	fprintf(fp, "\t\"demuxed\": %"PRId64",\n", stat_get(&stats->demuxed));
+	fprintf(fp, "\t\"streams\": [");
+	for (i = 0; i < nsinks; i++) {
+		fprintf(fp, "%s\n\t\t{\"stream\": \"%#x\", \"name\": \"%s\", \"bytes\": %"PRId64", \"write_seconds\": %.3f}",
+			i > 0 ? "," : "", sinks[i].stream, sinks[i].tag + 1, sinks[i].bytes, (double)sinks[i].ns / 1e9);
+	}
+	fprintf(fp, "\n\t]\n}\n");
+	if (fp != stdout && fclose(fp) != 0) {
+		perror("fclose");
+		return -1;
+	}
+	return 0;
+}
+
+char *itoa(int n) {
+	char *a = malloc(11);
+	int err = snprintf(a, 11, "%d", n);
+	if (err < 0) {
+		perror("snprintf");
+		free(a);
+		return NULL;
+	} else if (err >= 11) {
+		free(a);
+		return NULL;
+	}
+	return a;
+}
+
+static int file_write(struct writer* w, const u8* buf, int size);
+static int file_close(struct writer* w);
+static int64_t file_sync(struct writer* w);
+static int64_t inner_sync(struct writer* w);
+static int flac_close(struct writer* w);
+static int ring_write(struct writer* w, const u8* buf, int size);
+static int ring_close(struct writer* w);
+static int repack_write(struct writer* w, const u8* buf, int size);
+static int repack_close(struct writer* w);
+static int encoder_write(struct writer* w, const u8* buf, int size);
+static int encoder_close(struct writer* w);
+
+// Open a writer for a stream. Closing the writer closes fp.
+static struct writer* open_stream(FILE* fp)
+{
+	struct writer* w = malloc(sizeof *w);
+	if (w == NULL) {
+		return NULL;
+	}
+	w->fp = fp;
+	w->write = file_write;
+	w->close = file_close;
+	w->sync = file_sync;
+	return w;
+}
+
+// Open a track's file: a new one, or if offset isn't 0 one being carried
+// on, cut back to offset bytes and ready to write after them.
+static int open_output(const char* filename, int64_t offset)
+{
+	int fd = open(filename, offset > 0 ? O_WRONLY : O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		perror("open");
+		return -1;
+	}
+	if (offset > 0 && (ftruncate(fd, offset) < 0 || lseek(fd, offset, SEEK_SET) < 0)) {
+		perror(filename);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static struct writer* open_file(const char* filename, int64_t offset)
+{
+	struct writer* w;
+	FILE* fp;
+	int fd = open_output(filename, offset);
+	if (fd < 0) {
+		return NULL;
+	}
+	fp = fdopen(fd, "wb");
+	if (fp == NULL) {
+		perror("fdopen");
+		close(fd);
+		return NULL;
+	}
+	w = open_stream(fp);
+	if (w == NULL) {
+		fclose(fp);
+	}
+	return w;
+}
+
+static int file_write(struct writer* w, const u8* buf, int size)
+{
+	if (size < 0) {
+		return -1;
+	}
+	int64_t t = nanos();
+	if (fwrite(buf, 1, (size_t)size, w->fp) != (size_t)size) {
+		perror("fwrite");
+		return -1;
+	}
+	stat_add(&stats->write_ns, nanos() - t);
+	return 0;
+}
+
+static int file_close(struct writer* w)
+{
+	int err = fclose(w->fp);
+	free(w);
+	return err;
+}
+
+static int64_t file_sync(struct writer* w)
+{
+	if (fflush(w->fp) != 0) {
+		perror("fflush");
+		return -1;
+	}
+	return ftello(w->fp);
+}
+
+// Sync for writers which only pass data on.
+static int64_t inner_sync(struct writer* w)
+{
+	struct writer* inner = w->writer;
+	return inner->sync != NULL ? inner->sync(inner) : -1;
+}
+
+static int async_write(struct writer* w, const u8* buf, int size);
+static int async_close(struct writer* w);
+static int64_t async_sync(struct writer* w);
+
+// Open a writer which collects output for fd in the output thread's
+// buffers. Nothing is written from the calling thread. The fd is closed by
+// the output thread. Write errors are reported by iothread_close.
+static struct writer* open_async(struct iothread* io, int fd)
+{
+	struct writer* w = malloc(sizeof *w);
+	if (w == NULL) {
+		close(fd);
+		return NULL;
+	}
+	w->iofile = iofile_open(io, fd);
+	if (w->iofile == NULL) {
+		free(w);
+		return NULL;
+	}
+	w->write = async_write;
+	w->close = async_close;
+	w->sync = async_sync;
+	return w;
+}
+
+static int async_write(struct writer* w, const u8* buf, int size)
+{
+	if (size < 0) {
+		return -1;
+	}
+	iofile_write(w->iofile, buf, (size_t)size);
+	return 0;
+}
+
+static int64_t async_sync(struct writer* w)
+{
+	return iofile_sync(w->iofile);
+}
+
+static int async_close(struct writer* w)
+{
+	iofile_close(w->iofile);
+	free(w);
+	return 0;
+}
+
+static int wav_write(struct writer* w, const u8* buf, int size);
+static int wav_close(struct writer* w);
+
+// Header sizes. WAV headers leave room for the ds64 chunk that turns them
+// into RF64 if the data doesn't fit in 4GB.
+enum { wav_header_size = 12 + 36 + 48 + 8, w64_header_size = 40 + 64 + 24 };
+
+static void le16(u8* p, uint v)
+{
+	p[0] = (u8)v;
+	p[1] = (u8)(v >> 8);
+}
+
+static void le32(u8* p, uint32_t v)
+{
+	le16(p, v & 0xffff);
+	le16(p+2, v >> 16);
+}
+
+static void le64(u8* p, uint64_t v)
+{
+	le32(p, (uint32_t)v);
+	le32(p+4, (uint32_t)(v >> 32));
+}
+
+// Fill in a WAVEFORMATEXTENSIBLE.
+static void wave_format(u8* p, struct writer* w)
+{
+	static const u8 pcm[16] = {1, 0, 0, 0, 0, 0, 0x10, 0, 0x80, 0, 0, 0xaa, 0, 0x38, 0x9b, 0x71};
+	uint bytes = w->depth == 16 ? 2 : 3;
+	uint align = bytes * (uint)w->channels;
+
+	le16(p, 0xfffe);
+	le16(p+2, (uint)w->channels);
+	le32(p+4, (uint32_t)w->sample_rate);
+	le32(p+8, (uint32_t)w->sample_rate * align);
+	le16(p+12, align);
+	le16(p+14, bytes * 8);
+	le16(p+16, 22);
+	le16(p+18, (uint)w->depth);
+	// DVD LPCM doesn't say which speakers it's for beyond stereo.
+	le32(p+20, w->channels == 1 ? 0x4 : w->channels == 2 ? 0x3 : 0);
+	memcpy(p+24, pcm, sizeof pcm);
+}
+
+// Build the header for length bytes of data. Returns its size.
+static int wav_header(u8* h, struct writer* w, uint64_t length)
+{
+	static const u8 guid_tail[12] = {0xf3, 0xac, 0xd3, 0x11, 0x8c, 0xd1, 0x00, 0xc0, 0x4f, 0x8e, 0xdb, 0x8a};
+	static const u8 riff_tail[12] = {0x2e, 0x91, 0xcf, 0x11, 0xa5, 0xd6, 0x28, 0xdb, 0x04, 0xc1, 0x00, 0x00};
+	uint64_t riff;
+
+	if (w->w64) {
+		// Sony Wave64: chunks are named by GUIDs and sized in 64 bits,
+		// counting their own headers.
+		memcpy(h, "riff", 4);
+		memcpy(h+4, riff_tail, 12);
+		le64(h+16, w64_header_size + length);
+		memcpy(h+24, "wave", 4);
+		memcpy(h+28, guid_tail, 12);
+		memcpy(h+40, "fmt ", 4);
+		memcpy(h+44, guid_tail, 12);
+		le64(h+56, 64);
+		wave_format(h+64, w);
+		memcpy(h+104, "data", 4);
+		memcpy(h+108, guid_tail, 12);
+		le64(h+120, 24 + length);
+		return w64_header_size;
+	}
+
+	riff = wav_header_size - 8 + length;
+	memset(h, 0, wav_header_size);
+	if (riff > 0xffffffff) {
+		memcpy(h, "RF64", 4);
+		le32(h+4, 0xffffffff);
+		memcpy(h+12, "ds64", 4);
+		le64(h+20, riff);
+		le64(h+28, length);
+		le64(h+36, length / (uint64_t)(w->channels * (w->depth == 16 ? 2 : 3)));
+	} else {
+		memcpy(h, "RIFF", 4);
+		le32(h+4, (uint32_t)riff);
+		memcpy(h+12, "JUNK", 4);
+	}
+	memcpy(h+8, "WAVE", 4);
+	le32(h+16, 28);
+	memcpy(h+48, "fmt ", 4);
+	le32(h+52, 40);
+	wave_format(h+56, w);
+	memcpy(h+96, "data", 4);
+	le32(h+100, riff > 0xffffffff ? 0xffffffff : (uint32_t)length);
+	return wav_header_size;
+}
+
+// Open a writer for little-endian PCM in a WAV (or RF64) or Wave64 file.
+// The file is preallocated for the expected number of seconds of audio
+// and the data is written straight to its place after the header. The
+// header is written once, on close, when the length is known, and the
+// file is cut down to size. If offset isn't 0, the file's data is carried
+// on from there.
+struct writer* open_wav(const char* filename, struct lpcm_info info, bool w64, double seconds, struct iothread* io, int64_t offset)
+{
+	struct writer* w = malloc(sizeof *w);
+	off_t header = w64 ? w64_header_size : wav_header_size;
+	off_t expect;
+	FILE* fp;
+	int fd, err;
+
+	if (w == NULL) {
+		return NULL;
+	}
+	if (offset > 0 && offset < header) {
+		fprintf(stderr, "%s: too short to carry on\n", filename);
+		free(w);
+		return NULL;
+	}
+	fd = open_output(filename, offset);
+	if (fd < 0) {
+		free(w);
+		return NULL;
+	}
+	expect = (off_t)(seconds * info.sample_rate) * info.channels * (info.bitdepth == 16 ? 2 : 3);
+	if (expect > 0 && offset == 0) {
+		// Not every filesystem can do this, and it's only a hint.
+		err = posix_fallocate(fd, 0, header + expect);
+		if (err != 0 && err != EOPNOTSUPP && err != EINVAL) {
+			fprintf(stderr, "posix_fallocate: %s\n", strerror(err));
+		}
+	}
+	w->fd = dup(fd);
+	if (w->fd < 0 || (offset == 0 && lseek(fd, header, SEEK_SET) < 0)) {
+		perror("open_wav");
+		goto error;
+	}
+	// The data writer takes over fd.
+	if (io != NULL) {
+		w->writer = open_async(io, fd);
+		fd = -1;
+	} else if ((fp = fdopen(fd, "wb")) != NULL) {
+		w->writer = open_stream(fp);
+		if (w->writer == NULL) {
+			fclose(fp);
+		}
+		fd = -1;
+	} else {
+		w->writer = NULL;
+	}
+	if (w->writer == NULL) {
+		goto error;
+	}
+	w->w64 = w64;
+	w->length = offset > 0 ? offset - header : 0;
+	w->depth = info.bitdepth;
+	w->channels = info.channels;
+	w->sample_rate = info.sample_rate;
+	w->write = wav_write;
+	w->close = wav_close;
+	w->sync = inner_sync;
+	return w;
+
+error:
+	if (fd >= 0) {
+		close(fd);
+	}
+	if (w->fd >= 0) {
+		close(w->fd);
+	}
+	free(w);
+	return NULL;
+}
+
+static int wav_write(struct writer* w, const u8* buf, int size)
+{
+	w->length += size;
+	return w->writer->write(w->writer, buf, size);
+}
+
+static int wav_close(struct writer* w)
+{
+	u8 h[wav_header_size > w64_header_size ? wav_header_size : w64_header_size];
+	int n, err;
+
+	err = w->writer->close(w->writer);
+	n = wav_header(h, w, (uint64_t)w->length);
+	if (pwrite(w->fd, h, (size_t)n, 0) != n) {
+		perror("pwrite");
+		err = -1;
+	}
+	// Drop whatever was preallocated past the end.
+	if (ftruncate(w->fd, n + w->length) < 0) {
+		perror("ftruncate");
+		err = -1;
+	}
+	if (close(w->fd) < 0) {
+		perror("close");
+		err = -1;
+	}
+	free(w);
+	return err;
+}
+
+// Open a writer which pipes little-endian PCM to the flac command. If ring
+// is true, the PCM goes through a ring in shared memory instead, which a
+// process of our own passes on to flac's stdin, so that writing it only
+// takes a system call now and then.
+struct writer* open_flac(const char *filename, struct lpcm_info info, bool ring)
+{
+	char *bps = NULL, *samplerate = NULL, *chans = NULL;
+	int pid, err;
+	int fd[2];
+	FILE *fp = NULL;
+	struct writer* w = NULL;
+
+	if (filename == NULL) {
+		return NULL;
+	}
+
+	w = malloc(sizeof *w);
+	if (w == NULL) {
+		return NULL;
+	}
+	w->shring = NULL;
+
+	// It might seem like it would be better to allocate these in the
+	// child, but we'd be in big trouble if they failed.
+	bps = itoa(info.bitdepth);
+	samplerate = itoa(info.sample_rate);
+	chans = itoa(info.channels);
+	if (bps == NULL || samplerate == NULL || chans == NULL) {
+		goto cleanup;
+	}
+	char* argv[] = {
+		"flac",
+		"--silent",
+		"-o", (char*)filename,
+		"--force-raw-format",
+		"--sign=signed",
+		"--endian=little",
+		"--bps", bps,
+		"--sample-rate", samplerate,
+		"--channels", chans,
+		"-",
+		NULL,
+	};
+
+	if (ring) {
+		w->shring = shring_open(flac_ring_size);
+		if (w->shring == NULL) {
+			goto cleanup;
+		}
+		if (shring_spawn(w->shring, argv) < 0) {
+			shring_close(w->shring);
+			goto cleanup;
+		}
+		w->write = ring_write;
+		w->close = ring_close;
+		w->sync = NULL;
+		goto done;
+	}
+
+	err = pipe(fd);
+	if (err < 0) {
+		perror("pipe");
+		goto cleanup;
+	}
+
+	fp = fdopen(fd[1], "w");
+	if (fp == NULL) {
+		goto cleanup;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		goto cleanup;
+	} else if (pid == 0) {
+		sigset_t usr1;
+		sigemptyset(&usr1);
+		sigaddset(&usr1, SIGUSR1);
+		pthread_sigmask(SIG_UNBLOCK, &usr1, NULL);
+		close(fd[1]);
+		dup2(fd[0], 0);
+		execvp("flac", argv);
+		// If we get here, execvp failed
+		perror("execvp");
+		_exit(1);
+	}
+
+	close(fd[0]);
+
+	w->fp = fp;
+	w->pid = pid;
+	w->write = file_write;
+	w->close = flac_close;
+	w->sync = NULL;
+
+done:
+	free(bps);
+	free(samplerate);
+	free(chans);
+	return w;
+
+cleanup:
+	free(w);
+	free(bps);
+	free(samplerate);
+	free(chans);
+	return NULL;
+}
+
+static int flac_close(struct writer* w)
+{
+	int err = fclose(w->fp);
+	waitpid(w->pid, NULL, 0);
+	free(w);
+	return err;
+}
+
+static int ring_write(struct writer* w, const u8* buf, int size)
+{
+	if (size < 0) {
+		return -1;
+	}
+	int64_t t = nanos();
+	if (shring_write(w->shring, buf, (size_t)size) < 0) {
+		fprintf(stderr, "flac: quit early\n");
+		return -1;
+	}
+	stat_add(&stats->write_ns, nanos() - t);
+	return 0;
+}
+
+static int ring_close(struct writer* w)
+{
+	int err = shring_close(w->shring);
+	free(w);
+	return err;
+}
+
+enum { encoder_bufsize = 4096 };
+
+// Open a writer which encodes the little-endian PCM written by the repack
+// writer to a FLAC file, using threads worker threads.
+struct writer* open_encoder(const char *filename, struct lpcm_info info, int threads)
+{
+	struct writer* w = malloc(sizeof *w);
+	if (w == NULL) {
+		return NULL;
+	}
+	w->samples = malloc(encoder_bufsize * sizeof *w->samples);
+	if (w->samples == NULL) {
+		free(w);
+		return NULL;
+	}
+	w->fp = fopen(filename, "wb");
+	if (w->fp == NULL) {
+		perror("fopen");
+		free(w->samples);
+		free(w);
+		return NULL;
+	}
+	w->flacenc = flacenc_open(w->fp, info.sample_rate, info.channels, info.bitdepth, threads);
+	if (w->flacenc == NULL) {
+		fclose(w->fp);
+		free(w->samples);
+		free(w);
+		return NULL;
+	}
+	w->depth = info.bitdepth;
+	w->channels = info.channels;
+	w->write = encoder_write;
+	w->close = encoder_close;
+	w->sync = NULL;
+	return w;
+}
+
+static int encoder_write(struct writer* w, const u8* buf, int size)
+{
+	int bytes = w->depth == 16 ? 2 : 3;
+	int framesize = bytes * w->channels;
+	int n, i;
+
+	// Repack always writes whole sample frames.
+	n = size / framesize;
+	while (n > 0) {
+		int m = encoder_bufsize / w->channels;
+		if (m > n) {
+			m = n;
+		}
+		for (i = 0; i < m * w->channels; i++, buf += bytes) {
+			if (w->depth == 16) {
+				w->samples[i] = (int16_t)(buf[0] | buf[1] << 8);
+			} else {
+				// Sign extend, and drop the padding of 20-bit samples
+				int32_t v = (int32_t)((uint32_t)(buf[0] | buf[1] << 8 | buf[2] << 16) << 8) >> 8;
+				w->samples[i] = v >> (24 - w->depth);
+			}
+		}
+		if (flacenc_write(w->flacenc, w->samples, m) < 0) {
+			return -1;
+		}
+		n -= m;
+	}
+	return 0;
+}
+
+static int encoder_close(struct writer* w)
+{
+	int err = flacenc_close(w->flacenc);
+	if (fclose(w->fp) != 0) {
+		perror("fclose");
+		err = -1;
+	}
+	free(w->samples);
+	free(w);
+	return err;
+}
+
+enum { repack_bufsize = 8192 };
+
+static int repack_write(struct writer* w, const u8* buf, int size)
+{
+	// Two samples per channel
+	int block = w->channels * (w->depth == 16 ? 4 : w->depth == 20 ? 5 : 6);
+	int wn, rn, err;
+	int64_t t;
+
+	// DVD-Video packets hold whole blocks, but DVD-Audio ones needn't.
+	// Finish one split between packets first.
+	if (w->npartial > 0) {
+		int n = block - w->npartial < size ? block - w->npartial : size;
+		memcpy(w->partial + w->npartial, buf, (size_t)n);
+		w->npartial += n;
+		buf += n;
+		size -= n;
+		if (w->npartial < block) {
+			return 0;
+		}
+		w->npartial = 0;
+		err = repack_write(w, w->partial, block);
+		if (err < 0) {
+			return err;
+		}
+	}
+	while (size >= block) {
+		t = nanos();
+		repack(w->repacker, w->buf, buf, repack_bufsize, size, &wn, &rn);
+		stat_add(&stats->repack_ns, nanos() - t);
+		if (wn > 0) {
+			err = w->writer->write(w->writer, w->buf, wn);
+			if (err < 0) {
+				return err;
+			}
+		}
+		if (rn > size) {
+			if (debug) {
+				abort(); // uh-oh
+			}
+			rn = size;
+		}
+		buf += rn;
+		size -= rn;
+	}
+	memcpy(w->partial, buf, (size_t)size);
+	w->npartial = size;
+	return 0;
+}
+
+static int repack_close(struct writer* w)
+{
+	w->writer->complete = w->complete;
+	int err = w->writer->close(w->writer);
+	repack_free(w->repacker);
+	free(w->buf);
+	free(w);
+	return err;
+}
+
+struct writer* open_repack(struct writer* writer, struct lpcm_info info)
+{
+	struct writer* w;
+	u8 *buf;
+
+	w = malloc(sizeof *w);
+	if (w == NULL) {
+		return NULL;
+	}
+
+	buf = malloc((size_t)repack_bufsize);
+	if (buf == NULL) {
+		perror("malloc");
+		free(w);
+		return NULL;
+	}
+	w->repacker = repack_open(info.bitdepth, info.channels, repack_best());
+	if (w->repacker == NULL) {
+		free(buf);
+		free(w);
+		return NULL;
+	}
+
+	w->write = repack_write;
+	w->close = repack_close;
+	w->sync = inner_sync;
+	w->writer = writer;
+	w->buf = buf;
+	w->depth = info.bitdepth;
+	w->channels = info.channels;
+	w->npartial = 0;
+	return w;
+}
+
+// The loudness of each track of a stream, which go together as an album
+// for ReplayGain. Tracks are added as they're closed, on whichever thread
+// that is.
+struct gain {
+	pthread_mutex_t lock;
+	struct loudness** tracks;
+	char** names;
+	int n;
+};
+
+struct gain* open_gain(void)
+{
+	struct gain* g = calloc(1, sizeof *g);
+	if (g == NULL) {
+		return NULL;
+	}
+	pthread_mutex_init(&g->lock, NULL);
+	return g;
+}
+
+static int measure_write(struct writer* w, const u8* buf, int size)
+{
+	int bytes = w->depth == 16 ? 2 : 3;
+	int n = size / (bytes * w->channels), i;
+	const u8* p = buf;
+	int64_t t = nanos();
+
+	// 20-bit samples are padded to 24, so they're measured as 24-bit.
+	while (n > 0) {
+		int m = encoder_bufsize / w->channels;
+		if (m > n) {
+			m = n;
+		}
+		for (i = 0; i < m * w->channels; i++, p += bytes) {
+			if (bytes == 2) {
+				w->samples[i] = (int16_t)(p[0] | p[1] << 8);
+			} else {
+				w->samples[i] = (int32_t)((uint32_t)(p[0] | p[1] << 8 | p[2] << 16) << 8) >> 8;
+			}
+		}
+		loudness_add(w->loudness, w->samples, m);
+		n -= m;
+	}
+	stat_add(&stats->loudness_ns, nanos() - t);
+	return w->writer->write(w->writer, buf, size);
+}
+
+static int measure_close(struct writer* w)
+{
+	struct gain* g = w->gain;
+	w->writer->complete = w->complete;
+	int err = w->writer->close(w->writer);
+
+	pthread_mutex_lock(&g->lock);
+	struct loudness** tracks = realloc(g->tracks, (size_t)(g->n+1) * sizeof *tracks);
+	char** names = realloc(g->names, (size_t)(g->n+1) * sizeof *names);
+	if (tracks != NULL) {
+		g->tracks = tracks;
+	}
+	if (names != NULL) {
+		g->names = names;
+	}
+	if (tracks != NULL && names != NULL) {
+		g->tracks[g->n] = w->loudness;
+		g->names[g->n] = w->name;
+		g->n++;
+	} else {
+		loudness_free(w->loudness);
+		free(w->name);
+	}
+	pthread_mutex_unlock(&g->lock);
+	free(w->samples);
+	free(w);
+	return err;
+}
+
+// Open a writer which measures the loudness of the little-endian PCM
+// written by the repack writer before passing it on to writer, and adds
+// the track to g when it's closed.
+static struct writer* open_measure(struct writer* writer, struct gain* g, const char* name, struct lpcm_info info)
+{
+	struct writer* w = malloc(sizeof *w);
+	if (w == NULL) {
+		return NULL;
+	}
+	w->depth = info.bitdepth == 16 ? 16 : 24;
+	w->channels = info.channels;
+	w->loudness = loudness_open(info.sample_rate, info.channels, w->depth, loudness_best());
+	w->samples = malloc(encoder_bufsize * sizeof *w->samples);
+	w->name = strdup(name);
+	if (w->loudness == NULL || w->samples == NULL || w->name == NULL) {
+		loudness_free(w->loudness);
+		free(w->samples);
+		free(w->name);
+		free(w);
+		return NULL;
+	}
+	w->writer = writer;
+	w->gain = g;
+	w->write = measure_write;
+	w->close = measure_close;
+	w->sync = inner_sync;
+	return w;
+}
+
+static int compare_names(const void* a, const void* b)
+{
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// ReplayGain 2.0 aims for -18 LUFS.
+static double replay_gain(double lufs)
+{
+	return -18.0 - lufs;
+}
+
+// Print the loudness of each track of an album and write its ReplayGain
+// tags next to it, as name.tags, in the form metaflac --import-tags-from
+// reads. Frees g.
+int close_gain(struct gain* g)
+{
+	double album = loudness_album(g->tracks, g->n);
+	double album_peak = 0;
+	int err = 0, i, j;
+
+	// Tracks are added as they finish, so put them back in order.
+	for (i = 1; i < g->n; i++) {
+		for (j = i; j > 0 && compare_names(&g->names[j-1], &g->names[j]) > 0; j--) {
+			struct loudness* l = g->tracks[j];
+			char* name = g->names[j];
+			g->tracks[j] = g->tracks[j-1];
+			g->names[j] = g->names[j-1];
+			g->tracks[j-1] = l;
+			g->names[j-1] = name;
+		}
+	}
+	for (i = 0; i < g->n; i++) {
+		double peak = loudness_true_peak(g->tracks[i]);
+		if (peak > album_peak) {
+			album_peak = peak;
+		}
+	}
+	for (i = 0; i < g->n; i++) {
+		double lufs = loudness_integrated(g->tracks[i]);
+		double peak = loudness_true_peak(g->tracks[i]);
+		char filename[track_name_size + 5];
+		FILE* fp;
+
+		printf("%s: %.1f LUFS, sample peak %.1f dBFS, true peak %.1f dBTP\n", g->names[i], lufs,
+			20 * log10(loudness_sample_peak(g->tracks[i])), 20 * log10(peak));
+		snprintf(filename, sizeof filename, "%s.tags", g->names[i]);
+		fp = fopen(filename, "w");
+		if (fp == NULL) {
+			perror(filename);
+			err = -1;
+			continue;
+		}
+		// Silence has no gain.
+		if (lufs > -HUGE_VAL) {
+			fprintf(fp, "REPLAYGAIN_TRACK_GAIN=%+.2f dB\n", replay_gain(lufs));
+		}
+		fprintf(fp, "REPLAYGAIN_TRACK_PEAK=%.6f\n", peak);
+		if (album > -HUGE_VAL) {
+			fprintf(fp, "REPLAYGAIN_ALBUM_GAIN=%+.2f dB\n", replay_gain(album));
+		}
+		fprintf(fp, "REPLAYGAIN_ALBUM_PEAK=%.6f\n", album_peak);
+		if (fclose(fp) != 0) {
+			perror(filename);
+			err = -1;
+		}
+	}
+	if (g->n > 1) {
+		printf("album: %.1f LUFS, true peak %.1f dBTP\n", album, 20 * log10(album_peak));
+	}
+
+	for (i = 0; i < g->n; i++) {
+		loudness_free(g->tracks[i]);
+		free(g->names[i]);
+	}
+	free(g->tracks);
+	free(g->names);
+	pthread_mutex_destroy(&g->lock);
+	free(g);
+	return err;
+}
+
+// The CRC-32 and MD5 of each track, of the PCM for LPCM tracks and of the
+// stream as it's written for the others, so that two rips can be checked
+// against each other by comparing lists. Tracks are added as they're
+// closed, on whichever thread that is.
+struct sum {
+	char* name;
+	uint32_t crc;
+	u8 md5[16];
+	int64_t length;
+};
+
+struct sums {
+	pthread_mutex_t lock;
+	struct sum* tracks;
+	int n;
+};
+
+struct sums* open_sums(void)
+{
+	struct sums* m = calloc(1, sizeof *m);
+	if (m == NULL) {
+		return NULL;
+	}
+	pthread_mutex_init(&m->lock, NULL);
+	return m;
+}
+
+static int hash_write(struct writer* w, const u8* buf, int size)
+{
+	int64_t t = nanos();
+	hash_update(w->hash, buf, (size_t)size);
+	stat_add(&stats->hash_ns, nanos() - t);
+	return w->writer->write(w->writer, buf, size);
+}
+
+// Only complete tracks are listed.
+static int hash_close(struct writer* w)
+{
+	struct sums* m = w->sums;
+	struct sum x;
+	bool complete = w->complete;
+	int err;
+
+	x.name = w->name;
+	x.length = (int64_t)w->hash->length;
+	hash_final(w->hash, &x.crc, x.md5);
+	w->writer->complete = complete;
+	err = w->writer->close(w->writer);
+
+	pthread_mutex_lock(&m->lock);
+	struct sum* tracks = complete && err == 0 ? realloc(m->tracks, (size_t)(m->n+1) * sizeof *tracks) : NULL;
+	if (tracks != NULL) {
+		m->tracks = tracks;
+		m->tracks[m->n++] = x;
+	} else {
+		free(x.name);
+	}
+	pthread_mutex_unlock(&m->lock);
+	free(w->hash);
+	free(w);
+	return err;
+}
+
+// Open a writer which hashes what's written before passing it on to
+// writer, and adds the track to m when it's closed.
+static struct writer* open_hashed(struct writer* writer, struct sums* m, const char* name)
+{
+	struct writer* w = malloc(sizeof *w);
+	if (w == NULL) {
+		return NULL;
+	}
+	w->hash = malloc(sizeof *w->hash);
+	w->name = strdup(name);
+	if (w->hash == NULL || w->name == NULL) {
+		free(w->hash);
+		free(w->name);
+		free(w);
+		return NULL;
+	}
+	hash_init(w->hash);
+	w->writer = writer;
+	w->sums = m;
+	w->complete = false;
+	w->write = hash_write;
+	w->close = hash_close;
+	w->sync = inner_sync;
+	return w;
+}
+
+static int compare_sums(const void* a, const void* b)
+{
+	return strcmp(((const struct sum*)a)->name, ((const struct sum*)b)->name);
+}
+
+// Write the list of tracks to filename, one per line: CRC-32, MD5, length
+// in bytes and name. Tracks already in the file which weren't written
+// again, as when a rerun carries on from a checkpoint, stay. Frees m.
+int close_sums(struct sums* m, const char* filename)
+{
+	char line[128+track_name_size], name[track_name_size], md5[33], format[64];
+	struct sum x;
+	FILE* fp = fopen(filename, "r");
+	int err = 0, i, j, k, n = m->n;
+
+	// Names too long to be ours don't fit, and the line is skipped.
+	snprintf(format, sizeof format, "%%"SCNx32" %%32[0-9a-f] %%"SCNd64" %%%ds%%n", track_name_size-1);
+	qsort(m->tracks, (size_t)n, sizeof *m->tracks, compare_sums);
+	while (fp != NULL && fgets(line, sizeof line, fp) != NULL) {
+		x.name = name;
+		k = 0;
+		if (sscanf(line, format, &x.crc, md5, &x.length, name, &k) != 4 ||
+		    (line[k] != '\0' && line[k] != '\n') || strlen(md5) != 32 ||
+		    bsearch(&x, m->tracks, (size_t)n, sizeof *m->tracks, compare_sums) != NULL) {
+			continue;
+		}
+		for (j = 0; j < 16; j++) {
+			sscanf(md5 + 2*j, "%2"SCNx8, &x.md5[j]);
+		}
+		struct sum* tracks = realloc(m->tracks, (size_t)(m->n+1) * sizeof *tracks);
+		if (tracks == NULL || (x.name = strdup(name)) == NULL) {
+			die("Out of memory");
+		}
+		m->tracks = tracks;
+		m->tracks[m->n++] = x;
+	}
+	if (fp != NULL) {
+		fclose(fp);
+	}
+
+	fp = fopen(filename, "w");
+	if (fp == NULL) {
+		perror(filename);
+		err = -1;
+	}
+	qsort(m->tracks, (size_t)m->n, sizeof *m->tracks, compare_sums);
+	for (i = 0; i < m->n; i++) {
+		struct sum* y = &m->tracks[i];
+		if (fp != NULL) {
+			fprintf(fp, "%08"PRIx32" ", y->crc);
+			for (j = 0; j < 16; j++) {
+				fprintf(fp, "%02x", y->md5[j]);
+			}
+			fprintf(fp, " %"PRId64" %s\n", y->length, y->name);
+		}
+		free(y->name);
+	}
+	if (fp != NULL && fclose(fp) != 0) {
+		perror(filename);
+		err = -1;
+	}
+	free(m->tracks);
+	pthread_mutex_destroy(&m->lock);
+	free(m);
+	return err;
+}
+
+// Encoding slots shared by every job of a batch, or NULL. Workers hold one
+// while they encode a chunk, so the jobs together use each core once.
+static sem_t* encode_slots;
+
+// A track queued for an encoder worker, and then its writer.
+struct deferred {
+	struct output out;
+	int chapter;
+	struct writer* w;
+};
+
+static void* deferred_open(void* arg)
+{
+	struct deferred* d = arg;
+	d->w = open_track(&d->out, d->chapter, 0);
+	if (d->w == NULL) {
+		free(d);
+		return NULL;
+	}
+	return d;
+}
+
+static int deferred_encode(void* arg, const u8* buf, int size)
+{
+	struct deferred* d = arg;
+	if (d->w->write(d->w, buf, size) < 0) {
+		printf("track %d: write failed\n", d->chapter+1);
+		return -1;
+	}
+	return 0;
+}
+
+static int deferred_finish(void* arg, bool complete)
+{
+	struct deferred* d = arg;
+	int err;
+	d->w->complete = complete;
+	err = d->w->close(d->w);
+	free(d);
+	return err;
+}
+
+static const struct sched_ops encoder_ops = {deferred_open, deferred_encode, deferred_finish};
+
+// Start the encoder workers: workers of them, or one for each of streams
+// FLAC tracks written at once if that's more.
+static struct sched* open_encoders(int workers, int streams, int budget)
+{
+	return sched_open(&encoder_ops, workers, streams, (size_t)budget << 20, encode_slots);
+}
+
+static int deferred_write(struct writer* w, const u8* buf, int size);
+static int deferred_close(struct writer* w);
+
+// Open a writer which queues a track for the next free encoder worker.
+// Writes are copied into chunks, so closing the track never waits for the
+// encoder. Errors are reported by sched_close.
+static struct writer* open_deferred(struct output* out, int chapter)
+{
+	struct writer* w = malloc(sizeof *w);
+	struct deferred* d = malloc(sizeof *d);
+
+	if (w == NULL || d == NULL) {
+		free(w);
+		free(d);
+		return NULL;
+	}
+	d->out = *out;
+	d->out.sched = NULL;
+	d->chapter = chapter;
+	w->track = sched_add(out->sched, d);
+	if (w->track == NULL) {
+		free(w);
+		free(d);
+		return NULL;
+	}
+	w->write = deferred_write;
+	w->close = deferred_close;
+	w->sync = NULL;
+	return w;
+}
+
+static int deferred_write(struct writer* w, const u8* buf, int size)
+{
+	return sched_write(w->track, buf, size);
+}
+
+static int deferred_close(struct writer* w)
+{
+	sched_end(w->track, w->complete);
+	free(w);
+	return 0;
+}
+
+static int null_write(struct writer* w, const u8* buf, int size)
+{
+	(void)w;
+	(void)buf;
+	(void)size;
+	return 0;
+}
+
+static int null_close(struct writer* w)
+{
+	free(w);
+	return 0;
+}
+
+// Open a writer which throws everything away, for tracks which are
+// already done.
+static struct writer* open_null(void)
+{
+	struct writer* w = malloc(sizeof *w);
+	if (w == NULL) {
+		return NULL;
+	}
+	w->write = null_write;
+	w->close = null_close;
+	w->sync = NULL;
+	return w;
+}
+
+static int trim_write(struct writer* w, const u8* buf, int size)
+{
+	int n = w->head < size ? (int)w->head : size;
+
+	w->head -= n;
+	buf += n;
+	size -= n;
+	if (size > w->length) {
+		size = (int)w->length;
+	}
+	w->length -= size;
+	if (size == 0) {
+		return 0;
+	}
+	return w->writer->write(w->writer, buf, size);
+}
+
+static int trim_close(struct writer* w)
+{
+	w->writer->complete = w->complete;
+	int err = w->writer->close(w->writer);
+	free(w);
+	return err;
+}
+
+// Open a writer which drops the first head bytes and passes length bytes
+// after them on to writer. A trimmed track can't be carried on.
+static struct writer* open_trim(struct writer* writer, int64_t head, int64_t length)
+{
+	struct writer* w = malloc(sizeof *w);
+	if (w == NULL) {
+		return NULL;
+	}
+	w->writer = writer;
+	w->head = head;
+	w->length = length;
+	w->complete = false;
+	w->write = trim_write;
+	w->close = trim_close;
+	w->sync = NULL;
+	return w;
+}
+
+static int piece_write(struct writer* w, const u8* buf, int size)
+{
+	struct piece* p = w->piece;
+
+	// Pieces are written one after another, so a piece starts at the
+	// end of the spool. A subpicture piece can be opened before the one
+	// before it is done, but not written to.
+	if (p->offset < 0) {
+		if (fseeko(w->fp, 0, SEEK_END) < 0) {
+			perror("fseeko");
+			return -1;
+		}
+		p->offset = ftello(w->fp);
+	}
+	if (fwrite(buf, 1, (size_t)size, w->fp) != (size_t)size) {
+		perror("fwrite");
+		return -1;
+	}
+	p->length += size;
+	return 0;
+}
+
+static int piece_close(struct writer* w)
+{
+	w->piece->complete = w->complete;
+	free(w);
+	return 0;
+}
+
+// Open a writer which appends to the spool file as piece p.
+static struct writer* open_piece(FILE* spool, struct piece* p)
+{
+	struct writer* w = malloc(sizeof *w);
+	if (w == NULL) {
+		return NULL;
+	}
+	w->fp = spool;
+	w->piece = p;
+	w->complete = false;
+	w->write = piece_write;
+	w->close = piece_close;
+	w->sync = NULL;
+	return w;
+}
+
+static int checkpointed_write(struct writer* w, const u8* buf, int size)
+{
+	return w->writer->write(w->writer, buf, size);
+}
+
+static int checkpointed_close(struct writer* w)
+{
+	w->writer->complete = w->complete;
+	int err = w->writer->close(w->writer);
+	checkpoint_finish(w->ckpt, w->name, w->complete && err == 0);
+	free(w->name);
+	free(w);
+	return err;
+}
+
+// Open a writer which passes everything on to writer, and records in the
+// checkpoint whether the track was finished once writer is closed.
+static struct writer* open_checkpointed(struct writer* writer, struct checkpoint* c, const char* name)
+{
+	struct writer* w = malloc(sizeof *w);
+	if (w == NULL) {
+		return NULL;
+	}
+	w->name = strdup(name);
+	if (w->name == NULL) {
+		free(w);
+		return NULL;
+	}
+	w->writer = writer;
+	w->ckpt = c;
+	w->complete = false;
+	w->write = checkpointed_write;
+	w->close = checkpointed_close;
+	w->sync = inner_sync;
+	return w;
+}
+
+// Measure the loudness of a track written to w0, if the output asks for it.
+// A track carried on from a checkpoint isn't measured, since only the rest
+// of it is written.
+static struct writer* measured(struct output* out, const char* filename, struct writer* w0, int64_t offset)
+{
+	struct writer* w;
+
+	if (out->gain == NULL || offset > 0) {
+		return w0;
+	}
+	w = open_measure(w0, out->gain, filename, out->lpcm_info);
+	if (w == NULL) {
+		w0->close(w0);
+	}
+	return w;
+}
+
+// Hash a track written to w0, if the output asks for it. A track carried
+// on from a checkpoint can't be.
+static struct writer* hashed(struct output* out, const char* filename, struct writer* w0, int64_t offset)
+{
+	struct writer* w;
+
+	if (out->sums == NULL || offset > 0 || w0 == NULL) {
+		return w0;
+	}
+	w = open_hashed(w0, out->sums, filename);
+	if (w == NULL) {
+		w0->close(w0);
+	}
+	return w;
+}
+
+// Open the files, and the encoder if there is one, for a chapter's track.
+static struct writer* open_file_track(struct output* out, const char* filename, int chapter, int64_t offset)
+{
+	struct writer *w, *w0;
+
+	if (out->format == FORMAT_FLAC) {
+		if (out->threads < 0) {
+			w0 = open_flac(filename, out->lpcm_info, out->ring);
+		} else {
+			w0 = open_encoder(filename, out->lpcm_info, out->threads);
+		}
+		if (w0 == NULL) {
+			return NULL;
+		}
+		w0 = hashed(out, filename, measured(out, filename, w0, offset), offset);
+		if (w0 == NULL) {
+			return NULL;
+		}
+		w = open_repack(w0, out->lpcm_info);
+		if (w == NULL) {
+			w0->close(w0);
+			return NULL;
+		}
+		return w;
+	}
+	if (out->format == FORMAT_WAV || out->format == FORMAT_W64) {
+		w0 = open_wav(filename, out->lpcm_info, out->format == FORMAT_W64, out->seconds[chapter], out->io, offset);
+		if (w0 == NULL) {
+			return NULL;
+		}
+		w0 = hashed(out, filename, measured(out, filename, w0, offset), offset);
+		if (w0 == NULL) {
+			return NULL;
+		}
+		w = open_repack(w0, out->lpcm_info);
+		if (w == NULL) {
+			w0->close(w0);
+			return NULL;
+		}
+		return w;
+	}
+	if (out->io != NULL) {
+		int fd = open_output(filename, offset);
+		if (fd < 0) {
+			return NULL;
+		}
+		return hashed(out, filename, open_async(out->io, fd), offset);
+	}
+	return hashed(out, filename, open_file(filename, offset), offset);
+}
+
+// Open the writer for a chapter's track. If offset isn't 0, the track's
+// file is carried on from there. Tracks the checkpoint says are done get a
+// writer which drops everything.
+static struct writer* open_track(struct output* out, int chapter, int64_t offset)
+{
+	char filename[track_name_size];
+	struct writer *w, *w0;
+
+	if (out->pieces != NULL) {
+		return open_piece(out->spool, out->pieces[chapter]);
+	}
+	track_name(filename, out, chapter);
+	if (out->ckpt != NULL && checkpoint_done(out->ckpt, filename)) {
+		return open_null();
+	}
+	if (out->sched != NULL && out->format == FORMAT_FLAC) {
+		return open_deferred(out, chapter);
+	}
+	w0 = open_file_track(out, filename, chapter, offset);
+	if (w0 != NULL && out->trim) {
+		w = open_trim(w0, out->head, out->length);
+		if (w == NULL) {
+			w0->close(w0);
+		}
+		w0 = w;
+	}
+	if (w0 == NULL || out->ckpt == NULL) {
+		return w0;
+	}
+	w = open_checkpointed(w0, out->ckpt, filename);
+	if (w == NULL) {
+		w0->close(w0);
+	}
+	return w;
+}
+
+// Set up a sink for stream i of a titleset: audio streams come first, then
+// subpictures.
+static void init_sink(struct sink* k, ifo_handle_t *ifo, int i, int naudio)
+{
+	int index = i < naudio ? i : i - naudio;
+
+	memset(k, 0, sizeof *k);
+	k->out.format = FORMAT_RAW;
+	k->out.ext = ".bin";
+	if (i >= naudio) {
+		k->spu = true;
+		k->stream = 0x20 + index;
+		k->out.ext = ".spu";
+		snprintf(k->tag, sizeof k->tag, "-s%d", index);
+		printf("subpicture %d: %#02x\n", index, k->stream);
+	} else {
+		audio_attr_t a = ifo->vtsi_mat->vts_audio_attr[index];
+		if (stream_ids[a.audio_format] == 0) {
+			die("Unknown audio format");
+		}
+		if (a.sample_frequency == 1 && a.audio_format != 4) {
+			die("Unknown sample rate");
+		}
+		print_audio(&a, index);
+		k->stream = (int)stream_ids[a.audio_format] + index;
+		snprintf(k->tag, sizeof k->tag, "-a%d", index);
+	}
+
+	switch (k->stream & ~7) {
+	case 0x80:
+		k->out.ext = ".ac3";
+		break;
+	case 0x88:
+		k->out.ext = ".dts";
+		break;
+	case 0xa0:
+		k->out.ext = ".pcm";
+		break;
+	}
+}
+
+// Cut a sink down to one track running from one place in the title to
+// another, or to the end if to is NULL, lasting about seconds. Audio is cut
+// at the nearest frames, and LPCM at the sample.
+static int cut_excerpt(struct sink* k, dvd_file_t *vob, const struct title_point* from, const struct title_point* to, double seconds)
+{
+	bool lpcm = (k->stream & ~7) == 0xa0;
+	int end = k->sectors[k->last];
+	int64_t pts = 0, endpts;
+	int s;
+
+	if (k->spu) {
+		k->sectors[0] = from->nav;
+		k->sectors[1] = to != NULL ? to->nav : end;
+	} else {
+		k->sectors[0] = find_frame(vob, from->nav, from->last, k->stream, from->pts,
+			lpcm ? FRAME_BEFORE : FRAME_NEAREST, &pts);
+		if (k->sectors[0] < 0) {
+			return -1;
+		}
+		k->sectors[1] = end;
+		if (to != NULL) {
+			s = find_frame(vob, to->nav, to->last, k->stream, to->pts,
+				lpcm ? FRAME_AFTER : FRAME_NEAREST, &endpts);
+			if (s > k->sectors[0]) {
+				k->sectors[1] = s;
+			}
+		}
+	}
+	if (lpcm) {
+		// Cut in whole blocks of two samples per channel
+		sectorbuf b;
+		if (DVDReadBlocks(vob, k->sectors[0], 1, b) < 1) {
+			return -1;
+		}
+		struct lpcm_info info = read_lpcm_header(b);
+		int64_t block = info.bitdepth * info.channels / 4;
+		double rate = info.sample_rate / 2.0;
+		k->out.trim = true;
+		k->out.head = 0;
+		if (from->pts > pts) {
+			k->out.head = (int64_t)((double)(from->pts - pts) / 90000 * rate + 0.5) * block;
+		}
+		k->out.length = INT64_MAX;
+		if (to != NULL) {
+			k->out.length = (int64_t)(seconds * rate + 0.5) * block;
+		}
+	}
+	k->ch = 0;
+	k->last = 1;
+	if (k->seconds != NULL) {
+		k->seconds[0] = seconds;
+	}
+	return 0;
+}
+
+// What to rip from each title when ripping several.
+struct settings {
+	int angle;
+	uint audio, subpictures;
+	int chapterstart, chapterend; // 0-based; chapterend is 1-based or -1
+	enum format format;
+	int threads, workers, budget;
+	bool ring;
+	int iobuf, iodepth;
+	int batch, readahead;
+	bool gain; // measure the loudness of LPCM tracks
+	struct sums* sums; // hashes of the tracks, or NULL
+	const char* mapdir; // where title sets' sector maps are kept, or NULL
+	int scanners; // threads to look through an image's sectors
+};
+
+// Merge the angle blocks of another title into a.
+static struct angles* merge_angles(struct angles* a, struct angles* b)
+{
+	if (a == NULL || b == NULL) {
+		return a != NULL ? a : b;
+	}
+	for (int i = 0; i < b->n; i++) {
+		bool seen = false;
+		for (int j = 0; j < a->n; j++) {
+			seen = seen || a->blocks[j].start == b->blocks[i].start;
+		}
+		if (seen) {
+			continue;
+		}
+		struct angle_block* blocks = realloc(a->blocks, (size_t)(a->n+1) * sizeof *blocks);
+		if (blocks == NULL) {
+			die("Out of memory");
+		}
+		a->blocks = blocks;
+		a->blocks[a->n++] = b->blocks[i];
+	}
+	free_angles(b);
+	return a;
+}
+
+// Size of the runs pieces are copied from the spool in.
+enum { copy_size = 65536 };
+
+// Copy from..to of a piece from the spool to a track, in runs of size
+// bytes.
+static int copy_piece(struct writer* w, FILE* spool, const struct piece* p, int64_t from, int64_t to, u8* buf, int size)
+{
+	int n;
+
+	if (p->offset < 0 || from >= to) {
+		return 0;
+	}
+	if (fseeko(spool, p->offset + from, SEEK_SET) < 0) {
+		perror("fseeko");
+		return -1;
+	}
+	for (; from < to; from += n) {
+		n = to - from < size ? (int)(to - from) : size;
+		if (fread(buf, 1, (size_t)n, spool) != (size_t)n) {
+			perror("fread");
+			return -1;
+		}
+		if (w->write(w, buf, n) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Start the encoder workers and output thread for the given sinks, as main
+// does for a single title.
+static void start_output(const struct sink* sinks, int n, const struct settings* o,
+	struct sched** schedp, struct iothread** iop)
+{
+	int nflac = 0;
+	for (int i = 0; i < n; i++) {
+		nflac += sinks[i].out.format == FORMAT_FLAC;
+	}
+	if (nflac > 0 && o->budget > 0) {
+		*schedp = open_encoders(o->workers, nflac, o->budget);
+		if (*schedp == NULL) {
+			die("Couldn't start encoder workers");
+		}
+	}
+	if (nflac < n && o->iobuf > 0) {
+		*iop = iothread_open((size_t)o->iobuf << 10, o->iodepth, 2*n, &stats->write_ns);
+		if (*iop == NULL) {
+			die("Couldn't start output thread");
+		}
+	}
+}
+
+// Rip the titles of a titleset, as planned in cells.h.
+static int rip_titleset(dvd_reader_t *dvd, const char* filename, ifo_handle_t *ifo0, int ts,
+	const bool* titles, const struct settings* o)
+{
+	struct sched* sched = NULL;
+	struct iothread* io = NULL;
+	struct title_cells* tc = NULL;
+	struct cell_range* cells = NULL;
+	struct angles* angles = NULL;
+	struct sink streams[8+32], sinks[8+32];
+	struct piece* pieces[8+32];
+	FILE* spools[8+32];
+	int ntc = 0, ncells = 0, nstreams = 0, npasses = 0;
+	int err = 0;
+	int i, j, c, s;
+
+	ifo_handle_t *ifo = ifoOpen(dvd, ts);
+	if (ifo == NULL) {
+		printf("error: couldn't open IFO for titleset %d\n", ts);
+		return -1;
+	}
+	dvd_file_t *vob = DVDOpenFile(dvd, ts, DVD_READ_TITLE_VOBS);
+	if (vob == NULL) {
+		printf("error: couldn't open VOB for titleset %d\n", ts);
+		ifoClose(ifo);
+		return -1;
+	}
+
+	// The cells of each title
+	for (int t = 1; t <= ifo0->tt_srpt->nr_of_srpts && t <= max_titles; t++) {
+		title_info_t tt = ifo0->tt_srpt->title[t-1];
+		if (!titles[t] || tt.title_set_nr != ts) {
+			continue;
+		}
+		if (!(tt.vts_ttn - 1 < ifo->vts_ptt_srpt->nr_of_srpts)) {
+			printf("title %d: corrupt IFO: vts_ttn out of range\n", t);
+			err = -1;
+			continue;
+		}
+		ttu_t *vtt = &ifo->vts_ptt_srpt->title[tt.vts_ttn - 1];
+		int nchapters = vtt->nr_of_ptts;
+		int angle = o->angle <= tt.nr_of_angles ? o->angle - 1 : 0;
+		struct title_cells* x = realloc(tc, (size_t)(ntc+1) * sizeof *x);
+		if (x == NULL) {
+			die("Out of memory");
+		}
+		tc = x;
+		x = &tc[ntc];
+		memset(x, 0, sizeof *x);
+		x->title = t;
+		x->first = o->chapterstart;
+		x->end = o->chapterend >= 0 && o->chapterend < nchapters ? o->chapterend : nchapters;
+		if (x->first >= x->end) {
+			continue;
+		}
+		x->next = x->end < nchapters;
+		x->start = malloc((size_t)(x->end - x->first + 2) * sizeof *x->start);
+		x->seconds = calloc((size_t)nchapters, sizeof *x->seconds);
+		if (x->start == NULL || x->seconds == NULL) {
+			die("Out of memory");
+		}
+		for (c = x->first; c < x->end + x->next; c++) {
+			uint cell, end;
+			pgc_t *pgc = chapter_cells(ifo, vtt, c, &cell, &end);
+			x->start[c - x->first] = x->ncells;
+			for (; cell < end; cell++) {
+				if (!other_angle(pgc, cell, angle)) {
+					cell_playback_t *pb = &pgc->cell_playback[cell-1U];
+					if (cells_add(x, (int)pb->first_sector, (int)pb->last_sector) < 0) {
+						die("Out of memory");
+					}
+				}
+			}
+			if (c < x->end) {
+				x->seconds[c] = chapter_seconds(ifo, vtt, c, angle);
+			}
+		}
+		x->start[x->end + x->next - x->first] = x->ncells;
+		angles = merge_angles(angles, find_angles(ifo, vtt, angle));
+		ntc++;
+	}
+
+	// Every cell once, in order on the disc
+	ncells = cells_union(tc, ntc, &cells);
+	if (ncells < 0) {
+		die("Out of memory");
+	}
+	printf("titleset %d: %d titles play %d distinct cells\n", ts, ntc, ncells);
+
+	// The streams
+	int naudio = ifo->vtsi_mat->nr_of_vts_audio_streams;
+	int nsubp = ifo->vtsi_mat->nr_of_vts_subp_streams;
+	for (i = 0; i < naudio + nsubp && ncells > 0; i++) {
+		int index = i < naudio ? i : i - naudio;
+		if (index >= 32 || (i < naudio ? !(o->audio >> index & 1) : !(o->subpictures >> index & 1))) {
+			continue;
+		}
+		struct sink* k = &streams[nstreams];
+		init_sink(k, ifo, i, naudio);
+		k->out.threads = o->threads;
+		k->out.ring = o->ring;
+		k->out.sums = o->sums;
+		if (o->format != FORMAT_RAW && (k->stream & ~7) == 0xa0) {
+			sectorbuf b;
+			int sector = get_audio_sector(vob, cells[0].first, index);
+			if (sector < 0 || DVDReadBlocks(vob, sector, 1, b) < 1) {
+				printf("error: couldn't read audio sector\n");
+				err = -1;
+				continue;
+			}
+			k->out.lpcm_info = read_lpcm_header(b);
+			k->out.format = o->format;
+			k->out.ext = o->format == FORMAT_FLAC ? ".flac" : o->format == FORMAT_WAV ? ".wav" : ".w64";
+		}
+		pieces[nstreams] = malloc((size_t)ncells * sizeof *pieces[nstreams]);
+		if (pieces[nstreams] == NULL) {
+			die("Out of memory");
+		}
+		for (j = 0; j < ncells; j++) {
+			pieces[nstreams][j] = (struct piece){-1, 0, -1, false};
+		}
+		// Spooled next to the tracks, since it's as big as they are
+		char spoolname[] = "extractaudio-XXXXXX";
+		int fd = mkstemp(spoolname);
+		if (fd < 0 || (spools[nstreams] = fdopen(fd, "w+")) == NULL) {
+			die("Couldn't make a spool file: %s", strerror(errno));
+		}
+		unlink(spoolname);
+		nstreams++;
+	}
+
+	// Read the cells in passes, each of which has cells which don't
+	// overlap. Cells which follow each other on the disc are read in one
+	// go, as a span.
+	int* pass = malloc((size_t)ncells * sizeof *pass + 1);
+	int* span = malloc((size_t)ncells * sizeof *span + 1);
+	int* sectors = malloc((size_t)(ncells+1) * sizeof *sectors);
+	struct piece** spanpieces = malloc((size_t)(nstreams * ncells) * sizeof *spanpieces + 1);
+	if (pass == NULL || span == NULL || sectors == NULL || spanpieces == NULL ||
+	    (npasses = cells_passes(cells, ncells, pass)) < 0) {
+		die("Out of memory");
+	}
+	struct tsmap map;
+	open_tsmap(&map, o->mapdir, ts, vob);
+	for (int p = 0; p < npasses && nstreams > 0; p++) {
+		for (i = 0; i < ncells; i++) {
+			if (pass[i] != p) {
+				continue;
+			}
+			int n = cells_span(cells, ncells, pass, i, span);
+			i = span[n-1];
+
+			for (j = 0; j < n; j++) {
+				sectors[j] = cells[span[j]].first;
+			}
+			sectors[n] = cells[span[n-1]].last + 1;
+			for (s = 0; s < nstreams; s++) {
+				struct sink* k = &sinks[s];
+				*k = streams[s];
+				k->out.format = FORMAT_RAW;
+				k->out.pieces = &spanpieces[s*ncells];
+				k->out.spool = spools[s];
+				for (j = 0; j < n; j++) {
+					k->out.pieces[j] = &pieces[s][span[j]];
+				}
+				k->sectors = sectors;
+				k->last = n;
+				k->ch = 0;
+			}
+
+			struct source* src = open_mmap_source(filename, dvd, ts, false, o->batch);
+			bool mapped = src != NULL;
+			if (mapped) {
+				scan_source(src, o->scanners);
+			}
+			if (src == NULL) {
+				src = open_dvd_source(vob, o->batch);
+			}
+			if (src != NULL && o->readahead > 0 && !mapped) {
+				struct source* ra = open_readahead(src, o->readahead, sectors[n] - 1, angles);
+				if (ra == NULL) {
+					src->close(src);
+				}
+				src = ra;
+			}
+			if (src == NULL) {
+				err = -1;
+				break;
+			}
+			if (demux(src, sinks, nstreams, angles, NULL, map.map) < 0) {
+				err = -1;
+			}
+			src->close(src);
+		}
+	}
+	if (close_tsmap(&map) < 0) {
+		err = -1;
+	}
+
+	// Put the tracks together, with the encoders and output thread
+	// set up as for a single title.
+	if (err == 0) {
+		start_output(streams, nstreams, o, &sched, &io);
+	}
+	// Each title's tracks of a stream go together for ReplayGain.
+	struct gain** gains = calloc((size_t)(ntc * nstreams) + 1, sizeof *gains);
+	int maxcells = 0;
+	for (i = 0; i < ntc; i++) {
+		maxcells = tc[i].ncells > maxcells ? tc[i].ncells : maxcells;
+	}
+	u8* buf = malloc(copy_size);
+	struct piece_run* runs = malloc((size_t)maxcells * sizeof *runs + 1);
+	if (buf == NULL || gains == NULL || runs == NULL) {
+		die("Out of memory");
+	}
+	for (i = 0; i < ntc && err == 0; i++) {
+		struct title_cells* x = &tc[i];
+		for (s = 0; s < nstreams && o->gain; s++) {
+			if (streams[s].out.format != FORMAT_RAW && (gains[i*nstreams + s] = open_gain()) == NULL) {
+				die("Out of memory");
+			}
+		}
+		for (c = x->first; c < x->end; c++) {
+			for (s = 0; s < nstreams; s++) {
+				struct sink* k = &streams[s];
+				struct output out = k->out;
+				int size = copy_size;
+				bool complete;
+
+				out.title = x->title;
+				out.tag = nstreams > 1 ? k->tag : "";
+				out.seconds = x->seconds;
+				out.sched = sched;
+				out.io = io;
+				out.gain = gains[i*nstreams + s];
+				if ((k->stream & ~7) == 0xa0) {
+					// Repacking takes whole blocks
+					int block = out.lpcm_info.bitdepth * out.lpcm_info.channels / 4;
+					if (block > 0) {
+						size -= size % block;
+					}
+				}
+				struct writer* w = open_track(&out, c, 0);
+				if (w == NULL) {
+					err = -1;
+					break;
+				}
+				int nruns = cells_track(x, c, pieces[s], k->spu, runs, &complete);
+				for (j = 0; j < nruns; j++) {
+					struct piece_run* r = &runs[j];
+					if (copy_piece(w, spools[s], &pieces[s][r->cell], r->from, r->to, buf, size) < 0) {
+						complete = false;
+					}
+				}
+				close_track(w, complete);
+			}
+		}
+	}
+	free(buf);
+	free(runs);
+	if (sched != NULL && sched_close(sched) < 0) {
+		err = -1;
+	}
+	if (io != NULL && iothread_close(io) < 0) {
+		err = -1;
+	}
+	for (i = 0; i < ntc * nstreams; i++) {
+		if (gains[i] != NULL && close_gain(gains[i]) < 0) {
+			err = -1;
+		}
+	}
+	free(gains);
+
+	for (s = 0; s < nstreams; s++) {
+		fclose(spools[s]);
+		free(pieces[s]);
+	}
+	for (i = 0; i < ntc; i++) {
+		cells_free(&tc[i]);
+	}
+	free(tc);
+	free(cells);
+	free(pass);
+	free(span);
+	free(sectors);
+	free(spanpieces);
+	free_angles(angles);
+	DVDCloseFile(vob);
+	ifoClose(ifo);
+	return err;
+}
+
+// Rip several titles, a titleset at a time.
+int rip_titles(dvd_reader_t *dvd, const char* filename, const bool* titles, const struct settings* o)
+{
+	ifo_handle_t *ifo0 = ifoOpen(dvd, 0);
+	int err = 0;
+
+	if (ifo0 == NULL) {
+		die("Unable to open VIDEO_TS.IFO");
+	}
+	for (int ts = 1; ts <= ifo0->vmgi_mat->vmg_nr_of_title_sets; ts++) {
+		bool any = false;
+		for (int t = 1; t <= ifo0->tt_srpt->nr_of_srpts && t <= max_titles; t++) {
+			any = any || (titles[t] && ifo0->tt_srpt->title[t-1].title_set_nr == ts);
+		}
+		if (any && rip_titleset(dvd, filename, ifo0, ts, titles, o) < 0) {
+			err = -1;
+		}
+	}
+	ifoClose(ifo0);
+	return err;
+}
+
+// How many packs of a loose file are looked through for its streams.
+enum { probe_sectors = 8192 };
+
+// Rip the streams of a loose VOB or program stream file, each as one track.
+// With no IFO to list them, the streams are the ones with a packet in the
+// first probe_sectors packs, and each track starts at its stream's first
+// frame there.
+int rip_loose(const char* filename, const struct settings* o)
+{
+	static double unknown[1]; // how long the tracks are
+	// AC-3, DTS and LPCM, and subpictures
+	struct sink sinks[8+8+8+32];
+	int first[256];
+	sectorbuf lpcm[8];
+	struct stream_info info;
+	struct sched* sched = NULL;
+	struct iothread* io = NULL;
+	struct stat st;
+	u8 *buf, *b;
+	int nsinks = 0, sector, n, i, id;
+	int err = 0;
+
+	if (stat(filename, &st) < 0) {
+		die("Couldn't open %s: %s", filename, strerror(errno));
+	}
+	if (st.st_size / SECTOR_SIZE >= INT_MAX) {
+		die("%s is too big", filename);
+	}
+	struct source* src = open_loose_source(filename, o->batch);
+	if (src == NULL) {
+		return -1;
+	}
+	for (id = 0; id < 256; id++) {
+		first[id] = -1;
+	}
+	for (sector = 0; sector < probe_sectors; sector += n) {
+		n = src->read(src, sector, probe_sectors - sector, &buf);
+		if (n < 1) {
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			b = buf + i*SECTOR_SIZE;
+			if (pack_stream_id(b, false) != 0xbd || get_stream_info(b, &info) < 0) {
+				continue;
+			}
+			// Audio starts at a frame
+			id = info.stream;
+			if (first[id] < 0 && ((id & ~0x1f) == 0x20 || info.first_frame_offset >= 0)) {
+				first[id] = sector + i;
+				if ((id & ~7) == 0xa0) {
+					memcpy(lpcm[id & 7], b, SECTOR_SIZE);
+				}
+			}
+		}
+	}
+	src->close(src);
+
+	int total = (int)(st.st_size / SECTOR_SIZE);
+	for (id = 0; id < 256; id++) {
+		bool spu = (id & ~0x1f) == 0x20;
+		int index = spu ? id - 0x20 : id & 7;
+		// Anything else is more likely garbage than a stream
+		bool known = spu || (id & ~0xf) == 0x80 || (id & ~7) == 0xa0;
+		if (first[id] < 0 || !known || (spu ? !(o->subpictures >> index & 1) : !(o->audio >> index & 1))) {
+			continue;
+		}
+		if (nsinks == (int)(sizeof sinks / sizeof *sinks)) {
+			printf("warning: too many streams; skipping stream %#02x and any after it\n", id);
+			break;
+		}
+		struct sink* k = &sinks[nsinks];
+		memset(k, 0, sizeof *k);
+		k->stream = id;
+		k->spu = spu;
+		k->out.format = FORMAT_RAW;
+		k->out.threads = o->threads;
+		k->out.ring = o->ring;
+		k->out.sums = o->sums;
+		k->out.seconds = unknown;
+		switch (id & ~7) {
+		case 0x80:
+			k->out.ext = ".ac3";
+			break;
+		case 0x88:
+			k->out.ext = ".dts";
+			break;
+		case 0xa0:
+			k->out.ext = ".pcm";
+			if (o->format != FORMAT_RAW) {
+				k->out.lpcm_info = read_lpcm_header(lpcm[index]);
+				k->out.format = o->format;
+				k->out.ext = o->format == FORMAT_FLAC ? ".flac" : o->format == FORMAT_WAV ? ".wav" : ".w64";
+			}
+			break;
+		default:
+			k->out.ext = ".spu";
+			break;
+		}
+		// Codecs share indexes, so audio goes by the whole id
+		snprintf(k->tag, sizeof k->tag, spu ? "-s%d" : "-a%02x", spu ? index : id);
+		printf("stream %#02x from sector %d\n", id, first[id]);
+		k->sectors = malloc(2 * sizeof *k->sectors);
+		if (k->sectors == NULL) {
+			die("Out of memory");
+		}
+		// There can't be more packs than sectors' worth of file.
+		k->sectors[0] = first[id];
+		k->sectors[1] = total;
+		k->last = 1;
+		nsinks++;
+	}
+	if (nsinks == 0) {
+		printf("error: none of the streams asked for are in %s\n", filename);
+		return -1;
+	}
+	start_output(sinks, nsinks, o, &sched, &io);
+	for (i = 0; i < nsinks; i++) {
+		sinks[i].out.tag = nsinks > 1 ? sinks[i].tag : "";
+		sinks[i].out.sched = sched;
+		sinks[i].out.io = io;
+		if (o->gain && sinks[i].out.format != FORMAT_RAW && (sinks[i].out.gain = open_gain()) == NULL) {
+			die("Out of memory");
+		}
+	}
+
+	src = open_loose_source(filename, o->batch);
+	if (src != NULL && o->readahead > 0) {
+		struct source* ra = open_readahead(src, o->readahead, total, NULL);
+		if (ra == NULL) {
+			src->close(src);
+		}
+		src = ra;
+	}
+	if (src == NULL) {
+		return -1;
+	}
+	err = demux(src, sinks, nsinks, NULL, NULL, NULL);
+	src->close(src);
+	if (sched != NULL && sched_close(sched) < 0) {
+		err = -1;
+	}
+	if (io != NULL && iothread_close(io) < 0) {
+		err = -1;
+	}
+	for (i = 0; i < nsinks; i++) {
+		if (sinks[i].out.gain != NULL && close_gain(sinks[i].out.gain) < 0) {
+			err = -1;
+		}
+		free(sinks[i].sectors);
+	}
+	return err;
+}
+
+// Read a DVD-Audio title set's IFO out of a disc image and parse its track
+// tables.
+static struct ats* read_ats(dvd_reader_t *dvd, const char* filename, int ts)
+{
+	char fn[] = "/AUDIO_TS/ATS_??_0.IFO";
+	uint32_t lba, size;
+	struct ats* a = NULL;
+	u8* buf;
+	int fd;
+
+	snprintf(fn, sizeof fn, "/AUDIO_TS/ATS_%02d_0.IFO", ts);
+	lba = UDFFindFile(dvd, fn, &size);
+	if (lba == 0) {
+		printf("error: no %s\n", fn);
+		return NULL;
+	}
+	buf = malloc(size);
+	if (buf == NULL) {
+		die("Out of memory");
+	}
+	fd = open(filename, O_RDONLY);
+	if (fd >= 0 && pread(fd, buf, size, (off_t)lba * SECTOR_SIZE) == (ssize_t)size) {
+		a = ats_parse(buf, size);
+		if (a == NULL) {
+			printf("error: couldn't parse %s\n", fn);
+		}
+	} else {
+		printf("error: couldn't read %s\n", fn);
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+	free(buf);
+	return a;
+}
+
+// Rip a title of a DVD-Audio title set from a decrypted disc image. Its
+// tracks come from the title set's IFO, and each one runs up to the first
+// pack of the next. LPCM and MLP streams are found by looking at the
+// start of the first track, as in a loose file.
+int rip_aob(dvd_reader_t *dvd, const char* filename, int ts, int title, const struct settings* o)
+{
+	struct sink sinks[2];
+	int first[2] = {-1, -1};
+	sectorbuf lpcm;
+	struct stream_info info;
+	struct sched* sched = NULL;
+	struct iothread* io = NULL;
+	u8 *buf, *b;
+	int nsinks = 0, sector, start, end, n, i, id;
+	int err = 0;
+
+	struct ats* a = read_ats(dvd, filename, ts);
+	if (a == NULL) {
+		return -1;
+	}
+	if (title < 1 || title > a->ntitles) {
+		printf("error: title set %d has %d titles\n", ts, a->ntitles);
+		ats_free(a);
+		return -1;
+	}
+	const struct ats_title* x = &a->titles[title-1];
+	int last = o->chapterend >= 0 && o->chapterend < x->ntracks ? o->chapterend : x->ntracks;
+	if (o->chapterstart >= last) {
+		printf("error: title %d has %d tracks\n", title, x->ntracks);
+		ats_free(a);
+		return -1;
+	}
+	// The last track ends at its last pack, as a title's last chapter
+	// does.
+	start = x->tracks[o->chapterstart].first;
+	end = x->tracks[x->ntracks-1].last;
+
+	struct source* src = open_mmap_source(filename, dvd, ts, true, o->batch);
+	if (src == NULL) {
+		printf("error: %s isn't a disc image with the AOBs decrypted\n", filename);
+		ats_free(a);
+		return -1;
+	}
+	for (sector = start; sector < start + probe_sectors && sector <= end; sector += n) {
+		n = src->read(src, sector, start + probe_sectors - sector, &buf);
+		if (n < 1) {
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			b = buf + i*SECTOR_SIZE;
+			if (pack_stream_id(b, false) != 0xbd || get_aob_stream_info(b, &info) < 0) {
+				continue;
+			}
+			id = info.stream;
+			if ((id == 0xa0 || id == 0xa1) && first[id & 1] < 0 && info.first_frame_offset >= 0) {
+				first[id & 1] = sector + i;
+				if (id == 0xa0) {
+					memcpy(lpcm, b, SECTOR_SIZE);
+				}
+			}
+		}
+	}
+	src->close(src);
+
+	for (i = 0; i < 2; i++) {
+		if (first[i] < 0) {
+			continue;
+		}
+		struct sink* k = &sinks[nsinks];
+		memset(k, 0, sizeof *k);
+		k->stream = 0xa0 + i;
+		k->out.format = FORMAT_RAW;
+		k->out.threads = o->threads;
+		k->out.ring = o->ring;
+		k->out.sums = o->sums;
+		k->out.ext = i == 0 ? ".pcm" : ".mlp";
+		snprintf(k->tag, sizeof k->tag, "-a%d", i);
+		if (i == 1) {
+			printf("audio %#02x: mlp\n", k->stream);
+		} else if ((k->out.lpcm_info = read_aob_lpcm_header(lpcm)).bitdepth == 0) {
+			printf("audio %#02x: lpcm with channel groups that differ; writing it as it is\n", k->stream);
+		} else {
+			printf("audio %#02x: lpcm %dch %d %gkHz\n", k->stream, k->out.lpcm_info.channels,
+				k->out.lpcm_info.bitdepth, k->out.lpcm_info.sample_rate / 1000.0);
+			if (o->format != FORMAT_RAW) {
+				k->out.format = o->format;
+				k->out.ext = o->format == FORMAT_FLAC ? ".flac" : o->format == FORMAT_WAV ? ".wav" : ".w64";
+			}
+		}
+		k->sectors = malloc((size_t)(x->ntracks+1) * sizeof *k->sectors);
+		k->seconds = malloc((size_t)x->ntracks * sizeof *k->seconds);
+		if (k->sectors == NULL || k->seconds == NULL) {
+			die("Out of memory");
+		}
+		for (int t = 0; t < x->ntracks; t++) {
+			k->sectors[t] = x->tracks[t].first;
+			k->seconds[t] = x->tracks[t].length / 90000.0;
+		}
+		k->sectors[x->ntracks] = end;
+		k->out.seconds = k->seconds;
+		k->last = last;
+		k->ch = o->chapterstart;
+		nsinks++;
+	}
+	ats_free(a);
+	if (nsinks == 0) {
+		printf("error: no LPCM or MLP audio at sector %d\n", start);
+		return -1;
+	}
+	start_output(sinks, nsinks, o, &sched, &io);
+	for (i = 0; i < nsinks; i++) {
+		sinks[i].out.tag = nsinks > 1 ? sinks[i].tag : "";
+		sinks[i].out.sched = sched;
+		sinks[i].out.io = io;
+		if (o->gain && sinks[i].out.format != FORMAT_RAW && (sinks[i].out.gain = open_gain()) == NULL) {
+			die("Out of memory");
+		}
+	}
+
+	// The AOBs are always mapped, and read ahead by the page cache.
+	src = open_mmap_source(filename, dvd, ts, true, o->batch);
+	if (src == NULL) {
+		return -1;
+	}
+	scan_source(src, o->scanners);
+	err = demux(src, sinks, nsinks, NULL, NULL, NULL);
+	src->close(src);
+	if (sched != NULL && sched_close(sched) < 0) {
+		err = -1;
+	}
+	if (io != NULL && iothread_close(io) < 0) {
+		err = -1;
+	}
+	for (i = 0; i < nsinks; i++) {
+		if (sinks[i].out.gain != NULL && close_gain(sinks[i].out.gain) < 0) {
+			err = -1;
+		}
+		free(sinks[i].sectors);
+		free(sinks[i].seconds);
+	}
+	return err;
+}
+
+int main(int argc, char* argv[]);
+
+// Devices the jobs of a batch read from. Each one runs no more than limit
+// jobs at once: one for an optical drive or a spinning disk, which would
+// only seek back and forth between them, and more for flash.
+struct device {
+	dev_t id;
+	int limit;
+	int running;
+};
+
+// A job of a batch, as it runs.
+struct job {
+	struct manifest_job* m;
+	int dev; // index into the batch's devices
+	int pid; // 0 until started, -1 once finished
+	int status;
+};
+
+// Memory shared between a batch and its jobs.
+struct shared {
+	sem_t slots;
+	struct stats stats[];
+};
+
+// Returns true if the disk holding files of device id spins.
+static bool rotational(dev_t id)
 {
-	int err = fclose(w->fp);
-	waitpid(w->pid, NULL, 0);
-	free(w);
-	return err;
+	char path[64];
+	FILE* fp;
+	int c = EOF;
+
+	// A partition's queue is its disk's.
+	snprintf(path, sizeof path, "/sys/dev/block/%u:%u/queue/rotational", major(id), minor(id));
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		snprintf(path, sizeof path, "/sys/dev/block/%u:%u/../queue/rotational", major(id), minor(id));
+		fp = fopen(path, "r");
+	}
+	if (fp != NULL) {
+		c = fgetc(fp);
+		fclose(fp);
+	}
+	return c == '1';
 }
 
-// Copy src to dst, repacking DVD PCM to little-endian PCM. Reads no more than
-// srcsize bytes and writes no more than dstsize bytes. Stores the number of
-// bytes written and read in wn and rn.
-static void repack(u8 *dst, const u8 *src, int dstsize, int srcsize, int depth, int channels, int* wn, int* rn)
+// Find the device a job reads from and count it against that device.
+static int add_device(struct job* j, struct device** devs, int* ndevs, int perdevice)
 {
-	int si, di, ch, j;
-	uint b;
-	int srcblocksize = 2*depth/8 * channels;
-	int dstblocksize = 2*((depth+7)/8) * channels;
-	if (debug) {
-		fprintf(stderr, "dstsize=%d, dstblocksize=%d\n", dstsize, dstblocksize);
-		fprintf(stderr, "srcsize=%d, srcblocksize=%d\n", srcsize, srcblocksize);
-		fprintf(stderr, "depth=%d, channels=%d\n", depth, channels);
+	const char* filename = manifest_input(j->m);
+	struct stat st;
+	struct device* d;
+	dev_t id;
+	int limit, i;
+
+	if (filename == NULL) {
+		filename = "/dev/dvd";
 	}
-	for (si = 0, di = 0; si+srcblocksize <= srcsize && di+dstblocksize <= dstsize; ) {
-		//fprintf(stderr, "si=%d, di=%d\n", si, di);
-		if (depth == 16) {
-			for (ch = 0; ch < channels * 2; ch++) {
-				dst[di + ch*2 + 1] = src[si + ch*2 + 0];
-				dst[di + ch*2 + 0] = src[si + ch*2 + 1];
-			}
-		} else {
-			for (ch = 0; ch < channels * 2; ch++) {
-				dst[di + ch*3 + 2] = src[si + ch*2 + 0];
-				dst[di + ch*3 + 1] = src[si + ch*2 + 1];
-			}
-		}
-		si += channels * 2 * 2;
-		if (depth == 16) {
-			di += channels * 2 * 2;
-		}
-		else if (depth == 20) {
-			// Low nibbles packed two per byte
-			for (j = 0; j < channels; j++) {
-				b = src[si + j];
-				ch = j*2;
-				dst[di + (ch+0)*3 + 0] = b & 0xf0;
-				dst[di + (ch+1)*3 + 0] = (b & 0x0f) << 4;
-			}
-			si += channels;
-			di += channels * 2 * 3;
-		}
-		else if (depth == 24) {
-			for (ch = 0; ch < channels * 2; ch++) {
-				dst[di + ch*3 + 0] = src[si + ch];
-			}
-			si += channels * 2;
-			di += channels * 2 * 3;
+	if (stat(filename, &st) < 0) {
+		// Let the job itself report it
+		id = (dev_t)-1;
+		limit = 1;
+	} else if (S_ISBLK(st.st_mode)) {
+		id = st.st_rdev;
+		limit = 1;
+	} else {
+		id = st.st_dev;
+		limit = rotational(id) ? 1 : perdevice;
+	}
+	for (i = 0; i < *ndevs; i++) {
+		if ((*devs)[i].id == id) {
+			j->dev = i;
+			return 0;
 		}
 	}
-	*wn = di;
-	*rn = si;
-	return;
+	d = realloc(*devs, (size_t)(*ndevs + 1) * sizeof *d);
+	if (d == NULL) {
+		return -1;
+	}
+	*devs = d;
+	j->dev = (*ndevs)++;
+	d[j->dev].id = id;
+	d[j->dev].limit = limit;
+	d[j->dev].running = 0;
+	return 0;
 }
 
-enum { repack_bufsize = 8192 };
-
-static int repack_write(struct writer* w, const u8* buf, int size)
+static void print_batch(FILE* fp, struct job* jobs, int njobs, struct shared* sh)
 {
-	int wn, rn, err;
+	double t = now() - start_time;
+	int64_t sectors = 0, demuxed = 0;
+	int done = 0, failed = 0, running = 0;
+	double mb;
+	int i;
 
-	while (size > 0) {
-		repack(w->buf, buf, repack_bufsize, size, w->depth, w->channels, &wn, &rn);
-		if (wn > 0) {
-			err = w->writer->write(w->writer, w->buf, wn);
-			if (err < 0) {
-				return err;
-			}
+	// Keep it after the lines about jobs starting and finishing
+	fflush(stdout);
+	for (i = 0; i < njobs; i++) {
+		sectors += stat_get(&sh->stats[i].sectors);
+		demuxed += stat_get(&sh->stats[i].demuxed);
+		if (jobs[i].pid < 0) {
+			done++;
+			failed += jobs[i].status != 0;
+		} else if (jobs[i].pid > 0) {
+			running++;
 		}
-		if (rn > size) {
-			if (debug) {
-				abort(); // uh-oh
-			}
-			rn = size;
+	}
+	mb = (double)sectors * SECTOR_SIZE / 1e6;
+	fprintf(fp, "batch: %d of %d jobs done, %d failed, %d running; %.1f MB in %.1fs, %.1f MB/s, %.1f MB demuxed",
+		done, njobs, failed, running, mb, t, t > 0 ? mb / t : 0, (double)demuxed / 1e6);
+	for (i = 0; i < njobs; i++) {
+		if (jobs[i].pid > 0) {
+			fprintf(fp, "; %s %"PRId64"%%", jobs[i].m->dir, percent_done(&sh->stats[i]));
 		}
-		buf += rn;
-		size -= rn;
 	}
-	return 0;
+	fprintf(fp, "\n");
 }
 
-static int repack_close(struct writer* w)
+static void on_child(int sig)
 {
-	int err = w->writer->close(w->writer);
-	free(w->buf);
-	free(w);
-	return err;
+	(void)sig;
 }
 
-struct writer* open_repack(struct writer* writer, struct lpcm_info info)
+// Start a job in a new process, which rips into the job's directory and
+// logs to extractaudio.log there.
+static int start_job(struct job* jobs, int i, struct shared* sh, const sigset_t* mask)
 {
-	struct writer* w;
-	u8 *buf;
+	struct manifest_job* j = jobs[i].m;
+	int pid, fd;
 
-	w = malloc(sizeof *w);
-	if (w == NULL) {
-		return NULL;
+	fflush(stdout);
+	fflush(stderr);
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return -1;
 	}
-
-	buf = malloc((size_t)repack_bufsize);
-	if (buf == NULL) {
-		perror("malloc");
-		free(w);
-		return NULL;
+	if (pid > 0) {
+		jobs[i].pid = pid;
+		return 0;
 	}
 
-	w->write = repack_write;
-	w->close = repack_close;
-	w->writer = writer;
-	w->buf = buf;
-	w->depth = info.bitdepth;
-	w->channels = info.channels;
-	return w;
-}
-
-
-// Parse a decimal number and place it in *out.
-// Returns a pointer to the unparsed portion of the string.
-const char* parse_int(const char* s, int* out)
-{
-	int n = 0;
-	const char *p;
-	for (p = s; '0' <= *p && *p <= '9'; p++) {
-		n *= 10;
-		n += *p - '0';
+	signal(SIGCHLD, SIG_DFL);
+	pthread_sigmask(SIG_SETMASK, mask, NULL);
+	stats = &sh->stats[i];
+	encode_slots = &sh->slots;
+	if (mkdir(j->dir, 0777) < 0 && errno != EEXIST) {
+		die("Couldn't make %s: %s", j->dir, strerror(errno));
 	}
-	if (p != s) {
-		*out = n;
+	if (chdir(j->dir) < 0) {
+		die("Couldn't enter %s: %s", j->dir, strerror(errno));
 	}
-	return p;
+	fd = open("extractaudio.log", O_WRONLY|O_CREAT|O_TRUNC, 0666);
+	if (fd < 0 || dup2(fd, 1) < 0 || dup2(fd, 2) < 0) {
+		die("Couldn't open %s/extractaudio.log: %s", j->dir, strerror(errno));
+	}
+	close(fd);
+	optind = 1;
+	exit(main(j->argc, j->argv));
 }
 
-int parse_range(const char* s, int* startp, int* endp)
+// Run the jobs of a manifest, as many at once as their devices allow. Up
+// to slots chunks of FLAC are encoded at a time across all of the jobs.
+// Prints the progress of the whole batch every interval seconds, if it
+// isn't 0, and on SIGUSR1. Returns the number of jobs which failed.
+int run_batch(const char* manifest, int perdevice, int slots, int interval)
 {
-	// Valid inputs:
-	//     N-M
-	//      -N
-	//     N-
-	//      N
-
-	const char* p = s;
-	*startp = 1;
-	*endp = -1;
+	struct manifest_job* mjobs = NULL;
+	struct job* jobs;
+	struct device* devs = NULL;
+	struct shared* sh;
+	struct sigaction sa;
+	struct timespec ts = {interval, 0};
+	sigset_t mask, set;
+	size_t size;
+	int njobs, ndevs = 0, running = 0, failed = 0;
+	int i, fd, sig, pid, status;
+	FILE* fp;
 
-	if (s[0] == '-' && s[1] == '\0') {
-		return -1;
+	fp = fopen(manifest, "r");
+	if (fp == NULL) {
+		perror(manifest);
+		return 1;
+	}
+	njobs = manifest_read(fp, manifest, &mjobs);
+	fclose(fp);
+	if (njobs < 0) {
+		return 1;
+	}
+	jobs = calloc((size_t)njobs + 1, sizeof *jobs);
+	if (jobs == NULL) {
+		die("Out of memory");
+	}
+	for (i = 0; i < njobs; i++) {
+		jobs[i].m = &mjobs[i];
+		if (add_device(&jobs[i], &devs, &ndevs, perdevice) < 0) {
+			die("Out of memory");
+		}
 	}
 
-	p = parse_int(p, startp);
-	if (*p == '-') {
-		p = parse_int(p+1, endp);
-	} else if (p != s) {
-		*endp = *startp;
+	// Mapping /dev/zero shared gives memory which stays shared with
+	// the jobs after they fork.
+	size = sizeof *sh + (size_t)njobs * sizeof sh->stats[0];
+	fd = open("/dev/zero", O_RDWR);
+	if (fd < 0) {
+		die("Couldn't open /dev/zero: %s", strerror(errno));
 	}
-	if (*p != '\0' || p == s) {
-		return -1;
+	sh = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (sh == MAP_FAILED) {
+		die("Couldn't map shared memory: %s", strerror(errno));
+	}
+	if (sem_init(&sh->slots, 1, (unsigned)slots) < 0) {
+		die("Couldn't make encoder slots: %s", strerror(errno));
 	}
 
-	return 0;
+	// Wait for SIGCHLD as well as SIGUSR1. It needs a handler, or it
+	// might be thrown away instead of waiting.
+	pthread_sigmask(SIG_BLOCK, NULL, &mask);
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = on_child;
+	sigaction(SIGCHLD, &sa, NULL);
+	sigaddset(&set, SIGUSR1);
+
+	printf("batch: %d jobs on %d devices, %d encoder slots\n", njobs, ndevs, slots);
+	start_time = now();
+	for (;;) {
+		// Start every job whose device has room, in manifest order.
+		for (i = 0; i < njobs; i++) {
+			struct device* d = &devs[jobs[i].dev];
+			if (jobs[i].pid == 0 && d->running < d->limit) {
+				if (start_job(jobs, i, sh, &mask) < 0) {
+					jobs[i].pid = -1;
+					jobs[i].status = -1;
+					failed++;
+					continue;
+				}
+				printf("%s: started\n", jobs[i].m->dir);
+				d->running++;
+				running++;
+			}
+		}
+		if (running == 0) {
+			break;
+		}
+
+		if (interval > 0) {
+			sig = sigtimedwait(&set, NULL, &ts);
+		} else {
+			sig = sigwaitinfo(&set, NULL);
+		}
+		if (sig == SIGUSR1 || (sig < 0 && errno == EAGAIN)) {
+			print_batch(stderr, jobs, njobs, sh);
+		}
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			for (i = 0; i < njobs && jobs[i].pid != pid; i++) {
+			}
+			if (i == njobs) {
+				continue;
+			}
+			jobs[i].pid = -1;
+			jobs[i].status = status;
+			devs[jobs[i].dev].running--;
+			running--;
+			if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+				printf("%s: done\n", jobs[i].m->dir);
+			} else {
+				printf("%s: failed; see %s/extractaudio.log\n", jobs[i].m->dir, jobs[i].m->dir);
+				failed++;
+			}
+		}
+	}
+	print_batch(stderr, jobs, njobs, sh);
+
+	sem_destroy(&sh->slots);
+	munmap(sh, size);
+	manifest_free(mjobs, njobs);
+	free(jobs);
+	free(devs);
+	return failed;
 }
 
 void usage(void)
 {
-	printf("usage: extractaudio [-d /dev/dvd] [-t title] [-a audio] [range]\n");
+	printf("usage: extractaudio -B manifest [-D jobs] [-j slots] [-P seconds]\n");
+	printf("       extractaudio [-d /dev/dvd [-t title,...|all] [-u titleset] | -i file.vob] [-A angle] [-a audio,...|all] [-p subpicture,...|all] [-b sectors] [-r batches] [-S threads] [-O kilobytes[,buffers]] [-P seconds] [-J summary.json] [-f [-j threads | -x | -X] [-w workers] [-m megabytes] | -c wav|w64] [-G] [-H sums.txt] [-M mapdir] [range | -s [H:]MM:SS-[[H:]MM:SS]]\n");
 }
 
 int main(int argc, char *argv[])
 {
 	char *dvd_filename = "/dev/dvd";
 	uint title = 1;
-	uint audio = 0;
+	bool titles[max_titles+1];
+	int ntitles = 1;
+	int angle = 1;
+	uint audio = 1, subpictures = 0;
+	int batch = default_batch;
+	int readahead = default_readahead;
+	// A job of a batch shares the batch's encoder slots instead.
+	long threads = encode_slots != NULL ? 0 : sysconf(_SC_NPROCESSORS_ONLN);
+	bool ring = false;
+	int workers = default_workers;
+	int budget = default_budget;
+	int iobuf = default_iobuf, iodepth = default_iodepth;
+	char* rest;
+	int interval = 0;
+	const char* summary = NULL;
 	int chapterstart = 0, chapterend = -1;
 	char* chapterrange = "1-";
-	enum {
-		FORMAT_RAW,
-		FORMAT_FLAC,
-	} format = FORMAT_RAW;
+	enum format format = FORMAT_RAW;
+	const char* manifest = NULL;
+	int perdevice = default_perdevice;
+	const char* times = NULL;
+	double from = 0, to = -1;
+	const char* loose = NULL;
+	int ats = 0;
+	bool gain = false;
+	const char* sumsfile = NULL;
+	struct sums* sums = NULL;
+	const char* mapdir = NULL;
+	int scanners = 0;
 	int opt;
-	while ((opt = getopt(argc, argv, "a:d:t:f")) != -1)
+
+	// SIGUSR1 prints the progress line. Block it before starting any
+	// threads so that only the reporting thread takes it.
+	sigset_t usr1;
+	sigemptyset(&usr1);
+	sigaddset(&usr1, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+
+	while ((opt = getopt(argc, argv, "a:b:c:d:i:j:m:p:r:s:t:u:w:A:B:D:H:J:M:O:P:S:GfxX")) != -1)
 	switch (opt) {
 	case 'a':
-		audio = (uint)atoi(optarg);
+		if (parse_streams(optarg, &audio) < 0) {
+			die("Couldn't parse audio streams");
+		}
+		break;
+	case 'b':
+		batch = atoi(optarg);
+		if (batch < 1) {
+			die("Batch size must be at least one sector");
+		}
 		break;
 	case 'd':
 		dvd_filename = optarg;
 		break;
+	case 'i':
+		loose = optarg;
+		break;
+	case 'u':
+		// A DVD-Audio title set
+		ats = atoi(optarg);
+		if (ats < 1 || ats > 99) {
+			die("Audio title set out of range");
+		}
+		break;
+	case 'p':
+		if (parse_streams(optarg, &subpictures) < 0) {
+			die("Couldn't parse subpicture streams");
+		}
+		break;
+	case 'r':
+		readahead = atoi(optarg);
+		if (readahead < 0) {
+			die("Read-ahead can't be negative");
+		}
+		break;
+	case 's':
+		times = optarg;
+		if (parse_times(times, &from, &to) < 0) {
+			die("Couldn't parse time range");
+		}
+		break;
 	case 't':
-		title = (uint)atoi(optarg);
+		ntitles = parse_titles(optarg, titles);
+		if (ntitles < 1) {
+			die("Couldn't parse titles");
+		}
+		for (title = 1; ntitles == 1 && !titles[title]; title++) {
+		}
+		break;
+	case 'A':
+		angle = atoi(optarg);
+		break;
+	case 'P':
+		interval = atoi(optarg);
+		if (interval < 0) {
+			die("Progress interval can't be negative");
+		}
+		break;
+	case 'J':
+		summary = optarg;
+		break;
+	case 'B':
+		if (encode_slots != NULL) {
+			die("A batch job can't run a batch");
+		}
+		manifest = optarg;
+		break;
+	case 'D':
+		perdevice = atoi(optarg);
+		if (perdevice < 1) {
+			die("Need at least one job per device");
+		}
 		break;
 	case 'f':
 		format = FORMAT_FLAC;
 		break;
+	case 'G':
+		gain = true;
+		break;
+	case 'H':
+		sumsfile = optarg;
+		break;
+	case 'M':
+		mapdir = optarg;
+		break;
+	case 'S':
+		// 0 looks through the sectors on the demuxer's thread
+		scanners = atoi(optarg);
+		if (scanners < 0) {
+			die("Scan threads can't be negative");
+		}
+		break;
+	case 'c':
+		if (strcmp(optarg, "wav") == 0) {
+			format = FORMAT_WAV;
+		} else if (strcmp(optarg, "w64") == 0) {
+			format = FORMAT_W64;
+		} else {
+			die("Unknown container %s", optarg);
+		}
+		break;
+	case 'j':
+		threads = atoi(optarg);
+		if (threads < 0) {
+			die("Thread count can't be negative");
+		}
+		break;
+	case 'x':
+		// Use the flac command instead of the built-in encoder
+		threads = -1;
+		ring = false;
+		break;
+	case 'X':
+		// Or run it on a shared-memory ring rather than a pipe
+		threads = -1;
+		ring = true;
+		break;
+	case 'w':
+		workers = atoi(optarg);
+		if (workers < 1) {
+			die("Need at least one encoder worker");
+		}
+		break;
+	case 'O':
+		// 0 writes raw tracks with stdio
+		iobuf = (int)strtol(optarg, &rest, 10);
+		if (*rest == ',') {
+			iodepth = (int)strtol(rest+1, &rest, 10);
+		}
+		if (*rest != '\0' || iobuf < 0 || iodepth < 1) {
+			die("Couldn't parse output buffers");
+		}
+		break;
+	case 'm':
+		// 0 encodes each track before reading on
+		budget = atoi(optarg);
+		if (budget < 0) {
+			die("Memory budget can't be negative");
+		}
+		break;
 	default:
 		usage();
 		return 0;
 	}
 	if (optind < argc) {
+		if (times != NULL) {
+			die("Give either a chapter range or a time range");
+		}
 		chapterrange = argv[optind];
 		optind++;
 	}
@@ -756,11 +5270,96 @@ int main(int argc, char *argv[])
 		usage();
 		return 0;
 	}
+	if (manifest != NULL) {
+		if (threads < 1) {
+			die("Need at least one encoder slot");
+		}
+		return run_batch(manifest, perdevice, (int)threads, interval) > 0;
+	}
 
 	if (parse_range(chapterrange, &chapterstart, &chapterend) < 0) {
 		die("Couldn't parse chapter range");
 	}
-	printf("Ripping tracks %d through %d\n", chapterstart, chapterend);
+	if ((ntitles > 1 || loose != NULL || ats > 0) && (times != NULL || summary != NULL)) {
+		die("-s and -J only go with a single video title");
+	}
+	if (ats > 0 && (ntitles > 1 || loose != NULL)) {
+		die("-u rips one title of a disc image");
+	}
+	if (loose != NULL && (ntitles > 1 || strcmp(chapterrange, "1-") != 0)) {
+		die("A loose file has no titles or chapters");
+	}
+	if (gain && format == FORMAT_RAW) {
+		die("-G needs -f or -c");
+	}
+	if (mapdir != NULL && (loose != NULL || ats > 0)) {
+		die("-M only goes with video titles");
+	}
+	if (sumsfile != NULL && (sums = open_sums()) == NULL) {
+		die("Out of memory");
+	}
+	if (times != NULL) {
+		printf("Ripping %s\n", times);
+	} else if (loose != NULL) {
+		printf("Ripping %s\n", loose);
+	} else {
+		printf("Ripping tracks %d through %d\n", chapterstart, chapterend);
+	}
+
+	if (ntitles > 1 || loose != NULL || ats > 0) {
+		// Several titles, each cell of them read once however many
+		// play it, a loose file, or a DVD-Audio title. There's no
+		// checkpoint, as it only knows about one video title.
+		struct settings o;
+		dvd_reader_t *dvd = NULL;
+		if (angle < 1) {
+			die("Angle out of range");
+		}
+		o.angle = angle;
+		o.audio = audio;
+		o.subpictures = subpictures;
+		o.chapterstart = chapterstart > 0 ? chapterstart-1 : 0;
+		o.chapterend = chapterend;
+		o.format = format;
+		o.threads = (int)threads;
+		o.ring = ring;
+		o.workers = workers;
+		o.budget = budget;
+		o.iobuf = iobuf;
+		o.iodepth = iodepth;
+		o.batch = batch;
+		o.readahead = readahead;
+		o.gain = gain;
+		o.sums = sums;
+		o.mapdir = mapdir;
+		o.scanners = scanners;
+		if (loose == NULL) {
+			dvd = DVDOpen(dvd_filename);
+			if (dvd == NULL) { die("Couldn't open %s", dvd_filename); }
+		}
+
+		start_time = now();
+		struct reporter* reporter = open_reporter(interval);
+		if (reporter == NULL) {
+			die("Couldn't start reporting thread");
+		}
+		int err;
+		if (loose != NULL) {
+			err = rip_loose(loose, &o);
+		} else if (ats > 0) {
+			err = rip_aob(dvd, dvd_filename, ats, (int)title, &o);
+		} else {
+			err = rip_titles(dvd, dvd_filename, titles, &o);
+		}
+		if (sums != NULL && close_sums(sums, sumsfile) < 0) {
+			err = -1;
+		}
+		close_reporter(reporter);
+		if (dvd != NULL) {
+			DVDClose(dvd);
+		}
+		return err < 0;
+	}
 
 	dvd_reader_t *dvd = DVDOpen(dvd_filename);
 	if (dvd == NULL) { die("Couldn't open %s", dvd_filename); }
@@ -772,6 +5371,9 @@ int main(int argc, char *argv[])
 	}
 
 	title_info_t tt = ifo0->tt_srpt->title[title-1];
+	if (angle < 1 || (angle > tt.nr_of_angles && angle != 1)) {
+		die("Angle out of range");
+	}
 
 	ifoClose(ifo0);
 
@@ -792,107 +5394,221 @@ int main(int argc, char *argv[])
 	}
 	ttu_t vtt = ifo->vts_ptt_srpt->title[tt.vts_ttn - 1];
 
-	if (audio >= ifo->vtsi_mat->nr_of_vts_audio_streams) {
-		die("Audio stream out of range");
+	if (chapterstart > 0) {
+		// Switch to zero-indexing
+		chapterstart--;
 	}
-	audio_attr_t a = ifo->vtsi_mat->vts_audio_attr[audio];
-	if (stream_ids[a.audio_format] == 0) {
-		die("Unknown audio format");
+
+	int naudio = ifo->vtsi_mat->nr_of_vts_audio_streams;
+	int nsubp = ifo->vtsi_mat->nr_of_vts_subp_streams;
+	if (audio != ~0U && audio >> naudio != 0) {
+		die("Audio stream out of range");
 	}
-	if (a.sample_frequency == 1 && a.audio_format != 4) {
-		die("Unknown sample rate");
+	if (subpictures != ~0U && nsubp < 32 && subpictures >> nsubp != 0) {
+		die("Subpicture stream out of range");
 	}
-	print_audio(&a, (int)audio);
-	int stream = (int)stream_ids[a.audio_format] + (int)audio;
-
-	int chapters = vtt.nr_of_ptts;
-	int audio_sector[chapters+1];
-
-	for (int i = 0; i < chapters; i++) {
-		uint pgcn = vtt.ptt[i].pgcn - 1U;
-		uint pgn = vtt.ptt[i].pgn - 1U;
-		pgc_t *pgc = ifo->vts_pgcit->pgci_srp[pgcn].pgc;
-		uint cell = pgc->program_map[pgn];
-		cell_playback_t *pb = &pgc->cell_playback[cell-1U];
+	struct sink sinks[8+32];
+	int nsinks = 0;
+	for (int i = 0; i < naudio + nsubp; i++) {
+		int index = i < naudio ? i : i - naudio;
+		if (i < naudio ? !(audio >> index & 1) : !(subpictures >> index & 1)) {
+			continue;
+		}
+		struct sink* k = &sinks[nsinks++];
+		init_sink(k, ifo, i, naudio);
+		k->out.threads = (int)threads;
+		k->out.ring = ring;
+		k->out.sums = sums;
+		k->sectors = malloc((size_t)(vtt.nr_of_ptts+1) * sizeof *k->sectors);
+		if (k->sectors == NULL) {
+			die("Out of memory");
+		}
+		k->last = chapter_sectors(ifo, vob, &vtt, k->spu ? -1 : index, angle-1, chapterstart, k->sectors);
+		if (chapterend >= 0 && chapterend < k->last) {
+			k->last = chapterend;
+		}
+		k->ch = chapterstart < k->last ? chapterstart : k->last;
 
-		audio_sector[i] = get_audio_sector(vob, (int)pb->first_sector, (int)audio);
-		if (audio_sector[i] < 0) {
-			if (i != chapters - 1) {
-				if (i < chapterstart-1) {
-					fprintf(stderr, "warning: chapter %d: Couldn't get audio sector\n", i);
-				} else {
-					die("chapter %d: Couldn't get audio sector", i);
-				}
+		if (format != FORMAT_RAW && (k->stream & ~7) == 0xa0) {
+			sectorbuf b;
+			if (DVDReadBlocks(vob, k->sectors[0], 1, b) < 1) {
+				printf("error: couldn't read audio sector\n");
+				return 1;
 			}
-			audio_sector[i] = (int)pb->first_sector;
-			chapters = i;
-			break;
+			k->out.lpcm_info = read_lpcm_header(b);
+			//printf("%d: %d %d %d\n", k->sectors[0], k->out.lpcm_info.bitdepth, k->out.lpcm_info.sample_rate, k->out.lpcm_info.channels);
+			k->out.format = format;
+			k->out.ext = format == FORMAT_FLAC ? ".flac" : format == FORMAT_WAV ? ".wav" : ".w64";
+			k->seconds = malloc((size_t)vtt.nr_of_ptts * sizeof *k->seconds);
+			if (k->seconds == NULL) {
+				die("Out of memory");
+			}
+			for (int c = 0; c < vtt.nr_of_ptts; c++) {
+				k->seconds[c] = chapter_seconds(ifo, &vtt, c, angle-1);
+			}
+			k->out.seconds = k->seconds;
 		}
-		if (i == chapters - 1) {
-			audio_sector[chapters] = (int)pb->last_sector;
+	}
+	if (times != NULL) {
+		// One track from the VOBUs playing at those times
+		struct title_point start, stop;
+		double length = -from;
+		bool whole = to < 0;
+		for (int c = 0; c < vtt.nr_of_ptts; c++) {
+			length += chapter_seconds(ifo, &vtt, c, angle-1);
+		}
+		if (find_time(ifo, vob, &vtt, angle-1, from, &start) < 0) {
+			die("Title is shorter than %s", times);
+		}
+		if (!whole && find_time(ifo, vob, &vtt, angle-1, to, &stop) == 0) {
+			length = to - from;
+		} else {
+			whole = true;
+		}
+		for (int i = 0; i < nsinks; i++) {
+			if (cut_excerpt(&sinks[i], vob, &start, whole ? NULL : &stop, length) < 0) {
+				die("Couldn't find stream %#x at %s", sinks[i].stream, times);
+			}
 		}
 	}
-
-	char *ext = ".bin";
-	struct lpcm_info lpcm_info;
-	if (format == FORMAT_RAW) {
-		switch (stream & ~7) {
-		case 0x80:
-			ext = ".ac3";
-			break;
-		case 0x88:
-			ext = ".dts";
-			break;
-		case 0xa0:
-			ext = ".pcm";
-			break;
+	struct sched* sched = NULL;
+	if (format != FORMAT_RAW) {
+		int nlpcm = 0;
+		for (int i = 0; i < nsinks; i++) {
+			nlpcm += sinks[i].out.format == format;
 		}
-	} else if (format == FORMAT_FLAC) {
-		if ((stream & ~7) != 0xa0) {
-			printf("error: -f option can only be used with lpcm audio streams\n");
+		if (nlpcm == 0) {
+			printf("error: -%c option can only be used with lpcm audio streams\n", format == FORMAT_FLAC ? 'f' : 'c');
 			return 1;
 		}
-		sectorbuf b;
-		if (DVDReadBlocks(vob, audio_sector[0], 1, b) < 1) {
-			printf("error: couldn't read audio sector\n");
-			return 1;
+		if (format == FORMAT_FLAC && budget > 0) {
+			int nflac = nlpcm;
+			// Every stream's current track needs a worker, or a
+			// full budget could wait on a track nobody is encoding.
+			sched = open_encoders(workers, nflac, budget);
+			if (sched == NULL) {
+				die("Couldn't start encoder workers");
+			}
+			for (int i = 0; i < nsinks; i++) {
+				sinks[i].out.sched = sched;
+			}
+		}
+		for (int i = 0; i < nsinks && gain; i++) {
+			if (sinks[i].out.format == format && (sinks[i].out.gain = open_gain()) == NULL) {
+				die("Out of memory");
+			}
+		}
+	}
+	struct iothread* io = NULL;
+	for (int i = 0; i < nsinks && iobuf > 0; i++) {
+		if (sinks[i].out.format != FORMAT_FLAC) {
+			// A subpicture stream can have two tracks open.
+			io = iothread_open((size_t)iobuf << 10, iodepth, 2*nsinks, &stats->write_ns);
+			if (io == NULL) {
+				die("Couldn't start output thread");
+			}
+			break;
+		}
+	}
+	for (int i = 0; i < nsinks; i++) {
+		sinks[i].out.io = io;
+	}
+	// Pick up where a rip of the same thing left off.
+	char key[128];
+	snprintf(key, sizeof key, "title %u angle %d audio %#x spu %#x format %s%s%s", title, angle, audio, subpictures, format_names[format],
+		times != NULL ? " time " : "", times != NULL ? times : "");
+	struct checkpoint* ckpt = checkpoint_open(checkpoint_file, key);
+	if (ckpt == NULL) {
+		die("Out of memory");
+	}
+	// Only tag the file names if there's more than one stream.
+	int end = 0, skip = 0, resume = 0;
+	for (int i = 0; i < nsinks; i++) {
+		sinks[i].out.tag = nsinks > 1 ? sinks[i].tag : "";
+		sinks[i].out.ckpt = ckpt;
+		skip += resume_sink(&sinks[i], ckpt);
+		resume += sinks[i].from > 0;
+		if (sinks[i].sectors[sinks[i].last] > end) {
+			end = sinks[i].sectors[sinks[i].last];
 		}
-		lpcm_info = read_lpcm_header(b);
-		//printf("%d: %d %d %d\n", audio_sector[0], lpcm_info.bitdepth, lpcm_info.sample_rate, lpcm_info.channels);
-		ext = ".flac";
 	}
 
-	if (chapterstart > 0) {
-		// Switch to zero-indexing
-		chapterstart--;
+	if (skip > 0 || resume > 0) {
+		printf("%s: skipping %d finished tracks, carrying on %d\n", checkpoint_file, skip, resume);
+	}
+
+	// Titles with several angles only play one of them.
+	struct angles* angles = find_angles(ifo, &vtt, angle-1);
+
+	// A decrypted image is read straight from the page cache, which
+	// reads ahead by itself.
+	struct source* src = open_mmap_source(dvd_filename, dvd, tt.title_set_nr, false, batch);
+	if (src != NULL) {
+		readahead = 0;
+		scan_source(src, scanners);
+	} else {
+		src = open_dvd_source(vob, batch);
 	}
-	if (chapterend < 0) {
-		chapterend = chapters;
+	if (src == NULL) {
+		return 1;
+	}
+	if (readahead > 0) {
+		struct source* ra = open_readahead(src, readahead, end, angles);
+		if (ra == NULL) {
+			src->close(src);
+			return 1;
+		}
+		src = ra;
 	}
 
-	char filename[5+10+4+1];
-	struct writer* w;
-	for (int i = chapterstart; i < chapterend; i++) {
-		snprintf(filename, sizeof filename, "track%02d%s", i+1, ext);
-		if (format == FORMAT_RAW) {
-			w = open_file(filename);
-			if (w == NULL) {
-				return 1;
-			}
-		} else if (format == FORMAT_FLAC) {
-			struct writer* w0 = open_flac(filename, lpcm_info);
-			if (w0 == NULL) {
-				return 1;
-			}
-			w = open_repack(w0, lpcm_info);
-			if (w == NULL) {
-				w0->close(w0);
-				return 1;
-			}
+	start_time = now();
+	struct reporter* reporter = open_reporter(interval);
+	if (reporter == NULL) {
+		die("Couldn't start reporting thread");
+	}
+
+	struct tsmap map;
+	open_tsmap(&map, mapdir, tt.title_set_nr, vob);
+	int err = demux(src, sinks, nsinks, angles, ckpt, map.map);
+	src->close(src);
+	if (close_tsmap(&map) < 0) {
+		err = -1;
+	}
+	if (sched != NULL && sched_close(sched) < 0) {
+		err = -1;
+	}
+	if (io != NULL && iothread_close(io) < 0) {
+		err = -1;
+	}
+	for (int i = 0; i < nsinks; i++) {
+		if (sinks[i].out.gain != NULL && close_gain(sinks[i].out.gain) < 0) {
+			err = -1;
 		}
-		dump_audio(w, vob, stream, audio_sector[i], audio_sector[i+1]);
-		w->close(w);
 	}
+	if (sums != NULL && close_sums(sums, sumsfile) < 0) {
+		err = -1;
+	}
+	close_reporter(reporter);
+	if (summary != NULL && write_summary(summary, sinks, nsinks) < 0) {
+		err = -1;
+	}
+	// Keep the checkpoint if any track is missing, so that a rerun
+	// only redoes those.
+	bool finished = err == 0 && checkpoint_failed(ckpt) == 0;
+	if (!finished) {
+		save_checkpoint(ckpt, sinks, nsinks, NULL, 0);
+		printf("%s: not finished; run again to carry on\n", checkpoint_file);
+	}
+	checkpoint_close(ckpt, finished);
+	if (err < 0) {
+		return 1;
+	}
+
+	for (int i = 0; i < nsinks; i++) {
+		free(sinks[i].sectors);
+		free(sinks[i].seconds);
+	}
+	free_angles(angles);
 
 	DVDCloseFile(vob);
 	ifoClose(ifo);
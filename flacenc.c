@@ -0,0 +1,1050 @@
+/* flacenc - a small multithreaded FLAC encoder
+
+Blocks are fixed size and encoded independently, so a job of several frames
+can go to any worker thread as long as the jobs are written out in order.
+Each channel gets the cheapest of a constant, verbatim, fixed or LPC
+subframe, and stereo blocks use whichever channel decorrelation mode comes
+out smallest. */
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "flacenc.h"
+#include "hash.h"
+
+#define BLOCK_SIZE 4096
+#define MAX_CHANNELS 8
+#define MAX_ORDER 12
+#define MAX_PORDER 6
+#define FRAMES_PER_JOB 8
+
+// Residuals are kept well inside 32 bits so that zigzag coding can't
+// overflow. Predictors that do worse than this are skipped.
+#define MAX_RESIDUAL (1 << 30)
+
+enum { SUBFRAME_CONSTANT, SUBFRAME_VERBATIM, SUBFRAME_FIXED, SUBFRAME_LPC };
+
+enum {
+	CHANNELS_INDEPENDENT = 0,
+	CHANNELS_LEFT_SIDE = 8,
+	CHANNELS_RIGHT_SIDE = 9,
+	CHANNELS_MID_SIDE = 10,
+};
+
+struct bitwriter {
+	u8* buf;
+	size_t len;
+	u64 acc;
+	int n;
+};
+
+// Write the low bits of v. Bits must be at most 32.
+static void put(struct bitwriter* bw, uint32_t v, int bits)
+{
+	if (bits == 0) {
+		return;
+	}
+	bw->acc = bw->acc << bits | (v & (uint32_t)((1ULL << bits) - 1));
+	bw->n += bits;
+	while (bw->n >= 8) {
+		bw->n -= 8;
+		bw->buf[bw->len++] = (u8)(bw->acc >> bw->n);
+	}
+}
+
+static void put_signed(struct bitwriter* bw, int32_t v, int bits)
+{
+	put(bw, (uint32_t)v, bits);
+}
+
+// Write q zeros followed by a one.
+static void put_unary(struct bitwriter* bw, uint32_t q)
+{
+	while (q >= 32) {
+		put(bw, 0, 32);
+		q -= 32;
+	}
+	put(bw, 1, (int)q + 1);
+}
+
+static void put_rice(struct bitwriter* bw, int32_t r, int k)
+{
+	uint32_t u = (uint32_t)r << 1 ^ (uint32_t)(r >> 31);
+	uint32_t q = u >> k;
+	if (q + 1 + (uint32_t)k <= 32) {
+		put(bw, 1U << k | (u & ((1U << k) - 1)), (int)q + 1 + k);
+	} else {
+		put_unary(bw, q);
+		put(bw, u, k);
+	}
+}
+
+static void put_utf8(struct bitwriter* bw, uint32_t v)
+{
+	int i, n;
+
+	if (v < 0x80) {
+		put(bw, v, 8);
+		return;
+	}
+	n = v < 0x800 ? 2 : v < 0x10000 ? 3 : v < 0x200000 ? 4 : v < 0x4000000 ? 5 : 6;
+	put(bw, (0xff00U >> n & 0xff) | v >> (6*(n-1)), 8);
+	for (i = n-2; i >= 0; i--) {
+		put(bw, 0x80 | (v >> (6*i) & 0x3f), 8);
+	}
+}
+
+static void align(struct bitwriter* bw)
+{
+	if (bw->n > 0) {
+		put(bw, 0, 8 - bw->n);
+	}
+}
+
+static u8 crc8_table[256];
+static uint16_t crc16_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void init_crc(void)
+{
+	uint i, j, c;
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++) {
+			c = c & 0x80 ? (c << 1) ^ 0x07 : c << 1;
+		}
+		crc8_table[i] = (u8)c;
+		c = i << 8;
+		for (j = 0; j < 8; j++) {
+			c = c & 0x8000 ? (c << 1) ^ 0x8005 : c << 1;
+		}
+		crc16_table[i] = (uint16_t)c;
+	}
+}
+
+static uint crc8(const u8* p, size_t n)
+{
+	uint c = 0;
+	while (n-- > 0) {
+		c = crc8_table[c ^ *p++];
+	}
+	return c;
+}
+
+static uint crc16(const u8* p, size_t n)
+{
+	uint c = 0;
+	while (n-- > 0) {
+		c = (c << 8 & 0xff00) ^ crc16_table[(c >> 8) ^ *p++];
+	}
+	return c;
+}
+
+// How a subframe will be coded.
+struct plan {
+	int type;
+	int wasted; // low bits which are zero in every sample
+	int order;
+	int precision, shift;
+	int32_t coefs[MAX_ORDER];
+	int porder;
+	int method; // 0 for 4-bit rice parameters, 1 for 5-bit
+	u8 params[1 << MAX_PORDER];
+	u64 bits;
+};
+
+// Per-thread working space.
+struct scratch {
+	int32_t chan[MAX_CHANNELS+2][BLOCK_SIZE];
+	int32_t x[BLOCK_SIZE]; // channel with the wasted bits shifted out
+	int32_t res[BLOCK_SIZE];
+	double window[BLOCK_SIZE];
+	double wx[BLOCK_SIZE];
+	int window_size;
+};
+
+// Choose the rice partitioning of a residual. Returns the cost in bits,
+// including the coding method and partition order.
+static u64 plan_residual(struct plan* p, const int32_t* res, int n, int order)
+{
+	u64 sums[1 << MAX_PORDER];
+	u8 params[1 << MAX_PORDER];
+	int maxp, porder, parts, psize, i, j, k, m;
+	u64 best = UINT64_MAX;
+
+	maxp = 0;
+	while (maxp < MAX_PORDER && n % (2 << maxp) == 0 && n >> (maxp+1) > order) {
+		maxp++;
+	}
+	parts = 1 << maxp;
+	psize = n >> maxp;
+	for (i = 0; i < parts; i++) {
+		u64 sum = 0;
+		for (j = i == 0 ? order : i*psize; j < (i+1)*psize; j++) {
+			sum += (uint32_t)res[j] << 1 ^ (uint32_t)(res[j] >> 31);
+		}
+		sums[i] = sum;
+	}
+
+	for (porder = maxp; porder >= 0; porder--) {
+		u64 bits = 2 + 4;
+		bool wide = false;
+		parts = 1 << porder;
+		psize = n >> porder;
+		for (i = 0; i < parts; i++) {
+			u64 cnt = (u64)(i == 0 ? psize - order : psize);
+			u64 sum = sums[i];
+			u64 cost = UINT64_MAX, c;
+			int guess, best_k = 0;
+			// The best parameter is close to log2 of the mean.
+			for (guess = 0; guess < 30 && cnt << (guess+1) < sum; guess++) {
+			}
+			for (k = guess > 0 ? guess-1 : 0; k <= guess+1 && k <= 30; k++) {
+				c = cnt*(u64)(k+1) + (sum >> k);
+				if (c < cost) {
+					cost = c;
+					best_k = k;
+				}
+			}
+			k = best_k;
+			params[i] = (u8)k;
+			wide = wide || k > 14;
+			bits += cost;
+		}
+		bits += (u64)parts * (wide ? 5 : 4);
+		if (bits < best) {
+			best = bits;
+			p->porder = porder;
+			p->method = wide;
+			memcpy(p->params, params, (size_t)parts);
+		}
+		// Merge pairs of partitions for the next order down.
+		for (i = 0, m = parts/2; i < m; i++) {
+			sums[i] = sums[2*i] + sums[2*i+1];
+		}
+	}
+	return best;
+}
+
+static bool fixed_residual(const int32_t* x, int n, int order, int32_t* res)
+{
+	int i;
+	int64_t r;
+	for (i = order; i < n; i++) {
+		switch (order) {
+		case 0: r = x[i]; break;
+		case 1: r = (int64_t)x[i] - x[i-1]; break;
+		case 2: r = (int64_t)x[i] - 2*(int64_t)x[i-1] + x[i-2]; break;
+		case 3: r = (int64_t)x[i] - 3*(int64_t)x[i-1] + 3*(int64_t)x[i-2] - x[i-3]; break;
+		default: r = (int64_t)x[i] - 4*(int64_t)x[i-1] + 6*(int64_t)x[i-2] - 4*(int64_t)x[i-3] + x[i-4]; break;
+		}
+		if (r <= -MAX_RESIDUAL || r >= MAX_RESIDUAL) {
+			return false;
+		}
+		res[i] = (int32_t)r;
+	}
+	return true;
+}
+
+static bool lpc_residual(const int32_t* x, int n, const int32_t* coefs, int order, int shift, int32_t* res)
+{
+	int i, j;
+	int64_t sum, r;
+	for (i = order; i < n; i++) {
+		sum = 0;
+		for (j = 0; j < order; j++) {
+			sum += (int64_t)coefs[j] * x[i-j-1];
+		}
+		r = x[i] - (sum >> shift);
+		if (r <= -MAX_RESIDUAL || r >= MAX_RESIDUAL) {
+			return false;
+		}
+		res[i] = (int32_t)r;
+	}
+	return true;
+}
+
+// Quantize LPC coefficients to the given precision. Returns the shift, or
+// -1 if the coefficients can't be represented.
+static int quantize(const double* lp, int order, int precision, int32_t* q)
+{
+	double cmax = 0, err = 0;
+	int i, shift, log2cmax;
+	long v, qmax = (1L << (precision-1)) - 1;
+
+	for (i = 0; i < order; i++) {
+		if (fabs(lp[i]) > cmax) {
+			cmax = fabs(lp[i]);
+		}
+	}
+	if (cmax <= 0) {
+		return -1;
+	}
+	// Leave a bit for the sign.
+	frexp(cmax, &log2cmax);
+	shift = precision - 1 - log2cmax;
+	if (shift > 15) {
+		shift = 15;
+	}
+	if (shift < 0) {
+		return -1;
+	}
+	for (i = 0; i < order; i++) {
+		err += lp[i] * (double)(1 << shift);
+		v = lround(err);
+		if (v > qmax) {
+			v = qmax;
+		} else if (v < -qmax-1) {
+			v = -qmax-1;
+		}
+		err -= (double)v;
+		q[i] = (int32_t)v;
+	}
+	return shift;
+}
+
+static const double pi = 3.14159265358979323846;
+
+// Tukey(0.5) window, as used by the reference encoder.
+static void make_window(struct scratch* s, int n)
+{
+	int i, np = n/4;
+	for (i = 0; i < n; i++) {
+		if (i < np) {
+			s->window[i] = 0.5 - 0.5*cos(pi * i / np);
+		} else if (i >= n - np) {
+			s->window[i] = 0.5 - 0.5*cos(pi * (n-1-i) / np);
+		} else {
+			s->window[i] = 1;
+		}
+	}
+	s->window_size = n;
+}
+
+// Find the cheapest way to code s->x as a subframe of the given depth.
+static void plan_subframe(struct scratch* s, int n, int bps, struct plan* best)
+{
+	const int32_t* x = s->x;
+	double autoc[MAX_ORDER+1];
+	double lpc[MAX_ORDER], lp[MAX_ORDER][MAX_ORDER], errs[MAX_ORDER];
+	double err, r, tmp, est, best_est;
+	struct plan p;
+	int i, j, order, maxorder, precision, shift, guess;
+	u64 header = 8 + (u64)best->wasted;
+
+	// Constant
+	for (i = 1; i < n && x[i] == x[0]; i++) {
+	}
+	if (i == n) {
+		best->type = SUBFRAME_CONSTANT;
+		best->bits = header + (u64)bps;
+		return;
+	}
+
+	// Verbatim
+	best->type = SUBFRAME_VERBATIM;
+	best->bits = header + (u64)n*(u64)bps;
+
+	// Fixed
+	p = *best;
+	for (order = 0; order <= 4 && order < n; order++) {
+		if (!fixed_residual(x, n, order, s->res)) {
+			continue;
+		}
+		p.bits = header + (u64)(order*bps) + plan_residual(&p, s->res, n, order);
+		if (p.bits < best->bits) {
+			p.type = SUBFRAME_FIXED;
+			p.order = order;
+			*best = p;
+		}
+	}
+
+	// LPC
+	maxorder = bps <= 16 ? 8 : MAX_ORDER;
+	if (maxorder >= n) {
+		maxorder = n - 1;
+	}
+	if (s->window_size != n) {
+		make_window(s, n);
+	}
+	for (i = 0; i < n; i++) {
+		s->wx[i] = x[i] * s->window[i];
+	}
+	for (j = 0; j <= maxorder; j++) {
+		double sum = 0;
+		for (i = j; i < n; i++) {
+			sum += s->wx[i] * s->wx[i-j];
+		}
+		autoc[j] = sum;
+	}
+	if (autoc[0] == 0) {
+		return;
+	}
+	// Levinson-Durbin recursion
+	err = autoc[0];
+	for (i = 0; i < maxorder; i++) {
+		r = -autoc[i+1];
+		for (j = 0; j < i; j++) {
+			r -= lpc[j] * autoc[i-j];
+		}
+		r /= err;
+		lpc[i] = r;
+		for (j = 0; j < i/2; j++) {
+			tmp = lpc[j];
+			lpc[j] += r * lpc[i-1-j];
+			lpc[i-1-j] += r * tmp;
+		}
+		if (i & 1) {
+			lpc[j] += lpc[j] * r;
+		}
+		err *= 1 - r*r;
+		errs[i] = err;
+		for (j = 0; j <= i; j++) {
+			lp[i][j] = -lpc[j];
+		}
+		if (err <= 0) {
+			maxorder = i + 1;
+			break;
+		}
+	}
+
+	if (bps > 16) {
+		precision = 15;
+	} else {
+		precision = n <= 192 ? 7 : n <= 384 ? 8 : n <= 576 ? 9 :
+			n <= 1152 ? 10 : n <= 2304 ? 11 : n <= 4608 ? 12 : 13;
+	}
+	// Guess the best order from the prediction error, and only try it and
+	// its neighbours.
+	guess = 1;
+	best_est = HUGE_VAL;
+	for (order = 1; order <= maxorder; order++) {
+		est = errs[order-1] > 0 ? 0.5 * log2(0.5 * errs[order-1] / n) : 0;
+		if (est < 0) {
+			est = 0;
+		}
+		est = est * (n - order) + order * (bps + precision);
+		if (est < best_est) {
+			best_est = est;
+			guess = order;
+		}
+	}
+	for (order = guess > 1 ? guess-1 : 1; order <= guess+1 && order <= maxorder; order++) {
+		shift = quantize(lp[order-1], order, precision, p.coefs);
+		if (shift < 0) {
+			continue;
+		}
+		if (!lpc_residual(x, n, p.coefs, order, shift, s->res)) {
+			continue;
+		}
+		p.bits = header + (u64)(order*bps) + 4 + 5 + (u64)(order*precision) +
+			plan_residual(&p, s->res, n, order);
+		if (p.bits < best->bits) {
+			p.type = SUBFRAME_LPC;
+			p.order = order;
+			p.precision = precision;
+			p.shift = shift;
+			*best = p;
+		}
+	}
+}
+
+// Shift the wasted bits out of a channel into s->x and plan its subframe.
+static void analyze(struct scratch* s, const int32_t* in, int n, int bps, struct plan* p)
+{
+	uint32_t bits = 0;
+	int i, k = 0;
+
+	for (i = 0; i < n; i++) {
+		bits |= (uint32_t)in[i];
+	}
+	if (bits != 0) {
+		while (!(bits >> k & 1)) {
+			k++;
+		}
+	}
+	if (k >= bps) {
+		k = 0;
+	}
+	for (i = 0; i < n; i++) {
+		s->x[i] = in[i] >> k;
+	}
+	p->wasted = k;
+	plan_subframe(s, n, bps - k, p);
+}
+
+static void write_residual(struct bitwriter* bw, const struct plan* p, const int32_t* res, int n)
+{
+	int i, j, parts = 1 << p->porder, psize = n >> p->porder;
+
+	put(bw, (uint32_t)p->method, 2);
+	put(bw, (uint32_t)p->porder, 4);
+	for (i = 0; i < parts; i++) {
+		int k = p->params[i];
+		put(bw, (uint32_t)k, p->method ? 5 : 4);
+		for (j = i == 0 ? p->order : i*psize; j < (i+1)*psize; j++) {
+			put_rice(bw, res[j], k);
+		}
+	}
+}
+
+// Write the planned subframe for the channel in.
+static void write_subframe(struct bitwriter* bw, struct scratch* s, const struct plan* p, const int32_t* in, int n, int bps)
+{
+	const int32_t* x = s->x;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		s->x[i] = in[i] >> p->wasted;
+	}
+	bps -= p->wasted;
+
+	switch (p->type) {
+	case SUBFRAME_CONSTANT: put(bw, 0x00, 7); break;
+	case SUBFRAME_VERBATIM: put(bw, 0x01, 7); break;
+	case SUBFRAME_FIXED: put(bw, (uint32_t)(0x08 | p->order), 7); break;
+	case SUBFRAME_LPC: put(bw, (uint32_t)(0x20 | (p->order-1)), 7); break;
+	}
+	if (p->wasted > 0) {
+		put(bw, 1, 1);
+		put_unary(bw, (uint32_t)p->wasted - 1);
+	} else {
+		put(bw, 0, 1);
+	}
+
+	switch (p->type) {
+	case SUBFRAME_CONSTANT:
+		put_signed(bw, x[0], bps);
+		break;
+	case SUBFRAME_VERBATIM:
+		for (i = 0; i < n; i++) {
+			put_signed(bw, x[i], bps);
+		}
+		break;
+	case SUBFRAME_FIXED:
+		for (i = 0; i < p->order; i++) {
+			put_signed(bw, x[i], bps);
+		}
+		fixed_residual(x, n, p->order, s->res);
+		write_residual(bw, p, s->res, n);
+		break;
+	case SUBFRAME_LPC:
+		for (i = 0; i < p->order; i++) {
+			put_signed(bw, x[i], bps);
+		}
+		put(bw, (uint32_t)p->precision - 1, 4);
+		put_signed(bw, p->shift, 5);
+		for (i = 0; i < p->order; i++) {
+			put_signed(bw, p->coefs[i], p->precision);
+		}
+		lpc_residual(x, n, p->coefs, p->order, p->shift, s->res);
+		write_residual(bw, p, s->res, n);
+		break;
+	}
+}
+
+struct job {
+	int32_t* samples;
+	int n; // samples per channel
+	uint32_t frame; // number of the first frame
+	u8* out;
+	size_t len;
+	uint32_t minframe, maxframe;
+	int state;
+};
+
+enum { JOB_FREE, JOB_QUEUED, JOB_BUSY, JOB_DONE };
+
+struct flacenc {
+	FILE* fp;
+	int rate, channels, bits;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t* threads;
+	int nthreads;
+	bool quit;
+
+	struct job* jobs;
+	int njobs;
+	int fill; // job being filled
+	int next; // next job for a worker
+	int done; // next job to write
+
+	struct scratch* scratch; // for encoding on the calling thread
+
+	u64 total;
+	uint32_t frames;
+	uint32_t minframe, maxframe;
+	struct hash hash; // of the samples as little-endian bytes, for the MD5
+	u8 md5[16]; // all zeros, meaning unknown, until the stream is closed
+	int err;
+};
+
+static void encode_frame(struct flacenc* e, struct scratch* s, struct bitwriter* bw, const int32_t* samples, int n, uint32_t frame)
+{
+	struct plan plans[MAX_CHANNELS+2];
+	int nch = e->channels, bps = e->bits;
+	int i, c, bscode, srcode, sscode, chcode;
+	size_t start = bw->len;
+	u64 best;
+
+	for (i = 0; i < n; i++) {
+		for (c = 0; c < nch; c++) {
+			s->chan[c][i] = samples[i*nch + c];
+		}
+	}
+	for (c = 0; c < nch; c++) {
+		analyze(s, s->chan[c], n, bps, &plans[c]);
+	}
+	chcode = nch - 1;
+	if (nch == 2) {
+		// Mid and side in the two spare channels
+		for (i = 0; i < n; i++) {
+			int32_t l = s->chan[0][i], r = s->chan[1][i];
+			s->chan[2][i] = (l + r) >> 1;
+			s->chan[3][i] = l - r;
+		}
+		analyze(s, s->chan[2], n, bps, &plans[2]);
+		analyze(s, s->chan[3], n, bps+1, &plans[3]);
+		best = plans[0].bits + plans[1].bits;
+		chcode = CHANNELS_INDEPENDENT + 1;
+		if (plans[0].bits + plans[3].bits < best) {
+			best = plans[0].bits + plans[3].bits;
+			chcode = CHANNELS_LEFT_SIDE;
+		}
+		if (plans[3].bits + plans[1].bits < best) {
+			best = plans[3].bits + plans[1].bits;
+			chcode = CHANNELS_RIGHT_SIDE;
+		}
+		if (plans[2].bits + plans[3].bits < best) {
+			chcode = CHANNELS_MID_SIDE;
+		}
+	}
+
+	switch (n) {
+	case 192: bscode = 1; break;
+	case 576: bscode = 2; break;
+	case 1152: bscode = 3; break;
+	case 2304: bscode = 4; break;
+	case 4608: bscode = 5; break;
+	case 256: bscode = 8; break;
+	case 512: bscode = 9; break;
+	case 1024: bscode = 10; break;
+	case 2048: bscode = 11; break;
+	case 4096: bscode = 12; break;
+	default: bscode = n <= 256 ? 6 : 7; break;
+	}
+	switch (e->rate) {
+	case 88200: srcode = 1; break;
+	case 176400: srcode = 2; break;
+	case 192000: srcode = 3; break;
+	case 8000: srcode = 4; break;
+	case 16000: srcode = 5; break;
+	case 22050: srcode = 6; break;
+	case 24000: srcode = 7; break;
+	case 32000: srcode = 8; break;
+	case 44100: srcode = 9; break;
+	case 48000: srcode = 10; break;
+	case 96000: srcode = 11; break;
+	default:
+		srcode = e->rate % 1000 == 0 && e->rate <= 255000 ? 12 :
+			e->rate <= 65535 ? 13 : 0;
+		break;
+	}
+	switch (bps) {
+	case 8: sscode = 1; break;
+	case 12: sscode = 2; break;
+	case 16: sscode = 4; break;
+	case 20: sscode = 5; break;
+	case 24: sscode = 6; break;
+	default: sscode = 0; break;
+	}
+
+	put(bw, 0x3ffe, 14);
+	put(bw, 0, 1); // reserved
+	put(bw, 0, 1); // fixed block size
+	put(bw, (uint32_t)bscode, 4);
+	put(bw, (uint32_t)srcode, 4);
+	put(bw, (uint32_t)chcode, 4);
+	put(bw, (uint32_t)sscode, 3);
+	put(bw, 0, 1); // reserved
+	put_utf8(bw, frame);
+	if (bscode == 6) {
+		put(bw, (uint32_t)n - 1, 8);
+	} else if (bscode == 7) {
+		put(bw, (uint32_t)n - 1, 16);
+	}
+	if (srcode == 12) {
+		put(bw, (uint32_t)e->rate / 1000, 8);
+	} else if (srcode == 13) {
+		put(bw, (uint32_t)e->rate, 16);
+	}
+	put(bw, crc8(bw->buf + start, bw->len - start), 8);
+
+	switch (chcode) {
+	case CHANNELS_LEFT_SIDE:
+		write_subframe(bw, s, &plans[0], s->chan[0], n, bps);
+		write_subframe(bw, s, &plans[3], s->chan[3], n, bps+1);
+		break;
+	case CHANNELS_RIGHT_SIDE:
+		write_subframe(bw, s, &plans[3], s->chan[3], n, bps+1);
+		write_subframe(bw, s, &plans[1], s->chan[1], n, bps);
+		break;
+	case CHANNELS_MID_SIDE:
+		write_subframe(bw, s, &plans[2], s->chan[2], n, bps);
+		write_subframe(bw, s, &plans[3], s->chan[3], n, bps+1);
+		break;
+	default:
+		for (c = 0; c < nch; c++) {
+			write_subframe(bw, s, &plans[c], s->chan[c], n, bps);
+		}
+		break;
+	}
+	align(bw);
+	put(bw, crc16(bw->buf + start, bw->len - start), 16);
+}
+
+// Largest possible encoding of a frame: every subframe verbatim, plus
+// headers.
+static size_t max_frame_size(struct flacenc* e)
+{
+	return (size_t)BLOCK_SIZE * (size_t)e->channels * (size_t)(e->bits + 1) / 8 +
+		(size_t)e->channels * 8 + 32;
+}
+
+static void encode_job(struct flacenc* e, struct scratch* s, struct job* j)
+{
+	struct bitwriter bw = {j->out, 0, 0, 0};
+	int i, n;
+	size_t start;
+	uint32_t size;
+
+	j->minframe = UINT32_MAX;
+	j->maxframe = 0;
+	for (i = 0; i*BLOCK_SIZE < j->n; i++) {
+		n = j->n - i*BLOCK_SIZE;
+		if (n > BLOCK_SIZE) {
+			n = BLOCK_SIZE;
+		}
+		start = bw.len;
+		encode_frame(e, s, &bw, j->samples + (size_t)i*BLOCK_SIZE*(size_t)e->channels, n, j->frame + (uint32_t)i);
+		size = (uint32_t)(bw.len - start);
+		if (size < j->minframe) {
+			j->minframe = size;
+		}
+		if (size > j->maxframe) {
+			j->maxframe = size;
+		}
+	}
+	j->len = bw.len;
+}
+
+static void* worker(void* arg)
+{
+	struct flacenc* e = arg;
+	struct scratch* s = malloc(sizeof *s);
+	struct job* j;
+
+	pthread_mutex_lock(&e->lock);
+	if (s == NULL) {
+		e->err = -1;
+	} else {
+		s->window_size = 0;
+	}
+	for (;;) {
+		j = &e->jobs[e->next];
+		if (j->state == JOB_QUEUED && s != NULL) {
+			j->state = JOB_BUSY;
+			e->next = (e->next + 1) % e->njobs;
+			pthread_mutex_unlock(&e->lock);
+			encode_job(e, s, j);
+			pthread_mutex_lock(&e->lock);
+			j->state = JOB_DONE;
+			pthread_cond_broadcast(&e->cond);
+			continue;
+		}
+		if (e->quit) {
+			break;
+		}
+		pthread_cond_wait(&e->cond, &e->lock);
+	}
+	pthread_mutex_unlock(&e->lock);
+	free(s);
+	return NULL;
+}
+
+// Write out the finished job at the head of the queue. Called with the
+// lock held.
+static void write_job(struct flacenc* e, struct job* j)
+{
+	pthread_mutex_unlock(&e->lock);
+	if (j->len > 0 && fwrite(j->out, j->len, 1, e->fp) != 1) {
+		perror("fwrite");
+		e->err = -1;
+	}
+	pthread_mutex_lock(&e->lock);
+	if (j->n > 0) {
+		if (j->minframe < e->minframe) {
+			e->minframe = j->minframe;
+		}
+		if (j->maxframe > e->maxframe) {
+			e->maxframe = j->maxframe;
+		}
+	}
+	j->n = 0;
+	j->state = JOB_FREE;
+	e->done = (e->done + 1) % e->njobs;
+}
+
+// Queue the job being filled and move on to the next one, writing out
+// finished jobs until it is free.
+static void submit(struct flacenc* e)
+{
+	struct job* j = &e->jobs[e->fill];
+
+	j->frame = e->frames;
+	e->frames += (uint32_t)((j->n + BLOCK_SIZE - 1) / BLOCK_SIZE);
+	if (e->nthreads == 0) {
+		encode_job(e, e->scratch, j);
+		pthread_mutex_lock(&e->lock);
+		write_job(e, j);
+		pthread_mutex_unlock(&e->lock);
+		return;
+	}
+
+	pthread_mutex_lock(&e->lock);
+	j->state = JOB_QUEUED;
+	pthread_cond_broadcast(&e->cond);
+	e->fill = (e->fill + 1) % e->njobs;
+	for (;;) {
+		struct job* head = &e->jobs[e->done];
+		if (head->state == JOB_DONE) {
+			write_job(e, head);
+			continue;
+		}
+		if (e->jobs[e->fill].state == JOB_FREE) {
+			break;
+		}
+		pthread_cond_wait(&e->cond, &e->lock);
+	}
+	pthread_mutex_unlock(&e->lock);
+}
+
+static void write_streaminfo(struct flacenc* e)
+{
+	u8 buf[4+4+34];
+	struct bitwriter bw = {buf, 0, 0, 0};
+	uint32_t bs = BLOCK_SIZE;
+
+	if (e->total < BLOCK_SIZE && e->total > 0) {
+		bs = (uint32_t)e->total;
+	}
+	put(&bw, 0x664c6143, 32); // fLaC
+	put(&bw, 1, 1); // last metadata block
+	put(&bw, 0, 7); // STREAMINFO
+	put(&bw, 34, 24);
+	put(&bw, bs, 16);
+	put(&bw, bs, 16);
+	put(&bw, e->maxframe > 0 ? e->minframe : 0, 24);
+	put(&bw, e->maxframe, 24);
+	put(&bw, (uint32_t)e->rate, 20);
+	put(&bw, (uint32_t)e->channels - 1, 3);
+	put(&bw, (uint32_t)e->bits - 1, 5);
+	put(&bw, (uint32_t)(e->total >> 32), 4);
+	put(&bw, (uint32_t)e->total, 32);
+	memcpy(buf + bw.len, e->md5, 16);
+	if (fwrite(buf, sizeof buf, 1, e->fp) != 1) {
+		perror("fwrite");
+		e->err = -1;
+	}
+}
+
+struct flacenc* flacenc_open(FILE* fp, int sample_rate, int channels, int bits, int threads)
+{
+	struct flacenc* e;
+	int i;
+
+	if (channels < 1 || channels > MAX_CHANNELS || bits < 4 || bits > 24 ||
+	    sample_rate < 1 || sample_rate >= 1<<20) {
+		fprintf(stderr, "flacenc: unsupported format\n");
+		return NULL;
+	}
+	pthread_once(&crc_once, init_crc);
+
+	e = calloc(1, sizeof *e);
+	if (e == NULL) {
+		return NULL;
+	}
+	e->fp = fp;
+	e->rate = sample_rate;
+	e->channels = channels;
+	e->bits = bits;
+	e->minframe = UINT32_MAX;
+	hash_init(&e->hash);
+	e->nthreads = threads > 0 ? threads : 0;
+	e->njobs = threads > 0 ? 2*threads + 1 : 1;
+
+	e->jobs = calloc((size_t)e->njobs, sizeof *e->jobs);
+	if (e->jobs == NULL) {
+		goto error;
+	}
+	for (i = 0; i < e->njobs; i++) {
+		struct job* j = &e->jobs[i];
+		j->samples = malloc((size_t)FRAMES_PER_JOB*BLOCK_SIZE*(size_t)channels * sizeof *j->samples);
+		j->out = malloc(FRAMES_PER_JOB * max_frame_size(e));
+		if (j->samples == NULL || j->out == NULL) {
+			goto error;
+		}
+	}
+	if (e->nthreads == 0) {
+		e->scratch = malloc(sizeof *e->scratch);
+		if (e->scratch == NULL) {
+			goto error;
+		}
+		e->scratch->window_size = 0;
+	}
+
+	write_streaminfo(e);
+	if (e->err < 0) {
+		goto error;
+	}
+
+	pthread_mutex_init(&e->lock, NULL);
+	pthread_cond_init(&e->cond, NULL);
+	if (e->nthreads > 0) {
+		e->threads = calloc((size_t)e->nthreads, sizeof *e->threads);
+		if (e->threads == NULL) {
+			goto error_threads;
+		}
+		for (i = 0; i < e->nthreads; i++) {
+			if (pthread_create(&e->threads[i], NULL, worker, e) != 0) {
+				perror("pthread_create");
+				e->nthreads = i;
+				e->err = -1;
+				flacenc_close(e);
+				return NULL;
+			}
+		}
+	}
+	return e;
+
+error_threads:
+	pthread_mutex_destroy(&e->lock);
+	pthread_cond_destroy(&e->cond);
+error:
+	if (e->jobs != NULL) {
+		for (i = 0; i < e->njobs; i++) {
+			free(e->jobs[i].samples);
+			free(e->jobs[i].out);
+		}
+	}
+	free(e->jobs);
+	free(e->scratch);
+	free(e);
+	return NULL;
+}
+
+// Hash samples as FLAC's MD5 takes them: interleaved, each in as few
+// little-endian bytes as hold the sample size.
+static void hash_samples(struct flacenc* e, const int32_t* samples, size_t n)
+{
+	u8 buf[4096*3];
+	int bytes = (e->bits + 7) / 8;
+	size_t i, m;
+
+	while (n > 0) {
+		m = n < sizeof buf / 3 ? n : sizeof buf / 3;
+		u8* p = buf;
+		for (i = 0; i < m; i++) {
+			uint32_t v = (uint32_t)samples[i];
+			for (int k = 0; k < bytes; k++) {
+				*p++ = (u8)(v >> 8*k);
+			}
+		}
+		hash_update(&e->hash, buf, (size_t)(p - buf));
+		samples += m;
+		n -= m;
+	}
+}
+
+int flacenc_write(struct flacenc* e, const int32_t* samples, int n)
+{
+	int max = FRAMES_PER_JOB*BLOCK_SIZE;
+	int m;
+
+	if (n > 0) {
+		hash_samples(e, samples, (size_t)n*(size_t)e->channels);
+	}
+	while (n > 0) {
+		struct job* j = &e->jobs[e->fill];
+		m = max - j->n;
+		if (m > n) {
+			m = n;
+		}
+		memcpy(j->samples + (size_t)j->n*(size_t)e->channels, samples, (size_t)m*(size_t)e->channels * sizeof *samples);
+		j->n += m;
+		samples += (size_t)m*(size_t)e->channels;
+		n -= m;
+		e->total += (u64)m;
+		if (j->n == max) {
+			submit(e);
+		}
+	}
+	return e->err;
+}
+
+int flacenc_close(struct flacenc* e)
+{
+	int i, err;
+
+	if (e->jobs[e->fill].n > 0) {
+		submit(e);
+	}
+	if (e->nthreads > 0) {
+		pthread_mutex_lock(&e->lock);
+		while (e->done != e->fill) {
+			struct job* head = &e->jobs[e->done];
+			if (head->state == JOB_DONE) {
+				write_job(e, head);
+				continue;
+			}
+			pthread_cond_wait(&e->cond, &e->lock);
+		}
+		e->quit = true;
+		pthread_cond_broadcast(&e->cond);
+		pthread_mutex_unlock(&e->lock);
+		for (i = 0; i < e->nthreads; i++) {
+			pthread_join(e->threads[i], NULL);
+		}
+	}
+
+	if (e->err == 0) {
+		uint32_t crc;
+		hash_final(&e->hash, &crc, e->md5);
+		if (fseek(e->fp, 0, SEEK_SET) < 0) {
+			perror("fseek");
+			e->err = -1;
+		} else {
+			write_streaminfo(e);
+			fseek(e->fp, 0, SEEK_END);
+		}
+	}
+	err = e->err;
+
+	pthread_mutex_destroy(&e->lock);
+	pthread_cond_destroy(&e->cond);
+	for (i = 0; i < e->njobs; i++) {
+		free(e->jobs[i].samples);
+		free(e->jobs[i].out);
+	}
+	free(e->jobs);
+	free(e->threads);
+	free(e->scratch);
+	free(e);
+	return err;
+}
@@ -0,0 +1,21 @@
+#ifndef FLACENC_H
+#define FLACENC_H
+
+#include <stdio.h>
+#include "uint.h"
+
+struct flacenc;
+
+// Start a FLAC stream on fp. Fp must be seekable, since STREAMINFO is
+// filled in when the stream is closed. Frames are encoded on threads worker
+// threads, or on the calling thread if threads is 0.
+struct flacenc* flacenc_open(FILE* fp, int sample_rate, int channels, int bits, int threads);
+
+// Encode n interleaved samples per channel. Returns -1 on error.
+int flacenc_write(struct flacenc* e, const int32_t* samples, int n);
+
+// Flush the remaining frames, rewrite STREAMINFO and free the encoder.
+// Doesn't close fp. Returns -1 if anything failed.
+int flacenc_close(struct flacenc* e);
+
+#endif
@@ -0,0 +1,319 @@
+#include "flacenc.h"
+#include "bitreader.h"
+#include "hash.h"
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Just enough of a FLAC decoder to read back what flacenc writes.
+
+static size_t bitpos(struct bitreader *b)
+{
+	return b->pos*8 - b->count;
+}
+
+static int32_t read_signed(struct bitreader *b, int n)
+{
+	uint v = read_bits(b, (uint)n);
+	if (n < 32 && v >> (n-1) & 1) {
+		return (int32_t)(v | ~0U << n);
+	}
+	return (int32_t)v;
+}
+
+static uint read_unary(struct bitreader *b)
+{
+	uint q = 0;
+	while (read_bits(b, 1) == 0) {
+		q++;
+	}
+	return q;
+}
+
+static uint crc16(const u8 *p, size_t n)
+{
+	uint c = 0;
+	int i;
+	while (n-- > 0) {
+		c ^= (uint)*p++ << 8;
+		for (i = 0; i < 8; i++) {
+			c = c & 0x8000 ? (c << 1 ^ 0x8005) & 0xffff : c << 1 & 0xffff;
+		}
+	}
+	return c;
+}
+
+static void read_residual(struct bitreader *b, int32_t *x, int n, int order)
+{
+	uint method = read_bits(b, 2);
+	uint porder = read_bits(b, 4);
+	int parts = 1 << porder, psize = n >> porder;
+	int i, j;
+
+	assert(method <= 1);
+	for (i = 0; i < parts; i++) {
+		uint k = read_bits(b, method ? 5 : 4);
+		assert(k != (method ? 31U : 15U));
+		for (j = i == 0 ? order : i*psize; j < (i+1)*psize; j++) {
+			uint u = read_unary(b) << k | read_bits(b, k);
+			x[j] = (int32_t)(u >> 1 ^ -(u & 1));
+		}
+	}
+}
+
+static void read_subframe(struct bitreader *b, int32_t *x, int n, int bps)
+{
+	int type, wasted = 0, order, i, j;
+
+	assert(read_bits(b, 1) == 0);
+	type = (int)read_bits(b, 6);
+	if (read_bits(b, 1)) {
+		wasted = (int)read_unary(b) + 1;
+	}
+	bps -= wasted;
+
+	if (type == 0) {
+		int32_t v = read_signed(b, bps);
+		for (i = 0; i < n; i++) {
+			x[i] = v;
+		}
+	} else if (type == 1) {
+		for (i = 0; i < n; i++) {
+			x[i] = read_signed(b, bps);
+		}
+	} else if ((type & 0x38) == 0x08) {
+		static const int64_t fixed[5][4] = {
+			{0}, {1}, {2, -1}, {3, -3, 1}, {4, -6, 4, -1},
+		};
+		order = type & 7;
+		assert(order <= 4);
+		for (i = 0; i < order; i++) {
+			x[i] = read_signed(b, bps);
+		}
+		read_residual(b, x, n, order);
+		for (i = order; i < n; i++) {
+			int64_t sum = 0;
+			for (j = 0; j < order; j++) {
+				sum += fixed[order][j] * x[i-j-1];
+			}
+			x[i] = (int32_t)(x[i] + sum);
+		}
+	} else if (type & 0x20) {
+		int32_t coefs[32];
+		int precision, shift;
+		order = (type & 0x1f) + 1;
+		for (i = 0; i < order; i++) {
+			x[i] = read_signed(b, bps);
+		}
+		precision = (int)read_bits(b, 4) + 1;
+		shift = read_signed(b, 5);
+		assert(precision < 16 && shift >= 0);
+		for (i = 0; i < order; i++) {
+			coefs[i] = read_signed(b, precision);
+		}
+		read_residual(b, x, n, order);
+		for (i = order; i < n; i++) {
+			int64_t sum = 0;
+			for (j = 0; j < order; j++) {
+				sum += (int64_t)coefs[j] * x[i-j-1];
+			}
+			x[i] = (int32_t)(x[i] + (sum >> shift));
+		}
+	} else {
+		assert(!"reserved subframe type");
+	}
+	for (i = 0; i < n; i++) {
+		x[i] = (int32_t)((uint32_t)x[i] << wasted);
+	}
+}
+
+// Decode a whole stream and compare it against the original samples.
+static void check(const u8 *buf, size_t len, const int32_t *want, int total, int rate, int channels, int bits)
+{
+	static int32_t chan[8][65536];
+	struct bitreader b;
+	int frame = 0, pos = 0, i, c;
+
+	bitreader_init(&b, buf, len);
+	assert(read_bits(&b, 32) == 0x664c6143);
+	assert(read_bits(&b, 1) == 1);
+	assert(read_bits(&b, 7) == 0);
+	assert(read_bits(&b, 24) == 34);
+	skip_bits(&b, 16+16+24+24);
+	assert(read_bits(&b, 20) == (uint)rate);
+	assert(read_bits(&b, 3) == (uint)channels - 1);
+	assert(read_bits(&b, 5) == (uint)bits - 1);
+	assert(read_bits(&b, 4) == 0);
+	assert(read_bits(&b, 32) == (uint)total);
+	// The MD5 of the samples, as little-endian bytes
+	struct hash h;
+	uint32_t crc32;
+	u8 md5[16];
+	hash_init(&h);
+	for (i = 0; i < total*channels; i++) {
+		u8 sample[3] = {(u8)want[i], (u8)(want[i] >> 8), (u8)(want[i] >> 16)};
+		hash_update(&h, sample, (size_t)(bits + 7) / 8);
+	}
+	hash_final(&h, &crc32, md5);
+	for (i = 0; i < 16; i++) {
+		assert(read_bits(&b, 8) == md5[i]);
+	}
+	if (total == 0) {
+		assert(memcmp(md5, "\xd4\x1d\x8c\xd9\x8f\x00\xb2\x04\xe9\x80\x09\x98\xec\xf8\x42\x7e", 16) == 0);
+	}
+
+	while (bitpos(&b) < len*8) {
+		size_t start = bitpos(&b) / 8;
+		uint bscode, chcode, n;
+
+		assert(read_bits(&b, 15) == 0x7ffc);
+		assert(read_bits(&b, 1) == 0);
+		bscode = read_bits(&b, 4);
+		skip_bits(&b, 4); // sample rate
+		chcode = read_bits(&b, 4);
+		skip_bits(&b, 3+1);
+		assert(read_bits(&b, 8) == (uint)frame); // frames are few enough
+		if (bscode == 12) {
+			n = 4096;
+		} else if (bscode == 6) {
+			n = read_bits(&b, 8) + 1;
+		} else {
+			assert(bscode == 7);
+			n = read_bits(&b, 16) + 1;
+		}
+		skip_bits(&b, 8); // crc8
+
+		for (c = 0; c < channels; c++) {
+			int side = (chcode == 8 && c == 1) || (chcode == 9 && c == 0) || (chcode == 10 && c == 1);
+			read_subframe(&b, chan[c], (int)n, bits + side);
+		}
+		for (i = 0; i < (int)n; i++) {
+			int32_t l = chan[0][i], r = chan[1][i];
+			if (chcode == 8) {
+				chan[1][i] = l - r;
+			} else if (chcode == 9) {
+				chan[0][i] = l + r;
+			} else if (chcode == 10) {
+				int64_t mid = (int64_t)l * 2 | (r & 1);
+				chan[0][i] = (int32_t)((mid + r) >> 1);
+				chan[1][i] = (int32_t)((mid - r) >> 1);
+			}
+		}
+		if (b.count % 8 != 0) {
+			skip_bits(&b, b.count % 8);
+		}
+		uint crc = crc16(buf + start, bitpos(&b)/8 - start);
+		assert(read_bits(&b, 16) == crc);
+		assert(b.err == 0);
+
+		for (i = 0; i < (int)n; i++) {
+			for (c = 0; c < channels; c++) {
+				assert(chan[c][i] == want[(pos+i)*channels + c]);
+			}
+		}
+		pos += (int)n;
+		frame++;
+	}
+	assert(pos == total);
+}
+
+static u8 *encode(const int32_t *samples, int total, int rate, int channels, int bits, int threads, size_t *lenp)
+{
+	FILE *fp = tmpfile();
+	struct flacenc *e;
+	u8 *buf;
+	int i;
+
+	assert(fp != NULL);
+	e = flacenc_open(fp, rate, channels, bits, threads);
+	assert(e != NULL);
+	// Feed it in uneven pieces.
+	for (i = 0; i < total; ) {
+		int n = 1 + (i*7919) % 3000;
+		if (n > total - i) {
+			n = total - i;
+		}
+		assert(flacenc_write(e, samples + i*channels, n) == 0);
+		i += n;
+	}
+	assert(flacenc_close(e) == 0);
+
+	*lenp = (size_t)ftell(fp);
+	buf = malloc(*lenp);
+	assert(buf != NULL);
+	rewind(fp);
+	assert(fread(buf, 1, *lenp, fp) == *lenp);
+	fclose(fp);
+	return buf;
+}
+
+static int32_t samples[65536*6];
+
+int main(int argc, char *argv[])
+{
+	(void)argc;
+	(void)argv;
+
+	uint seed = 1;
+	size_t len;
+	u8 *buf;
+	int i, c, threads;
+
+	for (threads = 0; threads <= 3; threads += 3) {
+		// Smooth stereo with a little noise: LPC and mid/side territory
+		int total = 50000;
+		for (i = 0; i < total; i++) {
+			seed = seed*1103515245 + 12345;
+			int32_t v = (int32_t)(20000 * sin(i * (0.01 + i * 1e-6)));
+			samples[i*2] = v + (int32_t)(seed >> 30);
+			samples[i*2+1] = v/2 - (int32_t)(seed >> 31);
+		}
+		buf = encode(samples, total, 48000, 2, 16, threads, &len);
+		check(buf, len, samples, total, 48000, 2, 16);
+		assert(len < (size_t)total*2*2 / 2);
+		free(buf);
+
+		// Full-scale noise in 24 bits: verbatim
+		total = 10000;
+		for (i = 0; i < total*6; i++) {
+			seed = seed*1103515245 + 12345;
+			samples[i] = (int32_t)seed >> 8;
+		}
+		buf = encode(samples, total, 96000, 6, 24, threads, &len);
+		check(buf, len, samples, total, 96000, 6, 24);
+		free(buf);
+
+		// 20 bits with the low bits unused, constant channel and
+		// extreme values
+		total = 9000;
+		for (i = 0; i < total; i++) {
+			seed = seed*1103515245 + 12345;
+			samples[i*3] = ((int32_t)seed >> 16) * 16;
+			samples[i*3+1] = 1234;
+			samples[i*3+2] = i & 1 ? 524287 : -524288;
+		}
+		buf = encode(samples, total, 48000, 3, 20, threads, &len);
+		check(buf, len, samples, total, 48000, 3, 20);
+		free(buf);
+
+		// Shorter than a block
+		total = 100;
+		for (i = 0; i < total; i++) {
+			for (c = 0; c < 2; c++) {
+				samples[i*2+c] = (i*i*(c+1)) % 30000 - 15000;
+			}
+		}
+		buf = encode(samples, total, 44100, 2, 16, threads, &len);
+		check(buf, len, samples, total, 44100, 2, 16);
+		free(buf);
+
+		// Nothing at all
+		buf = encode(samples, 0, 48000, 2, 16, threads, &len);
+		check(buf, len, samples, 0, 48000, 2, 16);
+		free(buf);
+	}
+
+	return 0;
+}
@@ -0,0 +1,230 @@
+/* hash - CRC-32 and MD5 of track data as it's written
+
+The CRC is computed eight bytes at a time from eight tables (slicing-by-8),
+which is about as fast as the table-driven CRC gets without carry-less
+multiplication. Where the CPU has that (PCLMULQDQ), runs of 64 bytes or
+more are folded four vectors at a time instead, as in Intel's "Fast CRC
+Computation for Generic Polynomials Using PCLMULQDQ Instruction", with the
+constants for the reflected CRC-32 polynomial. MD5 is as in RFC 1321. */
+
+#include <string.h>
+#include <pthread.h>
+#include "hash.h"
+#include "cpu.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void make_crc_table(void)
+{
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; k++) {
+			c = c & 1 ? 0xedb88320 ^ c >> 1 : c >> 1;
+		}
+		crc_table[0][i] = c;
+	}
+	for (int t = 1; t < 8; t++) {
+		for (int i = 0; i < 256; i++) {
+			uint32_t c = crc_table[t-1][i];
+			crc_table[t][i] = crc_table[0][c & 0xff] ^ c >> 8;
+		}
+	}
+}
+
+#ifdef HAVE_X86
+
+// Fold n bytes, a multiple of 16 and at least 64, into crc, which is
+// inverted as the tables' loop keeps it.
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32_pclmul(uint32_t crc, const u8* p, size_t n)
+{
+	const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+	const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+	const __m128i k5 = _mm_set_epi64x(0, 0x0163cd6124);
+	const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+	const __m128i low32 = _mm_setr_epi32(~0, 0, ~0, 0);
+	__m128i x1, x2, x3, x4, y1, y2, y3, y4;
+
+	x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)p), _mm_cvtsi32_si128((int)crc));
+	x2 = _mm_loadu_si128((const __m128i*)(p + 16));
+	x3 = _mm_loadu_si128((const __m128i*)(p + 32));
+	x4 = _mm_loadu_si128((const __m128i*)(p + 48));
+	for (p += 64, n -= 64; n >= 64; p += 64, n -= 64) {
+		y1 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+		y2 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+		y3 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+		y4 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+		x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k1k2, 0x11), y1);
+		x2 = _mm_xor_si128(_mm_clmulepi64_si128(x2, k1k2, 0x11), y2);
+		x3 = _mm_xor_si128(_mm_clmulepi64_si128(x3, k1k2, 0x11), y3);
+		x4 = _mm_xor_si128(_mm_clmulepi64_si128(x4, k1k2, 0x11), y4);
+		x1 = _mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)p));
+		x2 = _mm_xor_si128(x2, _mm_loadu_si128((const __m128i*)(p + 16)));
+		x3 = _mm_xor_si128(x3, _mm_loadu_si128((const __m128i*)(p + 32)));
+		x4 = _mm_xor_si128(x4, _mm_loadu_si128((const __m128i*)(p + 48)));
+	}
+
+	// Fold the four into one, then any vectors left.
+	y1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x2), y1);
+	y1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x3), y1);
+	y1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x4), y1);
+	for (; n >= 16; p += 16, n -= 16) {
+		y1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+		x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), _mm_loadu_si128((const __m128i*)p)), y1);
+	}
+
+	// Down to 64 bits, then a Barrett reduction to 32.
+	x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, low32), k5, 0x00), x2);
+	x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, low32), poly, 0x10);
+	x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, low32), poly, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+#endif
+
+static uint32_t crc32_update(uint32_t crc, const u8* p, size_t n)
+{
+	uint32_t (*t)[256] = crc_table;
+
+	crc = ~crc;
+#ifdef HAVE_X86
+	if (n >= 64 && cpu_level() >= CPU_SSE42) {
+		size_t m = n & ~(size_t)15;
+		crc = crc32_pclmul(crc, p, m);
+		p += m;
+		n -= m;
+	}
+#endif
+	for (; n >= 8; p += 8, n -= 8) {
+		uint32_t a = crc ^ ((uint32_t)p[0] | (uint32_t)p[1]<<8 | (uint32_t)p[2]<<16 | (uint32_t)p[3]<<24);
+		crc = t[7][a & 0xff] ^ t[6][a >> 8 & 0xff] ^ t[5][a >> 16 & 0xff] ^ t[4][a >> 24] ^
+			t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+	}
+	for (; n > 0; p++, n--) {
+		crc = t[0][(crc ^ *p) & 0xff] ^ crc >> 8;
+	}
+	return ~crc;
+}
+
+static const uint32_t md5_k[64] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+	0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+	0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+	0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const int md5_r[16] = {7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21};
+
+static uint32_t rol(uint32_t x, int r)
+{
+	return x << r | x >> (32 - r);
+}
+
+static void md5_block(uint32_t* h, const u8* p)
+{
+	uint32_t m[16], a = h[0], b = h[1], c = h[2], d = h[3];
+
+	for (int i = 0; i < 16; i++) {
+		m[i] = (uint32_t)p[4*i] | (uint32_t)p[4*i+1]<<8 | (uint32_t)p[4*i+2]<<16 | (uint32_t)p[4*i+3]<<24;
+	}
+	for (int i = 0; i < 64; i++) {
+		uint32_t f, t;
+		int g;
+		switch (i >> 4) {
+		case 0:
+			f = (b & c) | (~b & d);
+			g = i;
+			break;
+		case 1:
+			f = (d & b) | (~d & c);
+			g = (5*i + 1) & 15;
+			break;
+		case 2:
+			f = b ^ c ^ d;
+			g = (3*i + 5) & 15;
+			break;
+		default:
+			f = c ^ (b | ~d);
+			g = (7*i) & 15;
+			break;
+		}
+		t = d;
+		d = c;
+		c = b;
+		b = b + rol(a + f + md5_k[i] + m[g], md5_r[(i >> 4) * 4 + (i & 3)]);
+		a = t;
+	}
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+}
+
+void hash_init(struct hash* h)
+{
+	pthread_once(&crc_once, make_crc_table);
+	h->crc = 0;
+	h->md5[0] = 0x67452301;
+	h->md5[1] = 0xefcdab89;
+	h->md5[2] = 0x98badcfe;
+	h->md5[3] = 0x10325476;
+	h->length = 0;
+}
+
+void hash_update(struct hash* h, const u8* p, size_t n)
+{
+	size_t used = (size_t)(h->length & 63);
+
+	h->crc = crc32_update(h->crc, p, n);
+	h->length += n;
+	if (used > 0) {
+		size_t m = 64 - used < n ? 64 - used : n;
+		memcpy(h->block + used, p, m);
+		p += m;
+		n -= m;
+		if (used + m < 64) {
+			return;
+		}
+		md5_block(h->md5, h->block);
+	}
+	for (; n >= 64; p += 64, n -= 64) {
+		md5_block(h->md5, p);
+	}
+	memcpy(h->block, p, n);
+}
+
+void hash_final(struct hash* h, uint32_t* crc, u8 md5[16])
+{
+	static const u8 pad[64] = {0x80};
+	uint64_t bits = h->length * 8;
+	size_t used = (size_t)(h->length & 63);
+	uint32_t c = h->crc;
+	u8 len[8];
+
+	for (int i = 0; i < 8; i++) {
+		len[i] = (u8)(bits >> 8*i);
+	}
+	hash_update(h, pad, used < 56 ? 56 - used : 120 - used);
+	hash_update(h, len, 8);
+	*crc = c;
+	for (int i = 0; i < 16; i++) {
+		md5[i] = (u8)(h->md5[i/4] >> 8*(i%4));
+	}
+}
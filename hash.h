@@ -0,0 +1,23 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include "uint.h"
+
+// The CRC-32 (as in zlib and PNG) and MD5 of a stream of bytes, taken
+// together in one pass.
+struct hash {
+	uint32_t crc;
+	uint32_t md5[4];
+	uint64_t length;
+	u8 block[64]; // the part of an MD5 block not hashed yet
+};
+
+void hash_init(struct hash* h);
+void hash_update(struct hash* h, const u8* p, size_t n);
+
+// Finish the hash, storing the CRC-32 and MD5. The hash can't be updated
+// after.
+void hash_final(struct hash* h, uint32_t* crc, u8 md5[16]);
+
+#endif
@@ -0,0 +1,68 @@
+#include "hash.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+// Hash s in pieces of the given size, and compare with the CRC and MD5
+// (in hex) given.
+static void check(const char* s, size_t piece, uint32_t crc, const char* md5)
+{
+	struct hash h;
+	size_t n = strlen(s);
+	uint32_t c;
+	u8 d[16];
+	char hex[33];
+
+	hash_init(&h);
+	for (size_t i = 0; i < n; i += piece) {
+		hash_update(&h, (const u8*)s + i, n - i < piece ? n - i : piece);
+	}
+	hash_final(&h, &c, d);
+	for (int i = 0; i < 16; i++) {
+		snprintf(hex + 2*i, 3, "%02x", d[i]);
+	}
+	assert(c == crc);
+	assert(strcmp(hex, md5) == 0);
+}
+
+static char a[1000001];
+
+int main(int argc, char *argv[])
+{
+	(void)argc;
+	(void)argv;
+
+	// RFC 1321's test suite, and the CRC check value
+	static const char digits[] = "12345678901234567890123456789012345678901234567890123456789012345678901234567890";
+	for (size_t piece = 1; piece < 100; piece += 7) {
+		check("", piece, 0, "d41d8cd98f00b204e9800998ecf8427e");
+		check("abc", piece, 0x352441c2, "900150983cd24fb0d6963f7d28e17f72");
+		check("123456789", piece, 0xcbf43926, "25f9e794323b453885f5181f1b624d0b");
+		check("message digest", piece, 0x20159d7f, "f96b697d7cb7938d525a2f31aaf161d0");
+		check(digits, piece, 0x7ca94a72, "57edf4a22be3c955ac49da2e2107b67a");
+	}
+	memset(a, 'a', sizeof a - 1);
+	check(a, 4096, 0xdc25bfbc, "7707d6ae4e027c70eea2a935c2296f21");
+
+	// Runs long enough for the folding kernel, against a byte at a time
+	uint seed = 1;
+	for (int i = 0; i < 1024; i++) {
+		seed = seed*1103515245 + 12345;
+		a[i] = (char)(seed >> 16);
+	}
+	for (size_t n = 0; n <= 1024; n += 13) {
+		struct hash h1, h2;
+		uint32_t c1, c2;
+		u8 d1[16], d2[16];
+		hash_init(&h1);
+		hash_init(&h2);
+		hash_update(&h1, (const u8*)a, n);
+		for (size_t i = 0; i < n; i++) {
+			hash_update(&h2, (const u8*)a + i, 1);
+		}
+		hash_final(&h1, &c1, d1);
+		hash_final(&h2, &c2, d2);
+		assert(c1 == c2);
+	}
+	return 0;
+}
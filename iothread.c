@@ -0,0 +1,342 @@
+/* iothread - writing files from a background thread
+
+Buffers are taken from the free list by the file writing into them, and
+queued for the output thread when full. The thread takes the run of
+buffers at the front of the queue which belong to the same file and
+writes them with one writev, then puts them back on the free list. A
+file's last buffer, even an empty one, tells the thread to close it. */
+
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "iothread.h"
+
+struct iobuf {
+	struct iobuf* next;
+	int fd;
+	bool close; // close fd once this buffer has been written
+	size_t len;
+	u8* data;
+};
+
+struct iothread {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct iobuf* bufs;
+	int depth;
+	size_t bufsize;
+	struct iobuf* free;
+	struct iobuf *queue, *queue_tail;
+	int busy; // buffers being written
+	bool quit;
+	int err;
+	int64_t* write_ns;
+
+	// Statistics
+	long buffers, calls, waits;
+	double wait_time;
+};
+
+struct iofile {
+	struct iothread* io;
+	int fd;
+	struct iobuf* buf; // being filled, or NULL
+};
+
+enum { max_iov = 64 };
+
+static int64_t nanos(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Write out a run of buffers for one file.
+static int write_run(struct iothread* io, struct iobuf** run, int n)
+{
+	struct iovec iov[max_iov];
+	struct iovec* v = iov;
+	int i, count = n;
+	ssize_t m;
+
+	for (i = 0; i < n; i++) {
+		iov[i].iov_base = run[i]->data;
+		iov[i].iov_len = run[i]->len;
+	}
+	while (count > 0) {
+		int64_t t = nanos();
+		m = writev(run[0]->fd, v, count);
+		if (io->write_ns != NULL) {
+			__atomic_fetch_add(io->write_ns, nanos() - t, __ATOMIC_RELAXED);
+		}
+		if (m < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("writev");
+			return -1;
+		}
+		// Skip what was written, in case it was short.
+		while (count > 0 && (size_t)m >= v->iov_len) {
+			m -= (ssize_t)v->iov_len;
+			v++;
+			count--;
+		}
+		if (count > 0) {
+			v->iov_base = (u8*)v->iov_base + m;
+			v->iov_len -= (size_t)m;
+		}
+	}
+	return 0;
+}
+
+static void* io_thread(void* arg)
+{
+	struct iothread* io = arg;
+	struct iobuf* run[max_iov];
+	int i, n, fd, err;
+	bool closing;
+
+	pthread_mutex_lock(&io->lock);
+	for (;;) {
+		while (io->queue == NULL && !io->quit) {
+			pthread_cond_wait(&io->cond, &io->lock);
+		}
+		if (io->queue == NULL) {
+			break;
+		}
+		// Take the run of buffers at the front of the queue which
+		// belong to the same file, up to and including a close.
+		fd = io->queue->fd;
+		closing = false;
+		for (n = 0; n < max_iov && io->queue != NULL && io->queue->fd == fd && !closing; n++) {
+			run[n] = io->queue;
+			io->queue = run[n]->next;
+			closing = run[n]->close;
+		}
+		if (io->queue == NULL) {
+			io->queue_tail = NULL;
+		}
+		io->busy += n;
+		pthread_mutex_unlock(&io->lock);
+
+		err = write_run(io, run, n);
+		if (closing && close(fd) < 0) {
+			perror("close");
+			err = -1;
+		}
+
+		pthread_mutex_lock(&io->lock);
+		for (i = 0; i < n; i++) {
+			run[i]->next = io->free;
+			io->free = run[i];
+		}
+		io->busy -= n;
+		io->buffers += n;
+		io->calls++;
+		if (err < 0) {
+			io->err = -1;
+		}
+		pthread_cond_broadcast(&io->cond);
+	}
+	pthread_mutex_unlock(&io->lock);
+	return NULL;
+}
+
+struct iothread* iothread_open(size_t bufsize, int depth, int files, int64_t* write_ns)
+{
+	struct iothread* io;
+	int i;
+
+	if (depth < files + 1) {
+		depth = files + 1;
+	}
+	io = calloc(1, sizeof *io);
+	if (io == NULL) {
+		return NULL;
+	}
+	io->bufs = calloc((size_t)depth, sizeof *io->bufs);
+	if (io->bufs == NULL) {
+		free(io);
+		return NULL;
+	}
+	for (i = 0; i < depth; i++) {
+		void* p;
+		if (posix_memalign(&p, 4096, bufsize) != 0) {
+			perror("posix_memalign");
+			goto error;
+		}
+		io->bufs[i].data = p;
+		io->bufs[i].next = io->free;
+		io->free = &io->bufs[i];
+	}
+	io->depth = depth;
+	io->bufsize = bufsize;
+	io->write_ns = write_ns;
+	pthread_mutex_init(&io->lock, NULL);
+	pthread_cond_init(&io->cond, NULL);
+	if (pthread_create(&io->thread, NULL, io_thread, io) != 0) {
+		perror("pthread_create");
+		pthread_mutex_destroy(&io->lock);
+		pthread_cond_destroy(&io->cond);
+		goto error;
+	}
+	return io;
+
+error:
+	for (i = 0; i < depth; i++) {
+		free(io->bufs[i].data);
+	}
+	free(io->bufs);
+	free(io);
+	return NULL;
+}
+
+int iothread_close(struct iothread* io)
+{
+	int i, err;
+
+	pthread_mutex_lock(&io->lock);
+	io->quit = true;
+	pthread_cond_broadcast(&io->cond);
+	pthread_mutex_unlock(&io->lock);
+	pthread_join(io->thread, NULL);
+
+	if (io->buffers > 0) {
+		fprintf(stderr, "output: %ld buffers in %ld writes; waited for a buffer %ld times (%.2fs)\n",
+			io->buffers, io->calls, io->waits, io->wait_time);
+	}
+
+	err = io->err;
+	for (i = 0; i < io->depth; i++) {
+		free(io->bufs[i].data);
+	}
+	free(io->bufs);
+	pthread_mutex_destroy(&io->lock);
+	pthread_cond_destroy(&io->cond);
+	free(io);
+	return err;
+}
+
+// Take a buffer from the pool, waiting for the output thread to finish
+// with one if they're all in use. Called with the lock held.
+static struct iobuf* get_iobuf(struct iothread* io, int fd)
+{
+	struct iobuf* b;
+	int64_t start;
+
+	if (io->free == NULL) {
+		start = nanos();
+		io->waits++;
+		while (io->free == NULL) {
+			pthread_cond_wait(&io->cond, &io->lock);
+		}
+		io->wait_time += (double)(nanos() - start) / 1e9;
+	}
+	b = io->free;
+	io->free = b->next;
+	b->next = NULL;
+	b->fd = fd;
+	b->close = false;
+	b->len = 0;
+	return b;
+}
+
+// Queue a buffer for the output thread. Called with the lock held.
+static void put_iobuf(struct iothread* io, struct iobuf* b)
+{
+	if (io->queue_tail != NULL) {
+		io->queue_tail->next = b;
+	} else {
+		io->queue = b;
+	}
+	io->queue_tail = b;
+	pthread_cond_broadcast(&io->cond);
+}
+
+struct iofile* iofile_open(struct iothread* io, int fd)
+{
+	struct iofile* f = malloc(sizeof *f);
+	if (f == NULL) {
+		close(fd);
+		return NULL;
+	}
+	f->io = io;
+	f->fd = fd;
+	f->buf = NULL;
+	return f;
+}
+
+void iofile_write(struct iofile* f, const u8* buf, size_t size)
+{
+	struct iothread* io = f->io;
+	struct iobuf* b;
+	size_t n;
+
+	while (size > 0) {
+		b = f->buf;
+		if (b == NULL) {
+			pthread_mutex_lock(&io->lock);
+			b = f->buf = get_iobuf(io, f->fd);
+			pthread_mutex_unlock(&io->lock);
+		}
+		n = io->bufsize - b->len;
+		if (n > size) {
+			n = size;
+		}
+		memcpy(b->data + b->len, buf, n);
+		b->len += n;
+		buf += n;
+		size -= n;
+		if (b->len == io->bufsize) {
+			pthread_mutex_lock(&io->lock);
+			put_iobuf(io, b);
+			pthread_mutex_unlock(&io->lock);
+			f->buf = NULL;
+		}
+	}
+}
+
+int64_t iofile_sync(struct iofile* f)
+{
+	struct iothread* io = f->io;
+	int err;
+
+	pthread_mutex_lock(&io->lock);
+	if (f->buf != NULL) {
+		put_iobuf(io, f->buf);
+		f->buf = NULL;
+	}
+	while (io->queue != NULL || io->busy > 0) {
+		pthread_cond_wait(&io->cond, &io->lock);
+	}
+	err = io->err;
+	pthread_mutex_unlock(&io->lock);
+	if (err < 0) {
+		return -1;
+	}
+	return lseek(f->fd, 0, SEEK_CUR);
+}
+
+void iofile_close(struct iofile* f)
+{
+	struct iothread* io = f->io;
+
+	pthread_mutex_lock(&io->lock);
+	if (f->buf == NULL) {
+		f->buf = get_iobuf(io, f->fd);
+	}
+	f->buf->close = true;
+	put_iobuf(io, f->buf);
+	pthread_mutex_unlock(&io->lock);
+	free(f);
+}
@@ -0,0 +1,41 @@
+#ifndef IOTHREAD_H
+#define IOTHREAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "uint.h"
+
+// An output thread writing files from a shared pool of buffers, so that
+// writing never blocks the calling thread on the disk. Runs of full
+// buffers for the same file are written with a single writev.
+
+struct iothread;
+struct iofile;
+
+// Start the output thread with depth buffers of bufsize bytes, or more if
+// that isn't more than files, the most files open at once: each open file
+// holds a buffer, so a writer can only ever get one with at least one
+// over. The time spent writing is added to *write_ns if it isn't NULL.
+// Returns NULL on error.
+struct iothread* iothread_open(size_t bufsize, int depth, int files, int64_t* write_ns);
+
+// Wait for everything to be written and stop the output thread. Returns
+// -1 if any write failed.
+int iothread_close(struct iothread* io);
+
+// Collect output for fd in the thread's buffers, which the output thread
+// closes fd after. Returns NULL, having closed fd, if out of memory.
+struct iofile* iofile_open(struct iothread* io, int fd);
+
+// Copy data into the file's buffers, waiting for a free buffer if they're
+// all queued. Write errors are reported by iothread_close.
+void iofile_write(struct iofile* f, const u8* buf, size_t size);
+
+// Wait for everything written so far to be in the file, and return the
+// file's length, or -1 if any write failed.
+int64_t iofile_sync(struct iofile* f);
+
+// Queue the rest of the file and free f.
+void iofile_close(struct iofile* f);
+
+#endif
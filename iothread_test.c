@@ -0,0 +1,106 @@
+#define _POSIX_C_SOURCE 200809L
+#include "iothread.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+enum { nfiles = 4, length = 300000 };
+
+static u8 want[nfiles][length];
+static u8 got[length + 1];
+
+static void name(char* s, int i)
+{
+	sprintf(s, "iothread_test.%d", i);
+}
+
+// Check that file i holds the first n bytes it was written.
+static void check(int i, int n)
+{
+	char s[32];
+	FILE* fp;
+
+	name(s, i);
+	fp = fopen(s, "rb");
+	assert(fp != NULL);
+	assert(fread(got, 1, sizeof got, fp) == (size_t)n);
+	assert(memcmp(got, want[i], (size_t)n) == 0);
+	fclose(fp);
+}
+
+int main(int argc, char *argv[])
+{
+	(void)argc;
+	(void)argv;
+
+	struct iothread* io;
+	struct iofile* f[nfiles];
+	int pos[nfiles] = {0};
+	int64_t write_ns = 0;
+	char s[32];
+	int i, k, n, left;
+
+	for (k = 0; k < nfiles; k++) {
+		for (i = 0; i < length; i++) {
+			want[k][i] = (u8)(i * 13 + i / 509 + k * 61);
+		}
+	}
+
+	// Only one buffer more than the files, so writers have to wait for
+	// them, and writes both smaller and larger than a buffer
+	io = iothread_open(4096, 1, nfiles, &write_ns);
+	assert(io != NULL);
+	for (k = 0; k < nfiles; k++) {
+		name(s, k);
+		int fd = open(s, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		assert(fd >= 0);
+		f[k] = iofile_open(io, fd);
+		assert(f[k] != NULL);
+	}
+	left = nfiles;
+	for (i = 0; left > 0; i++) {
+		k = (i * 7) % nfiles;
+		if (pos[k] == length) {
+			continue;
+		}
+		n = 1 + (i * 2731) % 10000;
+		if (n > length - pos[k]) {
+			n = length - pos[k];
+		}
+		iofile_write(f[k], want[k] + pos[k], (size_t)n);
+		pos[k] += n;
+		// Syncing puts everything so far in the file, even a buffer
+		// that isn't full yet
+		if (k == 1 && i % 50 == 0) {
+			assert(iofile_sync(f[k]) == pos[k]);
+			check(k, pos[k]);
+		}
+		if (pos[k] == length) {
+			iofile_close(f[k]);
+			left--;
+		}
+	}
+	assert(iothread_close(io) == 0);
+	assert(write_ns > 0);
+	for (k = 0; k < nfiles; k++) {
+		check(k, length);
+	}
+
+	// A file that can't be written fails the sync and the close
+	io = iothread_open(4096, 2, 1, NULL);
+	name(s, 0);
+	f[0] = iofile_open(io, open(s, O_RDONLY));
+	iofile_write(f[0], want[0], 10000);
+	assert(iofile_sync(f[0]) == -1);
+	iofile_close(f[0]);
+	assert(iothread_close(io) == -1);
+
+	for (k = 0; k < nfiles; k++) {
+		name(s, k);
+		remove(s);
+	}
+	return 0;
+}
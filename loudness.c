@@ -0,0 +1,424 @@
+/* loudness - integrated loudness and true peak of PCM
+
+Loudness is measured as in ITU-R BS.1770-4 and EBU R128. Each channel is
+K-weighted by two biquads, a high shelf and a high-pass, and the mean
+squares of every 100ms are summed over the channels with their weights.
+Gating blocks are 400ms long and start every 100ms, so each is the mean of
+four of those. Only the energies are kept, so the blocks of several tracks
+can be gated together for an album.
+
+True peaks are found by oversampling with a polyphase windowed-sinc filter,
+4x below 96kHz and 2x below 192kHz.
+
+Samples are kept as doubles in frames of eight lanes, one per channel, so
+that the SIMD kernels filter four channels of a frame at once. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "loudness.h"
+#include "cpu.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+enum {
+	LANES = 8, // doubles per frame
+	TAPS = 12, // taps per phase of the interpolator
+	MAX_FACTOR = 4,
+	BLOCK = 1024, // frames measured at once
+};
+
+struct loudness {
+	int isa;
+	int channels;
+	int rate;
+	double scale; // from samples to fractions of full scale
+	double weight[LANES];
+
+	// K-weighting: b0, b1, b2, a1, a2 of each stage, and the state of
+	// each lane
+	double shelf[5], pass[5];
+	double s1[LANES], s2[LANES], t1[LANES], t2[LANES];
+
+	// The current 100ms, and the energy of each one before it
+	double sum[LANES];
+	int sub; // frames in 100ms
+	int filled; // frames in the current 100ms
+	double* energy;
+	int nenergy, cap;
+
+	int factor;
+	double taps[MAX_FACTOR][TAPS];
+	double peak[LANES], tpeak[LANES];
+
+	// The last TAPS-1 frames, for the interpolator, then the frames
+	// being measured
+	double frames[(TAPS-1 + BLOCK) * LANES];
+};
+
+int loudness_best(void)
+{
+#ifdef HAVE_X86
+	if (cpu_level() >= CPU_AVX) {
+		return LOUDNESS_AVX;
+	}
+#endif
+	return LOUDNESS_SCALAR;
+}
+
+// The K-weighting filters for any sample rate, from the analogue
+// prototypes of the ones BS.1770 gives for 48kHz.
+static void kfilters(struct loudness* l)
+{
+	const double pi = 3.14159265358979323846;
+	double f0 = 1681.974450955533;
+	double g = 3.999843853973347;
+	double q = 0.7071752369554196;
+	double k = tan(pi * f0 / l->rate);
+	double vh = pow(10.0, g / 20.0);
+	double vb = pow(vh, 0.4996667741545416);
+	double a0 = 1.0 + k / q + k * k;
+
+	l->shelf[0] = (vh + vb * k / q + k * k) / a0;
+	l->shelf[1] = 2.0 * (k * k - vh) / a0;
+	l->shelf[2] = (vh - vb * k / q + k * k) / a0;
+	l->shelf[3] = 2.0 * (k * k - 1.0) / a0;
+	l->shelf[4] = (1.0 - k / q + k * k) / a0;
+
+	f0 = 38.13547087602444;
+	q = 0.5003270373238773;
+	k = tan(pi * f0 / l->rate);
+	a0 = 1.0 + k / q + k * k;
+	l->pass[0] = 1.0;
+	l->pass[1] = -2.0;
+	l->pass[2] = 1.0;
+	l->pass[3] = 2.0 * (k * k - 1.0) / a0;
+	l->pass[4] = (1.0 - k / q + k * k) / a0;
+}
+
+// A Hann-windowed sinc cutting off at the original Nyquist frequency,
+// split into phases, each of which adds up to one.
+static void interpolator(struct loudness* l)
+{
+	const double pi = 3.14159265358979323846;
+	int n = TAPS * l->factor;
+	double mid = (n - 1) / 2.0;
+
+	for (int p = 0; p < l->factor; p++) {
+		double total = 0;
+		for (int k = 0; k < TAPS; k++) {
+			double x = (p + k * l->factor - mid) / l->factor;
+			double h = x == 0 ? 1.0 : sin(pi * x) / (pi * x);
+			h *= 0.5 - 0.5 * cos(2 * pi * (p + k * l->factor + 0.5) / n);
+			l->taps[p][k] = h;
+			total += h;
+		}
+		for (int k = 0; k < TAPS; k++) {
+			l->taps[p][k] /= total;
+		}
+	}
+}
+
+struct loudness* loudness_open(int sample_rate, int channels, int depth, int isa)
+{
+	struct loudness* l;
+
+	if (channels < 1 || channels > LANES || sample_rate < 10) {
+		return NULL;
+	}
+	l = calloc(1, sizeof *l);
+	if (l == NULL) {
+		return NULL;
+	}
+	l->isa = isa;
+	l->channels = channels;
+	l->rate = sample_rate;
+	l->scale = 1.0 / (double)(1L << (depth - 1));
+	l->sub = sample_rate / 10;
+	l->factor = sample_rate < 96000 ? 4 : sample_rate < 192000 ? 2 : 1;
+	kfilters(l);
+	interpolator(l);
+
+	// Surround channels count for 1.41, and the LFE not at all.
+	for (int c = 0; c < channels; c++) {
+		l->weight[c] = 1.0;
+	}
+	if (channels == 4) {
+		l->weight[2] = l->weight[3] = 1.41;
+	} else if (channels == 5) {
+		l->weight[3] = l->weight[4] = 1.41;
+	} else if (channels >= 6) {
+		l->weight[3] = 0.0;
+		for (int c = 4; c < channels; c++) {
+			l->weight[c] = 1.41;
+		}
+	}
+	return l;
+}
+
+void loudness_free(struct loudness* l)
+{
+	if (l != NULL) {
+		free(l->energy);
+		free(l);
+	}
+}
+
+// K-weight n frames and add up their squares.
+static void kweight_scalar(struct loudness* l, const double* x, int n)
+{
+	const double* s = l->shelf;
+	const double* p = l->pass;
+
+	for (int c = 0; c < l->channels; c++) {
+		double s1 = l->s1[c], s2 = l->s2[c], t1 = l->t1[c], t2 = l->t2[c];
+		double sum = l->sum[c];
+		for (int f = 0; f < n; f++) {
+			double v = x[f*LANES + c];
+			double y = s[0] * v + s1;
+			s1 = s[1] * v - s[3] * y + s2;
+			s2 = s[2] * v - s[4] * y;
+			double z = p[0] * y + t1;
+			t1 = p[1] * y - p[3] * z + t2;
+			t2 = p[2] * y - p[4] * z;
+			sum += z * z;
+		}
+		l->s1[c] = s1;
+		l->s2[c] = s2;
+		l->t1[c] = t1;
+		l->t2[c] = t2;
+		l->sum[c] = sum;
+	}
+}
+
+// Find the sample and true peaks of n frames, which have TAPS-1 frames of
+// history before them.
+static void peaks_scalar(struct loudness* l, const double* x, int n)
+{
+	for (int c = 0; c < l->channels; c++) {
+		double peak = l->peak[c], tpeak = l->tpeak[c];
+		for (int f = 0; f < n; f++) {
+			const double* v = x + f*LANES + c;
+			if (fabs(*v) > peak) {
+				peak = fabs(*v);
+			}
+			for (int p = 0; p < l->factor && l->factor > 1; p++) {
+				double y = 0;
+				for (int k = 0; k < TAPS; k++) {
+					y += l->taps[p][k] * v[-k*LANES];
+				}
+				if (fabs(y) > tpeak) {
+					tpeak = fabs(y);
+				}
+			}
+		}
+		l->peak[c] = peak;
+		l->tpeak[c] = tpeak;
+	}
+}
+
+#ifdef HAVE_X86
+
+__attribute__((target("avx")))
+static void kweight_avx(struct loudness* l, const double* x, int n)
+{
+	const __m256d s0 = _mm256_set1_pd(l->shelf[0]);
+	const __m256d s1c = _mm256_set1_pd(l->shelf[1]);
+	const __m256d s2c = _mm256_set1_pd(l->shelf[2]);
+	const __m256d s3 = _mm256_set1_pd(l->shelf[3]);
+	const __m256d s4 = _mm256_set1_pd(l->shelf[4]);
+	const __m256d p3 = _mm256_set1_pd(l->pass[3]);
+	const __m256d p4 = _mm256_set1_pd(l->pass[4]);
+	const __m256d two = _mm256_set1_pd(2.0);
+
+	for (int c = 0; c < l->channels; c += 4) {
+		__m256d s1 = _mm256_loadu_pd(l->s1 + c), s2 = _mm256_loadu_pd(l->s2 + c);
+		__m256d t1 = _mm256_loadu_pd(l->t1 + c), t2 = _mm256_loadu_pd(l->t2 + c);
+		__m256d sum = _mm256_loadu_pd(l->sum + c);
+		for (int f = 0; f < n; f++) {
+			__m256d v = _mm256_loadu_pd(x + f*LANES + c);
+			__m256d y = _mm256_add_pd(_mm256_mul_pd(s0, v), s1);
+			s1 = _mm256_add_pd(_mm256_sub_pd(_mm256_mul_pd(s1c, v), _mm256_mul_pd(s3, y)), s2);
+			s2 = _mm256_sub_pd(_mm256_mul_pd(s2c, v), _mm256_mul_pd(s4, y));
+			// The high-pass has b = 1, -2, 1.
+			__m256d z = _mm256_add_pd(y, t1);
+			t1 = _mm256_sub_pd(_mm256_sub_pd(t2, _mm256_mul_pd(two, y)), _mm256_mul_pd(p3, z));
+			t2 = _mm256_sub_pd(y, _mm256_mul_pd(p4, z));
+			sum = _mm256_add_pd(sum, _mm256_mul_pd(z, z));
+		}
+		_mm256_storeu_pd(l->s1 + c, s1);
+		_mm256_storeu_pd(l->s2 + c, s2);
+		_mm256_storeu_pd(l->t1 + c, t1);
+		_mm256_storeu_pd(l->t2 + c, t2);
+		_mm256_storeu_pd(l->sum + c, sum);
+	}
+}
+
+__attribute__((target("avx")))
+static void peaks_avx(struct loudness* l, const double* x, int n)
+{
+	const __m256d mask = _mm256_castsi256_pd(_mm256_set1_epi64x(INT64_MAX));
+
+	for (int c = 0; c < l->channels; c += 4) {
+		__m256d peak = _mm256_loadu_pd(l->peak + c), tpeak = _mm256_loadu_pd(l->tpeak + c);
+		for (int f = 0; f < n; f++) {
+			const double* v = x + f*LANES + c;
+			peak = _mm256_max_pd(peak, _mm256_and_pd(_mm256_loadu_pd(v), mask));
+			for (int p = 0; p < l->factor && l->factor > 1; p++) {
+				__m256d y = _mm256_setzero_pd();
+				for (int k = 0; k < TAPS; k++) {
+					y = _mm256_add_pd(y, _mm256_mul_pd(_mm256_broadcast_sd(&l->taps[p][k]), _mm256_loadu_pd(v - k*LANES)));
+				}
+				tpeak = _mm256_max_pd(tpeak, _mm256_and_pd(y, mask));
+			}
+		}
+		_mm256_storeu_pd(l->peak + c, peak);
+		_mm256_storeu_pd(l->tpeak + c, tpeak);
+	}
+}
+
+#endif
+
+static void kweight(struct loudness* l, const double* x, int n)
+{
+#ifdef HAVE_X86
+	if (l->isa == LOUDNESS_AVX) {
+		kweight_avx(l, x, n);
+		return;
+	}
+#endif
+	kweight_scalar(l, x, n);
+}
+
+static void peaks(struct loudness* l, const double* x, int n)
+{
+#ifdef HAVE_X86
+	if (l->isa == LOUDNESS_AVX) {
+		peaks_avx(l, x, n);
+		return;
+	}
+#endif
+	peaks_scalar(l, x, n);
+}
+
+// Finish the current 100ms.
+static int finish_sub(struct loudness* l)
+{
+	double e = 0;
+
+	if (l->nenergy == l->cap) {
+		int cap = l->cap > 0 ? 2 * l->cap : 1024;
+		double* energy = realloc(l->energy, (size_t)cap * sizeof *energy);
+		if (energy == NULL) {
+			return -1;
+		}
+		l->energy = energy;
+		l->cap = cap;
+	}
+	for (int c = 0; c < l->channels; c++) {
+		e += l->weight[c] * l->sum[c] / l->sub;
+		l->sum[c] = 0;
+	}
+	l->energy[l->nenergy++] = e;
+	l->filled = 0;
+	return 0;
+}
+
+void loudness_add(struct loudness* l, const int32_t* samples, int n)
+{
+	double* x = l->frames + (TAPS-1) * LANES;
+
+	while (n > 0) {
+		int m = n < BLOCK ? n : BLOCK;
+		for (int f = 0; f < m; f++) {
+			for (int c = 0; c < l->channels; c++) {
+				x[f*LANES + c] = samples[f*l->channels + c] * l->scale;
+			}
+		}
+		peaks(l, x, m);
+		for (int f = 0; f < m; ) {
+			int k = l->sub - l->filled;
+			if (k > m - f) {
+				k = m - f;
+			}
+			kweight(l, x + f*LANES, k);
+			l->filled += k;
+			f += k;
+			if (l->filled == l->sub && finish_sub(l) < 0) {
+				// Out of memory: start the 100ms over
+				memset(l->sum, 0, sizeof l->sum);
+				l->filled = 0;
+			}
+		}
+		memmove(l->frames, x + (m - (TAPS-1)) * LANES, (TAPS-1) * LANES * sizeof *x);
+		samples += m * l->channels;
+		n -= m;
+	}
+}
+
+static double lufs(double energy)
+{
+	return -0.691 + 10 * log10(energy);
+}
+
+double loudness_integrated(const struct loudness* l)
+{
+	return loudness_album((struct loudness* const*)&l, 1);
+}
+
+double loudness_album(struct loudness* const* l, int n)
+{
+	// The absolute gate is -70 LUFS, and the relative gate 10 LU below
+	// the loudness of the blocks above that.
+	double gate = pow(10.0, (-70 + 0.691) / 10);
+	double sum = 0;
+	long count = 0;
+
+	for (int pass = 0; pass < 2; pass++) {
+		double total = 0;
+		count = 0;
+		for (int i = 0; i < n; i++) {
+			const double* e = l[i]->energy;
+			for (int j = 0; j + 4 <= l[i]->nenergy; j++) {
+				double b = (e[j] + e[j+1] + e[j+2] + e[j+3]) / 4;
+				if (b > gate) {
+					total += b;
+					count++;
+				}
+			}
+		}
+		if (count == 0) {
+			return -HUGE_VAL;
+		}
+		sum = total / (double)count;
+		if (pass == 0) {
+			gate = pow(10.0, (lufs(sum) - 10 + 0.691) / 10);
+		}
+	}
+	return lufs(sum);
+}
+
+double loudness_sample_peak(const struct loudness* l)
+{
+	double peak = 0;
+	for (int c = 0; c < l->channels; c++) {
+		if (l->peak[c] > peak) {
+			peak = l->peak[c];
+		}
+	}
+	return peak;
+}
+
+double loudness_true_peak(const struct loudness* l)
+{
+	double peak = loudness_sample_peak(l);
+	for (int c = 0; c < l->channels; c++) {
+		if (l->tpeak[c] > peak) {
+			peak = l->tpeak[c];
+		}
+	}
+	return peak;
+}
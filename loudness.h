@@ -0,0 +1,37 @@
+#ifndef LOUDNESS_H
+#define LOUDNESS_H
+
+#include "uint.h"
+
+// Instruction sets the loudness kernels can use, from worst to best.
+enum { LOUDNESS_SCALAR, LOUDNESS_AVX };
+
+struct loudness;
+
+// Return the best kernels this CPU can run, as cpu_level() allows.
+int loudness_best(void);
+
+// Start measuring the loudness of PCM with the given sample rate, number of
+// channels (1-8) and depth, with the kernels for isa, which should be no
+// better than loudness_best(). Channels are in WAV order. Returns NULL if
+// out of memory.
+struct loudness* loudness_open(int sample_rate, int channels, int depth, int isa);
+void loudness_free(struct loudness* l);
+
+// Measure n interleaved samples per channel, right-aligned in depth bits.
+void loudness_add(struct loudness* l, const int32_t* samples, int n);
+
+// Return the integrated loudness of everything added so far in LUFS, as in
+// ITU-R BS.1770-4, or -HUGE_VAL if it's all below the absolute gate.
+double loudness_integrated(const struct loudness* l);
+
+// Return the integrated loudness of several measurements together, as of
+// the tracks of an album.
+double loudness_album(struct loudness* const* l, int n);
+
+// Return the highest sample, and the highest true peak found by
+// oversampling, as fractions of full scale.
+double loudness_sample_peak(const struct loudness* l);
+double loudness_true_peak(const struct loudness* l);
+
+#endif
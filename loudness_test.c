@@ -0,0 +1,85 @@
+#include "loudness.h"
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+
+enum { rate = 48000 };
+
+// Measure seconds of a sine of the given frequency, amplitude and phase in
+// the given channels, at 24 bits.
+static struct loudness* sine(int channels, uint mask, double freq, double amp, double phase, double seconds, int isa)
+{
+	const double pi = 3.14159265358979323846;
+	int n = (int)(seconds * rate);
+	int32_t* s = malloc((size_t)(n * channels) * sizeof *s);
+	struct loudness* l = loudness_open(rate, channels, 24, isa);
+
+	assert(s != NULL && l != NULL);
+	for (int i = 0; i < n; i++) {
+		double v = amp * sin(2 * pi * freq * i / rate + phase) * 8388607;
+		for (int c = 0; c < channels; c++) {
+			s[i*channels + c] = mask >> c & 1 ? (int32_t)lround(v) : 0;
+		}
+	}
+	// In uneven pieces
+	for (int i = 0; i < n; ) {
+		int m = 1 + (i * 7919) % 3000;
+		if (m > n - i) {
+			m = n - i;
+		}
+		loudness_add(l, s + i*channels, m);
+		i += m;
+	}
+	free(s);
+	return l;
+}
+
+static void check(int isa)
+{
+	struct loudness* l;
+	struct loudness* album[2];
+
+	// BS.1770: a 0dBFS 1kHz sine in one channel is -3.01 LKFS, and
+	// -20dBFS in both of two is -20.
+	l = sine(1, 1, 1000, 1.0, 0, 5, isa);
+	assert(fabs(loudness_integrated(l) + 3.01) < 0.05);
+	loudness_free(l);
+	l = sine(2, 3, 1000, 0.1, 0, 5, isa);
+	assert(fabs(loudness_integrated(l) + 20) < 0.05);
+	assert(fabs(loudness_sample_peak(l) - 0.1) < 1e-4);
+	album[0] = l;
+
+	// The LFE doesn't count, and surrounds count for more.
+	l = sine(6, 1 << 3, 1000, 0.5, 0, 2, isa);
+	assert(loudness_integrated(l) == -HUGE_VAL);
+	loudness_free(l);
+	l = sine(6, 1 << 4, 1000, 0.1, 0, 2, isa);
+	assert(fabs(loudness_integrated(l) - (-23.01 + 10 * log10(1.41))) < 0.05);
+	loudness_free(l);
+
+	// Silence is below the absolute gate, and gated out of an album.
+	l = sine(2, 0, 1000, 0, 0, 5, isa);
+	assert(loudness_integrated(l) == -HUGE_VAL);
+	album[1] = l;
+	assert(fabs(loudness_album(album, 2) + 20) < 0.05);
+	loudness_free(album[0]);
+	loudness_free(album[1]);
+
+	// A quarter of the sample rate at 45 degrees never has a sample at
+	// its peaks.
+	l = sine(2, 3, rate / 4, 0.5, 3.14159265358979323846 / 4, 1, isa);
+	assert(fabs(loudness_sample_peak(l) - 0.5 * sqrt(0.5)) < 1e-4);
+	assert(fabs(loudness_true_peak(l) - 0.5) < 0.01);
+	loudness_free(l);
+}
+
+int main(int argc, char *argv[])
+{
+	(void)argc;
+	(void)argv;
+
+	for (int isa = LOUDNESS_SCALAR; isa <= loudness_best(); isa++) {
+		check(isa);
+	}
+	return 0;
+}
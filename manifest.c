@@ -0,0 +1,159 @@
+/* manifest - the jobs of a batch */
+
+#define _POSIX_C_SOURCE 200809L
+#include <limits.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "manifest.h"
+
+static const char blanks[] = " \t\r\n";
+
+// Make path independent of the working directory, cwd.
+static char* absolute(const char* path, const char* cwd)
+{
+	char* p;
+
+	if (path[0] == '/' || cwd == NULL) {
+		return strdup(path);
+	}
+	p = malloc(strlen(cwd) + strlen(path) + 2);
+	if (p != NULL) {
+		sprintf(p, "%s/%s", cwd, path);
+	}
+	return p;
+}
+
+// Whether arg is an option naming the path a job reads from: a disc, or a
+// loose file.
+static bool input_option(const char* arg)
+{
+	return strcmp(arg, "-d") == 0 || strcmp(arg, "-i") == 0;
+}
+
+void manifest_free_job(struct manifest_job* j)
+{
+	for (int i = 1; i < j->argc; i++) {
+		free(j->argv[i]);
+	}
+	free(j->argv);
+	free(j->dir);
+	j->argv = NULL;
+	j->dir = NULL;
+}
+
+int manifest_parse(char* line, const char* cwd, struct manifest_job* j)
+{
+	char* arg;
+	char* save;
+	size_t maxargs;
+
+	memset(j, 0, sizeof *j);
+	line[strcspn(line, "#")] = '\0';
+	// Every argument takes at least two characters, even one split in two
+	maxargs = strlen(line) / 2 + 3;
+	arg = strtok_r(line, blanks, &save);
+	if (arg == NULL) {
+		return 0;
+	}
+	j->dir = strdup(arg);
+	j->argv = malloc(maxargs * sizeof *j->argv);
+	if (j->dir == NULL || j->argv == NULL) {
+		goto error;
+	}
+	j->argv[j->argc++] = "extractaudio";
+	while ((arg = strtok_r(NULL, blanks, &save)) != NULL) {
+		// Split the path from an option it's run on after
+		if ((strncmp(arg, "-d", 2) == 0 || strncmp(arg, "-i", 2) == 0) && arg[2] != '\0') {
+			j->argv[j->argc] = strndup(arg, 2);
+			if (j->argv[j->argc] == NULL) {
+				goto error;
+			}
+			j->argc++;
+			arg += 2;
+		}
+		if (input_option(j->argv[j->argc-1])) {
+			j->argv[j->argc] = absolute(arg, cwd);
+		} else {
+			j->argv[j->argc] = strdup(arg);
+		}
+		if (j->argv[j->argc] == NULL) {
+			goto error;
+		}
+		j->argc++;
+	}
+	j->argv[j->argc] = NULL;
+	return 1;
+
+error:
+	manifest_free_job(j);
+	return -1;
+}
+
+int manifest_read(FILE* fp, const char* filename, struct manifest_job** jobsp)
+{
+	struct manifest_job* jobs = NULL;
+	struct manifest_job j;
+	char cwd[PATH_MAX];
+	const char* dir = getcwd(cwd, sizeof cwd);
+	char* line = NULL;
+	size_t linesize = 0;
+	int njobs = 0, lineno = 0, n;
+
+	while (getline(&line, &linesize, fp) >= 0) {
+		lineno++;
+		n = manifest_parse(line, dir, &j);
+		if (n == 0) {
+			continue;
+		}
+		if (n < 0) {
+			fprintf(stderr, "%s:%d: out of memory\n", filename, lineno);
+			goto error;
+		}
+		if (j.argc == 1) {
+			fprintf(stderr, "%s:%d: no arguments for %s\n", filename, lineno, j.dir);
+			manifest_free_job(&j);
+			goto error;
+		}
+		struct manifest_job* p = realloc(jobs, (size_t)(njobs + 1) * sizeof *p);
+		if (p == NULL) {
+			fprintf(stderr, "%s:%d: out of memory\n", filename, lineno);
+			manifest_free_job(&j);
+			goto error;
+		}
+		jobs = p;
+		jobs[njobs++] = j;
+	}
+	free(line);
+	*jobsp = jobs;
+	return njobs;
+
+error:
+	free(line);
+	manifest_free(jobs, njobs);
+	return -1;
+}
+
+const char* manifest_input(const struct manifest_job* j)
+{
+	const char* disc = NULL;
+	const char* loose = NULL;
+	for (int i = 1; i+1 < j->argc; i++) {
+		if (strcmp(j->argv[i], "-d") == 0) {
+			disc = j->argv[++i];
+		} else if (strcmp(j->argv[i], "-i") == 0) {
+			loose = j->argv[++i];
+		}
+	}
+	// extractaudio reads a loose file rather than the disc
+	return loose != NULL ? loose : disc;
+}
+
+void manifest_free(struct manifest_job* jobs, int njobs)
+{
+	for (int i = 0; i < njobs; i++) {
+		manifest_free_job(&jobs[i]);
+	}
+	free(jobs);
+}
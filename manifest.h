@@ -0,0 +1,36 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdio.h>
+
+// A batch manifest: a line for each job, giving the directory to rip into
+// followed by the arguments of an ordinary run in that directory,
+// separated by blanks. # starts a comment.
+
+struct manifest_job {
+	char* dir;
+	int argc;
+	char** argv; // argv[0] is "extractaudio", and argv[argc] is NULL
+};
+
+// Split a line of a manifest into a job. Jobs run in their own directory,
+// so the paths a job reads from, after -d and -i, are made absolute, from
+// cwd if it isn't NULL. The line is changed. Returns 1 if the line has a
+// job, 0 if it's blank, or -1 if out of memory.
+int manifest_parse(char* line, const char* cwd, struct manifest_job* j);
+
+// Read the jobs of a manifest from fp, reporting errors as in filename.
+// Returns the number of jobs, or -1 on error.
+int manifest_read(FILE* fp, const char* filename, struct manifest_job** jobsp);
+
+// Return the path a job reads from, the loose file if it has one or else
+// the disc, or NULL if it's left to the default.
+const char* manifest_input(const struct manifest_job* j);
+
+// Free the job parsed from a line.
+void manifest_free_job(struct manifest_job* j);
+
+// Free the jobs of a manifest.
+void manifest_free(struct manifest_job* jobs, int njobs);
+
+#endif
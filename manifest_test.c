@@ -0,0 +1,154 @@
+#define _POSIX_C_SOURCE 200809L
+#include "manifest.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Parse a copy of s, so it can be a literal.
+static int parse(const char* s, struct manifest_job* j)
+{
+	char* line = strdup(s);
+	assert(line != NULL);
+	int n = manifest_parse(line, "/work", j);
+	free(line);
+	return n;
+}
+
+static void check_args(const struct manifest_job* j, const char* dir, int argc, const char* const* argv)
+{
+	assert(strcmp(j->dir, dir) == 0);
+	assert(j->argc == argc);
+	assert(strcmp(j->argv[0], "extractaudio") == 0);
+	for (int i = 1; i < argc; i++) {
+		assert(strcmp(j->argv[i], argv[i-1]) == 0);
+	}
+	assert(j->argv[argc] == NULL);
+}
+
+// Read a whole manifest from a string.
+static int read_string(const char* s, struct manifest_job** jobs)
+{
+	FILE* fp = fmemopen((void*)s, strlen(s), "r");
+	assert(fp != NULL);
+	int n = manifest_read(fp, "test", jobs);
+	fclose(fp);
+	return n;
+}
+
+int main(int argc, char *argv[])
+{
+	(void)argc;
+	(void)argv;
+
+	struct manifest_job j;
+	struct manifest_job* jobs;
+	char* line;
+	int n;
+
+	// Blank lines and comments have no job
+	assert(parse("", &j) == 0);
+	assert(parse(" \t\r\n", &j) == 0);
+	assert(parse("# a1 -t 1\n", &j) == 0);
+	assert(parse("   # a1 -t 1\n", &j) == 0);
+
+	// Blanks of any kind separate arguments, and comments end the line
+	assert(parse("a1\t-t 1  -f flac\t# the film\r\n", &j) == 1);
+	check_args(&j, "a1", 5, (const char*[]){"-t", "1", "-f", "flac"});
+	manifest_free_job(&j);
+	assert(parse("a1 -t 1#2", &j) == 1);
+	check_args(&j, "a1", 3, (const char*[]){"-t", "1"});
+	manifest_free_job(&j);
+
+	// The disc's path is made absolute, whether or not it's run on
+	assert(parse("a1 -d film.iso -t 1", &j) == 1);
+	check_args(&j, "a1", 5, (const char*[]){"-d", "/work/film.iso", "-t", "1"});
+	assert(strcmp(manifest_input(&j), "/work/film.iso") == 0);
+	manifest_free_job(&j);
+	assert(parse("a1 -dfilm.iso -t 1", &j) == 1);
+	check_args(&j, "a1", 5, (const char*[]){"-d", "/work/film.iso", "-t", "1"});
+	assert(strcmp(manifest_input(&j), "/work/film.iso") == 0);
+	manifest_free_job(&j);
+	assert(parse("a1 -d /dev/sr1", &j) == 1);
+	check_args(&j, "a1", 3, (const char*[]){"-d", "/dev/sr1"});
+	manifest_free_job(&j);
+	assert(parse("a1 -d/dev/sr1", &j) == 1);
+	check_args(&j, "a1", 3, (const char*[]){"-d", "/dev/sr1"});
+	manifest_free_job(&j);
+
+	// So is a loose file's, and it's read rather than the disc
+	assert(parse("a1 -i film.vob", &j) == 1);
+	check_args(&j, "a1", 3, (const char*[]){"-i", "/work/film.vob"});
+	assert(strcmp(manifest_input(&j), "/work/film.vob") == 0);
+	manifest_free_job(&j);
+	assert(parse("a1 -ifilm.vob -d /dev/sr1", &j) == 1);
+	check_args(&j, "a1", 5, (const char*[]){"-i", "/work/film.vob", "-d", "/dev/sr1"});
+	assert(strcmp(manifest_input(&j), "/work/film.vob") == 0);
+	manifest_free_job(&j);
+
+	// The last one counts, and other arguments aren't touched
+	assert(parse("a1 -d one -d two -t d", &j) == 1);
+	assert(strcmp(manifest_input(&j), "/work/two") == 0);
+	assert(strcmp(j.argv[6], "d") == 0);
+	manifest_free_job(&j);
+	assert(parse("a1 -i one -i two -t i", &j) == 1);
+	assert(strcmp(manifest_input(&j), "/work/two") == 0);
+	assert(strcmp(j.argv[6], "i") == 0);
+	manifest_free_job(&j);
+	assert(parse("a1 -t 1", &j) == 1);
+	assert(manifest_input(&j) == NULL);
+	manifest_free_job(&j);
+	// A trailing -d is left for the job to complain about
+	assert(parse("a1 -d", &j) == 1);
+	check_args(&j, "a1", 2, (const char*[]){"-d"});
+	assert(manifest_input(&j) == NULL);
+	manifest_free_job(&j);
+
+	// Without a working directory, paths are left as they are
+	line = strdup("a1 -dfilm.iso");
+	assert(manifest_parse(line, NULL, &j) == 1);
+	check_args(&j, "a1", 3, (const char*[]){"-d", "film.iso"});
+	manifest_free_job(&j);
+	free(line);
+
+	// Long lines of the shortest arguments, some split in two, fit
+	enum { nargs = 5000 };
+	line = malloc(4*nargs + 3);
+	assert(line != NULL);
+	strcpy(line, "a1");
+	for (int i = 0; i < nargs; i++) {
+		strcat(line, i % 2 ? " x" : " -dx");
+	}
+	assert(manifest_parse(line, "/", &j) == 1);
+	assert(j.argc == 1 + nargs + nargs/2);
+	assert(strcmp(j.argv[1], "-d") == 0 && strcmp(j.argv[2], "//x") == 0);
+	assert(strcmp(j.argv[3], "x") == 0);
+	assert(j.argv[j.argc] == NULL);
+	manifest_free_job(&j);
+	strcpy(line, "a");
+	for (int i = 0; i < nargs; i++) {
+		strcat(line, "\t-dx");
+	}
+	assert(manifest_parse(line, NULL, &j) == 1);
+	assert(j.argc == 1 + 2*nargs);
+	assert(j.argv[j.argc] == NULL);
+	manifest_free_job(&j);
+	free(line);
+
+	// A whole manifest
+	n = read_string("# rips\n\na1 -t 1\n  \na2 -dfilm.iso -t 2 # the other one\na3 -t 3", &jobs);
+	assert(n == 3);
+	assert(strcmp(jobs[0].dir, "a1") == 0 && jobs[0].argc == 3);
+	assert(strcmp(jobs[1].dir, "a2") == 0 && jobs[1].argc == 5);
+	assert(manifest_input(&jobs[1])[0] == '/');
+	assert(strcmp(jobs[2].dir, "a3") == 0 && jobs[2].argc == 3);
+	manifest_free(jobs, n);
+	assert(read_string("", &jobs) == 0);
+	manifest_free(jobs, 0);
+
+	// A directory with nothing to do is an error
+	assert(parse("a1", &j) == 1);
+	assert(j.argc == 1);
+	manifest_free_job(&j);
+	assert(read_string("a1 -t 1\na2 # later\na3 -t 3\n", &jobs) == -1);
+	return 0;
+}
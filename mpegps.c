@@ -0,0 +1,246 @@
+/* mpegps - helpers for the MPEG program stream packs found on DVDs */
+
+#include <stddef.h>
+#include "mpegps.h"
+#include "cpu.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+// Skip the MPEG header. Returns a pointer to the PES header.
+u8 *skip_mpeg_header(u8 *b)
+{
+	return b + 0xe + (b[0xd] & 7);
+}
+
+// Skip the MPEG and PES headers. Returns a pointer to the substream header.
+u8* skip_pes_header(u8 *b)
+{
+	u8 *p = b + 0xe + (b[0xd] & 7); // points to PES
+	p = p + 9 + p[8]; // points to PES payload
+	return p;
+}
+
+
+// Return the stream id associated with a pack. If private is true and the
+// packet is private stream 1, return the stream id of the private stream.
+int pack_stream_id(sectorbuf b, bool private)
+{
+	// Theoretically, each pack only contains a single stream, so we
+	// shouldn't have to look beyond the first packet.
+	if (b[0] != 0 || b[1] != 0 || b[2] != 1 || b[3] != 0xba) {
+		return -1; // not a PACK
+	}
+	u8 *p = skip_mpeg_header(b);
+	if (p[0] != 0 || p[1] != 0 || p[2] != 1) {
+		return -1; // not a packet
+	}
+	if (private && p[3] == 0xbd) {
+		// private stream
+		return p[9+p[8]];
+	}
+	return p[3];
+}
+
+int get_stream_info(sectorbuf b, struct stream_info *info)
+{
+	int data_offset, first_frame_offset, size, stream;
+	u8 *p = b;
+
+	if (p[0] != 0 || p[1] != 0 || p[2] != 1 || p[3] != 0xba) {
+		return -1;
+	}
+
+	p = skip_mpeg_header(b);
+	if (p[0] != 0 || p[1] != 0 || p[2] != 1) {
+		return -1;
+	}
+	if (p[3] != 0xbd) {
+		return -1;
+	}
+	size = p[4]<<8 | p[5]; // + p+6 = end, so, length of the remaining data
+	size += p+6 - b;
+
+	p = skip_pes_header(b);
+	stream = p[0];
+	first_frame_offset = p[2]<<8 | p[3]; // relative to &p[3]
+	if (first_frame_offset == 0) {
+		// no first frame
+		first_frame_offset = -1;
+	} else {
+		first_frame_offset += p+3 - b;
+	}
+
+	data_offset = p+4 - b;
+	if ((stream & ~7) == 0xA0) {
+		// LPCM streams have a 3-byte header
+		data_offset += 3;
+	} else if ((stream & ~0x1f) == 0x20) {
+		// Subpictures have no header beyond the stream id
+		data_offset = (int)(p+1 - b);
+		first_frame_offset = -1;
+	}
+
+	info->stream = stream;
+	info->end_offset = size;
+	info->data_offset = data_offset;
+	info->first_frame_offset = first_frame_offset;
+	// The length comes from the stream, so it can run past the pack
+	if (data_offset > size || size > SECTOR_SIZE || first_frame_offset > size) {
+		return -1;
+	}
+	return 0;
+}
+
+// DVD-Audio substream header:
+// 1 byte: stream id (A0 LPCM, A1 MLP)
+// 1 byte: continuity counter
+// 2 bytes: offset to first access unit, relative to the last of them
+// 1 byte: length of the rest of the header
+int get_aob_stream_info(sectorbuf b, struct stream_info *info)
+{
+	int first_frame_offset, size;
+	u8 *p;
+
+	if (b[0] != 0 || b[1] != 0 || b[2] != 1 || b[3] != 0xba) {
+		return -1;
+	}
+	p = skip_mpeg_header(b);
+	if (p[0] != 0 || p[1] != 0 || p[2] != 1 || p[3] != 0xbd) {
+		return -1;
+	}
+	size = p[4]<<8 | p[5];
+	size += (int)(p+6 - b);
+
+	p = skip_pes_header(b);
+	first_frame_offset = p[2]<<8 | p[3];
+	if (first_frame_offset == 0) {
+		first_frame_offset = -1;
+	} else {
+		first_frame_offset += (int)(p+3 - b);
+	}
+
+	info->stream = p[0];
+	info->end_offset = size;
+	info->data_offset = (int)(p+5 + p[4] - b);
+	info->first_frame_offset = first_frame_offset;
+	if (info->data_offset > size || size > SECTOR_SIZE) {
+		return -1;
+	}
+	return 0;
+}
+
+// Return the presentation time stamp of a pack's packet in 90kHz ticks, or
+// -1 if it doesn't have one.
+int64_t pack_pts(sectorbuf b)
+{
+	if (b[0] != 0 || b[1] != 0 || b[2] != 1 || b[3] != 0xba) {
+		return -1;
+	}
+	u8 *p = skip_mpeg_header(b);
+	if (p[0] != 0 || p[1] != 0 || p[2] != 1 || p + 14 > b + SECTOR_SIZE) {
+		return -1;
+	}
+	// MPEG-2 PES header with PTS_DTS_flags set
+	if ((p[6] & 0xc0) != 0x80 || !(p[7] & 0x80) || p[8] < 5) {
+		return -1;
+	}
+	return (int64_t)(p[9] & 0x0e) << 29 | (int64_t)p[10] << 22 |
+		(int64_t)(p[11] & 0xfe) << 14 | (int64_t)p[12] << 7 | p[13] >> 1;
+}
+
+static const u8* find_pack_scalar(const u8* p, const u8* end)
+{
+	for (; end - p >= 4; p++) {
+		if (p[3] == 0xba && p[2] == 1 && p[1] == 0 && p[0] == 0) {
+			return p;
+		}
+	}
+	return NULL;
+}
+
+#ifdef HAVE_X86
+
+// Compare the vector at each of the four bytes of the start code with that
+// byte, so that bit i of the mask is set if a start code begins at p+i.
+__attribute__((target("sse2")))
+static const u8* find_pack_sse2(const u8* p, const u8* end)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one = _mm_set1_epi8(1);
+	const __m128i ba = _mm_set1_epi8((char)0xba);
+
+	for (; end - p >= 16+3; p += 16) {
+		__m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), zero);
+		__m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p+1)), zero);
+		__m128i c = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p+2)), one);
+		__m128i d = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p+3)), ba);
+		int mask = _mm_movemask_epi8(_mm_and_si128(_mm_and_si128(a, b), _mm_and_si128(c, d)));
+		if (mask != 0) {
+			return p + __builtin_ctz((unsigned)mask);
+		}
+	}
+	return find_pack_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static const u8* find_pack_avx2(const u8* p, const u8* end)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i one = _mm256_set1_epi8(1);
+	const __m256i ba = _mm256_set1_epi8((char)0xba);
+
+	for (; end - p >= 32+3; p += 32) {
+		__m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p), zero);
+		__m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p+1)), zero);
+		__m256i c = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p+2)), one);
+		__m256i d = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p+3)), ba);
+		unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, d)));
+		if (mask != 0) {
+			return p + __builtin_ctz(mask);
+		}
+	}
+	return find_pack_sse2(p, end);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static const u8* find_pack_avx512(const u8* p, const u8* end)
+{
+	const __m512i zero = _mm512_setzero_si512();
+	const __m512i one = _mm512_set1_epi8(1);
+	const __m512i ba = _mm512_set1_epi8((char)0xba);
+
+	for (; end - p >= 64+3; p += 64) {
+		__mmask64 mask = _mm512_cmpeq_epi8_mask(_mm512_loadu_si512((const void*)p), zero) &
+			_mm512_cmpeq_epi8_mask(_mm512_loadu_si512((const void*)(p+1)), zero) &
+			_mm512_cmpeq_epi8_mask(_mm512_loadu_si512((const void*)(p+2)), one) &
+			_mm512_cmpeq_epi8_mask(_mm512_loadu_si512((const void*)(p+3)), ba);
+		if (mask != 0) {
+			return p + __builtin_ctzll(mask);
+		}
+	}
+	return find_pack_avx2(p, end);
+}
+
+#endif
+
+// Return the first pack start code (00 00 01 BA) between p and end, or
+// NULL if there isn't one. It needn't be aligned to anything.
+const u8* find_pack(const u8* p, const u8* end)
+{
+#ifdef HAVE_X86
+	int l = cpu_level();
+	if (l >= CPU_AVX512) {
+		return find_pack_avx512(p, end);
+	}
+	if (l >= CPU_AVX2) {
+		return find_pack_avx2(p, end);
+	}
+	if (l >= CPU_SSE2) {
+		return find_pack_sse2(p, end);
+	}
+#endif
+	return find_pack_scalar(p, end);
+}
@@ -0,0 +1,53 @@
+#ifndef MPEGPS_H
+#define MPEGPS_H
+
+#include <stdbool.h>
+#include "uint.h"
+
+// Every DVD sector holds exactly one MPEG pack.
+#define SECTOR_SIZE 2048
+
+typedef u8 sectorbuf[SECTOR_SIZE];
+
+// MPEG Header
+// 00-03: 00 00 01 BA (4 bytes)
+// 04-09: system clock reference (6 bytes)
+// 0A-0C: mux rate
+// 0D: stuffing length
+// <stuffing>
+//
+// PES HEADER
+// 00 00 01 <stream id>
+// packet length
+// XX XX <header length>
+//
+// AUDIO HEADER
+// 1 byte: stream id
+// 2 bytes: offset to first packet
+// format-specific extra stuff
+
+struct stream_info {
+	// stream is the audio or subpicture substream id.
+	int stream;
+	// data_offset is the offset to the start of the stream data.
+	// all offsets are relative to the start of the sector.
+	int data_offset;
+	// first_frame_offset is the offset to the frame corresponding to the
+	// packet's PTS (FirstAccUnit).
+	// if there is no first frame, it is -1. subpictures never have one.
+	int first_frame_offset;
+	// end_offset is the offset to the byte after the packet data. in other
+	// words, it is the size of the packet.
+	int end_offset;
+};
+
+u8 *skip_mpeg_header(u8 *b);
+u8 *skip_pes_header(u8 *b);
+int pack_stream_id(sectorbuf b, bool private);
+int get_stream_info(sectorbuf b, struct stream_info *info);
+// The same for the packs of a DVD-Audio AOB, which have a header of their own.
+int get_aob_stream_info(sectorbuf b, struct stream_info *info);
+int64_t pack_pts(sectorbuf b);
+const u8* find_pack(const u8* p, const u8* end);
+
+#endif
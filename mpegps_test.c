@@ -0,0 +1,134 @@
+#include "mpegps.h"
+#include <assert.h>
+#include <string.h>
+
+// An LPCM pack: pack header, then a PES packet with a PTS, then the
+// substream header.
+static void make_pack(sectorbuf b, int64_t pts)
+{
+	static const u8 head[] = {
+		0x00, 0x00, 0x01, 0xba, 0x44, 0x00, 0x04, 0x00, 0x04, 0x01, 0x01, 0x89, 0xc3, 0xf8,
+		0x00, 0x00, 0x01, 0xbd, 0x07, 0xec, 0x81, 0x80, 0x05,
+	};
+	u8* p = b + sizeof head;
+
+	memset(b, 0, SECTOR_SIZE);
+	memcpy(b, head, sizeof head);
+	p[0] = (u8)(0x21 | (pts >> 29 & 0x0e));
+	p[1] = (u8)(pts >> 22);
+	p[2] = (u8)(0x01 | (pts >> 14 & 0xfe));
+	p[3] = (u8)(pts >> 7);
+	p[4] = (u8)(0x01 | (pts << 1 & 0xfe));
+	p += 5;
+	p[0] = 0xa0; // substream
+	p[1] = 1; // frames
+	p[2] = 0; // first frame offset
+	p[3] = 4;
+}
+
+// Check find_pack against a plain search from every offset of buf.
+static void check_find_pack(const u8* buf, int size)
+{
+	for (int i = 0; i <= size; i++) {
+		const u8* want = NULL;
+		for (int j = i; j + 4 <= size && want == NULL; j++) {
+			if (buf[j] == 0 && buf[j+1] == 0 && buf[j+2] == 1 && buf[j+3] == 0xba) {
+				want = buf + j;
+			}
+		}
+		assert(find_pack(buf + i, buf + size) == want);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	(void)argc;
+	(void)argv;
+
+	sectorbuf b;
+	struct stream_info info;
+	u8* p;
+
+	make_pack(b, 90000);
+	assert(pack_stream_id(b, false) == 0xbd);
+	assert(pack_stream_id(b, true) == 0xa0);
+	assert(get_stream_info(b, &info) == 0);
+	assert(info.stream == 0xa0);
+	assert(info.data_offset == 23+5+4+3);
+	assert(info.first_frame_offset == 23+5+3+4);
+	assert(info.end_offset == SECTOR_SIZE);
+	assert(pack_pts(b) == 90000);
+
+	// Lengths from a bad pack that run past it, or end before the data
+	// or the first frame
+	b[0x12] = 0x07;
+	b[0x13] = 0xed;
+	assert(get_stream_info(b, &info) < 0);
+	b[0x12] = 0xff;
+	b[0x13] = 0xff;
+	assert(get_stream_info(b, &info) < 0);
+	b[0x12] = 0x00;
+	b[0x13] = 0x0e;
+	assert(get_stream_info(b, &info) < 0);
+	b[0x13] = 0x30;
+	assert(get_stream_info(b, &info) == 0);
+	assert(info.end_offset == 0x14 + 0x30);
+	p = skip_pes_header(b);
+	p[3] = 0x30;
+	assert(get_stream_info(b, &info) < 0);
+	make_pack(b, 90000);
+
+	// The same pack as DVD-Audio LPCM, with an 8-byte header after the
+	// length, and MLP with none
+	p = skip_pes_header(b);
+	p[1] = 5; // continuity counter
+	p[2] = 0;
+	p[3] = 12;
+	p[4] = 8;
+	assert(get_aob_stream_info(b, &info) == 0);
+	assert(info.stream == 0xa0);
+	assert(info.data_offset == 23+5+5+8);
+	assert(info.first_frame_offset == 23+5+3+12);
+	assert(info.end_offset == SECTOR_SIZE);
+	p[0] = 0xa1;
+	p[3] = 2;
+	p[4] = 0;
+	assert(get_aob_stream_info(b, &info) == 0);
+	assert(info.stream == 0xa1);
+	assert(info.data_offset == info.first_frame_offset);
+	p[3] = 0;
+	assert(get_aob_stream_info(b, &info) == 0);
+	assert(info.first_frame_offset == -1);
+
+	// All 33 bits
+	make_pack(b, 0x1fedcba98);
+	assert(pack_pts(b) == 0x1fedcba98);
+
+	// No PTS
+	b[21] = 0x00;
+	b[22] = 0x00;
+	assert(pack_pts(b) == -1);
+
+	// Not a pack
+	b[3] = 0xbb;
+	assert(pack_pts(b) == -1);
+	assert(pack_stream_id(b, false) == -1);
+
+	// Start codes anywhere, including across vector boundaries and at
+	// the very end, among near misses
+	static u8 buf[300];
+	static const int at[] = {0, 15, 16, 30, 31, 63, 95, 200, 296};
+	memset(buf, 0, sizeof buf);
+	for (int i = 0; i < (int)sizeof buf; i += 7) {
+		buf[i] = 1;
+		buf[i+1 < (int)sizeof buf ? i+1 : i] = 0xba;
+	}
+	for (int i = 0; i < (int)(sizeof at / sizeof at[0]); i++) {
+		memcpy(buf + at[i], "\x00\x00\x01\xba", 4);
+	}
+	check_find_pack(buf, sizeof buf);
+	check_find_pack(buf, 298);
+	memset(buf, 0, sizeof buf);
+	check_find_pack(buf, sizeof buf);
+	return 0;
+}
@@ -0,0 +1,170 @@
+/* parse - extractaudio's arguments */
+
+#include <stdbool.h>
+#include <string.h>
+#include "parse.h"
+
+const char* parse_int(const char* s, int* out)
+{
+	int n = 0;
+	const char *p;
+	for (p = s; '0' <= *p && *p <= '9'; p++) {
+		n *= 10;
+		n += *p - '0';
+	}
+	if (p != s) {
+		*out = n;
+	}
+	return p;
+}
+
+int parse_range(const char* s, int* startp, int* endp)
+{
+	// Valid inputs:
+	//     N-M
+	//      -N
+	//     N-
+	//      N
+
+	const char* p = s;
+	*startp = 1;
+	*endp = -1;
+
+	if (s[0] == '-' && s[1] == '\0') {
+		return -1;
+	}
+
+	p = parse_int(p, startp);
+	if (*p == '-') {
+		p = parse_int(p+1, endp);
+	} else if (p != s) {
+		*endp = *startp;
+	}
+	if (*p != '\0' || p == s) {
+		return -1;
+	}
+
+	return 0;
+}
+
+const char* parse_time(const char* s, double* out)
+{
+	const char* p = s;
+	const char* q;
+	double t = 0, scale = 0.1;
+	int n, fields = 0;
+
+	for (;;) {
+		n = 0;
+		q = parse_int(p, &n);
+		// Only the first field can run over
+		if (q == p || (fields > 0 && n >= 60) || ++fields > 3) {
+			return s;
+		}
+		t = t*60 + n;
+		p = q;
+		if (*p != ':') {
+			break;
+		}
+		p++;
+	}
+	if (*p == '.') {
+		for (p++; '0' <= *p && *p <= '9'; p++) {
+			t += (*p - '0') * scale;
+			scale /= 10;
+		}
+	}
+	*out = t;
+	return p;
+}
+
+int parse_times(const char* s, double* startp, double* endp)
+{
+	// Valid inputs:
+	//     T-T
+	//     T-
+
+	const char* p = parse_time(s, startp);
+	const char* q;
+
+	*endp = -1;
+	if (p == s || *p != '-') {
+		return -1;
+	}
+	p++;
+	if (*p != '\0') {
+		q = parse_time(p, endp);
+		if (q == p || *endp <= *startp) {
+			return -1;
+		}
+		p = q;
+	}
+	if (*p != '\0') {
+		return -1;
+	}
+	return 0;
+}
+
+int parse_titles(const char* s, bool* titles)
+{
+	const char* p = s;
+	int n = 0, start, end;
+
+	memset(titles, 0, (max_titles+1) * sizeof *titles);
+	if (strcmp(s, "all") == 0) {
+		for (start = 1; start <= max_titles; start++) {
+			titles[start] = true;
+		}
+		return max_titles;
+	}
+	for (;;) {
+		start = -1;
+		p = parse_int(p, &start);
+		end = start;
+		if (*p == '-') {
+			end = -1;
+			p = parse_int(p+1, &end);
+		}
+		if (start < 1 || end < start || end > max_titles) {
+			return -1;
+		}
+		for (; start <= end; start++) {
+			n += !titles[start];
+			titles[start] = true;
+		}
+		if (*p == '\0') {
+			return n;
+		}
+		if (*p != ',') {
+			return -1;
+		}
+		p++;
+	}
+}
+
+int parse_streams(const char* s, uint* maskp)
+{
+	const char* p = s;
+	int n;
+
+	if (strcmp(s, "all") == 0) {
+		*maskp = ~0U;
+		return 0;
+	}
+	*maskp = 0;
+	for (;;) {
+		n = -1;
+		p = parse_int(p, &n);
+		if (n < 0 || n > 31) {
+			return -1;
+		}
+		*maskp |= 1U << n;
+		if (*p == '\0') {
+			return 0;
+		}
+		if (*p != ',') {
+			return -1;
+		}
+		p++;
+	}
+}
@@ -0,0 +1,38 @@
+#ifndef PARSE_H
+#define PARSE_H
+
+#include <stdbool.h>
+#include "uint.h"
+
+// Parsers for extractaudio's arguments.
+
+// Titles go from 1 to 99.
+enum { max_titles = 99 };
+
+// Parse a decimal number and place it in *out.
+// Returns a pointer to the unparsed portion of the string.
+const char* parse_int(const char* s, int* out);
+
+// Parse a range of chapters: N-M, N-, -M, or N on its own. A missing
+// start is 1, and a missing end -1. Returns -1 if it can't be parsed.
+int parse_range(const char* s, int* startp, int* endp);
+
+// Parse a time of the form [[H:]M:]S[.F] into seconds. Minutes and
+// seconds after a larger field have to be under 60. Returns a pointer to
+// the unparsed portion of the string, which is s if there's no time.
+const char* parse_time(const char* s, double* out);
+
+// Parse a range of times, T-T or T-, into seconds. A missing end is -1.
+// Returns -1 if it can't be parsed, or the end isn't after the start.
+int parse_times(const char* s, double* startp, double* endp);
+
+// Parse a comma-separated list of titles and ranges of titles, or "all",
+// marking them in titles[1..max_titles]. Returns how many there are, or
+// -1 if it can't be parsed.
+int parse_titles(const char* s, bool* titles);
+
+// Parse a comma-separated list of stream numbers, or "all", into a
+// bitmask. Returns -1 if it can't be parsed.
+int parse_streams(const char* s, uint* maskp);
+
+#endif
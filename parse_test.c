@@ -0,0 +1,100 @@
+#include "parse.h"
+#include <assert.h>
+#include <string.h>
+
+// Whether s parses as a time of want seconds, and nothing after it.
+static bool time_is(const char* s, double want)
+{
+	double t = -1;
+	const char* p = parse_time(s, &t);
+	return p != s && *p == '\0' && t > want - 1e-9 && t < want + 1e-9;
+}
+
+static bool times_are(const char* s, double start, double end)
+{
+	double a, b;
+	return parse_times(s, &a, &b) == 0 && a == start && b == end;
+}
+
+int main(int argc, char *argv[])
+{
+	(void)argc;
+	(void)argv;
+
+	bool titles[max_titles+1];
+	double a, b;
+	int start, end;
+	uint mask;
+
+	// Times
+	assert(time_is("0", 0));
+	assert(time_is("75", 75));
+	assert(time_is("1:15", 75));
+	assert(time_is("90:00", 5400));
+	assert(time_is("1:02:03", 3723));
+	assert(time_is("1:02:03.25", 3723.25));
+	assert(time_is("59.5", 59.5));
+	assert(time_is("0:59.", 59));
+	assert(time_is("2:00:59", 7259));
+
+	// Only the first field can be 60 or more
+	const char* bad[] = {"1:75", "1:60", "1:00:60", "1:60:00", "0:99:00", "1:2:3:4", "", ":30", ".5"};
+	for (size_t i = 0; i < sizeof bad / sizeof *bad; i++) {
+		a = -2;
+		assert(parse_time(bad[i], &a) == bad[i]);
+		assert(a == -2);
+	}
+
+	// What follows a time is left to the caller
+	const char* s = "1:30-2:00";
+	assert(parse_time(s, &a) == s+4 && a == 90);
+	// but a colon has to have a field after it
+	s = "1:30:";
+	assert(parse_time(s, &a) == s);
+
+	// Ranges of times
+	assert(times_are("1:00-2:00", 60, 120));
+	assert(times_are("1:00-", 60, -1));
+	assert(times_are("0-0:00.5", 0, 0.5));
+	assert(times_are("1:59:59-2:00:00", 7199, 7200));
+	assert(parse_times("1:75-2:00", &a, &b) < 0);
+	assert(parse_times("1:00-2:75", &a, &b) < 0);
+	assert(parse_times("2:00-1:00", &a, &b) < 0);
+	assert(parse_times("1:00-1:00", &a, &b) < 0);
+	assert(parse_times("1:00", &a, &b) < 0);
+	assert(parse_times("-2:00", &a, &b) < 0);
+	assert(parse_times("1:00-2:00x", &a, &b) < 0);
+	assert(parse_times("1:00--2:00", &a, &b) < 0);
+
+	// Titles
+	assert(parse_titles("3", titles) == 1);
+	assert(titles[3] && !titles[2] && !titles[4]);
+	assert(parse_titles("1,3-5,4,99", titles) == 5);
+	assert(titles[1] && !titles[2] && titles[3] && titles[4] && titles[5] && !titles[6] && titles[99]);
+	assert(parse_titles("all", titles) == max_titles);
+	assert(titles[1] && titles[max_titles] && !titles[0]);
+	// A bad list still clears what an earlier one set
+	assert(parse_titles("2,x", titles) < 0);
+	assert(!titles[1] && titles[2] && !titles[3]);
+	const char* badtitles[] = {"", "0", "100", "5-3", "1-100", "1,", ",1", "1;2", "-3", "3-", "all,1"};
+	for (size_t i = 0; i < sizeof badtitles / sizeof *badtitles; i++) {
+		assert(parse_titles(badtitles[i], titles) < 0);
+	}
+
+	// Chapters
+	assert(parse_range("3", &start, &end) == 0 && start == 3 && end == 3);
+	assert(parse_range("2-5", &start, &end) == 0 && start == 2 && end == 5);
+	assert(parse_range("2-", &start, &end) == 0 && start == 2 && end == -1);
+	assert(parse_range("-5", &start, &end) == 0 && start == 1 && end == 5);
+	assert(parse_range("-", &start, &end) < 0);
+	assert(parse_range("", &start, &end) < 0);
+	assert(parse_range("2x", &start, &end) < 0);
+
+	// Streams
+	assert(parse_streams("0,2,31", &mask) == 0 && mask == (1U | 4U | 1U<<31));
+	assert(parse_streams("all", &mask) == 0 && mask == ~0U);
+	assert(parse_streams("32", &mask) < 0);
+	assert(parse_streams("1,", &mask) < 0);
+	assert(parse_streams("", &mask) < 0);
+	return 0;
+}
@@ -0,0 +1,405 @@
+/* repack - convert DVD LPCM to little-endian PCM
+
+DVD LPCM comes in blocks of two samples per channel. 16-bit samples are
+big-endian. 20- and 24-bit samples have their top 16 bits stored first,
+big-endian, followed by the low bits of every sample in the block: a byte
+each for 24-bit, a nibble each for 20-bit.
+
+Every output byte comes from a fixed place in the block, so for each depth
+and channel count we work out once where each output vector's bytes come
+from, and the SIMD kernels move them with byte shuffles. */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "repack.h"
+#include "cpu.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+#define MAX_VECTORS 8
+#define MAX_LOADS 8
+
+// How the bytes picked out by a load are used
+enum {
+	MODE_COPY, // as they are
+	MODE_HIGH, // the high nibble, for even 20-bit samples
+	MODE_LOW, // the low nibble moved up, for odd 20-bit samples
+	NUM_MODES,
+};
+
+// 16 source bytes starting at offset, shuffled by mask. Mask entries with
+// the top bit set pick nothing.
+struct load {
+	int offset;
+	u8 mask[16];
+};
+
+// The SIMD kernels work on units of a few blocks, large enough to fill at
+// least one vector. The last vector of a unit may overlap the one before.
+// Every vector is built from the same number of loads of each mode, padded
+// with loads that pick nothing, so that the kernels can be unrolled.
+struct repacker {
+	int depth;
+	int channels;
+	int isa;
+	int unit_in, unit_out;
+	int span; // bytes of source read for each unit
+	int nvectors; // 0 if the unit can't be planned
+	int shape[NUM_MODES]; // loads of each mode per vector
+	int stores[MAX_VECTORS];
+	struct load loads[MAX_VECTORS*MAX_LOADS];
+};
+
+static void repack_scalar(u8 *dst, const u8 *src, int dstsize, int srcsize, int depth, int channels, int* wn, int* rn);
+
+int repack_best(void)
+{
+#ifdef HAVE_X86
+	int l = cpu_level();
+	if (l >= CPU_AVX512) {
+		return REPACK_AVX512;
+	}
+	if (l >= CPU_AVX2) {
+		return REPACK_AVX2;
+	}
+	if (l >= CPU_SSSE3) {
+		return REPACK_SSSE3;
+	}
+#endif
+	return REPACK_SCALAR;
+}
+
+// Find where byte p of a unit's output comes from.
+static void locate(struct repacker* r, int p, int* src, int* mode)
+{
+	int blockin = 2*r->depth/8 * r->channels;
+	int blockout = 2*3 * r->channels;
+	int b = p / blockout, q = p % blockout;
+	int s = q / 3;
+
+	*mode = MODE_COPY;
+	if (q % 3 == 2) {
+		*src = b*blockin + 2*s;
+	} else if (q % 3 == 1) {
+		*src = b*blockin + 2*s + 1;
+	} else if (r->depth == 24) {
+		*src = b*blockin + 4*r->channels + s;
+	} else {
+		*src = b*blockin + 4*r->channels + s/2;
+		*mode = s % 2 == 0 ? MODE_HIGH : MODE_LOW;
+	}
+}
+
+// Cover the output vector at offset with as few loads as we can, sorted
+// by mode. Returns false if it needs too many.
+static bool plan_vector(struct repacker* r, int offset, struct load* loads, int* count)
+{
+	int src[16], mode[16];
+	bool done[16] = {false};
+	int i, m, start, n = 0;
+
+	for (i = 0; i < 16; i++) {
+		locate(r, offset + i, &src[i], &mode[i]);
+	}
+	for (m = 0; m < NUM_MODES; m++) {
+		count[m] = 0;
+		for (;;) {
+			// Start a load at the first byte not yet covered.
+			start = -1;
+			for (i = 0; i < 16; i++) {
+				if (!done[i] && mode[i] == m && (start < 0 || src[i] < start)) {
+					start = src[i];
+				}
+			}
+			if (start < 0) {
+				break;
+			}
+			if (n == MAX_LOADS) {
+				return false;
+			}
+			struct load* l = &loads[n++];
+			l->offset = start;
+			memset(l->mask, 0x80, sizeof l->mask);
+			for (i = 0; i < 16; i++) {
+				if (!done[i] && mode[i] == m && src[i] < start + 16) {
+					l->mask[i] = (u8)(src[i] - start);
+					done[i] = true;
+				}
+			}
+			if (start + 16 > r->span) {
+				r->span = start + 16;
+			}
+			count[m]++;
+		}
+	}
+	return true;
+}
+
+// Work out the loads for each vector of a unit.
+static void plan(struct repacker* r)
+{
+	struct load loads[MAX_VECTORS][MAX_LOADS];
+	int count[MAX_VECTORS][NUM_MODES];
+	int blocks, offset, v, m, i, j, n;
+
+	blocks = (16 + 6*r->channels - 1) / (6*r->channels);
+	r->unit_in = blocks * 2*r->depth/8 * r->channels;
+	r->unit_out = blocks * 6*r->channels;
+	if (r->unit_out > 16*MAX_VECTORS) {
+		return;
+	}
+	for (v = 0, offset = 0; ; v++, offset += 16) {
+		if (offset + 16 > r->unit_out) {
+			offset = r->unit_out - 16;
+		}
+		if (!plan_vector(r, offset, loads[v], count[v])) {
+			return;
+		}
+		r->stores[v] = offset;
+		if (offset + 16 == r->unit_out) {
+			break;
+		}
+	}
+	n = v + 1;
+
+	for (m = 0; m < NUM_MODES; m++) {
+		r->shape[m] = 0;
+		for (v = 0; v < n; v++) {
+			if (count[v][m] > r->shape[m]) {
+				r->shape[m] = count[v][m];
+			}
+		}
+	}
+	if (r->shape[MODE_COPY] + r->shape[MODE_HIGH] + r->shape[MODE_LOW] > MAX_LOADS) {
+		return;
+	}
+	for (v = 0, i = 0; v < n; v++) {
+		struct load* l = loads[v];
+		for (m = 0; m < NUM_MODES; m++) {
+			for (j = 0; j < r->shape[m]; j++, i++) {
+				if (j < count[v][m]) {
+					r->loads[i] = *l++;
+				} else {
+					r->loads[i].offset = 0;
+					memset(r->loads[i].mask, 0x80, sizeof r->loads[i].mask);
+				}
+			}
+		}
+	}
+	r->nvectors = n;
+}
+
+struct repacker* repack_open(int depth, int channels, int isa)
+{
+	struct repacker* r = malloc(sizeof *r);
+
+	if (r == NULL) {
+		return NULL;
+	}
+	r->depth = depth;
+	r->channels = channels;
+	r->isa = isa;
+	r->span = 0;
+	r->nvectors = 0;
+	if ((depth == 20 || depth == 24) && isa != REPACK_SCALAR) {
+		plan(r);
+	}
+	return r;
+}
+
+void repack_free(struct repacker* r)
+{
+	free(r);
+}
+
+#ifdef HAVE_X86
+
+__attribute__((target("ssse3")))
+static int swap16_ssse3(u8* dst, const u8* src, int n)
+{
+	const __m128i swap = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+	int i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(src + i));
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_shuffle_epi8(x, swap));
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static int swap16_avx2(u8* dst, const u8* src, int n)
+{
+	const __m256i swap = _mm256_setr_epi8(
+		1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+		1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+	int i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i*)(src + i));
+		_mm256_storeu_si256((__m256i*)(dst + i), _mm256_shuffle_epi8(x, swap));
+	}
+	return i + swap16_ssse3(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static int swap16_avx512(u8* dst, const u8* src, int n)
+{
+	const __m512i swap = _mm512_broadcast_i32x4(_mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14));
+	int i;
+
+	for (i = 0; i + 64 <= n; i += 64) {
+		__m512i x = _mm512_loadu_si512((const void*)(src + i));
+		_mm512_storeu_si512((void*)(dst + i), _mm512_shuffle_epi8(x, swap));
+	}
+	return i + swap16_avx2(dst + i, src + i, n - i);
+}
+
+// Repack whole units with vectors of the given shape. Returns the number
+// of units done. Inlined with a constant shape, the loops over the loads
+// unroll.
+__attribute__((target("ssse3"), always_inline))
+static inline int units_ssse3(struct repacker* r, u8* dst, const u8* src, int dstsize, int srcsize, int ncopy, int nhigh, int nlow)
+{
+	const __m128i nibble = _mm_set1_epi8((char)0xf0);
+	__m128i masks[MAX_VECTORS*MAX_LOADS], acc, x;
+	int offsets[MAX_VECTORS*MAX_LOADS], stores[MAX_VECTORS];
+	int nvectors = r->nvectors, unit_in = r->unit_in, unit_out = r->unit_out;
+	int per = ncopy + nhigh + nlow;
+	int si, di, v, k;
+
+	// Keep the plan in locals: stores to dst could alias r.
+	for (k = 0; k < nvectors*per; k++) {
+		masks[k] = _mm_loadu_si128((const __m128i*)r->loads[k].mask);
+		offsets[k] = r->loads[k].offset;
+	}
+	for (v = 0; v < nvectors; v++) {
+		stores[v] = r->stores[v];
+	}
+	for (si = 0, di = 0; si + r->span <= srcsize && di + unit_out <= dstsize; si += unit_in, di += unit_out) {
+		for (v = 0; v < nvectors; v++) {
+			const __m128i* m = &masks[v*per];
+			const int* o = &offsets[v*per];
+			acc = _mm_setzero_si128();
+			for (k = 0; k < ncopy; k++, m++, o++) {
+				x = _mm_loadu_si128((const __m128i*)(src + si + *o));
+				acc = _mm_or_si128(acc, _mm_shuffle_epi8(x, *m));
+			}
+			for (k = 0; k < nhigh; k++, m++, o++) {
+				x = _mm_loadu_si128((const __m128i*)(src + si + *o));
+				x = _mm_shuffle_epi8(x, *m);
+				acc = _mm_or_si128(acc, _mm_and_si128(x, nibble));
+			}
+			for (k = 0; k < nlow; k++, m++, o++) {
+				x = _mm_loadu_si128((const __m128i*)(src + si + *o));
+				x = _mm_shuffle_epi8(x, *m);
+				acc = _mm_or_si128(acc, _mm_and_si128(_mm_slli_epi16(x, 4), nibble));
+			}
+			_mm_storeu_si128((__m128i*)(dst + di + stores[v]), acc);
+		}
+	}
+	return si / unit_in;
+}
+
+// The kernels. 24-bit vectors take two loads, 20-bit vectors one of each
+// mode; anything else gets the loops as they are. There are no AVX2 or
+// AVX-512 versions: with a unit in each lane, the extra loads cost as much
+// as the wider shuffles save.
+__attribute__((target("ssse3")))
+static int repack_ssse3(struct repacker* r, u8* dst, const u8* src, int dstsize, int srcsize)
+{
+	const int* shape = r->shape;
+	if (shape[MODE_COPY] == 2 && shape[MODE_HIGH] == 0 && shape[MODE_LOW] == 0) {
+		return units_ssse3(r, dst, src, dstsize, srcsize, 2, 0, 0);
+	}
+	if (shape[MODE_COPY] == 1 && shape[MODE_HIGH] == 1 && shape[MODE_LOW] == 1) {
+		return units_ssse3(r, dst, src, dstsize, srcsize, 1, 1, 1);
+	}
+	return units_ssse3(r, dst, src, dstsize, srcsize, shape[MODE_COPY], shape[MODE_HIGH], shape[MODE_LOW]);
+}
+
+#endif
+
+void repack(struct repacker* r, u8* dst, const u8* src, int dstsize, int srcsize, int* wn, int* rn)
+{
+	int si = 0, di = 0;
+
+#ifdef HAVE_X86
+	int n;
+	if (r->isa != REPACK_SCALAR && r->depth == 16) {
+		int block = 4 * r->channels;
+		n = (srcsize < dstsize ? srcsize : dstsize) / block * block;
+		if (r->isa == REPACK_AVX512) {
+			si = swap16_avx512(dst, src, n);
+		} else if (r->isa == REPACK_AVX2) {
+			si = swap16_avx2(dst, src, n);
+		} else {
+			si = swap16_ssse3(dst, src, n);
+		}
+		// Finish off the bytes that don't fill a vector.
+		for (; si < n; si += 2) {
+			dst[si] = src[si+1];
+			dst[si+1] = src[si];
+		}
+		*wn = *rn = n;
+		return;
+	}
+	if (r->nvectors > 0) {
+		n = repack_ssse3(r, dst, src, dstsize, srcsize);
+		si = n * r->unit_in;
+		di = n * r->unit_out;
+	}
+#endif
+	repack_scalar(dst + di, src + si, dstsize - di, srcsize - si, r->depth, r->channels, wn, rn);
+	*wn += di;
+	*rn += si;
+}
+
+static void repack_scalar(u8 *dst, const u8 *src, int dstsize, int srcsize, int depth, int channels, int* wn, int* rn)
+{
+	int si, di, ch, j;
+	uint b;
+	int srcblocksize = 2*depth/8 * channels;
+	int dstblocksize = 2*((depth+7)/8) * channels;
+	for (si = 0, di = 0; si+srcblocksize <= srcsize && di+dstblocksize <= dstsize; ) {
+		if (depth == 16) {
+			for (ch = 0; ch < channels * 2; ch++) {
+				dst[di + ch*2 + 1] = src[si + ch*2 + 0];
+				dst[di + ch*2 + 0] = src[si + ch*2 + 1];
+			}
+		} else {
+			for (ch = 0; ch < channels * 2; ch++) {
+				dst[di + ch*3 + 2] = src[si + ch*2 + 0];
+				dst[di + ch*3 + 1] = src[si + ch*2 + 1];
+			}
+		}
+		si += channels * 2 * 2;
+		if (depth == 16) {
+			di += channels * 2 * 2;
+		}
+		else if (depth == 20) {
+			// Low nibbles packed two per byte
+			for (j = 0; j < channels; j++) {
+				b = src[si + j];
+				ch = j*2;
+				dst[di + (ch+0)*3 + 0] = b & 0xf0;
+				dst[di + (ch+1)*3 + 0] = (b & 0x0f) << 4;
+			}
+			si += channels;
+			di += channels * 2 * 3;
+		}
+		else if (depth == 24) {
+			for (ch = 0; ch < channels * 2; ch++) {
+				dst[di + ch*3 + 0] = src[si + ch];
+			}
+			si += channels * 2;
+			di += channels * 2 * 3;
+		}
+	}
+	*wn = di;
+	*rn = si;
+}
@@ -0,0 +1,26 @@
+#ifndef REPACK_H
+#define REPACK_H
+
+#include "uint.h"
+
+// Instruction sets the repack kernels can use, from worst to best.
+enum { REPACK_SCALAR, REPACK_SSSE3, REPACK_AVX2, REPACK_AVX512 };
+
+struct repacker;
+
+// Return the best kernels this CPU can run, as cpu_level() allows.
+int repack_best(void);
+
+// Prepare to repack DVD PCM of the given depth (16, 20 or 24 bits) and
+// number of channels (1-8) with the kernels for isa, which should be no
+// better than repack_best(). Returns NULL if out of memory.
+struct repacker* repack_open(int depth, int channels, int isa);
+void repack_free(struct repacker* r);
+
+// Copy src to dst, repacking DVD PCM to little-endian PCM. 20-bit samples
+// are padded to 24 bits. Only whole blocks of two samples per channel are
+// repacked. Reads no more than srcsize bytes and writes no more than
+// dstsize bytes. Stores the number of bytes written and read in wn and rn.
+void repack(struct repacker* r, u8* dst, const u8* src, int dstsize, int srcsize, int* wn, int* rn);
+
+#endif
@@ -0,0 +1,66 @@
+#include "repack.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+static u8 want[8192+64], got[8192+64];
+
+int main(int argc, char *argv[])
+{
+	(void)argc;
+	(void)argv;
+
+	static const int depths[] = {16, 20, 24};
+	uint seed = 1;
+	int best = repack_best();
+	int d, channels, isa, i, n;
+
+	for (d = 0; d < 3; d++) {
+		for (channels = 1; channels <= 8; channels++) {
+			struct repacker* ref = repack_open(depths[d], channels, REPACK_SCALAR);
+			assert(ref != NULL);
+			for (isa = REPACK_SCALAR; isa <= best; isa++) {
+				struct repacker* r = repack_open(depths[d], channels, isa);
+				assert(r != NULL);
+				for (n = 0; n < 200; n++) {
+					// Sizes that aren't whole blocks, and destinations
+					// that fill up before the source runs out.
+					int srcsize = (int)(seed % 3000);
+					int dstsize = n % 4 == 0 ? (int)(seed >> 8) % 8192 : 8192;
+					int wn1, rn1, wn2, rn2;
+					// Allocated to size, so that overreads show up
+					// under a sanitizer.
+					u8* src = malloc((size_t)srcsize + 1);
+					assert(src != NULL);
+					for (i = 0; i < srcsize; i++) {
+						seed = seed*1103515245 + 12345;
+						src[i] = (u8)(seed >> 16);
+					}
+					memset(want, 0xaa, sizeof want);
+					memset(got, 0xaa, sizeof got);
+					repack(ref, want, src, dstsize, srcsize, &wn1, &rn1);
+					repack(r, got, src, dstsize, srcsize, &wn2, &rn2);
+					assert(wn1 == wn2 && rn1 == rn2);
+					assert(memcmp(want, got, sizeof got) == 0);
+					free(src);
+				}
+				repack_free(r);
+			}
+			repack_free(ref);
+		}
+	}
+
+	// A 24-bit stereo block by hand: high, middle bytes first, then low.
+	{
+		struct repacker* r = repack_open(24, 2, best);
+		const u8 src[12] = {0x11, 0x12, 0x21, 0x22, 0x31, 0x32, 0x41, 0x42, 0x13, 0x23, 0x33, 0x43};
+		const u8 le[12] = {0x13, 0x12, 0x11, 0x23, 0x22, 0x21, 0x33, 0x32, 0x31, 0x43, 0x42, 0x41};
+		int wn, rn;
+		repack(r, got, src, sizeof got, sizeof src, &wn, &rn);
+		assert(wn == 12 && rn == 12);
+		assert(memcmp(got, le, 12) == 0);
+		repack_free(r);
+	}
+
+	return 0;
+}
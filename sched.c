@@ -0,0 +1,307 @@
+/* sched - workers for tracks written out in the background
+
+A track's data is copied into chunks as it's written, and the chunks are
+queued on the track. A worker takes the oldest track without a worker and
+replays its chunks until the track ends, then takes the next. Every chunk
+counts against the budget until a worker has written it. */
+
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sched.h"
+
+// A run of writes waiting for a worker, each stored as its size followed
+// by the data. The writes are replayed as they came, since a writer like
+// repack can't take a sample group split across two writes.
+struct chunk {
+	struct chunk* next;
+	int size;
+	u8 data[];
+};
+
+struct sched_track {
+	struct sched_track* next; // in the queue of tracks waiting for a worker
+	struct sched* sched;
+	void* arg;
+	struct chunk *head, *tail;
+	struct chunk* fill; // being filled, not queued yet
+	bool closed;
+	bool complete;
+};
+
+struct sched {
+	const struct sched_ops* ops;
+	sem_t* slots;
+	pthread_t* threads;
+	int nthreads;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct sched_track *queue, *queue_tail;
+	int pending; // tracks not finished yet
+	size_t used, budget;
+	bool quit;
+	int err;
+
+	// Stall statistics
+	long tracks, full;
+	double full_time;
+};
+
+enum { chunk_size = 65536 };
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void take_slot(struct sched* s)
+{
+	if (s->slots != NULL) {
+		while (sem_wait(s->slots) < 0 && errno == EINTR) {
+		}
+	}
+}
+
+static void give_slot(struct sched* s)
+{
+	if (s->slots != NULL) {
+		sem_post(s->slots);
+	}
+}
+
+static void* worker(void* arg)
+{
+	struct sched* s = arg;
+	struct sched_track* t;
+	struct chunk* c;
+	void* h;
+	int err, off, n;
+
+	pthread_mutex_lock(&s->lock);
+	for (;;) {
+		while (s->queue == NULL && !s->quit) {
+			pthread_cond_wait(&s->cond, &s->lock);
+		}
+		if (s->queue == NULL) {
+			break;
+		}
+		t = s->queue;
+		s->queue = t->next;
+		if (s->queue == NULL) {
+			s->queue_tail = NULL;
+		}
+		pthread_mutex_unlock(&s->lock);
+
+		// Keep draining the track even if it fails, so that its
+		// chunks don't hold up the producer.
+		h = s->ops->open(t->arg);
+		err = h == NULL ? -1 : 0;
+		pthread_mutex_lock(&s->lock);
+		for (;;) {
+			while (t->head == NULL && !t->closed) {
+				pthread_cond_wait(&s->cond, &s->lock);
+			}
+			c = t->head;
+			if (c == NULL) {
+				break;
+			}
+			t->head = c->next;
+			if (t->head == NULL) {
+				t->tail = NULL;
+			}
+			pthread_mutex_unlock(&s->lock);
+			take_slot(s);
+			for (off = 0; err == 0 && off < c->size; off += n) {
+				memcpy(&n, c->data + off, sizeof n);
+				off += (int)sizeof n;
+				if (s->ops->write(h, c->data + off, n) < 0) {
+					err = -1;
+				}
+			}
+			give_slot(s);
+			pthread_mutex_lock(&s->lock);
+			s->used -= (size_t)c->size;
+			pthread_cond_broadcast(&s->cond);
+			free(c);
+		}
+		pthread_mutex_unlock(&s->lock);
+		if (h != NULL && s->ops->close(h, t->complete && err == 0) < 0) {
+			err = -1;
+		}
+		free(t);
+		pthread_mutex_lock(&s->lock);
+		if (err < 0) {
+			s->err = -1;
+		}
+		s->pending--;
+		pthread_cond_broadcast(&s->cond);
+	}
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+struct sched* sched_open(const struct sched_ops* ops, int nthreads, int streams, size_t budget, sem_t* slots)
+{
+	struct sched* s;
+	int i;
+
+	if (nthreads < streams) {
+		nthreads = streams;
+	}
+	s = calloc(1, sizeof *s);
+	if (s == NULL) {
+		return NULL;
+	}
+	s->threads = calloc((size_t)nthreads, sizeof *s->threads);
+	if (s->threads == NULL) {
+		free(s);
+		return NULL;
+	}
+	s->ops = ops;
+	s->slots = slots;
+	s->budget = budget;
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&s->threads[i], NULL, worker, s) != 0) {
+			perror("pthread_create");
+			break;
+		}
+	}
+	s->nthreads = i;
+	if (i < nthreads) {
+		sched_close(s);
+		return NULL;
+	}
+	return s;
+}
+
+int sched_close(struct sched* s)
+{
+	int i, err;
+
+	pthread_mutex_lock(&s->lock);
+	while (s->pending > 0) {
+		pthread_cond_wait(&s->cond, &s->lock);
+	}
+	s->quit = true;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	for (i = 0; i < s->nthreads; i++) {
+		pthread_join(s->threads[i], NULL);
+	}
+
+	if (s->tracks > 0) {
+		fprintf(stderr, "encoders: %ld tracks; waited on the encoders %ld times (%.2fs)\n",
+			s->tracks, s->full, s->full_time);
+	}
+
+	err = s->err;
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->cond);
+	free(s->threads);
+	free(s);
+	return err;
+}
+
+int sched_workers(const struct sched* s)
+{
+	return s->nthreads;
+}
+
+struct sched_track* sched_add(struct sched* s, void* arg)
+{
+	struct sched_track* t = calloc(1, sizeof *t);
+	if (t == NULL) {
+		return NULL;
+	}
+	t->sched = s;
+	t->arg = arg;
+
+	pthread_mutex_lock(&s->lock);
+	if (s->queue_tail != NULL) {
+		s->queue_tail->next = t;
+	} else {
+		s->queue = t;
+	}
+	s->queue_tail = t;
+	s->pending++;
+	s->tracks++;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	return t;
+}
+
+// Hand the chunk being filled to the track's worker, waiting for room in
+// the budget first.
+static void flush(struct sched_track* t)
+{
+	struct sched* s = t->sched;
+	struct chunk* c = t->fill;
+	double start;
+
+	if (c == NULL) {
+		return;
+	}
+	t->fill = NULL;
+	pthread_mutex_lock(&s->lock);
+	if (s->used > 0 && s->used + (size_t)c->size > s->budget) {
+		start = now();
+		s->full++;
+		while (s->used > 0 && s->used + (size_t)c->size > s->budget) {
+			pthread_cond_wait(&s->cond, &s->lock);
+		}
+		s->full_time += now() - start;
+	}
+	s->used += (size_t)c->size;
+	if (t->tail != NULL) {
+		t->tail->next = c;
+	} else {
+		t->head = c;
+	}
+	t->tail = c;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+}
+
+int sched_write(struct sched_track* t, const u8* buf, int size)
+{
+	struct chunk* c = t->fill;
+	int need = (int)sizeof size + size;
+
+	if (c != NULL && c->size + need > chunk_size) {
+		flush(t);
+		c = NULL;
+	}
+	if (c == NULL) {
+		c = malloc(sizeof *c + (size_t)(need > chunk_size ? need : chunk_size));
+		if (c == NULL) {
+			return -1;
+		}
+		c->next = NULL;
+		c->size = 0;
+		t->fill = c;
+	}
+	memcpy(c->data + c->size, &size, sizeof size);
+	memcpy(c->data + c->size + sizeof size, buf, (size_t)size);
+	c->size += need;
+	return 0;
+}
+
+void sched_end(struct sched_track* t, bool complete)
+{
+	struct sched* s = t->sched;
+
+	flush(t);
+	pthread_mutex_lock(&s->lock);
+	t->complete = complete;
+	t->closed = true;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+}
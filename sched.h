@@ -0,0 +1,53 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <semaphore.h>
+#include "uint.h"
+
+// Workers which take tracks in the order they're added and write each one
+// out as it comes in, so that whoever produces the data never waits for a
+// track to be finished. Data waiting for the workers is limited to a
+// budget; the producer waits when it would go over.
+
+struct sched;
+struct sched_track;
+
+// What a worker does with a track.
+struct sched_ops {
+	// Start the track added with arg, which is the worker's from then on.
+	// Returns NULL on error, in which case the track's data is dropped.
+	void* (*open)(void* arg);
+	// Write data as it was passed to sched_write. Returns -1 on error.
+	int (*write)(void* t, const u8* buf, int size);
+	// Finish the track, which got all of its data and had no errors if
+	// complete is true. Returns -1 on error.
+	int (*close)(void* t, bool complete);
+};
+
+// Start enough workers for every one of streams tracks open at once to
+// have its own, and nthreads if that's more; with fewer, a track waiting
+// for a worker could use up the budget while the workers wait for the
+// data of theirs. Workers hold one of slots, if it isn't NULL, while they
+// write. Returns NULL on error.
+struct sched* sched_open(const struct sched_ops* ops, int nthreads, int streams, size_t budget, sem_t* slots);
+
+// Wait for every track to be finished and stop the workers. Returns -1
+// if any track failed.
+int sched_close(struct sched* s);
+
+// The number of workers.
+int sched_workers(const struct sched* s);
+
+// Queue a track for the next free worker. Returns NULL if out of memory.
+struct sched_track* sched_add(struct sched* s, void* arg);
+
+// Queue data for a track, waiting for room in the budget. Returns -1 if
+// out of memory.
+int sched_write(struct sched_track* t, const u8* buf, int size);
+
+// Mark the end of a track's data. Errors are reported by sched_close.
+void sched_end(struct sched_track* t, bool complete);
+
+#endif
@@ -0,0 +1,153 @@
+#define _POSIX_C_SOURCE 200809L
+#include "sched.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+enum { ntracks = 3, length = 1 << 21, budget = 1 << 18 };
+
+// A chunk, as sched.c makes them: the most a track can have queued
+// without counting against the budget.
+enum { chunk = 65536 };
+
+struct out {
+	u8 data[length];
+	int len;
+	int closed; // 1 if complete, 2 if not
+	bool fail; // fail writes after the first megabyte
+};
+
+static struct out outs[ntracks];
+static long queued, written; // bytes, across the tracks
+
+static void* test_open(void* arg)
+{
+	return arg;
+}
+
+static int test_write(void* t, const u8* buf, int size)
+{
+	struct out* o = t;
+	if (o->fail && o->len >= length/2) {
+		return -1;
+	}
+	assert(o->len + size <= length);
+	memcpy(o->data + o->len, buf, (size_t)size);
+	o->len += size;
+	__atomic_fetch_add(&written, size, __ATOMIC_SEQ_CST);
+	// Be slow now and then, so the budget fills up
+	if (o->len % 8 == 0) {
+		struct timespec ts = {0, 20000};
+		nanosleep(&ts, NULL);
+	}
+	return 0;
+}
+
+static int test_close(void* t, bool complete)
+{
+	struct out* o = t;
+	o->closed = complete ? 1 : 2;
+	return 0;
+}
+
+static void* fail_open(void* arg)
+{
+	(void)arg;
+	return NULL;
+}
+
+static const struct sched_ops ops = {test_open, test_write, test_close};
+static const struct sched_ops fail_ops = {fail_open, test_write, test_close};
+
+static u8 pattern(int track, int i)
+{
+	return (u8)(i * 7 + i / 251 + track * 85);
+}
+
+// Write every track's data a piece at a time, in turn. If bounded, check
+// that what hasn't been written yet is held to the budget.
+static void produce(struct sched_track** t, bool bounded)
+{
+	static u8 buf[5000];
+	int pos[ntracks] = {0};
+	int i, k, n, left = ntracks;
+
+	for (i = 0; left > 0; i++) {
+		k = i % ntracks;
+		if (pos[k] == length) {
+			continue;
+		}
+		n = 1 + (i * 37) % (int)sizeof buf;
+		if (n > length - pos[k]) {
+			n = length - pos[k];
+		}
+		for (int j = 0; j < n; j++) {
+			buf[j] = pattern(k, pos[k] + j);
+		}
+		assert(sched_write(t[k], buf, n) == 0);
+		pos[k] += n;
+		queued += n;
+		assert(!bounded || queued - __atomic_load_n(&written, __ATOMIC_SEQ_CST) <= budget + ntracks * chunk);
+		if (pos[k] == length) {
+			sched_end(t[k], k != 1);
+			left--;
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	(void)argc;
+	(void)argv;
+
+	struct sched* s;
+	struct sched_track* t[ntracks];
+	int k;
+
+	// One worker asked for, but every track open at once gets its own
+	s = sched_open(&ops, 1, ntracks, budget, NULL);
+	assert(s != NULL);
+	assert(sched_workers(s) == ntracks);
+	for (k = 0; k < ntracks; k++) {
+		t[k] = sched_add(s, &outs[k]);
+		assert(t[k] != NULL);
+	}
+	produce(t, true);
+	assert(sched_close(s) == 0);
+	for (k = 0; k < ntracks; k++) {
+		assert(outs[k].len == length);
+		for (int i = 0; i < length; i++) {
+			assert(outs[k].data[i] == pattern(k, i));
+		}
+		assert(outs[k].closed == (k != 1 ? 1 : 2));
+	}
+
+	// A track that fails is drained anyway and closed as incomplete, and
+	// the others carry on
+	memset(outs, 0, sizeof outs);
+	queued = written = 0;
+	outs[2].fail = true;
+	s = sched_open(&ops, 4, ntracks, budget, NULL);
+	assert(sched_workers(s) == 4);
+	for (k = 0; k < ntracks; k++) {
+		t[k] = sched_add(s, &outs[k]);
+	}
+	produce(t, false);
+	assert(sched_close(s) == -1);
+	assert(outs[0].len == length && outs[0].closed == 1);
+	assert(outs[2].len >= length/2 && outs[2].len < length && outs[2].closed == 2);
+
+	// So does a track that can't be started
+	memset(outs, 0, sizeof outs);
+	queued = written = 0;
+	s = sched_open(&fail_ops, 1, ntracks, budget, NULL);
+	for (k = 0; k < ntracks; k++) {
+		t[k] = sched_add(s, &outs[k]);
+	}
+	produce(t, false);
+	assert(sched_close(s) == -1);
+	assert(outs[0].len == 0 && outs[0].closed == 0);
+
+	return 0;
+}
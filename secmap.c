@@ -0,0 +1,244 @@
+/* secmap - which stream each sector of a title set holds
+
+The map is kept as runs of sectors, which on a DVD are short (an audio pack
+between every dozen or so video packs) but still far fewer than sectors.
+It's saved as text, one run to a line. */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "secmap.h"
+
+struct run {
+	int start, count, id;
+};
+
+struct secmap {
+	struct run* known; // as loaded: sorted, and not overlapping
+	int nknown;
+	struct run* noted; // since loaded, in the order noted
+	int nnoted, cap;
+};
+
+static const char secmap_magic[] = "extractaudio sector map 1\n";
+
+static int add_run(struct run** runs, int* n, int* cap, int start, int count, int id)
+{
+	if (*n == *cap) {
+		int c = *cap > 0 ? *cap * 2 : 256;
+		struct run* r = realloc(*runs, (size_t)c * sizeof *r);
+		if (r == NULL) {
+			return -1;
+		}
+		*runs = r;
+		*cap = c;
+	}
+	(*runs)[*n].start = start;
+	(*runs)[*n].count = count;
+	(*runs)[*n].id = id;
+	(*n)++;
+	return 0;
+}
+
+static int by_start(const void* a, const void* b)
+{
+	const struct run* x = a;
+	const struct run* y = b;
+	return (x->start > y->start) - (x->start < y->start);
+}
+
+struct secmap* secmap_new(void)
+{
+	return calloc(1, sizeof(struct secmap));
+}
+
+void secmap_free(struct secmap* m)
+{
+	if (m != NULL) {
+		free(m->known);
+		free(m->noted);
+		free(m);
+	}
+}
+
+struct secmap* secmap_load(const char* filename, const char* key)
+{
+	struct secmap* m = secmap_new();
+	char line[128];
+	int start, count, cap = 0;
+	unsigned id;
+	FILE* fp;
+
+	if (m == NULL) {
+		return NULL;
+	}
+	fp = fopen(filename, "r");
+	if (fp == NULL) {
+		return m;
+	}
+	if (fgets(line, sizeof line, fp) == NULL || strcmp(line, secmap_magic) != 0 ||
+	    fgets(line, sizeof line, fp) == NULL || strncmp(line, key, strlen(key)) != 0 ||
+	    strcmp(line + strlen(key), "\n") != 0) {
+		fprintf(stderr, "%s: not from this disc; starting a new map\n", filename);
+		fclose(fp);
+		return m;
+	}
+	while (fgets(line, sizeof line, fp) != NULL) {
+		// Runs out of order or overlapping mean the file has been
+		// mangled, and it's safest to forget all of it.
+		if (sscanf(line, "%d %d %x", &start, &count, &id) != 3 || start < 0 || count < 1 ||
+		    count > INT_MAX - start || id > 255 ||
+		    (m->nknown > 0 && start < m->known[m->nknown-1].start + m->known[m->nknown-1].count)) {
+			fprintf(stderr, "%s: bad run; starting a new map\n", filename);
+			m->nknown = 0;
+			break;
+		}
+		if (add_run(&m->known, &m->nknown, &cap, start, count, (int)id) < 0) {
+			fclose(fp);
+			secmap_free(m);
+			return NULL;
+		}
+	}
+	fclose(fp);
+	return m;
+}
+
+int secmap_note(struct secmap* m, int sector, int id)
+{
+	if (m->nnoted > 0) {
+		struct run* r = &m->noted[m->nnoted-1];
+		if (r->id == id && sector >= r->start && sector <= r->start + r->count) {
+			if (sector == r->start + r->count) {
+				r->count++;
+			}
+			return 0;
+		}
+	}
+	return add_run(&m->noted, &m->nnoted, &m->cap, sector, 1, id);
+}
+
+int secmap_save(struct secmap* m, const char* filename, const char* key)
+{
+	struct run* runs = NULL;
+	struct run cur = {0, 0, 0};
+	int n = 0, cap = 0, i, j, pos, end;
+	char* tmp = NULL;
+	FILE* fp;
+
+	qsort(m->noted, (size_t)m->nnoted, sizeof *m->noted, by_start);
+	// What was noted replaces what was known, so keep only the parts of
+	// the known runs in between.
+	for (i = 0, j = 0; i < m->nknown; i++) {
+		pos = m->known[i].start;
+		end = pos + m->known[i].count;
+		while (pos < end) {
+			while (j < m->nnoted && m->noted[j].start + m->noted[j].count <= pos) {
+				j++;
+			}
+			int to = j < m->nnoted && m->noted[j].start < end ? m->noted[j].start : end;
+			if (to > pos && add_run(&runs, &n, &cap, pos, to - pos, m->known[i].id) < 0) {
+				goto fail;
+			}
+			pos = to < end ? m->noted[j].start + m->noted[j].count : end;
+		}
+	}
+	for (j = 0; j < m->nnoted; j++) {
+		if (add_run(&runs, &n, &cap, m->noted[j].start, m->noted[j].count, m->noted[j].id) < 0) {
+			goto fail;
+		}
+	}
+	qsort(runs, (size_t)n, sizeof *runs, by_start);
+
+	tmp = malloc(strlen(filename) + 5);
+	if (tmp == NULL) {
+		goto fail;
+	}
+	sprintf(tmp, "%s.tmp", filename);
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		perror(tmp);
+		goto fail;
+	}
+	fprintf(fp, "%s%s\n", secmap_magic, key);
+	// A sector noted twice is only written once, and adjoining runs of
+	// the same stream are joined up.
+	for (i = 0, pos = 0; i < n; i++) {
+		struct run r = runs[i];
+		if (r.start < pos) {
+			r.count -= pos - r.start;
+			r.start = pos;
+		}
+		if (r.count <= 0) {
+			continue;
+		}
+		if (cur.count > 0 && cur.id == r.id && cur.start + cur.count == r.start) {
+			cur.count += r.count;
+		} else {
+			if (cur.count > 0) {
+				fprintf(fp, "%d %d %02x\n", cur.start, cur.count, cur.id);
+			}
+			cur = r;
+		}
+		pos = r.start + r.count;
+	}
+	if (cur.count > 0) {
+		fprintf(fp, "%d %d %02x\n", cur.start, cur.count, cur.id);
+	}
+	free(runs);
+	if (fclose(fp) != 0 || rename(tmp, filename) < 0) {
+		perror(filename);
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+	return 0;
+
+fail:
+	free(runs);
+	free(tmp);
+	return -1;
+}
+
+// Find the last run starting at or before sector, or -1.
+static int find(const struct secmap* m, int sector)
+{
+	int lo = 0, hi = m->nknown;
+
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (m->known[mid].start <= sector) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo - 1;
+}
+
+int secmap_next(const struct secmap* m, int sector, const bool want[256])
+{
+	int i = find(m, sector);
+
+	for (; i >= 0 && i < m->nknown; i++) {
+		const struct run* r = &m->known[i];
+		if (sector < r->start || sector >= r->start + r->count || want[r->id]) {
+			break;
+		}
+		sector = r->start + r->count;
+	}
+	return sector;
+}
+
+int secmap_skip(const struct secmap* m, int sector, const bool want[256])
+{
+	int i = find(m, sector);
+
+	for (i = i < 0 ? 0 : i; i < m->nknown; i++) {
+		const struct run* r = &m->known[i];
+		if (sector < r->start + r->count && !want[r->id]) {
+			return sector > r->start ? sector : r->start;
+		}
+	}
+	return INT_MAX;
+}
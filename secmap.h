@@ -0,0 +1,40 @@
+#ifndef SECMAP_H
+#define SECMAP_H
+
+#include <limits.h>
+#include <stdbool.h>
+
+// A map of what each sector of a title set holds, as runs of sectors
+// whose packs belong to the same stream: the substream id for private
+// stream 1, and the stream id for anything else. Once a title has been
+// read through, the map says which sectors a later rip can skip.
+//
+// Sectors not in the map are unknown, and have to be read. Lookups go by
+// the map as it was loaded; what's noted only counts once it's saved.
+
+struct secmap;
+
+struct secmap* secmap_new(void);
+void secmap_free(struct secmap* m);
+
+// Load the map saved in filename. Returns an empty map if there isn't one,
+// or if it was saved with a different key, and NULL if out of memory.
+struct secmap* secmap_load(const char* filename, const char* key);
+
+// Save the map with the sectors noted since it was loaded, which replace
+// what it said about them. Returns -1 on error.
+int secmap_save(struct secmap* m, const char* filename, const char* key);
+
+// Note what a sector holds. Sectors are cheapest to note in order.
+// Returns -1 if out of memory.
+int secmap_note(struct secmap* m, int sector, int id);
+
+// Return the first sector from the given one on which isn't known to hold
+// a stream that want is false for.
+int secmap_next(const struct secmap* m, int sector, const bool want[256]);
+
+// Return the first sector from the given one on which is known to hold a
+// stream that want is false for, or INT_MAX.
+int secmap_skip(const struct secmap* m, int sector, const bool want[256]);
+
+#endif
@@ -0,0 +1,73 @@
+#include "secmap.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char filename[] = "secmap_test.map";
+
+int main(int argc, char *argv[])
+{
+	(void)argc;
+	(void)argv;
+
+	struct secmap* m;
+	bool want[256] = {0};
+	int s;
+
+	remove(filename);
+	m = secmap_load(filename, "vts 1");
+	assert(m != NULL);
+	assert(secmap_next(m, 5, want) == 5);
+	assert(secmap_skip(m, 5, want) == INT_MAX);
+
+	// A NAV pack, then video with an audio pack every ten sectors, up to
+	// sector 100, with 50-59 left out as though they couldn't be read
+	for (s = 0; s < 100; s++) {
+		if (s < 50 || s >= 60) {
+			assert(secmap_note(m, s, s == 0 ? 0xbf : s % 10 == 5 ? 0x80 : 0xe0) == 0);
+		}
+	}
+	// Nothing counts until it's saved
+	assert(secmap_next(m, 1, want) == 1);
+	assert(secmap_save(m, filename, "vts 1") == 0);
+	secmap_free(m);
+
+	m = secmap_load(filename, "vts 1");
+	want[0x80] = true;
+	assert(secmap_next(m, 0, want) == 5);
+	assert(secmap_next(m, 5, want) == 5);
+	assert(secmap_next(m, 6, want) == 15);
+	assert(secmap_next(m, 46, want) == 50);
+	assert(secmap_next(m, 55, want) == 55);
+	assert(secmap_next(m, 96, want) == 100);
+	assert(secmap_skip(m, 5, want) == 6);
+	assert(secmap_skip(m, 50, want) == 60);
+	assert(secmap_skip(m, 100, want) == INT_MAX);
+
+	// Filling in the gap and changing a sector keeps the rest
+	for (s = 50; s < 60; s++) {
+		secmap_note(m, s, 0xe0);
+	}
+	secmap_note(m, 25, 0xe0);
+	secmap_note(m, 200, 0x80);
+	assert(secmap_save(m, filename, "vts 1") == 0);
+	secmap_free(m);
+
+	m = secmap_load(filename, "vts 1");
+	assert(secmap_next(m, 6, want) == 15);
+	assert(secmap_next(m, 16, want) == 35);
+	assert(secmap_next(m, 46, want) == 65);
+	assert(secmap_next(m, 96, want) == 100);
+	assert(secmap_next(m, 101, want) == 101);
+	assert(secmap_next(m, 200, want) == 200);
+	assert(secmap_skip(m, 101, want) == INT_MAX);
+	secmap_free(m);
+
+	// Another disc's map is ignored
+	m = secmap_load(filename, "vts 2");
+	assert(secmap_next(m, 6, want) == 6);
+	secmap_free(m);
+
+	remove(filename);
+	return 0;
+}
@@ -0,0 +1,308 @@
+/* shring - a shared-memory ring feeding a program's stdin
+
+The memfd holds a page of control fields and then the ring. Positions are
+byte counts that only grow, and the ring offset is a position's low bits.
+Only the writer moves head and only the reader moves tail.
+
+Before sleeping, a side sets its wait flag and looks again, and the other
+side swaps the flag out after moving its position. With all four accesses
+sequentially consistent, one of them always sees the other, so no wakeup
+is lost. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "shring.h"
+
+struct control {
+	uint64_t head, tail;
+	int wait_data, wait_space;
+	int closed; // set by the writer after the last of the data
+	int failed; // set by the reader if it can't pass data on
+};
+
+struct shring {
+	struct control* ctl;
+	u8* data;
+	size_t size, ctlsize;
+	size_t wake; // data the reader waits for unless the writer is done
+	int memfd, data_ev, space_ev;
+	pid_t pid; // the reader, or -1
+	int status; // the reader's, once it's been waited for
+};
+
+enum { poll_ms = 1000 };
+
+#define LOAD(p) __atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define STORE(p, v) __atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+#define SWAP(p, v) __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST)
+
+static void signal_ev(int fd)
+{
+	uint64_t one = 1;
+	while (write(fd, &one, sizeof one) < 0 && errno == EINTR) {
+	}
+}
+
+// Wait up to poll_ms for fd to be signalled. Returns false on a timeout.
+static bool wait_ev(int fd)
+{
+	struct pollfd p = {fd, POLLIN, 0};
+	uint64_t n;
+	if (poll(&p, 1, poll_ms) <= 0) {
+		return false;
+	}
+	return read(fd, &n, sizeof n) == sizeof n;
+}
+
+struct shring* shring_open(size_t size)
+{
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	struct shring* r;
+	void* p;
+
+	if (size < page || (size & (size - 1)) != 0) {
+		return NULL;
+	}
+	r = calloc(1, sizeof *r);
+	if (r == NULL) {
+		return NULL;
+	}
+	r->size = size;
+	r->ctlsize = page;
+	r->wake = size / 16;
+	r->pid = -1;
+	r->data_ev = r->space_ev = -1;
+	r->memfd = memfd_create("shring", MFD_CLOEXEC);
+	if (r->memfd < 0) {
+		perror("memfd_create");
+		goto error;
+	}
+	if (ftruncate(r->memfd, (off_t)(r->ctlsize + size)) < 0) {
+		perror("ftruncate");
+		goto error;
+	}
+	p = mmap(NULL, r->ctlsize + size, PROT_READ|PROT_WRITE, MAP_SHARED, r->memfd, 0);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		goto error;
+	}
+	r->ctl = p;
+	r->data = (u8*)p + r->ctlsize;
+	r->data_ev = eventfd(0, EFD_CLOEXEC);
+	r->space_ev = eventfd(0, EFD_CLOEXEC);
+	if (r->data_ev < 0 || r->space_ev < 0) {
+		perror("eventfd");
+		goto error;
+	}
+	return r;
+
+error:
+	shring_close(r);
+	return NULL;
+}
+
+// Copy the ring to fd until the writer is done. Runs in the reader, so
+// it mustn't allocate.
+static int drain(struct shring* r, int fd, pid_t parent)
+{
+	struct control* c = r->ctl;
+	uint64_t tail = c->tail, head;
+	ssize_t n;
+	size_t m;
+
+	for (;;) {
+		int closed = LOAD(&c->closed);
+		head = LOAD(&c->head);
+		if (head == tail || (head - tail < r->wake && !closed)) {
+			if (head == tail && closed) {
+				return 0;
+			}
+			STORE(&c->wait_data, 1);
+			head = LOAD(&c->head);
+			if ((head != tail && head - tail >= r->wake) || LOAD(&c->closed)) {
+				STORE(&c->wait_data, 0);
+				continue;
+			}
+			if (!wait_ev(r->data_ev)) {
+				STORE(&c->wait_data, 0);
+				if (getppid() != parent) {
+					return -1; // the writer died
+				}
+			}
+			continue;
+		}
+		m = (size_t)(head - tail);
+		if (m > r->size - (tail & (r->size - 1))) {
+			m = r->size - (tail & (r->size - 1));
+		}
+		n = write(fd, r->data + (tail & (r->size - 1)), m);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		tail += (uint64_t)n;
+		STORE(&c->tail, tail);
+		if (SWAP(&c->wait_space, 0)) {
+			signal_ev(r->space_ev);
+		}
+	}
+}
+
+int shring_spawn(struct shring* r, char* const argv[])
+{
+	pid_t parent = getpid(), pid;
+	sigset_t none;
+	int fd[2], status;
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return -1;
+	}
+	if (pid > 0) {
+		r->pid = pid;
+		return 0;
+	}
+
+	// The reader: start the program on a pipe, and pass the ring on.
+	sigemptyset(&none);
+	sigprocmask(SIG_SETMASK, &none, NULL);
+	if (pipe(fd) < 0) {
+		perror("pipe");
+		_exit(1);
+	}
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		_exit(1);
+	}
+	if (pid == 0) {
+		close(fd[1]);
+		dup2(fd[0], 0);
+		close(fd[0]);
+		execvp(argv[0], argv);
+		perror("execvp");
+		_exit(127);
+	}
+	close(fd[0]);
+	// A program that quits early shows up as a failed write.
+	signal(SIGPIPE, SIG_IGN);
+	if (drain(r, fd[1], parent) < 0) {
+		STORE(&r->ctl->failed, 1);
+		signal_ev(r->space_ev);
+	}
+	close(fd[1]);
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status)) {
+		_exit(1);
+	}
+	_exit(LOAD(&r->ctl->failed) ? 1 : WEXITSTATUS(status));
+}
+
+// Whether the reader has gone, waiting for it if it has.
+static bool reader_gone(struct shring* r)
+{
+	if (r->pid < 0) {
+		return true;
+	}
+	if (waitpid(r->pid, &r->status, WNOHANG) == r->pid) {
+		r->pid = -1;
+		return true;
+	}
+	return false;
+}
+
+int shring_write(struct shring* r, const u8* buf, size_t n)
+{
+	struct control* c = r->ctl;
+	uint64_t head = c->head, tail;
+	size_t m, off;
+
+	while (n > 0) {
+		if (LOAD(&c->failed)) {
+			return -1;
+		}
+		tail = LOAD(&c->tail);
+		if (head - tail == r->size) {
+			STORE(&c->wait_space, 1);
+			if (LOAD(&c->tail) != tail) {
+				STORE(&c->wait_space, 0);
+				continue;
+			}
+			if (!wait_ev(r->space_ev) && reader_gone(r)) {
+				return -1;
+			}
+			continue;
+		}
+		m = r->size - (size_t)(head - tail);
+		if (m > n) {
+			m = n;
+		}
+		off = head & (r->size - 1);
+		if (m > r->size - off) {
+			memcpy(r->data + off, buf, r->size - off);
+			memcpy(r->data, buf + (r->size - off), m - (r->size - off));
+		} else {
+			memcpy(r->data + off, buf, m);
+		}
+		head += m;
+		buf += m;
+		n -= m;
+		STORE(&c->head, head);
+		if (head - tail >= r->wake && SWAP(&c->wait_data, 0)) {
+			signal_ev(r->data_ev);
+		}
+	}
+	return 0;
+}
+
+int shring_close(struct shring* r)
+{
+	int err = 0;
+
+	if (r->ctl != NULL) {
+		STORE(&r->ctl->closed, 1);
+	}
+	if (r->data_ev >= 0) {
+		signal_ev(r->data_ev);
+	}
+	if (r->pid >= 0) {
+		while (waitpid(r->pid, &r->status, 0) < 0) {
+			if (errno != EINTR) {
+				perror("waitpid");
+				r->status = -1;
+				break;
+			}
+		}
+		r->pid = -1;
+	}
+	if (r->ctl != NULL && !(WIFEXITED(r->status) && WEXITSTATUS(r->status) == 0)) {
+		err = -1;
+	}
+	if (r->ctl != NULL) {
+		munmap(r->ctl, r->ctlsize + r->size);
+	}
+	if (r->memfd >= 0) {
+		close(r->memfd);
+	}
+	if (r->data_ev >= 0) {
+		close(r->data_ev);
+	}
+	if (r->space_ev >= 0) {
+		close(r->space_ev);
+	}
+	free(r);
+	return err;
+}
@@ -0,0 +1,32 @@
+#ifndef SHRING_H
+#define SHRING_H
+
+#include <stddef.h>
+#include "uint.h"
+
+// A ring buffer in shared memory (a memfd) for feeding a program's stdin.
+// The writer copies into the ring, and a reader process forked off for it
+// copies out to a pipe into the program. Each side sleeps on an eventfd
+// only when it has to wait for the other, and the reader isn't woken until
+// there's a good run of data to pass on, so the writer makes a system call
+// for every so many writes rather than for each one.
+
+struct shring;
+
+// Make a ring of size bytes, a power of two of at least a page. Returns
+// NULL on error.
+struct shring* shring_open(size_t size);
+
+// Run argv[0], found on the PATH, with the ring as its stdin. Returns -1
+// on error.
+int shring_spawn(struct shring* r, char* const argv[]);
+
+// Copy n bytes into the ring, waiting for room. Returns -1 if the program
+// has gone.
+int shring_write(struct shring* r, const u8* buf, size_t n);
+
+// Mark the end of the data, wait for the program to exit, and free the
+// ring. Returns -1 if anything went wrong or the program didn't succeed.
+int shring_close(struct shring* r);
+
+#endif
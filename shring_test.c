@@ -0,0 +1,62 @@
+#include "shring.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char filename[] = "shring_test.out";
+static u8 data[1<<20], got[(1<<20) + 1];
+
+int main(int argc, char *argv[])
+{
+	(void)argc;
+	(void)argv;
+
+	char* cat[] = {"sh", "-c", "cat > shring_test.out", NULL};
+	char* quit[] = {"false", NULL};
+	struct shring* r;
+	uint seed = 1;
+	size_t i, n;
+	FILE* fp;
+
+	assert(shring_open(1000) == NULL);
+	for (i = 0; i < sizeof data; i++) {
+		seed = seed*1103515245 + 12345;
+		data[i] = (u8)(seed >> 16);
+	}
+
+	// Pieces of all sizes, wrapping round a ring much smaller than the data
+	r = shring_open(1<<16);
+	assert(r != NULL);
+	assert(shring_spawn(r, cat) == 0);
+	for (i = 0; i < sizeof data; i += n) {
+		seed = seed*1103515245 + 12345;
+		n = (seed >> 16) % 10000;
+		if (n > sizeof data - i) {
+			n = sizeof data - i;
+		}
+		assert(shring_write(r, data + i, n) == 0);
+	}
+	assert(shring_close(r) == 0);
+	fp = fopen(filename, "rb");
+	assert(fp != NULL);
+	assert(fread(got, 1, sizeof got, fp) == sizeof data);
+	assert(memcmp(got, data, sizeof data) == 0);
+	fclose(fp);
+	remove(filename);
+
+	// A program that doesn't read it all
+	r = shring_open(1<<16);
+	assert(r != NULL);
+	assert(shring_spawn(r, quit) == 0);
+	for (i = 0; i < 64 && shring_write(r, data, sizeof data) == 0; i++) {
+	}
+	assert(i < 64);
+	assert(shring_close(r) == -1);
+
+	// A program that fails with nothing to read
+	r = shring_open(1<<16);
+	assert(shring_spawn(r, quit) == 0);
+	assert(shring_close(r) == -1);
+	return 0;
+}
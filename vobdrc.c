@@ -0,0 +1,266 @@
+/* vobdrc - strip dynamic range compression from the AC-3 audio in a VOB
+
+Reads a VOB or a decrypted disc image one sector at a time and zeroes the
+DRC fields of every AC-3 frame it finds, fixing up the CRCs as it goes. The
+frames keep their size, so the output is sector-for-sector identical to the
+input apart from the patched bits, and nothing needs to be remuxed. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <getopt.h>
+#include "uint.h"
+#include "mpegps.h"
+#include "ac3drc.h"
+
+// Number of sectors that can be held back waiting for a frame to be
+// completed by a later pack. Frames span at most three packs of their own
+// stream, but other streams are interleaved between them.
+#define WINDOW 1024
+
+// Maximum number of packs a single frame can be split across.
+#define MAX_PIECES 8
+
+// A piece of a frame that lives in a held-back sector.
+struct piece {
+	long sector;
+	int offset;
+	int len;
+};
+
+// A partially collected frame of one AC-3 substream.
+struct frame {
+	bool synced;
+	int size; // 0 until the header has been seen
+	int len;
+	int npieces;
+	struct piece pieces[MAX_PIECES];
+	u8 data[AC3_MAX_FRAME_SIZE];
+};
+
+static sectorbuf window[WINDOW];
+static int pins[WINDOW];
+static struct frame frames[8];
+
+static long nframes, nstripped, nskipped;
+
+void usage(void)
+{
+	printf("usage: vobdrc [-a audio] input.vob output.vob\n");
+}
+
+static void unpin(struct frame *f)
+{
+	int i;
+	for (i = 0; i < f->npieces; i++) {
+		pins[f->pieces[i].sector % WINDOW]--;
+	}
+	f->npieces = 0;
+	f->len = 0;
+	f->size = 0;
+}
+
+// Drop a partial frame. Its sectors are written out unchanged.
+static void abandon(struct frame *f)
+{
+	if (f->len > 0) {
+		nskipped++;
+	}
+	unpin(f);
+	f->synced = false;
+}
+
+// Patch a complete frame and copy it back into the sectors it came from.
+static void finish(struct frame *f)
+{
+	int i, off;
+	int n = ac3_strip_drc(f->data, f->size);
+
+	nframes++;
+	if (n < 0) {
+		nskipped++;
+	} else if (n > 0) {
+		nstripped++;
+		for (i = 0, off = 0; i < f->npieces; i++) {
+			struct piece *p = &f->pieces[i];
+			memcpy(window[p->sector % WINDOW] + p->offset, f->data + off, (size_t)p->len);
+			off += p->len;
+		}
+	}
+	unpin(f);
+}
+
+// Append data from the given sector to a frame. Returns the number of bytes
+// consumed, or -1 if the frame doesn't start with a valid header.
+static int collect(struct frame *f, long sector, int offset, int end)
+{
+	int want, n;
+
+	// Only take the header at first, since we don't know the frame size
+	// until we've seen it.
+	want = f->size > 0 ? f->size : 5;
+	n = end - offset;
+	if (n > want - f->len) {
+		n = want - f->len;
+	}
+	if (f->npieces == MAX_PIECES) {
+		return -1;
+	}
+	memcpy(f->data + f->len, window[sector % WINDOW] + offset, (size_t)n);
+	f->len += n;
+	f->pieces[f->npieces].sector = sector;
+	f->pieces[f->npieces].offset = offset;
+	f->pieces[f->npieces].len = n;
+	f->npieces++;
+	pins[sector % WINDOW]++;
+
+	if (f->size == 0 && f->len == 5) {
+		f->size = ac3_frame_size(f->data);
+		if (f->size < 0) {
+			return -1;
+		}
+	}
+	return n;
+}
+
+// Feed the payload of an AC-3 pack to its stream's frame.
+static void process(long sector, struct stream_info *info)
+{
+	struct frame *f = &frames[info->stream & 7];
+	int pos = info->data_offset;
+	int n;
+
+	if (!f->synced) {
+		if (info->first_frame_offset < 0) {
+			return;
+		}
+		pos = info->first_frame_offset;
+		f->synced = true;
+	}
+	while (pos < info->end_offset) {
+		if (f->len == 0 && info->first_frame_offset >= 0 && pos < info->first_frame_offset) {
+			// We lost track of the frame boundaries somewhere.
+			pos = info->first_frame_offset;
+		}
+		n = collect(f, sector, pos, info->end_offset);
+		if (n < 0) {
+			abandon(f);
+			if (info->first_frame_offset > pos) {
+				f->synced = true;
+				pos = info->first_frame_offset;
+				continue;
+			}
+			return;
+		}
+		pos += n;
+		if (f->size > 0 && f->len == f->size) {
+			finish(f);
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	FILE *in, *out;
+	struct stream_info info;
+	long sector, next = 0;
+	size_t tail = 0;
+	int audio = -1;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "a:")) != -1)
+	switch (opt) {
+	case 'a':
+		audio = atoi(optarg);
+		break;
+	default:
+		usage();
+		return 1;
+	}
+	if (argc - optind != 2) {
+		usage();
+		return 1;
+	}
+
+	in = fopen(argv[optind], "rb");
+	if (in == NULL) {
+		perror(argv[optind]);
+		return 1;
+	}
+	out = fopen(argv[optind+1], "wb");
+	if (out == NULL) {
+		perror(argv[optind+1]);
+		return 1;
+	}
+	setvbuf(in, NULL, _IOFBF, 1<<20);
+	setvbuf(out, NULL, _IOFBF, 1<<20);
+
+	for (sector = 0; ; sector++) {
+		// Make room in the window. If the oldest sector is still
+		// waiting on a frame, give up on the frame.
+		if (sector - next >= WINDOW) {
+			for (i = 0; i < 8; i++) {
+				struct frame *f = &frames[i];
+				if (f->npieces > 0 && f->pieces[0].sector == next) {
+					fprintf(stderr, "sector %ld: stream %#x: frame too long\n", next, 0x80+i);
+					abandon(f);
+				}
+			}
+		}
+		for (; next < sector && pins[next % WINDOW] == 0; next++) {
+			if (fwrite(window[next % WINDOW], SECTOR_SIZE, 1, out) != 1) {
+				perror("fwrite");
+				return 1;
+			}
+		}
+
+		u8 *b = window[sector % WINDOW];
+		tail = fread(b, 1, SECTOR_SIZE, in);
+		if (tail < SECTOR_SIZE) {
+			if (ferror(in)) {
+				perror("fread");
+				return 1;
+			}
+			break;
+		}
+		tail = 0;
+		if (pack_stream_id(b, false) != 0xbd) {
+			continue;
+		}
+		if (get_stream_info(b, &info) < 0) {
+			fprintf(stderr, "sector %ld: bad packet length\n", sector);
+			continue;
+		}
+		if ((info.stream & ~7) != 0x80) {
+			continue;
+		}
+		if (audio >= 0 && info.stream != 0x80 + audio) {
+			continue;
+		}
+		process(sector, &info);
+	}
+
+	for (i = 0; i < 8; i++) {
+		abandon(&frames[i]);
+	}
+	for (; next < sector; next++) {
+		if (fwrite(window[next % WINDOW], SECTOR_SIZE, 1, out) != 1) {
+			perror("fwrite");
+			return 1;
+		}
+	}
+	// Pass through any partial sector at the end unchanged.
+	if (tail > 0 && fwrite(window[sector % WINDOW], 1, tail, out) != tail) {
+		perror("fwrite");
+		return 1;
+	}
+	if (fclose(out) != 0) {
+		perror("fclose");
+		return 1;
+	}
+	fclose(in);
+
+	fprintf(stderr, "%ld frames, %ld stripped, %ld skipped\n", nframes, nstripped, nskipped);
+	return 0;
+}